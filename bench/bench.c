@@ -0,0 +1,772 @@
+/*
+A minimal Image Processing in pure C library
+Copyright (C) 2025  Mina Albert Saeed <mina.albert.saeed@gmail.com>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+    Benchmarks every public operation on synthetic images of a few sizes
+    and channel counts and on the files in images/.
+
+    usage: bench [-j] [-q] [-t seconds] [-T threads] [-f filter] [-i dir]
+      -j  one JSON object per line instead of the table
+      -q  only the smallest synthetic size, no files
+      -t  minimum time per measurement (default 0.2)
+      -T  thread count passed to img_set_threads (default: all CPUs)
+      -f  only operations whose name contains filter
+      -i  directory with .ppm/.pgm files (default images)
+
+    Per operation it reports megapixels per second and nanoseconds per
+    source pixel (mean over as many calls as fit in the time), the number
+    of malloc/calloc/realloc calls the first call makes and the average
+    over the later ones, rounded up (steady state, 0 once buffers are
+    reused), and the peak resident set size during one call.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "../src/image.h"
+
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+
+typedef struct {
+    Image src, src2, dest;
+    Image planar;       /* src in IMG_LAYOUT_PLANAR */
+    Image wide[2];      /* src as IMG_DEPTH_U16 and IMG_DEPTH_F32 */
+    Kernel box5, sharpen3;
+    IntegralImage ii;
+    Pyramid pyr;
+    char path[64];      /* scratch PNM file of src */
+    u8 *mem;            /* img_savepnm_mem buffer */
+    size_t memsz;
+    u8 *mem16;          /* wide[0] as a 16-bit PNM */
+    size_t mem16sz;
+    BatchItem thumb;    /* mem through img_batch_run, out kept across calls */
+} Bench;
+
+typedef struct {
+    const char *name;
+    u8 channels;        /* bit c set: runs on c-channel images */
+    ImgError (*run)(Bench *b);
+} Op;
+
+/*
+    Counting allocations: the executable's malloc wins over libc's for the
+    library too. Only with glibc, which exports the real ones under
+    __libc_*; elsewhere the count is reported as -1.
+*/
+#if defined(__GLIBC__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long nallocs;
+
+void *
+malloc(size_t size)
+{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+static long
+alloc_count(void)
+{
+    return (long)__atomic_load_n(&nallocs, __ATOMIC_RELAXED);
+}
+#else
+static long
+alloc_count(void)
+{
+    return -1;
+}
+#endif
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Linux lets us reset the high-water mark, elsewhere ru_maxrss is all we get */
+static void
+rss_reset(void)
+{
+    FILE *f;
+
+    f = fopen("/proc/self/clear_refs", "w");
+    if (f == NULL) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+static long
+rss_peak_kb(void)
+{
+    struct rusage ru;
+    char line[128];
+    long kb;
+    FILE *f;
+
+    f = fopen("/proc/self/status", "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "VmHWM: %ld", &kb) == 1) {
+                fclose(f);
+                return kb;
+            }
+        }
+        fclose(f);
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static ImgType
+pnm_type(u8 channels)
+{
+    return channels == 1 ? IMG_PGM_BIN : channels == 3 ? IMG_PPM_BIN : IMG_UNKNOWN;
+}
+
+/* Deterministic gradient plus noise, so nothing is all zeros or all equal */
+static void
+fill(Image *img, u32 seed)
+{
+    u32 x, y, r;
+    u8 *row;
+
+    r = seed * 2654435761u + 1;
+    for (y = 0; y < img->height; y++) {
+        row = img->data + (size_t)y * img->stride;
+        for (x = 0; x < img->width * img->channels; x++) {
+            r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+            row[x] = (u8)((x + y) / 4 + (r & 31));
+        }
+    }
+}
+
+static ImgError
+op_loadpnm(Bench *b)
+{
+    ImgError err;
+    Image img = {0};
+
+    err = img_loadpnm(&img, b->path, b->src.type, NULL);
+    if (err == IMG_OK)
+        img_free(&img);
+    return err;
+}
+
+static ImgError
+op_decode_pnm(Bench *b)
+{
+    ImgError err;
+    Image img;
+
+    err = img_decode_pnm(&img, b->mem, b->memsz, NULL, 0);
+    if (err == IMG_OK)
+        img_free(&img);
+    return err;
+}
+
+static ImgError
+op_encode_pnm(Bench *b)
+{
+    ImgError err;
+    u8 *out;
+    size_t len;
+
+    err = img_encode_pnm(&b->src, &out, &len);
+    if (err == IMG_OK)
+        free(out);
+    return err;
+}
+
+static ImgError
+op_load_async(Bench *b)
+{
+    ImgError err;
+    ImgAsync *async;
+    Image img;
+
+    err = img_load_async(&async, &img, b->path);
+    if (err != IMG_OK)
+        return err;
+    err = img_async_finish(async);
+    if (err == IMG_OK)
+        img_free(&img);
+    return err;
+}
+
+static ImgError
+op_save_async(Bench *b)
+{
+    ImgError err;
+    ImgAsync *async;
+
+    err = img_save_async(&async, &b->src, b->path);
+    if (err != IMG_OK)
+        return err;
+    return img_async_finish(async);
+}
+
+static ImgError op_savepnm(Bench *b)      { return img_savepnm(&b->src, b->path); }
+static ImgError op_cpy(Bench *b)          { return img_cpy(&b->dest, &b->src); }
+static ImgError op_rgb2gray(Bench *b)     { return img_rgb2gray(&b->dest, &b->src); }
+static ImgError op_rgb2hsv(Bench *b)      { return img_rgb2hsv(&b->dest, &b->src); }
+static ImgError op_hsv2rgb(Bench *b)      { return img_hsv2rgb(&b->dest, &b->src); }
+static ImgError op_rgb2ycbcr(Bench *b)    { return img_rgb2ycbcr(&b->dest, &b->src); }
+static ImgError op_ycbcr2rgb(Bench *b)    { return img_ycbcr2rgb(&b->dest, &b->src); }
+static ImgError op_premultiply(Bench *b)  { return img_premultiply(&b->dest, &b->src); }
+static ImgError op_add(Bench *b)          { return img_add(&b->dest, &b->src, &b->src2); }
+static ImgError op_subtract(Bench *b)     { return img_subtract(&b->dest, &b->src, &b->src2); }
+static ImgError op_absdiff(Bench *b)      { return img_subtract_mode(&b->dest, &b->src, &b->src2, IMG_SUBTRACT_ABSDIFF); }
+static ImgError op_blend(Bench *b)        { return img_blend(&b->dest, &b->src, &b->src2, 0.3f); }
+static ImgError op_multiply(Bench *b)     { return img_multiply(&b->dest, &b->src, &b->src2); }
+static ImgError op_add_scalar(Bench *b)   { return img_add_scalar(&b->dest, &b->src, 40); }
+static ImgError op_mul_scalar(Bench *b)   { return img_multiply_scalar(&b->dest, &b->src, 1.7f); }
+static ImgError op_conv_box5(Bench *b)    { return img_convolve(&b->dest, &b->src, &b->box5, IMG_BORDER_REPLICATE); }
+static ImgError op_conv_sharpen3(Bench *b){ return img_convolve(&b->dest, &b->src, &b->sharpen3, IMG_BORDER_REPLICATE); }
+static ImgError op_box2(Bench *b)         { return img_box_filter(&b->dest, &b->src, 2, IMG_BORDER_REPLICATE); }
+static ImgError op_box15(Bench *b)        { return img_box_filter(&b->dest, &b->src, 15, IMG_BORDER_REPLICATE); }
+static ImgError op_integral(Bench *b)     { return img_integral(&b->ii, &b->src); }
+static ImgError op_gauss2(Bench *b)       { return img_gaussian_blur(&b->dest, &b->src, 2.0f, IMG_BORDER_REPLICATE); }
+static ImgError op_gauss10(Bench *b)      { return img_gaussian_blur(&b->dest, &b->src, 10.0f, IMG_BORDER_REPLICATE); }
+static ImgError op_median1(Bench *b)      { return img_median_filter(&b->dest, &b->src, 1, IMG_BORDER_REPLICATE); }
+static ImgError op_median2(Bench *b)      { return img_median_filter(&b->dest, &b->src, 2, IMG_BORDER_REPLICATE); }
+static ImgError op_median7(Bench *b)      { return img_median_filter(&b->dest, &b->src, 7, IMG_BORDER_REPLICATE); }
+static ImgError op_min7(Bench *b)         { return img_min_filter(&b->dest, &b->src, 7, IMG_BORDER_REPLICATE); }
+static ImgError op_max7(Bench *b)         { return img_max_filter(&b->dest, &b->src, 7, IMG_BORDER_REPLICATE); }
+static ImgError op_pyramid(Bench *b)      { return img_pyramid(&b->pyr, &b->src, 0, 0, NULL); }
+static ImgError op_laplacian(Bench *b)    { return img_pyramid(&b->pyr, &b->src, 0, IMG_PYRAMID_LAPLACIAN, NULL); }
+
+/* collapses the Laplacian pyramid of src, built only when src changes */
+static ImgError
+op_reconstruct(Bench *b)
+{
+    ImgError err;
+    Image *base = &b->pyr.level[0];
+
+    if (b->pyr.levels == 0 || !(b->pyr.flags & IMG_PYRAMID_LAPLACIAN) || base->width != b->src.width ||
+        base->height != b->src.height || base->channels != b->src.channels) {
+        err = img_pyramid(&b->pyr, &b->src, 0, IMG_PYRAMID_LAPLACIAN, NULL);
+        if (err != IMG_OK)
+            return err;
+    }
+    return img_pyramid_reconstruct(&b->dest, &b->pyr);
+}
+
+/* converts src to b->planar when its size changed */
+static ImgError
+planar_src(Bench *b)
+{
+    if (b->planar.data != NULL && b->planar.width == b->src.width &&
+        b->planar.height == b->src.height && b->planar.channels == b->src.channels)
+        return IMG_OK;
+    return img_convert_layout(&b->planar, &b->src, IMG_LAYOUT_PLANAR);
+}
+
+static ImgError op_to_planar(Bench *b)     { return img_convert_layout(&b->dest, &b->src, IMG_LAYOUT_PLANAR); }
+
+static ImgError
+op_to_interleaved(Bench *b)
+{
+    ImgError err = planar_src(b);
+
+    return err != IMG_OK ? err : img_convert_layout(&b->dest, &b->planar, IMG_LAYOUT_INTERLEAVED);
+}
+
+static ImgError
+op_gauss2_planar(Bench *b)
+{
+    ImgError err = planar_src(b);
+
+    return err != IMG_OK ? err : img_gaussian_blur(&b->dest, &b->planar, 2.0f, IMG_BORDER_REPLICATE);
+}
+
+static ImgError
+op_resize_planar(Bench *b)
+{
+    ImgError err = planar_src(b);
+
+    return err != IMG_OK ? err : img_resize_filter(&b->dest, &b->planar, MAX(b->src.width / 2, 1),
+                                                   MAX(b->src.height / 2, 1), IMG_RESIZE_BICUBIC);
+}
+
+static ImgError
+op_ycbcr_planar(Bench *b)
+{
+    ImgError err = planar_src(b);
+
+    return err != IMG_OK ? err : img_rgb2ycbcr(&b->dest, &b->planar);
+}
+
+/* converts src to b->wide[] at the given depth when its size changed */
+static ImgError
+wide_src(Bench *b, ImgDepth depth, Image **img)
+{
+    *img = &b->wide[depth == IMG_DEPTH_F32];
+    if ((*img)->data != NULL && (*img)->width == b->src.width &&
+        (*img)->height == b->src.height && (*img)->channels == b->src.channels)
+        return IMG_OK;
+    return img_convert_depth(*img, &b->src, depth);
+}
+
+static ImgError op_to_u16(Bench *b)        { return img_convert_depth(&b->dest, &b->src, IMG_DEPTH_U16); }
+static ImgError op_to_f32(Bench *b)        { return img_convert_depth(&b->dest, &b->src, IMG_DEPTH_F32); }
+
+static ImgError
+op_f32_to_u8(Bench *b)
+{
+    Image *w;
+    ImgError err = wide_src(b, IMG_DEPTH_F32, &w);
+
+    return err != IMG_OK ? err : img_convert_depth(&b->dest, w, IMG_DEPTH_U8);
+}
+
+static ImgError
+op_encode_pnm16(Bench *b)
+{
+    ImgError err;
+    Image *w;
+    u8 *out;
+    size_t len;
+
+    err = wide_src(b, IMG_DEPTH_U16, &w);
+    if (err == IMG_OK)
+        err = img_encode_pnm(w, &out, &len);
+    if (err == IMG_OK)
+        free(out);
+    return err;
+}
+
+/* decodes wide[0] as encoded on the first call */
+static ImgError
+op_decode_pnm16(Bench *b)
+{
+    ImgError err;
+    Image img, *w;
+
+    if (b->mem16 == NULL) {
+        err = wide_src(b, IMG_DEPTH_U16, &w);
+        if (err == IMG_OK)
+            err = img_encode_pnm(w, &b->mem16, &b->mem16sz);
+        if (err != IMG_OK)
+            return err;
+    }
+    err = img_decode_pnm(&img, b->mem16, b->mem16sz, NULL, 0);
+    if (err == IMG_OK)
+        img_free(&img);
+    return err;
+}
+
+static ImgError
+op_conv_box5_wide(Bench *b, ImgDepth depth)
+{
+    Image *w;
+    ImgError err = wide_src(b, depth, &w);
+
+    return err != IMG_OK ? err : img_convolve(&b->dest, w, &b->box5, IMG_BORDER_REPLICATE);
+}
+
+static ImgError
+op_resize_wide(Bench *b, ImgDepth depth)
+{
+    Image *w;
+    ImgError err = wide_src(b, depth, &w);
+
+    return err != IMG_OK ? err : img_resize_filter(&b->dest, w, MAX(b->src.width / 2, 1),
+                                                   MAX(b->src.height / 2, 1), IMG_RESIZE_BICUBIC);
+}
+
+static ImgError
+op_add_wide(Bench *b, ImgDepth depth)
+{
+    Image *w;
+    ImgError err = wide_src(b, depth, &w);
+
+    return err != IMG_OK ? err : img_add(&b->dest, w, w);
+}
+
+static ImgError op_conv_box5_u16(Bench *b) { return op_conv_box5_wide(b, IMG_DEPTH_U16); }
+static ImgError op_conv_box5_f32(Bench *b) { return op_conv_box5_wide(b, IMG_DEPTH_F32); }
+static ImgError op_resize_u16(Bench *b)    { return op_resize_wide(b, IMG_DEPTH_U16); }
+static ImgError op_resize_f32(Bench *b)    { return op_resize_wide(b, IMG_DEPTH_F32); }
+static ImgError op_add_u16(Bench *b)       { return op_add_wide(b, IMG_DEPTH_U16); }
+static ImgError op_add_f32(Bench *b)       { return op_add_wide(b, IMG_DEPTH_F32); }
+
+static ImgError
+op_savepnm_mem(Bench *b)
+{
+    size_t written;
+
+    return img_savepnm_mem(&b->src, b->mem, b->memsz, &written);
+}
+
+static ImgError
+op_filter2D(Bench *b)
+{
+    return img_filter2D(&b->dest, &b->src, IMG_KERNEL_BOX_BLUR, IMG_KERNEL_3x3, IMG_BORDER_ZERO_PADDING);
+}
+
+static ImgError
+resize_half(Bench *b, ResizeFilter filter)
+{
+    return img_resize_filter(&b->dest, &b->src, MAX(b->src.width / 2, 1), MAX(b->src.height / 2, 1), filter);
+}
+
+static ImgError op_rotate_nearest(Bench *b)  { return img_rotate(&b->dest, &b->src, 3.7f, IMG_RESIZE_NEAREST, IMG_BORDER_REPLICATE); }
+static ImgError op_rotate_bilinear(Bench *b) { return img_rotate(&b->dest, &b->src, 3.7f, IMG_RESIZE_BILINEAR, IMG_BORDER_REPLICATE); }
+static ImgError op_rotate_bicubic(Bench *b)  { return img_rotate(&b->dest, &b->src, 3.7f, IMG_RESIZE_BICUBIC, IMG_BORDER_REPLICATE); }
+static ImgError op_transpose(Bench *b)       { return img_transpose(&b->dest, &b->src); }
+static ImgError op_rotate90(Bench *b)        { return img_rotate90(&b->dest, &b->src, 1); }
+static ImgError op_flip_h(Bench *b)          { return img_flip(&b->dest, &b->src, IMG_FLIP_HORIZONTAL); }
+static ImgError op_resize_nearest(Bench *b)  { return resize_half(b, IMG_RESIZE_NEAREST); }
+static ImgError op_resize_bilinear(Bench *b) { return resize_half(b, IMG_RESIZE_BILINEAR); }
+static ImgError op_resize_bicubic(Bench *b)  { return resize_half(b, IMG_RESIZE_BICUBIC); }
+static ImgError op_resize_lanczos3(Bench *b) { return resize_half(b, IMG_RESIZE_LANCZOS3); }
+
+static ImgError
+op_resize_up2(Bench *b)
+{
+    return img_resize(&b->dest, &b->src, b->src.width * 2, b->src.height * 2);
+}
+
+/* thumbnail: 40 times smaller, so the bicubic taps span 162 source pixels */
+static ImgError
+op_resize_thumb(Bench *b)
+{
+    return img_resize(&b->dest, &b->src, MAX(b->src.width / 40, 1), MAX(b->src.height / 40, 1));
+}
+
+/* one batch item, decoded from mem and made 40 times smaller like resize_thumb */
+static ImgError
+op_batch_thumb(Bench *b)
+{
+    BatchOp op;
+    ImgError err;
+
+    memset(&op, 0, sizeof(op));
+    op.kind = IMG_BATCH_RESIZE;
+    op.width = MAX(b->src.width / 40, 1);
+    op.filter = IMG_RESIZE_BICUBIC;
+    b->thumb.buf = b->mem;
+    b->thumb.size = b->memsz;
+    err = img_batch_run(&b->thumb, 1, &op, 1);
+    return err != IMG_OK ? err : b->thumb.status;
+}
+
+/* gray -> 5x5 box -> half size in one pipeline */
+static ImgError
+op_pipeline(Bench *b)
+{
+    ImgError err;
+    Pipeline pipe;
+
+    img_pipe_init(&pipe, &b->src);
+    img_pipe_rgb2gray(&pipe, IMG_GRAY_BT709);
+    img_pipe_convolve(&pipe, &b->box5, IMG_BORDER_REPLICATE);
+    img_pipe_resize(&pipe, MAX(b->src.width / 2, 1), MAX(b->src.height / 2, 1), IMG_RESIZE_BICUBIC);
+    err = img_pipe_run(&pipe, &b->dest);
+    img_pipe_free(&pipe);
+    return err;
+}
+
+#define CH(c)   (1u << (c))
+#define PNM     (CH(1) | CH(3))
+#define COLOR   (CH(3) | CH(4))
+#define ANY     (CH(1) | CH(2) | CH(3) | CH(4))
+
+static const Op ops[] = {
+    { "loadpnm",          PNM,    op_loadpnm },
+    { "savepnm",          PNM,    op_savepnm },
+    { "savepnm_mem",      PNM,    op_savepnm_mem },
+    { "decode_pnm",       PNM,    op_decode_pnm },
+    { "encode_pnm",       PNM,    op_encode_pnm },
+    { "decode_pnm16",     PNM,    op_decode_pnm16 },
+    { "encode_pnm16",     PNM,    op_encode_pnm16 },
+    { "load_async",       PNM,    op_load_async },
+    { "save_async",       PNM,    op_save_async },
+    { "cpy",              ANY,    op_cpy },
+    { "to_planar",        ANY,    op_to_planar },
+    { "to_interleaved",   ANY,    op_to_interleaved },
+    { "to_u16",           ANY,    op_to_u16 },
+    { "to_f32",           ANY,    op_to_f32 },
+    { "f32_to_u8",        ANY,    op_f32_to_u8 },
+    { "rgb2gray",         COLOR,  op_rgb2gray },
+    { "rgb2hsv",          COLOR,  op_rgb2hsv },
+    { "hsv2rgb",          COLOR,  op_hsv2rgb },
+    { "rgb2ycbcr",        COLOR,  op_rgb2ycbcr },
+    { "ycbcr2rgb",        COLOR,  op_ycbcr2rgb },
+    { "rgb2ycbcr_planar", COLOR,  op_ycbcr_planar },
+    { "premultiply",      CH(4),  op_premultiply },
+    { "convolve_box5",    ANY,    op_conv_box5 },
+    { "convolve_sharpen3",ANY,    op_conv_sharpen3 },
+    { "convolve_box5_u16",ANY,    op_conv_box5_u16 },
+    { "convolve_box5_f32",ANY,    op_conv_box5_f32 },
+    { "filter2D_box3",    ANY,    op_filter2D },
+    { "box_filter_r2",    ANY,    op_box2 },
+    { "box_filter_r15",   ANY,    op_box15 },
+    { "integral",         ANY,    op_integral },
+    { "gaussian_s2",      ANY,    op_gauss2 },
+    { "gaussian_s10",     ANY,    op_gauss10 },
+    { "gaussian_s2_planar",ANY,   op_gauss2_planar },
+    { "median_r1",        ANY,    op_median1 },
+    { "median_r2",        ANY,    op_median2 },
+    { "median_r7",        ANY,    op_median7 },
+    { "min_r7",           ANY,    op_min7 },
+    { "max_r7",           ANY,    op_max7 },
+    { "pyramid",          ANY,    op_pyramid },
+    { "pyramid_laplacian",ANY,    op_laplacian },
+    { "pyramid_recon",    ANY,    op_reconstruct },
+    { "resize_nearest",   ANY,    op_resize_nearest },
+    { "resize_bilinear",  ANY,    op_resize_bilinear },
+    { "resize_bicubic",   ANY,    op_resize_bicubic },
+    { "resize_lanczos3",  ANY,    op_resize_lanczos3 },
+    { "resize_up2",       ANY,    op_resize_up2 },
+    { "resize_thumb",     ANY,    op_resize_thumb },
+    { "resize_bic_planar",ANY,    op_resize_planar },
+    { "resize_bic_u16",   ANY,    op_resize_u16 },
+    { "resize_bic_f32",   ANY,    op_resize_f32 },
+    { "rotate_nearest",   ANY,    op_rotate_nearest },
+    { "rotate_bilinear",  ANY,    op_rotate_bilinear },
+    { "rotate_bicubic",   ANY,    op_rotate_bicubic },
+    { "transpose",        ANY,    op_transpose },
+    { "rotate90",         ANY,    op_rotate90 },
+    { "flip_h",           ANY,    op_flip_h },
+    { "add",              ANY,    op_add },
+    { "add_u16",          ANY,    op_add_u16 },
+    { "add_f32",          ANY,    op_add_f32 },
+    { "subtract",         ANY,    op_subtract },
+    { "subtract_absdiff", ANY,    op_absdiff },
+    { "blend",            ANY,    op_blend },
+    { "multiply",         ANY,    op_multiply },
+    { "add_scalar",       ANY,    op_add_scalar },
+    { "multiply_scalar",  ANY,    op_mul_scalar },
+    { "pipeline",         COLOR,  op_pipeline },
+    { "batch_thumb",      PNM,    op_batch_thumb },
+};
+
+static int json;
+static double min_time = 0.2;
+static const char *filter;
+
+static void
+report_header(void)
+{
+    if (json) return;
+    printf("%-18s %-28s %-16s %8s %10s %9s %7s %7s %9s\n",
+           "op", "image", "size", "iters", "MP/s", "ns/px", "allocs", "steady", "rss_kb");
+}
+
+static void
+measure(Bench *b, const Op *op, const char *image)
+{
+    ImgError err;
+    char size[32];
+    double t0, t, mps, nspx;
+    long iters, allocs, steady, rss;
+    u64 pixels;
+
+    rss_reset();
+    allocs = alloc_count();
+    err = op->run(b);   /* also warms caches, buffers and the thread pool */
+    allocs = allocs < 0 ? -1 : alloc_count() - allocs;
+    rss = rss_peak_kb();
+    if (err != IMG_OK) {
+        fprintf(stderr, "bench: %s on %s: %s\n", op->name, image, img_err2str(err));
+        return;
+    }
+
+    iters = 0;
+    steady = alloc_count();
+    t0 = now();
+    do {
+        op->run(b);
+        iters++;
+        t = now() - t0;
+    } while (t < min_time);
+    steady = steady < 0 ? -1 : (alloc_count() - steady + iters - 1) / iters;
+
+    pixels = (u64)b->src.width * b->src.height;
+    nspx = t * 1e9 / ((double)pixels * iters);
+    mps = (double)pixels * iters / t / 1e6;
+    snprintf(size, sizeof(size), "%ux%ux%u", b->src.width, b->src.height, b->src.channels);
+
+    if (json)
+        printf("{\"op\":\"%s\",\"image\":\"%s\",\"width\":%u,\"height\":%u,\"channels\":%u,"
+               "\"threads\":%u,\"iterations\":%ld,\"mpix_per_s\":%.3f,\"ns_per_pixel\":%.4f,"
+               "\"allocs\":%ld,\"steady_allocs\":%ld,\"peak_rss_kb\":%ld}\n",
+               op->name, image, b->src.width, b->src.height, b->src.channels,
+               img_get_threads(), iters, mps, nspx, allocs, steady, rss);
+    else
+        printf("%-18s %-28s %-16s %8ld %10.2f %9.3f %7ld %7ld %9ld\n",
+               op->name, image, size, iters, mps, nspx, allocs, steady, rss);
+    fflush(stdout);
+}
+
+/* Runs every matching operation on b->src */
+static void
+run_all(Bench *b, const char *image)
+{
+    size_t i, written;
+    int fd;
+
+    img_cpy(&b->src2, &b->src);
+    fill(&b->src2, 7);
+
+    b->path[0] = '\0';
+    if (pnm_type(b->src.channels) != IMG_UNKNOWN) {
+        snprintf(b->path, sizeof(b->path), "/tmp/imglib_bench_XXXXXX");
+        fd = mkstemp(b->path);
+        if (fd >= 0) close(fd);
+        img_savepnm(&b->src, b->path);
+        img_savepnm_mem(&b->src, NULL, 0, &written);
+        b->mem = malloc(written);
+        b->memsz = written;
+        if (b->mem != NULL)
+            img_savepnm_mem(&b->src, b->mem, b->memsz, &written);
+    }
+
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (!(ops[i].channels & CH(b->src.channels))) continue;
+        if (filter != NULL && strstr(ops[i].name, filter) == NULL) continue;
+        measure(b, &ops[i], image);
+    }
+
+    if (b->path[0] != '\0')
+        unlink(b->path);
+    free(b->mem);
+    b->mem = NULL;
+    free(b->mem16);
+    b->mem16 = NULL;
+    if (b->thumb.out.data != NULL)
+        img_free(&b->thumb.out);
+    memset(&b->thumb, 0, sizeof(b->thumb));
+    img_free(&b->src2);
+    memset(&b->src2, 0, sizeof(b->src2));
+    if (b->dest.data != NULL)
+        img_free(&b->dest);
+    memset(&b->dest, 0, sizeof(b->dest));
+}
+
+static void
+bench_files(Bench *b, const char *dir)
+{
+    struct dirent *ent;
+    char path[1024];
+    const char *ext;
+    DIR *d;
+
+    d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "bench: cannot open %s, skipping files\n", dir);
+        return;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        ext = strrchr(ent->d_name, '.');
+        if (ext == NULL || (strcmp(ext, ".ppm") != 0 && strcmp(ext, ".pgm") != 0))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        memset(&b->src, 0, sizeof(b->src));
+        if (img_load(&b->src, path, NULL) != IMG_OK) {
+            fprintf(stderr, "bench: cannot load %s\n", path);
+            continue;
+        }
+        run_all(b, ent->d_name);
+        img_free(&b->src);
+    }
+    closedir(d);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const u32 sizes[][2] = { {640, 480}, {1920, 1080}, {3840, 2160} };
+    static const u8 channels[] = { 1, 3, 4 };
+    Bench b = {0};
+    const char *dir = "images";
+    char name[32];
+    size_t s, c, nsizes;
+    int opt, quick;
+
+    quick = 0;
+    while ((opt = getopt(argc, argv, "jqt:T:f:i:")) != -1) {
+        switch (opt) {
+            case 'j': json = 1; break;
+            case 'q': quick = 1; break;
+            case 't': min_time = atof(optarg); break;
+            case 'T': img_set_threads((u32)atoi(optarg)); break;
+            case 'f': filter = optarg; break;
+            case 'i': dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-j] [-q] [-t seconds] [-T threads] [-f filter] [-i dir]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (img_get_kernel(IMG_KERNEL_BOX_BLUR, IMG_KERNEL_5x5, &b.box5) != IMG_OK ||
+        img_get_kernel(IMG_KERNEL_SHARPEN, IMG_KERNEL_3x3, &b.sharpen3) != IMG_OK) {
+        fprintf(stderr, "bench: cannot build kernels\n");
+        return 1;
+    }
+
+    report_header();
+    nsizes = quick ? 1 : sizeof(sizes) / sizeof(sizes[0]);
+    for (s = 0; s < nsizes; s++) {
+        for (c = 0; c < sizeof(channels); c++) {
+            memset(&b.src, 0, sizeof(b.src));
+            if (img_init(&b.src, sizes[s][0], sizes[s][1], channels[c], NULL) != IMG_OK)
+                return 1;
+            b.src.type = pnm_type(channels[c]);
+            fill(&b.src, 1);
+            snprintf(name, sizeof(name), "synthetic");
+            run_all(&b, name);
+            img_free(&b.src);
+        }
+    }
+    if (!quick)
+        bench_files(&b, dir);
+
+    img_free_kernel(&b.box5);
+    img_free_kernel(&b.sharpen3);
+    img_integral_free(&b.ii);
+    img_pyramid_free(&b.pyr);
+    return 0;
+}
@@ -2,3 +2,7 @@
 
 C_TOOLKIT_BASE = https://raw.githubusercontent.com/minahermina/c-toolkit/main
 ARENA_URL = $(C_TOOLKIT_BASE)
+
+# Optional features, e.g. make FEATURES=-DIMG_STATS
+#   -DIMG_STATS   per-operation call counters, timings and byte counts (img_stats_get)
+FEATURES =
@@ -48,8 +48,8 @@ int main(int argc, char *argv[]) {
     CHECK_STATUS(err);
 
     // --- 4. Resize the Image ---
-    u16 new_width = 320;
-    u16 new_height = 213;
+    u32 new_width = 320;
+    u32 new_height = 213;
     err = img_resize(&resized_img, &img, new_width, new_height);
     CHECK_STATUS(err);
 
@@ -57,7 +57,27 @@ int main(int argc, char *argv[]) {
     err = img_save(&resized_img, resized_path);
     CHECK_STATUS(err);
 
-    // --- 5. Display the original image ---
+    // --- 5. Grayscale -> Sharpen -> Resize in a single pass ---
+    // The rows flow through all three steps, no intermediate image is made.
+    if (img.channels >= 3) {
+        Pipeline pipe;
+        Image thumb = {0};
+
+        img_pipe_init(&pipe, &img);
+        img_pipe_rgb2gray(&pipe, IMG_GRAY_BT709);
+        img_pipe_filter2D(&pipe, IMG_KERNEL_SHARPEN, IMG_KERNEL_3x3, IMG_BORDER_REPLICATE);
+        img_pipe_resize(&pipe, new_width, new_height, IMG_RESIZE_BICUBIC);
+        err = img_pipe_run(&pipe, &thumb);
+        img_pipe_free(&pipe);
+        CHECK_STATUS(err);
+
+        const char *thumb_path = "pipeline_output.pgm";
+        err = img_save(&thumb, thumb_path);
+        img_free(&thumb);
+        CHECK_STATUS(err);
+    }
+
+    // --- 6. Display the original image ---
     // Note: This requires an image viewer like 'eog', and 'feh' to be installed.
     img_disp(&img, "sxiv");
     arena_destroy(&arena);
@@ -23,18 +23,58 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <fcntl.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__ELF__) && defined(__SSE2__)
+#define IMG_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define IMG_X86_DISPATCH 0
+#endif
+#if defined(__linux__) && !defined(IMG_NO_URING)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IMG_URING 1
+#endif
+#endif
+#endif
+#ifndef IMG_URING
+#define IMG_URING 0
+#endif
 
 #include "image.h"
 
 /* Macros */
 #define MAXLINE 1024
-#define CHUNK_SIZE 8192
+#define IMG_MAX_TAPS 64            /* built-in kernel sizes kept in kernel_cache */
+#define IMG_MAX_THREADS 256
+#define IMG_GRAIN_PIXELS 16384    /* smallest amount of work worth a band */
+#define FIX_BITS 14               /* fractional bits of fixed-point weights */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define IMG_IOV_MAX IOV_MAX
+#else
+#define IMG_IOV_MAX 1024
+#endif
 #define MAX(A, B)                 ((A) > (B) ? (A) : (B))
 #define MIN(A, B)                 ((A) < (B) ? (A) : (B))
 #define FLOOR(x)                  ((int)(x) - ((x) < 0 && (x) != (int)(x)))
 #define ABS(x)                    ((x) < 0 ? -(x) : (x))
 #define P(x)                      (x <= 0 ? 0 : x)
 #define IMG_PIXEL_PTR(img, x, y)  ((u8*)((img)->data + (y) * (img)->stride + (x) * (img)->channels))
+#define ROW_GRAIN(width)          ((u32)MAX(1, IMG_GRAIN_PIXELS / (u64)(width)))
 #define IMG_ARR_SIZE(x)           (sizeof(x) / sizeof((x)[0]))
 #define VAR(var)                  fprintf(stderr, "[DEBUG] %s = %d\n", #var, (var))
 /* TODO: find more flexible & dynamic way for this (more than 2 bytes))*/
@@ -69,42 +109,240 @@ static const struct error_entry error_entries[] = {
     ERROR(IMG_ERR_UNSUPPORTED_KERNEL,  "Unsupported Kernel type"),
     ERROR(IMG_ERR_CORRUPT_DATA,        "Corrupted image data"),
     ERROR(IMG_ERR_COLOR_SPACE,         "Unsupported or invalid color space"),
-    ERROR(IMG_ERR_UNKNOWN,             "Unknown error")
+    ERROR(IMG_ERR_UNKNOWN,             "Unknown error"),
+    ERROR(IMG_ERR_BUFFER_TOO_SMALL,    "Output buffer is too small"),
+    ERROR(IMG_ERR_UNAVAILABLE,         "Not available in this build")
 };
 
+typedef struct {
+    ImgType type;
+    u32 width, height, maxval;
+    u8 channels;
+    u8 bytes;           /* per binary sample, 2 (big-endian) when maxval > 255 */
+    size_t offset;      /* first raster byte */
+} PnmHeader;
+
 static inline u32
-calc_stride(u16 width, u8 channels)
+calc_stride(u32 width, u8 channels)
 {
     return (((u32) width * (u32)channels + 15) & ~(u32)15);
 }
 
-/* TODO: Replace current_pos logic with x, y to use img_getpx & img_setpx*/
-static i8
-addpixel(Image *img, const u8 *pixel, u32 *current_pos)
+/* width * channels plus padding has to fit the u32 stride */
+static inline int
+row_fits(u32 width, u8 channels)
 {
-    u8 *p, i;
-    u32 x, y;
+    return (u64)width * channels + 15 <= UINT32_MAX;
+}
 
-    MUST(img != NULL,         "img is NULL in addpixel"); 
-    MUST(pixel != NULL ,      "img is NULL in addpixel");
-    MUST(current_pos != NULL, "img is NULL in addpixel"); 
+/* FIX_BITS fixed-point accumulator back to a sample */
+static inline u8
+fix_clamp(i32 acc)
+{
+    acc >>= FIX_BITS;
+    return (u8)(acc < 0 ? 0 : acc > 255 ? 255 : acc);
+}
 
-    if (*current_pos >= (u32)(img->width * img->height)) {
-        fprintf(stderr, "Error: Exceeded image capacity.\n");
-        return -1;
-    }
+static const char *op_names[IMG_OP_COUNT] = {
+    [IMG_OP_INIT]            = "img_init",
+    [IMG_OP_CONVERT_LAYOUT]  = "img_convert_layout",
+    [IMG_OP_CONVERT_DEPTH]   = "img_convert_depth",
+    [IMG_OP_LOAD]            = "img_load",
+    [IMG_OP_LOADPNM]         = "img_loadpnm",
+    [IMG_OP_SAVE]            = "img_save",
+    [IMG_OP_SAVEPNM]         = "img_savepnm",
+    [IMG_OP_SAVEPNM_MEM]     = "img_savepnm_mem",
+    [IMG_OP_DECODE_PNM]      = "img_decode_pnm",
+    [IMG_OP_ENCODE_PNM]      = "img_encode_pnm",
+    [IMG_OP_CPY]             = "img_cpy",
+    [IMG_OP_READER_READ]     = "img_reader_read",
+    [IMG_OP_WRITER_WRITE]    = "img_writer_write",
+    [IMG_OP_LOAD_ASYNC]      = "img_load_async",
+    [IMG_OP_SAVE_ASYNC]      = "img_save_async",
+    [IMG_OP_CONVOLVE]        = "img_convolve",
+    [IMG_OP_FILTER2D]        = "img_filter2D",
+    [IMG_OP_BOX_FILTER]      = "img_box_filter",
+    [IMG_OP_INTEGRAL]        = "img_integral",
+    [IMG_OP_GAUSSIAN_BLUR]   = "img_gaussian_blur",
+    [IMG_OP_MEDIAN_FILTER]   = "img_median_filter",
+    [IMG_OP_MIN_FILTER]      = "img_min_filter",
+    [IMG_OP_MAX_FILTER]      = "img_max_filter",
+    [IMG_OP_RESIZE]          = "img_resize_filter",
+    [IMG_OP_WARP_AFFINE]     = "img_warp_affine",
+    [IMG_OP_TRANSPOSE]       = "img_transpose",
+    [IMG_OP_FLIP]            = "img_flip",
+    [IMG_OP_ROTATE90]        = "img_rotate90",
+    [IMG_OP_PYRAMID]         = "img_pyramid",
+    [IMG_OP_RECONSTRUCT]     = "img_pyramid_reconstruct",
+    [IMG_OP_RGB2GRAY]        = "img_rgb2gray_coeffs",
+    [IMG_OP_RGB2HSV]         = "img_rgb2hsv",
+    [IMG_OP_HSV2RGB]         = "img_hsv2rgb",
+    [IMG_OP_RGB2YCBCR]       = "img_rgb2ycbcr",
+    [IMG_OP_YCBCR2RGB]       = "img_ycbcr2rgb",
+    [IMG_OP_PREMULTIPLY]     = "img_premultiply",
+    [IMG_OP_ADD]             = "img_add",
+    [IMG_OP_SUBTRACT]        = "img_subtract_mode",
+    [IMG_OP_BLEND]           = "img_blend",
+    [IMG_OP_MULTIPLY]        = "img_multiply",
+    [IMG_OP_ADD_SCALAR]      = "img_add_scalar",
+    [IMG_OP_MULTIPLY_SCALAR] = "img_multiply_scalar",
+    [IMG_OP_PIPE_RUN]        = "img_pipe_run",
+    [IMG_OP_PIPE_RUN_STREAM] = "img_pipe_run_stream",
+    [IMG_OP_BATCH_RUN]       = "img_batch_run",
+};
 
-    x = *current_pos % img->width;
-    y = *current_pos / img->width;
-    p = IMG_PIXEL_PTR(img, x, y);
+/*
+    Instrumentation, compiled in with -DIMG_STATS. A counted function opens
+    a StatsCall with STATS_BEGIN before its first goto and closes it with
+    STATS_END on its way out. The open calls of a thread form a stack,
+    STATS_IO/STATS_ARENA charge the innermost one and a closing call passes
+    its bytes on to its caller. Without the flag the macros are empty.
+*/
+#if defined(IMG_STATS)
+typedef struct StatsCall {
+    ImgOp op;
+    struct timespec t0;
+    ImgStats delta;
+    struct StatsCall *parent;
+} StatsCall;
+
+static struct {
+    pthread_mutex_t lock;
+    ImgStats total[IMG_OP_COUNT];
+    ImgStatsHook hook;
+    void *userdata;
+} stats = { PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void
+stats_init(void)
+{
+    pthread_key_create(&stats_key, NULL);
+}
+
+static void
+stats_begin(StatsCall *call, ImgOp op)
+{
+    pthread_once(&stats_once, stats_init);
+    memset(call, 0, sizeof(*call));
+    call->op = op;
+    call->parent = pthread_getspecific(stats_key);
+    pthread_setspecific(stats_key, call);
+    clock_gettime(CLOCK_MONOTONIC, &call->t0);
+}
 
-    for (i = 0; i < img->channels; i++) {
-        p[i] = pixel[i];
+static void
+stats_end(StatsCall *call, u64 pixels)
+{
+    struct timespec t1;
+    ImgStats *d, *t;
+    ImgStatsHook hook;
+    void *userdata;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    d = &call->delta;
+    d->calls = 1;
+    d->wall_ns = (u64)(t1.tv_sec - call->t0.tv_sec) * 1000000000u
+                 + t1.tv_nsec - call->t0.tv_nsec;
+    d->pixels = pixels;
+
+    pthread_mutex_lock(&stats.lock);
+    t = &stats.total[call->op];
+    t->calls         += 1;
+    t->wall_ns       += d->wall_ns;
+    t->pixels        += d->pixels;
+    t->bytes_read    += d->bytes_read;
+    t->bytes_written += d->bytes_written;
+    t->arena_bytes   += d->arena_bytes;
+    hook = stats.hook;
+    userdata = stats.userdata;
+    pthread_mutex_unlock(&stats.lock);
+
+    pthread_setspecific(stats_key, call->parent);
+    if (call->parent != NULL) {
+        call->parent->delta.bytes_read    += d->bytes_read;
+        call->parent->delta.bytes_written += d->bytes_written;
+        call->parent->delta.arena_bytes   += d->arena_bytes;
     }
+    if (hook != NULL)
+        hook(call->op, d, userdata);
+}
 
-    (*current_pos)++;
+static void
+stats_add(u64 rd, u64 wr, u64 arena)
+{
+    StatsCall *call;
+
+    pthread_once(&stats_once, stats_init);
+    call = pthread_getspecific(stats_key);
+    if (call == NULL)
+        return;
+    call->delta.bytes_read    += rd;
+    call->delta.bytes_written += wr;
+    call->delta.arena_bytes   += arena;
+}
 
-    return 1;
+#define STATS_BEGIN(op)     StatsCall stats_call; stats_begin(&stats_call, (op))
+#define STATS_END(pixels)   stats_end(&stats_call, (pixels))
+#define STATS_IO(rd, wr)    stats_add((rd), (wr), 0)
+#define STATS_ARENA(bytes)  stats_add(0, 0, (bytes))
+#else
+#define STATS_BEGIN(op)     do {} while (0)
+#define STATS_END(pixels)   do {} while (0)
+#define STATS_IO(rd, wr)    do {} while (0)
+#define STATS_ARENA(bytes)  do {} while (0)
+#endif
+
+ImgError
+img_stats_get(ImgOp op, ImgStats *out)
+{
+    MUST(out != NULL, "out is NULL in img_stats_get");
+
+    if (op < 0 || op >= IMG_OP_COUNT)
+        return IMG_ERR_INVALID_PARAMETERS;
+#if defined(IMG_STATS)
+    pthread_mutex_lock(&stats.lock);
+    *out = stats.total[op];
+    pthread_mutex_unlock(&stats.lock);
+    return IMG_OK;
+#else
+    memset(out, 0, sizeof(*out));
+    return IMG_ERR_UNAVAILABLE;
+#endif
+}
+
+ImgError
+img_stats_set_hook(ImgStatsHook hook, void *userdata)
+{
+#if defined(IMG_STATS)
+    pthread_mutex_lock(&stats.lock);
+    stats.hook = hook;
+    stats.userdata = userdata;
+    pthread_mutex_unlock(&stats.lock);
+    return IMG_OK;
+#else
+    return hook == NULL ? IMG_OK : IMG_ERR_UNAVAILABLE;
+#endif
+}
+
+void
+img_stats_reset(void)
+{
+#if defined(IMG_STATS)
+    pthread_mutex_lock(&stats.lock);
+    memset(stats.total, 0, sizeof(stats.total));
+    pthread_mutex_unlock(&stats.lock);
+#endif
+}
+
+const char *
+img_op_name(ImgOp op)
+{
+    if (op < 0 || op >= IMG_OP_COUNT)
+        return "unknown";
+    return op_names[op];
 }
 
 void*
@@ -112,8 +350,8 @@ img_malloc(size_t size, Arena* arena)
 {
     if(arena == NULL)
         return malloc(size);
-    else
-        return arena_alloc(arena, size);
+    STATS_ARENA(size);
+    return arena_alloc(arena, size);
 }
 
 void*
@@ -121,76 +359,225 @@ img_realloc(void* ptr, size_t oldsz, size_t newsz, Arena* arena)
 {
     if(arena == NULL)
         return realloc(ptr, newsz);
-    else
-        return arena_realloc(arena, ptr, oldsz, newsz);
+    STATS_ARENA(newsz);
+    return arena_realloc(arena, ptr, oldsz, newsz);
 }
 
-ImgError
-img_realloc_pixels(Image *img, u16 new_width, u16 new_height, u8 new_channels)
+static void
+img_release_borrowed(Image *img)
+{
+    if (img->map != NULL)
+        munmap(img->map, img->map_size);
+
+    img->data = NULL;
+    img->capacity = 0;
+    img->borrowed = 0;
+    img->map = NULL;
+    img->map_size = 0;
+}
+
+/* bytes of one sample */
+static inline u8
+depth_size(ImgDepth depth)
+{
+    return depth == IMG_DEPTH_F32 ? 4 : depth == IMG_DEPTH_U16 ? 2 : 1;
+}
+
+/*
+    Makes room for new_width x new_height x new_channels samples of depth.
+    The buffer is kept when it is big enough and replaced otherwise. The
+    pixel values are left undefined, every caller writes all of them.
+*/
+static ImgError
+img_realloc_depth(Image *img, u32 new_width, u32 new_height, u8 new_channels, ImgDepth depth)
 {
     ImgError err;
-    u32 old_stride;
+    size_t need;
+    u8 size;
 
-    MUST(img != NULL, "img is NULL in img_realloc_pixels");
+    MUST(img != NULL, "img is NULL in img_realloc_depth");
 
     err = IMG_OK;
-    if(new_width < 1 || new_height < 1 || new_channels < 1 || new_channels > 4){
+    size = depth_size(depth);
+    if(new_width < 1 || new_height < 1 || new_channels < 1 || new_channels > 4 ||
+       !row_fits(new_width, new_channels * size)){
         err = IMG_ERR_INVALID_DIMENSIONS;  goto error;
     }
 
-    old_stride = img->stride;
-
-    img->stride = calc_stride(new_width, new_channels);
-    img->data = (u8*) img_realloc((void *)img->data, 
-                                  img->height * old_stride,
-                                  new_height * img->stride, 
-                                  img->arena);
-
-    MUST(img->data != NULL, "img->data is NULL in img_realloc_pixels");
-
-    memset(img->data, 0, new_height * img->stride);
+    if (img->borrowed)
+        img_release_borrowed(img);
+
+    img->stride = calc_stride(new_width, new_channels * size);
+    need = (size_t)new_height * img->stride;
+    if (img->data == NULL || need > img->capacity) {
+        /* the old pixels are not kept, so there is nothing to copy over */
+        if (img->data != NULL && img->arena == NULL)
+            free(img->data);
+        img->data = (u8*) img_malloc(need, img->arena);
+        img->capacity = img->data != NULL ? need : 0;
+        if (img->data == NULL) {
+            img->width = img->height = 0;
+            err = IMG_ERR_MEMORY; goto error;
+        }
+    }
 
     img->width = new_width;
     img->height = new_height;
     img->channels = new_channels;
+    img->depth = depth;
+    img->layout = IMG_LAYOUT_INTERLEAVED;
+    img->plane_size = 0;
 
 error: 
     return err;
 }
 
+/* img_realloc_depth for 8-bit samples */
+ImgError
+img_realloc_pixels(Image *img, u32 new_width, u32 new_height, u8 new_channels)
+{
+    return img_realloc_depth(img, new_width, new_height, new_channels, IMG_DEPTH_U8);
+}
+
+/* bytes of one 64-byte aligned plane, 0 when channels of them would not fit a size_t */
+static size_t
+plane_bytes(u32 width, u32 height, u8 channels)
+{
+    size_t plane;
+
+    plane = ((size_t)height * calc_stride(width, 1) + 63) & ~(size_t)63;
+    return plane > SIZE_MAX / channels - 63 ? 0 : plane;
+}
+
+/* size bytes at a 64-byte boundary, which arenas do not promise */
+static u8 *
+planes_alloc(size_t size, Arena *arena)
+{
+    void *p;
+
+    if (arena == NULL)
+        return posix_memalign(&p, 64, size) == 0 ? p : NULL;
+    p = img_malloc(size + 63, arena);
+    return p != NULL ? (u8 *)(((uintptr_t)p + 63) & ~(uintptr_t)63) : NULL;
+}
+
+/* img_realloc_pixels for a planar image */
+static ImgError
+img_realloc_planes(Image *img, u32 width, u32 height, u8 channels)
+{
+    size_t plane, need;
+
+    if (width < 1 || height < 1 || channels < 1 || channels > 4 || !row_fits(width, 1))
+        return IMG_ERR_INVALID_DIMENSIONS;
+    plane = plane_bytes(width, height, channels);
+    if (plane == 0)
+        return IMG_ERR_INVALID_DIMENSIONS;
+
+    if (img->borrowed)
+        img_release_borrowed(img);
+
+    need = plane * channels;
+    if (img->data == NULL || need > img->capacity || ((uintptr_t)img->data & 63)) {
+        if (img->data != NULL && img->arena == NULL)
+            free(img->data);
+        img->data = planes_alloc(need, img->arena);
+        img->capacity = img->data != NULL ? need : 0;
+        if (img->data == NULL) {
+            img->width = img->height = 0;
+            return IMG_ERR_MEMORY;
+        }
+    }
+
+    img->stride = calc_stride(width, 1);
+    img->plane_size = plane;
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->depth = IMG_DEPTH_U8;
+    img->layout = IMG_LAYOUT_PLANAR;
+    return IMG_OK;
+}
+
+
+ImgError
+img_init(Image *img, u32 width, u32 height, u8 channels, Arena* arena)
+{
+    return img_init_depth(img, width, height, channels, IMG_DEPTH_U8, arena);
+}
 
+/* img_init with samples of the given depth, zeroed as well */
 ImgError
-img_init(Image *img, u16 width, u16 height, u8 channels, Arena* arena)
+img_init_depth(Image *img, u32 width, u32 height, u8 channels, ImgDepth depth, Arena *arena)
 {
     ImgError err;
 
+    STATS_BEGIN(IMG_OP_INIT);
     /*TODO: Extend channel support beyond the current 1-4 limit to accommodate additional color spaces:
      * - LAB (3 channels)
      * - CMYK (4 channels)
      * - CMYKA (5 channels)
      * - etc.
      */
-    if(width == 0 || height == 0 || channels < 1 || channels > 4){
+    if(width == 0 || height == 0 || channels < 1 || channels > 4 ||
+       (depth != IMG_DEPTH_U8 && depth != IMG_DEPTH_U16 && depth != IMG_DEPTH_F32) ||
+       !row_fits(width, channels * depth_size(depth))){
         err = IMG_ERR_INVALID_DIMENSIONS; goto error;
     }
 
-    img->stride = calc_stride(width, channels);
+    img->stride = calc_stride(width, channels * depth_size(depth));
     img->arena = arena;
-    img->data = (u8*) img_malloc(height * img->stride, img->arena);
+    img->data = (u8*) img_malloc((size_t)height * img->stride, img->arena);
 
     if(img->data == NULL) {
         err = IMG_ERR_MEMORY;  goto error;
     }
 
-    memset(img->data, 0, height * img->stride);
+    memset(img->data, 0, (size_t)height * img->stride);
+    img->capacity = (size_t)height * img->stride;
 
     img->width = width;
     img->height = height;
     img->channels = channels;
+    img->depth = depth;
+    img->layout = IMG_LAYOUT_INTERLEAVED;
+    img->plane_size = 0;
     img->type = -1;
+    img->borrowed = 0;
+    img->map = NULL;
+    img->map_size = 0;
 
     err = IMG_OK;
 error:
+    STATS_END(err == IMG_OK ? (u64)width * height : 0);
+    return err;
+}
+
+/* img_init with a choice of layout, planar images start zeroed as well */
+ImgError
+img_init_layout(Image *img, u32 width, u32 height, u8 channels, ImgLayout layout, Arena *arena)
+{
+    ImgError err;
+
+    MUST(img != NULL, "img is NULL in img_init_layout");
+
+    if (layout == IMG_LAYOUT_INTERLEAVED)
+        return img_init(img, width, height, channels, arena);
+    if (layout != IMG_LAYOUT_PLANAR)
+        return IMG_ERR_INVALID_PARAMETERS;
+
+    STATS_BEGIN(IMG_OP_INIT);
+    img->data = NULL;
+    img->capacity = 0;
+    img->arena = arena;
+    img->borrowed = 0;
+    img->map = NULL;
+    img->map_size = 0;
+    err = img_realloc_planes(img, width, height, channels);
+    if (err == IMG_OK) {
+        memset(img->data, 0, img->capacity);
+        img->type = -1;
+    }
+    STATS_END(err == IMG_OK ? (u64)width * height : 0);
     return err;
 }
 
@@ -242,216 +629,611 @@ error:
     return err;
 }
 
-ImgError
-img_load(Image *img, const char* file, Arena *arena)
+/* Skip whitespace and '#' comments (which may appear anywhere in a PNM header) */
+static void
+pnm_skip(const u8 *buf, size_t len, size_t *pos)
 {
-    ImgError err;
-    FILE *f;
-    ImgType type;
-    MUST(img != NULL, "img is NULL in img_load");
-
-    err = IMG_OK;
+    while (*pos < len) {
+        if (buf[*pos] == '#') {
+            while (*pos < len && buf[*pos] != '\n')
+                (*pos)++;
+        } else if (isspace(buf[*pos])) {
+            (*pos)++;
+        } else {
+            break;
+        }
+    }
+}
 
-    f = fopen(file, "r");
-    if (f == NULL){
-        err = IMG_ERR_FILE_NOT_FOUND; goto error;
+static ImgError
+pnm_uint(const u8 *buf, size_t len, size_t *pos, u32 *val)
+{
+    u32 v = 0;
+    size_t start;
+
+    pnm_skip(buf, len, pos);
+    start = *pos;
+    while (*pos < len && isdigit(buf[*pos])) {
+        if (v > (UINT32_MAX - 9) / 10)
+            return IMG_ERR_CORRUPT_DATA;
+        v = v * 10 + (buf[*pos] - '0');
+        (*pos)++;
     }
+    if (*pos == start)
+        return IMG_ERR_CORRUPT_DATA;
 
-    err = img_type(file, &type);
-    if(err != IMG_OK) goto error;
+    *val = v;
+    return IMG_OK;
+}
 
-    switch(type) {
+/* Parses a whole PNM header in one pass, leaves hdr->offset at the first raster byte */
+static ImgError
+pnm_header(const u8 *buf, size_t len, PnmHeader *hdr)
+{
+    ImgError err;
+    size_t pos;
+
+    if (len < 2) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
+    }
+
+    hdr->type = (ImgType)((buf[0] << 8) | buf[1]);
+    switch (hdr->type) {
         case IMG_PPM_BIN: /* FALLTHROUGH */
         case IMG_PPM_ASCII:
-        case IMG_PGM_BIN:
+            hdr->channels = 3;
+            break;
+        case IMG_PGM_BIN: /* FALLTHROUGH */
         case IMG_PGM_ASCII:
-            err = img_loadpnm(img, file, type, arena);
+            hdr->channels = 1;
             break;
         default:
+            hdr->type = IMG_UNKNOWN;
             err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
-     
     }
+
+    pos = 2;
+    if ((err = pnm_uint(buf, len, &pos, &hdr->width))  != IMG_OK) goto error;
+    if ((err = pnm_uint(buf, len, &pos, &hdr->height)) != IMG_OK) goto error;
+    if ((err = pnm_uint(buf, len, &pos, &hdr->maxval)) != IMG_OK) goto error;
+
+    if (hdr->maxval < 1 || hdr->maxval > 65535) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
+    }
+    hdr->bytes = hdr->maxval > 255 ? 2 : 1;
+    if (hdr->width < 1 || hdr->height < 1 || !row_fits(hdr->width, hdr->channels * hdr->bytes)) {
+        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
+    }
+
+    /* exactly one whitespace character separates the header from the raster */
+    if (pos >= len || !isspace(buf[pos])) {
+        err = IMG_ERR_CORRUPT_DATA; goto error;
+    }
+    hdr->offset = pos + 1;
+
+    err = IMG_OK;
 error:
     return err;
 }
 
-
-/* TODO: Optimize this funciton*/
-ImgError
-img_loadpnm(Image *img, const char* file, ImgType type, Arena *arena)
+static ImgError
+pnm_map(const char *file, u8 **map, size_t *size)
 {
     ImgError err;
-    ssize_t imgfile;
-    FILE* tmp_file;
-    u8 pixel[3], channels, ch, leftover[2] = {0}, leftover_size = 0;
-    u16 w, h;
-    u32 i, curr_pos = 0, bytesread = 0;
-    char line[MAXLINE], chunk[CHUNK_SIZE];
+    struct stat st;
+    int fd;
 
-    tmp_file = fopen(file, "rb");
-    if(tmp_file  == NULL){
+    fd = open(file, O_RDONLY);
+    if (fd < 0) {
         err = IMG_ERR_FILE_NOT_FOUND; goto error;
-    } 
-
-    switch(type) {
-        case IMG_PPM_BIN: /* FALLTHROUGH */
-        case IMG_PPM_ASCII:
-            channels = 3;
-            break;
-        case IMG_PGM_BIN: /* FALLTHROUGH */
-        case IMG_PGM_ASCII:
-            channels = 1;
-            break;
-        default:
-            err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
     }
 
-    if (!fgets(line, sizeof(line), tmp_file)) {
-        fclose(tmp_file);
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
         err = IMG_ERR_FILE_READ; goto error;
-    }  /* Read PNM magic number*/
-
-    do {
-        if (!fgets(line, sizeof(line), tmp_file)) {
-            fclose(tmp_file); 
-            err = IMG_ERR_FILE_READ;  goto error;
-        }
-    } while (line[0] == '#'); /* Read width & height*/
+    }
 
-    if (!sscanf(line, "%hu %hu", &w, &h) ) {
-        fclose(tmp_file);
+    /*
+     * MAP_PRIVATE + PROT_WRITE keeps the file itself read-only while letting
+     * callers modify borrowed pixels (pages are copied on first write).
+     */
+    *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        *map = NULL;
         err = IMG_ERR_FILE_READ; goto error;
     }
+    *size = st.st_size;
 
-    do {
-        if (!fgets(line, sizeof(line), tmp_file)) {
-            fclose(tmp_file);
-            err = IMG_ERR_FILE_READ;  goto error;
-        }
-    } while (line[0] == '#'); /* Ignore depth info, typically 255*/
+    err = IMG_OK;
+error:
+    return err;
+}
 
-    long pos = ftell(tmp_file);
-    fclose(tmp_file);
+static inline int
+pnm_ascii(ImgType type)
+{
+    return type == IMG_PPM_ASCII || type == IMG_PGM_ASCII;
+}
 
-    imgfile = open(file, O_RDONLY);
-    if(imgfile < 0){
-        err = IMG_ERR_FILE_READ; goto error;
-    } 
+/* Maps samples in [0, maxval] to [0, 255] */
+static void
+pnm_scale_lut(u8 *lut, u32 maxval)
+{
+    u32 v;
+    for (v = 0; v <= maxval; v++)
+        lut[v] = (u8)((v * 255 + maxval / 2) / maxval);
+}
+
+/* Maps samples in [0, maxval] to [0, 65535], maxval > 255 */
+static inline u16
+pnm_scale16(u32 v, u32 maxval)
+{
+    return (u16)((v * 65535 + maxval / 2) / maxval);
+}
 
-    lseek(imgfile, pos, SEEK_SET);
+/*
+    Big-endian 16-bit samples to native ones and back. Both directions are
+    the same byte swap, SSE2 hosts are little-endian so it is done with two
+    shifts per 8 samples.
+*/
+static void
+pnm_be16_load(u16 *dst, const u8 *src, size_t n)
+{
+    size_t i;
 
-    err = img_init(img, w, h, channels, arena);
-    img->type = type;
-    if(err != IMG_OK) {
-        close(imgfile);  goto error;
+    i = 0;
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
     }
+#endif
+    for (; i < n; i++)
+        dst[i] = (u16)(src[2 * i] << 8 | src[2 * i + 1]);
+}
 
-    while ((bytesread = read(imgfile, chunk, sizeof(chunk))) > 0) {
-        int total_bytes = bytesread + leftover_size;
-        int valid_bytes = (total_bytes / channels) * channels;
+static void
+pnm_be16_store(u8 *dst, const u16 *src, size_t n)
+{
+    size_t i;
 
-        // Copy leftover from the previous iteration
-        memmove(chunk + leftover_size, chunk, bytesread);
-        memcpy(chunk, leftover, leftover_size);
+    i = 0;
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[2 * i] = (u8)(src[i] >> 8);
+        dst[2 * i + 1] = (u8)src[i];
+    }
+}
 
-        for (i = 0; i < valid_bytes; i += channels) {
-            for (ch = 0; ch < channels; ch++) {
-                pixel[ch] = chunk[i + ch];
-            }
-            if (addpixel(img, pixel, &curr_pos) < 0) {
-                close(imgfile);
+/*
+    Swaps the 16-bit binary rows at raster into img (U16, already
+    allocated) and stretches [0, maxval] to [0, 65535] through a table
+    unless maxval already is 65535.
+*/
+static ImgError
+pnm_decode_wide(Image *img, const u8 *raster, u32 maxval)
+{
+    ImgError err;
+    u16 *lut, *row;
+    u32 x, y, rowsz;
+
+    lut = NULL;
+    if (maxval != 65535) {
+        lut = malloc(((size_t)maxval + 1) * sizeof(*lut));
+        if (lut == NULL)
+            return IMG_ERR_MEMORY;
+        for (x = 0; x <= maxval; x++)
+            lut[x] = pnm_scale16(x, maxval);
+    }
+
+    err = IMG_OK;
+    rowsz = img->width * img->channels;
+    for (y = 0; y < img->height; y++) {
+        row = (u16 *)(img->data + (size_t)y * img->stride);
+        pnm_be16_load(row, raster + (size_t)y * rowsz * 2, rowsz);
+        if (lut == NULL) continue;
+        for (x = 0; x < rowsz; x++) {
+            if (row[x] > maxval) {
                 err = IMG_ERR_CORRUPT_DATA; goto error;
             }
+            row[x] = lut[row[x]];
         }
-
-        // Store leftover bytes
-        leftover_size = total_bytes % channels;
-        memcpy(leftover, chunk + valid_bytes, leftover_size);
     }
-    close(imgfile);
 
-    err = IMG_OK;
 error:
+    free(lut);
     return err;
 }
 
-ImgError
-img_getpx(Image *img, u16 x, u16 y, u8 *pixel)
+/*
+    Decodes P2/P3 text samples into img (already allocated), *used is set
+    to the number of bytes consumed.
+    On SSE2 the digit runs of 16 bytes are located at once and only the runs
+    themselves are walked; anything unusual (comments, bad bytes, the tail)
+    drops to the scalar tokenizer.
+*/
+static ImgError
+pnm_decode_ascii(Image *img, const u8 *buf, size_t len, u32 maxval, size_t *used)
+{
+    u8 lut[256], *p;
+    u32 v, x, rowsz, rowbytes;
+    size_t pos, n, total;
+
+    if (maxval <= 255)
+        pnm_scale_lut(lut, maxval);
+    rowsz = img->width * img->channels;
+    rowbytes = rowsz * depth_size(img->depth);
+    total = (size_t)rowsz * img->height;
+    p = img->data;
+    pos = x = n = 0;
+
+    /* a U16 img takes 16-bit samples (maxval > 255), scaled one at a time */
+#define EMIT(val) \
+    do { \
+        if ((val) > maxval) return IMG_ERR_CORRUPT_DATA; \
+        if (img->depth == IMG_DEPTH_U16) { \
+            *(u16 *)p = maxval == 65535 ? (u16)(val) : pnm_scale16((val), maxval); \
+            p += 2; \
+        } else { \
+            *p++ = lut[(val)]; \
+        } \
+        if (++x == rowsz) { \
+            x = 0; \
+            p += img->stride - rowbytes; \
+        } \
+        n++; \
+    } while (0)
+
+    while (n < total) {
+#if defined(__SSE2__)
+        const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+        const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4), space = _mm_set1_epi8(' ');
+        __m128i b, d, w;
+        const u8 *q;
+        u32 digits, blanks, starts, ends, step, s, run, cnt, i, k, v2, v3, e;
+        int slow;
+
+        /* 2 bytes of slack so a 3-digit sample can be read past the block */
+        while (n < total && pos + 18 <= len) {
+            b = _mm_loadu_si128((const __m128i *)(buf + pos));
+            d = _mm_sub_epi8(b, zero);
+            digits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, nine), d));
+            w = _mm_sub_epi8(b, tab);
+            blanks = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(w, four), w),
+                                                    _mm_cmpeq_epi8(b, space)));
+            if ((digits | blanks) != 0xFFFF)
+                break;  /* comment or garbage, let the scalar path sort it out */
+
+            starts = digits & ~(digits << 1);
+            ends = digits & ~(digits >> 1);
+            step = 16;
+            if (digits & 0x8000) {
+                /* the last run may go on in the next block, leave it for then */
+                step = 31 - __builtin_clz(starts);
+                if (step == 0) break;  /* 16 digits in a row, zero-padded or too big */
+                starts &= ~(1u << step);
+                ends &= 0x7FFF;
+            }
+
+            cnt = __builtin_popcount(starts);
+            if (cnt > total - n) cnt = total - n;
+            slow = e = 0;
+            for (i = 0; i < cnt; i++) {
+                s = __builtin_ctz(starts);
+                run = __builtin_ctz(ends) - s + 1;
+                starts &= starts - 1;
+                ends &= ends - 1;
+
+                q = buf + pos + s;
+                if (run <= 3) {
+                    /* branch-free for the usual 1-3 digit samples */
+                    v2 = (u32)(q[0] - '0') * 10 + (u32)(q[1] - '0');
+                    v3 = v2 * 10 + (u32)(q[2] - '0');
+                    v = run == 1 ? (u32)(q[0] - '0') : run == 2 ? v2 : v3;
+                } else if (run > 5) {
+                    /* leading zeros or out of range, pnm_uint tells which */
+                    step = s;
+                    slow = 1;
+                    break;
+                } else {
+                    for (v = 0, k = 0; k < run; k++)
+                        v = v * 10 + (q[k] - '0');
+                }
+                EMIT(v);
+                e = s + run;
+            }
+            /* the last sample may sit before other ones, the next band starts right after it */
+            if (n == total && cnt > 0) step = e;
+            pos += step;
+            if (slow) break;
+        }
+        if (n == total) break;
+#endif
+        /* one token the slow way, then back to the fast loop */
+        if (pnm_uint(buf, len, &pos, &v) != IMG_OK)
+            return IMG_ERR_CORRUPT_DATA;
+        if (pos < len && !isspace(buf[pos]) && buf[pos] != '#')
+            return IMG_ERR_CORRUPT_DATA;
+        EMIT(v);
+    }
+#undef EMIT
+
+    *used = pos;
+    return IMG_OK;
+}
+
+#define PNM_MAPPED  1   /* buf is our file mapping, kept as the pixels or unmapped */
+#define PNM_REUSE   2   /* img holds a buffer to reuse, never freed here */
+#define PNM_COPY    4   /* always copy the rows, buf may go away after the call */
+
+/*
+    Decodes the PNM in buf into img. When the rows need no conversion img
+    borrows them from buf instead of copying, unless PNM_COPY is set. With PNM_REUSE the buffer
+    already in img is grown as needed rather than a new one allocated, and
+    left alone when the rows are borrowed: the caller keeps a copy of it.
+*/
+static ImgError
+pnm_load_buf(Image *img, u8 *buf, size_t size, ImgType type, Arena *arena, int flags)
 {
-    u8 *p, i;
     ImgError err;
+    PnmHeader hdr;
+    const u8 *raster;
+    ImgDepth depth;
+    u8 lut[256], *row;
+    u32 x, y, rowsz;
+    size_t used;
+
+    err = pnm_header(buf, size, &hdr);
+    if (err != IMG_OK) goto error;
 
-    err = IMG_OK;
-    if (img == NULL || pixel == NULL || x >= img->width || y >= img->height) {
-        fprintf(stderr, "Error: (function: %s, line %d, file %s)\n", __func__, __LINE__, __FILE__);
-        err = IMG_ERR_INVALID_PARAMETERS;  goto error;
+    if (type != IMG_UNKNOWN && type != hdr.type) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
     }
 
-    p = IMG_PIXEL_PTR(img, x, y);
-    for(i = 0; i < img->channels; i++) {
-        pixel[i] = p[i];
+    /* maxval above 255 keeps its precision in a U16 image */
+    depth = hdr.bytes == 2 ? IMG_DEPTH_U16 : IMG_DEPTH_U8;
+    rowsz = hdr.width * hdr.channels;
+    raster = buf + hdr.offset;
+
+    if (pnm_ascii(hdr.type)) {
+        if (flags & PNM_REUSE)
+            err = img_realloc_depth(img, hdr.width, hdr.height, hdr.channels, depth);
+        else
+            err = img_init_depth(img, hdr.width, hdr.height, hdr.channels, depth, arena);
+        if (err != IMG_OK) goto error;
+        img->type = hdr.type;
+
+        err = pnm_decode_ascii(img, raster, size - hdr.offset, hdr.maxval, &used);
+        if (err != IMG_OK && !(flags & PNM_REUSE)) img_free(img);
+        goto error;
+    }
+
+    if (size - hdr.offset < (size_t)rowsz * hdr.bytes * hdr.height) {
+        err = IMG_ERR_CORRUPT_DATA; goto error;
+    }
+
+    if (!(flags & PNM_COPY) && calc_stride(hdr.width, hdr.channels) == rowsz && hdr.maxval == 255) {
+        /* rows are already laid out the way we want them, no copy needed */
+        img->data = (u8 *)raster;
+        img->stride = rowsz;
+        img->layout = IMG_LAYOUT_INTERLEAVED;
+        img->plane_size = 0;
+        img->capacity = 0;
+        img->width = hdr.width;
+        img->height = hdr.height;
+        img->channels = hdr.channels;
+        img->depth = IMG_DEPTH_U8;
+        img->arena = arena;
+        img->type = hdr.type;
+        img->borrowed = 1;
+        img->map = (flags & PNM_MAPPED) ? buf : NULL;
+        img->map_size = (flags & PNM_MAPPED) ? size : 0;
+        return IMG_OK;
+    }
+
+    if (flags & PNM_MAPPED)
+        posix_madvise(buf, size, POSIX_MADV_SEQUENTIAL);
+
+    if (flags & PNM_REUSE)
+        err = img_realloc_depth(img, hdr.width, hdr.height, hdr.channels, depth);
+    else
+        err = img_init_depth(img, hdr.width, hdr.height, hdr.channels, depth, arena);
+    if (err != IMG_OK) goto error;
+    img->type = hdr.type;
+
+    if (depth == IMG_DEPTH_U16) {
+        err = pnm_decode_wide(img, raster, hdr.maxval);
+        if (err != IMG_OK && !(flags & PNM_REUSE)) img_free(img);
+        goto error;
+    }
+
+    for (y = 0; y < hdr.height; y++)
+        memcpy(img->data + y * img->stride, raster + (size_t)y * rowsz, rowsz);
+
+    if (hdr.maxval != 255) {
+        pnm_scale_lut(lut, hdr.maxval);
+        for (y = 0; y < hdr.height; y++) {
+            row = img->data + (size_t)y * img->stride;
+            for (x = 0; x < rowsz; x++) {
+                if (row[x] > hdr.maxval) {
+                    if (!(flags & PNM_REUSE)) img_free(img);
+                    err = IMG_ERR_CORRUPT_DATA; goto error;
+                }
+                row[x] = lut[row[x]];
+            }
+        }
     }
 
 error:
+    if (flags & PNM_MAPPED)
+        munmap(buf, size);
     return err;
 }
 
 ImgError
-img_setpx(Image *img, u16 x, u16 y, u8 *pixel)
+img_load(Image *img, const char* file, Arena *arena)
 {
-    u8 *p, i;
     ImgError err;
+    u8 *map;
+    size_t size;
 
-    err = IMG_OK;
-    if (img == NULL || pixel == NULL || x >= img->width || y >= img->height) {
-        fprintf(stderr, "Error: (function: %s, line %d, file %s)\n", __func__, __LINE__, __FILE__);
-        err = IMG_ERR_INVALID_PARAMETERS;  goto error;
-    }
+    MUST(img  != NULL, "img is NULL in img_load");
+    MUST(file != NULL, "file is NULL in img_load");
 
-    p = IMG_PIXEL_PTR(img, x, y);
+    STATS_BEGIN(IMG_OP_LOAD);
+    err = pnm_map(file, &map, &size);
+    if (err != IMG_OK) goto error;
+    STATS_IO(size, 0);
 
-    for(i = 0; i < img->channels; i++)
-        p[i] = MIN(255, pixel[i]);
+    /* only PNM for now, the magic number decides the rest */
+    err = pnm_load_buf(img, map, size, IMG_UNKNOWN, arena, PNM_MAPPED);
 
 error:
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
     return err;
 }
 
 ImgError
-img_cpy(Image *dest, Image *src)
+img_loadpnm(Image *img, const char* file, ImgType type, Arena *arena)
 {
     ImgError err;
+    u8 *map;
+    size_t size;
 
-    MUST(dest != NULL, "dest is NULL in img_cpy");
-    MUST(src  != NULL, "src is NULL in img_cpy");
-    MUST(src->data  != NULL, "src->data is NULL in img_cpy");
-
-    err = IMG_OK;
-    /* Check if destination has compatible dimensions and channels */
-    if (dest->width != src->width || 
-        dest->height != src->height || 
-        dest->channels != src->channels) {
-
-        err = img_realloc_pixels(dest, src->width, src->height, src->channels);
-        if (err != IMG_OK) goto error;
-    }
+    MUST(img  != NULL, "img is NULL in img_loadpnm");
+    MUST(file != NULL, "file is NULL in img_loadpnm");
 
-    dest->type = src->type;
+    STATS_BEGIN(IMG_OP_LOADPNM);
+    err = pnm_map(file, &map, &size);
+    if (err != IMG_OK) goto error;
+    STATS_IO(size, 0);
 
-    // Copy image data
-    memcpy(dest->data, src->data, src->height * src->stride);
+    err = pnm_load_buf(img, map, size, type, arena, PNM_MAPPED);
 
 error:
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
     return err;
 }
 
 ImgError
-img_save(Image *img, const char *file)
+img_getpx(Image *img, u32 x, u32 y, u8 *pixel)
 {
+    u8 *p, i;
     ImgError err;
-    MUST(img != NULL, "img is NULL in img_save");
-    MUST(file != NULL, "file is NULL in img_save");
 
+    err = IMG_OK;
+    if (img == NULL || pixel == NULL || x >= img->width || y >= img->height) {
+        fprintf(stderr, "Error: (function: %s, line %d, file %s)\n", __func__, __LINE__, __FILE__);
+        err = IMG_ERR_INVALID_PARAMETERS;  goto error;
+    }
+
+    if (img->layout == IMG_LAYOUT_PLANAR) {
+        p = img->data + (size_t)y * img->stride + x;
+        for (i = 0; i < img->channels; i++)
+            pixel[i] = p[i * img->plane_size];
+        goto error;
+    }
+
+    /* wider samples go out as they are, channels * 2 or 4 bytes */
+    if (img->depth != IMG_DEPTH_U8) {
+        memcpy(pixel, img->data + (size_t)y * img->stride + (size_t)x * img->channels * depth_size(img->depth),
+               img->channels * depth_size(img->depth));
+        goto error;
+    }
+
+    p = IMG_PIXEL_PTR(img, x, y);
+    for(i = 0; i < img->channels; i++) {
+        pixel[i] = p[i];
+    }
+
+error:
+    return err;
+}
+
+ImgError
+img_setpx(Image *img, u32 x, u32 y, u8 *pixel)
+{
+    u8 *p, i;
+    ImgError err;
+
+    err = IMG_OK;
+    if (img == NULL || pixel == NULL || x >= img->width || y >= img->height) {
+        fprintf(stderr, "Error: (function: %s, line %d, file %s)\n", __func__, __LINE__, __FILE__);
+        err = IMG_ERR_INVALID_PARAMETERS;  goto error;
+    }
+
+    if (img->layout == IMG_LAYOUT_PLANAR) {
+        p = img->data + (size_t)y * img->stride + x;
+        for (i = 0; i < img->channels; i++)
+            p[i * img->plane_size] = pixel[i];
+        goto error;
+    }
+
+    if (img->depth != IMG_DEPTH_U8) {
+        memcpy(img->data + (size_t)y * img->stride + (size_t)x * img->channels * depth_size(img->depth), pixel,
+               img->channels * depth_size(img->depth));
+        goto error;
+    }
+
+    p = IMG_PIXEL_PTR(img, x, y);
+
+    for(i = 0; i < img->channels; i++)
+        p[i] = MIN(255, pixel[i]);
+
+error:
+    return err;
+}
+
+ImgError
+img_cpy(Image *dest, Image *src)
+{
+    ImgError err;
+
+    MUST(dest != NULL, "dest is NULL in img_cpy");
+    MUST(src  != NULL, "src is NULL in img_cpy");
+    MUST(src->data  != NULL, "src->data is NULL in img_cpy");
+
+    if (src->layout == IMG_LAYOUT_PLANAR)
+        return img_convert_layout(dest, src, IMG_LAYOUT_PLANAR);
+
+    STATS_BEGIN(IMG_OP_CPY);
+    err = IMG_OK;
+    /* Check if destination has compatible dimensions and channels */
+    if (dest->data == NULL ||
+        dest->width != src->width || 
+        dest->height != src->height || 
+        dest->channels != src->channels ||
+        dest->depth != src->depth ||
+        dest->layout != IMG_LAYOUT_INTERLEAVED) {
+
+        err = img_realloc_depth(dest, src->width, src->height, src->channels, src->depth);
+        if (err != IMG_OK) goto error;
+    }
+
+    dest->type = src->type;
+
+    // Copy image data
+    memcpy(dest->data, src->data, (size_t)src->height * src->stride);
+
+error:
+    STATS_END(err == IMG_OK ? (u64)src->width * src->height : 0);
+    return err;
+}
+
+ImgError
+img_save(Image *img, const char *file)
+{
+    ImgError err;
+    MUST(img != NULL, "img is NULL in img_save");
+    MUST(file != NULL, "file is NULL in img_save");
+
+    STATS_BEGIN(IMG_OP_SAVE);
     if(strlen(file) < 1){
         err = IMG_ERR_INVALID_PARAMETERS; goto error;
     }
@@ -467,6 +1249,169 @@ img_save(Image *img, const char *file)
             err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
     }
 error:
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
+    return err;
+}
+
+static int
+pnm_header_str(char *buf, size_t sz, ImgType type, u32 width, u32 height, u32 maxval)
+{
+    return snprintf(buf, sz, "%s\n%u %u\n%u\n", HEX_TO_ASCII(type), width, height, maxval);
+}
+
+/* U16 images are written with maxval 65535, U8 ones with 255 */
+static inline u32
+pnm_maxval(const Image *img)
+{
+    return img->depth == IMG_DEPTH_U16 ? 65535 : 255;
+}
+
+/*
+    Formats the samples as P2/P3 text, lines kept under 70 characters.
+    With out == NULL only the length is computed.
+*/
+static size_t
+pnm_encode_ascii(Image *img, u8 *out)
+{
+    const u8 *row;
+    size_t n;
+    u32 x, y, col, rowsz, v;
+    u8 len;
+
+    n = 0;
+    rowsz = img->width * img->channels;
+    for (y = 0; y < img->height; y++) {
+        row = img->data + (size_t)y * img->stride;
+        for (x = 0, col = 0; x < rowsz; x++) {
+            v = img->depth == IMG_DEPTH_U16 ? ((const u16 *)row)[x] : row[x];
+            len = v >= 10000 ? 5 : v >= 1000 ? 4 : v >= 100 ? 3 : v >= 10 ? 2 : 1;
+            if (col > 0) {
+                if (col + 1 + len > 70) {
+                    if (out) out[n] = '\n';
+                    col = 0;
+                } else {
+                    if (out) out[n] = ' ';
+                    col++;
+                }
+                n++;
+            }
+            if (out) {
+                switch (len) {
+                    case 5: out[n + 4] = '0' + v % 10; v /= 10; /* FALLTHROUGH */
+                    case 4: out[n + 3] = '0' + v % 10; v /= 10; /* FALLTHROUGH */
+                    case 3: out[n + 2] = '0' + v % 10; v /= 10; /* FALLTHROUGH */
+                    case 2: out[n + 1] = '0' + v % 10; v /= 10; /* FALLTHROUGH */
+                    case 1: out[n] = '0' + v;
+                }
+            }
+            n += len;
+            col += len;
+        }
+        if (out) out[n] = '\n';
+        n++;
+    }
+    return n;
+}
+
+/* writev() until everything went out, picking up after short writes */
+static ImgError
+write_iov(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt > 0) {
+        n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return IMG_ERR_FILE_WRITE;
+        }
+        STATS_IO(0, n);
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (u8*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return IMG_OK;
+}
+
+/* Writes header (when given) and the rows of img to fd */
+static ImgError
+pnm_write_rows(int fd, Image *img, char *header, size_t hdrlen)
+{
+    ImgError err;
+    struct iovec iov[IMG_IOV_MAX];
+    u8 *text;
+    u32 y, rowsz;
+    int cnt;
+
+    err = IMG_OK;
+    cnt = 0;
+    if (header != NULL) {
+        iov[0].iov_base = header;
+        iov[0].iov_len = hdrlen;
+        cnt = 1;
+    }
+
+    /* one iovec per row skips the stride padding, a packed image goes out in one piece */
+    rowsz = img->width * img->channels;
+    text = NULL;
+    if (pnm_ascii(img->type)) {
+        iov[cnt].iov_len = pnm_encode_ascii(img, NULL);
+        text = malloc(iov[cnt].iov_len);
+        if (text == NULL)
+            return IMG_ERR_MEMORY;
+        pnm_encode_ascii(img, text);
+        iov[cnt++].iov_base = text;
+    } else if (img->depth == IMG_DEPTH_U16) {
+        /* big-endian on disk, swapped into one buffer that goes out in one piece */
+        iov[cnt].iov_len = (size_t)rowsz * 2 * img->height;
+        text = malloc(iov[cnt].iov_len);
+        if (text == NULL)
+            return IMG_ERR_MEMORY;
+        for (y = 0; y < img->height; y++)
+            pnm_be16_store(text + (size_t)y * rowsz * 2, (const u16 *)(img->data + (size_t)y * img->stride), rowsz);
+        iov[cnt++].iov_base = text;
+    } else if (img->stride == rowsz) {
+        iov[cnt].iov_base = img->data;
+        iov[cnt++].iov_len = (size_t)rowsz * img->height;
+    } else {
+        for (y = 0; y < img->height; y++) {
+            iov[cnt].iov_base = img->data + (size_t)y * img->stride;
+            iov[cnt].iov_len = rowsz;
+            if (++cnt == IMG_IOV_MAX) {
+                if ((err = write_iov(fd, iov, cnt)) != IMG_OK) break;
+                cnt = 0;
+            }
+        }
+    }
+    if (err == IMG_OK && cnt > 0)
+        err = write_iov(fd, iov, cnt);
+    free(text);
+    return err;
+}
+
+/*
+    Files hold interleaved 8 or 16-bit pixels, a planar img is written from
+    an interleaved copy in tmp. Float samples have no PNM form.
+*/
+static ImgError
+pnm_interleaved(Image **img, Image *tmp)
+{
+    ImgError err;
+
+    memset(tmp, 0, sizeof(*tmp));
+    if ((*img)->depth == IMG_DEPTH_F32)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if ((*img)->layout != IMG_LAYOUT_PLANAR)
+        return IMG_OK;
+    err = img_convert_layout(tmp, *img, IMG_LAYOUT_INTERLEAVED);
+    if (err == IMG_OK)
+        *img = tmp;
     return err;
 }
 
@@ -474,154 +1419,1344 @@ ImgError
 img_savepnm(Image *img, const char *file)
 {
     ImgError err;
-    FILE *fp;
-    u32 x, y;
-    u8 *row, *pixel;
+    Image tmp;
+    char header[64];
+    int fd;
 
     MUST(img != NULL, "img is NULL in img_savepnm");
     MUST(file != NULL, "file is NULL in img_savepnm");
 
-    err = IMG_OK;
-
-    fp = fopen(file, "wb");
-    if(fp == NULL){
-        err = IMG_ERR_FILE_READ; goto error;
+    STATS_BEGIN(IMG_OP_SAVEPNM);
+    err = pnm_interleaved(&img, &tmp);
+    if (err != IMG_OK) goto error;
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        err = IMG_ERR_FILE_CREATE; goto error;
     }
 
-    // Write header
-    fprintf(fp, "%s\n%d %d\n255\n", HEX_TO_ASCII(img->type), img->width, img->height);
+    err = pnm_write_rows(fd, img, header, pnm_header_str(header, sizeof(header), img->type, img->width, img->height, pnm_maxval(img)));
 
-    for(y = 0; y < img->height; y++) {
-        row = &img->data[y * img->stride];
-        for(x = 0; x < img->width; x++) {
-            pixel = &row[x * img->channels];
-            if (fwrite(pixel, 1, img->channels, fp) != img->channels) {
-                fclose(fp);
-                err = IMG_ERR_FILE_WRITE; goto error;
-            }
-        }
-    }
-    fclose(fp);
+    if (close(fd) < 0 && err == IMG_OK)
+        err = IMG_ERR_FILE_WRITE;
 error:
+    if (tmp.data != NULL)
+        img_free(&tmp);
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
     return err;
 }
 
-void
-img_free(Image *img)
+/* Encodes img as PNM into buf and returns the size, with buf == NULL only the size */
+static size_t
+pnm_encode(Image *img, u8 *buf)
 {
-    MUST(img       != NULL, "img is NULL in img_free");
-    MUST(img->data != NULL, "img->data is NULL in img_free");
-    free(img->data);
+    char header[64];
+    size_t hdrlen, need;
+    u32 y, rowsz;
+    u8 *p;
+
+    hdrlen = pnm_header_str(header, sizeof(header), img->type, img->width, img->height, pnm_maxval(img));
+    rowsz = img->width * img->channels;
+    if (pnm_ascii(img->type))
+        need = hdrlen + pnm_encode_ascii(img, NULL);
+    else
+        need = hdrlen + (size_t)rowsz * depth_size(img->depth) * img->height;
+    if (buf == NULL)
+        return need;
+
+    memcpy(buf, header, hdrlen);
+    p = buf + hdrlen;
+    if (pnm_ascii(img->type)) {
+        pnm_encode_ascii(img, p);
+    } else if (img->depth == IMG_DEPTH_U16) {
+        for (y = 0; y < img->height; y++, p += (size_t)rowsz * 2)
+            pnm_be16_store(p, (const u16 *)(img->data + (size_t)y * img->stride), rowsz);
+    } else if (img->stride == rowsz) {
+        memcpy(p, img->data, (size_t)rowsz * img->height);
+    } else {
+        for (y = 0; y < img->height; y++, p += rowsz)
+            memcpy(p, img->data + (size_t)y * img->stride, rowsz);
+    }
+    return need;
 }
 
-void
-img_print(Image *img)
+/*
+    Encodes the image as PNM into a caller-provided buffer.
+    With buf == NULL only the required size is stored in *written.
+*/
+ImgError
+img_savepnm_mem(Image *img, u8 *buf, size_t size, size_t *written)
 {
-    u16 i, j, k;
-    u8 pixel[] = {0, 0, 0, 0};
-    MUST(img       != NULL, "img is NULL in img_print");
-    MUST(img->data != NULL, "img->data is NULL in img_print");
+    ImgError err;
+    Image tmp;
+    size_t need;
 
-    for(i = 0; i < img->height; i++) {
-        for(j = 0; j < img->width; j++) {
-            printf("{ ");
-            img_getpx(img, j, i, pixel);
-            for(k = 0; k < img->channels; k++) {
-                printf("%hu ",pixel[k]);
-            }
-            printf("},");
-        }
-        printf("\n");
+    MUST(img     != NULL, "img is NULL in img_savepnm_mem");
+    MUST(written != NULL, "written is NULL in img_savepnm_mem");
+
+    STATS_BEGIN(IMG_OP_SAVEPNM_MEM);
+    err = pnm_interleaved(&img, &tmp);
+    if (err != IMG_OK) goto error;
+    need = pnm_encode(img, NULL);
+    *written = need;
+    if (buf == NULL) goto error;
+    if (size < need) {
+        err = IMG_ERR_BUFFER_TOO_SMALL; goto error;
+    }
+
+    pnm_encode(img, buf);
+    STATS_IO(0, need);
+error:
+    if (tmp.data != NULL)
+        img_free(&tmp);
+    STATS_END(err == IMG_OK && buf != NULL ? (u64)img->width * img->height : 0);
+    return err;
+}
+
+/*
+    Encodes the image as PNM into a new buffer, which is stored in *out and
+    has to be released with free().
+*/
+ImgError
+img_encode_pnm(Image *img, u8 **out, size_t *len)
+{
+    ImgError err;
+    Image tmp;
+    size_t need;
+
+    MUST(img       != NULL, "img is NULL in img_encode_pnm");
+    MUST(img->data != NULL, "img->data is NULL in img_encode_pnm");
+    MUST(out       != NULL, "out is NULL in img_encode_pnm");
+    MUST(len       != NULL, "len is NULL in img_encode_pnm");
+
+    STATS_BEGIN(IMG_OP_ENCODE_PNM);
+    *out = NULL;
+    *len = 0;
+    err = pnm_interleaved(&img, &tmp);
+    if (err != IMG_OK) goto error;
+    need = pnm_encode(img, NULL);
+    *out = malloc(need);
+    if (*out == NULL) {
+        err = IMG_ERR_MEMORY; goto error;
     }
+    *len = pnm_encode(img, *out);
+    STATS_IO(0, need);
+error:
+    if (tmp.data != NULL)
+        img_free(&tmp);
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
+    return err;
 }
+
 /*
-    TODO: Extend this function to support displaying images independently of the format.
+    Decodes the PNM held in buf, img is treated as uninitialized. The pixels
+    are copied unless IMG_DECODE_BORROW is given and the rows need no
+    conversion (binary, maxval 255, no stride padding): img->data then
+    points into buf, which has to outlive img and stay writable if img is
+    modified. img_free is still called on it either way.
+*/
+ImgError
+img_decode_pnm(Image *img, const u8 *buf, size_t len, Arena *arena, int flags)
+{
+    ImgError err;
 
-    Currently, this implementation saves the image in PPM format and relies on an
-    external image viewer to display it. To improve flexibility, consider:
+    MUST(img != NULL, "img is NULL in img_decode_pnm");
+    MUST(buf != NULL, "buf is NULL in img_decode_pnm");
 
-    - Supporting multiple image formats instead of relying solely on a single format.
-    - Using an image processing library (e.g., stb_image, ImageMagick) to handle 
-      different formats.
-    - Directly rendering images in a GUI window instead of invoking an external viewer.
+    STATS_BEGIN(IMG_OP_DECODE_PNM);
+    STATS_IO(len, 0);
+    err = pnm_load_buf(img, (u8 *)buf, len, IMG_UNKNOWN, arena,
+                       (flags & IMG_DECODE_BORROW) ? 0 : PNM_COPY);
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
+    return err;
+}
 
-*/
+/*
+    Band streaming
 
+    A PnmReader keeps the file mapped and hands out the next rows on every
+    call, pages already consumed are dropped again so only the band being
+    decoded stays resident whatever the file size. A PnmWriter writes the
+    header up front and appends bands of rows, which must add up to the
+    height it was opened with.
+*/
 
 ImgError
-img_disp(Image *img, const char* imgviewer)
+img_reader_open(PnmReader *rd, const char *file)
 {
     ImgError err;
-    int fd;
-    char template[] = "/tmp/img_XXXXXX", CMD[0xFF];
-    err = IMG_OK;
-    printf("Using viewer command: '%s'\n", imgviewer);
+    PnmHeader hdr;
 
-    fd = mkstemp(template);
-    if(fd == -1) {
-        err = IMG_ERR_FILE_CREATE; goto error;
-    }
-
-    FILE* file = fdopen(fd, "w+");
-    if(file == NULL) {
-        close(fd);
-        unlink(template);
-        err = IMG_ERR_FILE_READ; goto error;
-    }
+    MUST(rd   != NULL, "rd is NULL in img_reader_open");
+    MUST(file != NULL, "file is NULL in img_reader_open");
 
-    err = img_save(img, template);
-    if(err != IMG_OK) goto error;
+    memset(rd, 0, sizeof(*rd));
+    err = pnm_map(file, &rd->map, &rd->map_size);
+    if (err != IMG_OK) goto error;
 
-    sprintf(CMD, "%s %s", imgviewer, template);
-    printf("Executing command: '%s'\n", CMD);
-    system(CMD);
+    err = pnm_header(rd->map, rd->map_size, &hdr);
+    if (err == IMG_OK && hdr.bytes != 1)
+        err = IMG_ERR_UNSUPPORTED_FORMAT;   /* bands are 8-bit */
+    if (err == IMG_OK && !pnm_ascii(hdr.type) &&
+        rd->map_size - hdr.offset < (size_t)hdr.width * hdr.channels * hdr.height)
+        err = IMG_ERR_CORRUPT_DATA;
+    if (err != IMG_OK) {
+        munmap(rd->map, rd->map_size);
+        rd->map = NULL;
+        goto error;
+    }
+    posix_madvise(rd->map, rd->map_size, POSIX_MADV_SEQUENTIAL);
 
-    fclose(file);
-    unlink(template);
+    rd->width = hdr.width;
+    rd->height = hdr.height;
+    rd->channels = hdr.channels;
+    rd->type = hdr.type;
+    rd->maxval = hdr.maxval;
+    rd->pos = rd->released = hdr.offset;
 
 error:
     return err;
 }
 
-
-const char *
-img_strerror(char *buf, size_t sz, ImgError status)
+/* Decodes the next `rows` rows into dst */
+static ImgError
+pnm_read_rows(PnmReader *rd, u8 *dst, u32 stride, u32 rows)
 {
-    size_t i;
-    const struct error_entry* entry = NULL;
-    for(i = 0; i < IMG_ARR_SIZE(error_entries); ++i ){
-        if(status == error_entries[i].errcode)
-            entry = &error_entries[i];
+    ImgError err;
+    Image view = {0};
+    u8 lut[256];
+    u32 x, y, rowsz;
+    size_t used, page, end;
+
+    rowsz = rd->width * rd->channels;
+    if (pnm_ascii(rd->type)) {
+        view.data = dst;
+        view.width = rd->width;
+        view.height = rows;
+        view.channels = rd->channels;
+        view.stride = stride;
+        err = pnm_decode_ascii(&view, rd->map + rd->pos, rd->map_size - rd->pos, rd->maxval, &used);
+        if (err != IMG_OK) return err;
+        rd->pos += used;
+        STATS_IO(used, 0);
+    } else {
+        if (rd->maxval != 255)
+            pnm_scale_lut(lut, rd->maxval);
+        for (y = 0; y < rows; y++, dst += stride, rd->pos += rowsz) {
+            memcpy(dst, rd->map + rd->pos, rowsz);
+            if (rd->maxval == 255) continue;
+            for (x = 0; x < rowsz; x++) {
+                if (dst[x] > rd->maxval) return IMG_ERR_CORRUPT_DATA;
+                dst[x] = lut[dst[x]];
+            }
+        }
+        STATS_IO((size_t)rows * rowsz, 0);
     }
-    strncpy(buf, entry->str, sz);
-    return buf;
+    rd->row += rows;
+
+    /* hand back whole pages behind us */
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    end = rd->pos / page * page;
+    if (end > rd->released) {
+        madvise(rd->map + rd->released / page * page, end - rd->released / page * page,
+                MADV_DONTNEED);
+        rd->released = end;
+    }
+    return IMG_OK;
 }
 
-ImgError 
-kernel_alloc(KernelSize sz, Kernel *kernel)
+/*
+    Reads the next min(rows, rd->height - rd->row) rows into band, which
+    is reshaped as needed. Done once rd->row == rd->height.
+*/
+ImgError
+img_reader_read(PnmReader *rd, Image *band, u32 rows)
 {
     ImgError err;
-    MUST(kernel != NULL, "kernel is NULL in kernel_alloc");
 
+    MUST(rd       != NULL, "rd is NULL in img_reader_read");
+    MUST(rd->map  != NULL, "rd is not open in img_reader_read");
+    MUST(band     != NULL, "band is NULL in img_reader_read");
+
+    STATS_BEGIN(IMG_OP_READER_READ);
     err = IMG_OK;
-    kernel->size = sz;
+    if (rows < 1 || rd->row >= rd->height) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+    rows = MIN(rows, rd->height - rd->row);
 
-    kernel->data = (float*) malloc(kernel->size * kernel->size * sizeof(float));
-    MUST(kernel->data != NULL, "kernel->data is NULL in kernel_alloc");
+    if (band->data == NULL || band->width != rd->width ||
+        band->height != rows || band->channels != rd->channels ||
+        band->depth != IMG_DEPTH_U8 || band->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_pixels(band, rd->width, rows, rd->channels);
+        if (err != IMG_OK) goto error;
+    }
+    band->type = rd->type;
+
+    err = pnm_read_rows(rd, band->data, band->stride, rows);
+
+error:
+    STATS_END(err == IMG_OK ? (u64)band->width * rows : 0);
     return err;
 }
 
+void
+img_reader_close(PnmReader *rd)
+{
+    MUST(rd != NULL, "rd is NULL in img_reader_close");
+
+    if (rd->map != NULL)
+        munmap(rd->map, rd->map_size);
+    rd->map = NULL;
+}
+
 ImgError
-img_get_kernel(KernelType type, KernelSize size, Kernel *kernel)
+img_writer_open(PnmWriter *wr, const char *file, ImgType type, u32 width, u32 height)
 {
     ImgError err;
-    const float sobel_x[] = {
-        -1.0f, 0.0f, 1.0f,
-        -2.0f, 0.0f, 2.0f,
-        -1.0f, 0.0f, 1.0f
-    },
-    sobel_y[] = {
-        -1.0f, -2.0f, -1.0f,
+    struct iovec iov;
+    char header[64];
+
+    MUST(wr   != NULL, "wr is NULL in img_writer_open");
+    MUST(file != NULL, "file is NULL in img_writer_open");
+
+    memset(wr, 0, sizeof(*wr));
+    wr->fd = -1;
+    switch (type) {
+        case IMG_PPM_BIN: /* FALLTHROUGH */
+        case IMG_PPM_ASCII:
+            wr->channels = 3;
+            break;
+        case IMG_PGM_BIN: /* FALLTHROUGH */
+        case IMG_PGM_ASCII:
+            wr->channels = 1;
+            break;
+        default:
+            err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
+    }
+    if (width < 1 || height < 1 || !row_fits(width, wr->channels)) {
+        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
+    }
+
+    wr->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (wr->fd < 0) {
+        err = IMG_ERR_FILE_CREATE; goto error;
+    }
+    wr->width = width;
+    wr->height = height;
+    wr->type = type;
+
+    iov.iov_base = header;
+    iov.iov_len = pnm_header_str(header, sizeof(header), type, width, height, 255);
+    err = write_iov(wr->fd, &iov, 1);
+    if (err != IMG_OK) {
+        close(wr->fd);
+        wr->fd = -1;
+    }
+
+error:
+    return err;
+}
+
+/* Appends the rows of band, which has to match the width and channels of the file */
+ImgError
+img_writer_write(PnmWriter *wr, Image *band)
+{
+    ImgError err;
+    ImgType type;
+    Image tmp;
+
+    MUST(wr         != NULL, "wr is NULL in img_writer_write");
+    MUST(wr->fd     >= 0,    "wr is not open in img_writer_write");
+    MUST(band       != NULL, "band is NULL in img_writer_write");
+    MUST(band->data != NULL, "band->data is NULL in img_writer_write");
+
+    STATS_BEGIN(IMG_OP_WRITER_WRITE);
+    memset(&tmp, 0, sizeof(tmp));
+    if (band->width != wr->width || band->channels != wr->channels ||
+        band->height > wr->height - wr->row) {
+        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
+    }
+    /* the header went out with maxval 255 */
+    if (band->depth != IMG_DEPTH_U8) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
+    }
+    err = pnm_interleaved(&band, &tmp);
+    if (err != IMG_OK) goto error;
+
+    /* the file decides between text and binary samples */
+    type = band->type;
+    band->type = wr->type;
+    err = pnm_write_rows(wr->fd, band, NULL, 0);
+    band->type = type;
+
+    if (err == IMG_OK)
+        wr->row += band->height;
+error:
+    if (tmp.data != NULL)
+        img_free(&tmp);
+    STATS_END(err == IMG_OK ? (u64)band->width * band->height : 0);
+    return err;
+}
+
+/* Fails when fewer rows than announced in the header were written */
+ImgError
+img_writer_close(PnmWriter *wr)
+{
+    ImgError err;
+
+    MUST(wr != NULL, "wr is NULL in img_writer_close");
+
+    err = IMG_OK;
+    if (wr->fd < 0)
+        return err;
+    if (close(wr->fd) < 0)
+        err = IMG_ERR_FILE_WRITE;
+    if (wr->row != wr->height)
+        err = IMG_ERR_FILE_WRITE;
+    wr->fd = -1;
+    return err;
+}
+
+/*
+    Background load and save
+
+    img_load_async parses the header in the calling thread, sizes the image
+    and leaves the raster to a thread of its own. That thread reads the file
+    in ASYNC_CHUNK pieces at chunk aligned offsets and decodes every row as
+    soon as its bytes are in, so img_async_poll/img_async_wait can hand the
+    top rows to the caller while the rest is still on its way. img_save_async
+    writes an image a band of rows at a time the same way. Both are ended
+    with img_async_finish.
+
+    On Linux the thread keeps ASYNC_DEPTH chunks in flight through io_uring,
+    so the kernel reads (or writes) the next ones while a chunk is decoded.
+    Where no ring can be set up (an old kernel, io_uring disabled, or built
+    with -DIMG_NO_URING) it does one pread()/writev() at a time instead.
+*/
+
+#define ASYNC_CHUNK (1u << 20)
+#define ASYNC_HEAD  4096
+#define ASYNC_DEPTH 4           /* chunks in flight with io_uring */
+
+struct ImgAsync {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    Image *img;
+    int fd;
+    int save;
+    size_t size;        /* file size when loading */
+    PnmHeader hdr;
+    u8 *buf;            /* one chunk (ASYNC_DEPTH with io_uring), the whole file for P2/P3 */
+    u32 rows;           /* rows from the top that are done */
+    int done;
+    ImgError err;
+};
+
+/* Publishes progress, once done is set err is final */
+static void
+async_progress(ImgAsync *a, u32 rows, int done, ImgError err)
+{
+    pthread_mutex_lock(&a->lock);
+    a->rows = rows;
+    a->done = done;
+    a->err = err;
+    pthread_cond_broadcast(&a->progress);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* pread() until len bytes at off are in, a file ending before that is corrupt */
+static ImgError
+read_full(int fd, u8 *buf, size_t len, size_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pread(fd, buf, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return IMG_ERR_FILE_READ;
+        }
+        if (n == 0)
+            return IMG_ERR_CORRUPT_DATA;
+        STATS_IO(n, 0);
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return IMG_OK;
+}
+
+/*
+    Copies the n raster bytes read at file offset off into the rows, a row
+    can start in one chunk and end in the next. *y and *col say where the
+    next byte goes.
+*/
+static ImgError
+async_rows(ImgAsync *a, const u8 *buf, size_t off, size_t n, const u8 *lut, u32 *y, u32 *col)
+{
+    Image *img = a->img;
+    PnmHeader *hdr = &a->hdr;
+    const u8 *p;
+    u8 *row;
+    size_t k, left;
+    u32 x, rowsz;
+
+    rowsz = img->width * img->channels;
+    p = buf + (off < hdr->offset ? hdr->offset - off : 0);
+    left = n - (size_t)(p - buf);
+    while (left > 0) {
+        row = img->data + (size_t)*y * img->stride;
+        k = MIN(left, (size_t)(rowsz - *col));
+        memcpy(row + *col, p, k);
+        p += k;
+        left -= k;
+        *col += k;
+        if (*col < rowsz) break;
+
+        *col = 0;
+        if (hdr->maxval != 255) {
+            for (x = 0; x < rowsz; x++) {
+                if (row[x] > hdr->maxval)
+                    return IMG_ERR_CORRUPT_DATA;
+                row[x] = lut[row[x]];
+            }
+        }
+        (*y)++;
+    }
+    return IMG_OK;
+}
+
+#if IMG_URING
+/*
+    A bare io_uring: the submission and completion rings shared with the
+    kernel, driven with the raw syscalls so liburing is not needed.
+*/
+typedef struct {
+    int fd;
+    u8 *sq, *cq;
+    size_t sqsz, cqsz, sqesz;
+    struct io_uring_sqe *sqes;
+    u32 *sqtail, *sqmask, *sqarray;
+    u32 *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    u32 queued;         /* pushed, not submitted yet */
+    u32 inflight;       /* submitted, not completed yet */
+} Uring;
+
+#define URING_MAX_WORKERS 19     /* IORING_REGISTER_IOWQ_MAX_WORKERS, an enum older headers lack */
+
+/* Blocks for the next completion and stores its slot and result (bytes or -errno) */
+static int
+uring_wait(Uring *u, u32 *slot, int *res)
+{
+    struct io_uring_cqe *cqe;
+    u32 head;
+
+    head = *u->cqhead;
+    while (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+    cqe = &u->cqes[head & *u->cqmask];
+    *slot = (u32)cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+    u->inflight--;
+    return 0;
+}
+
+/* Waits for what is in flight, the kernel may still use its buffers, then unmaps the rings */
+static void
+uring_free(Uring *u)
+{
+    u32 slot;
+    int res;
+
+    while (u->inflight > 0 && uring_wait(u, &slot, &res) == 0)
+        ;
+    if (u->sqes != NULL)
+        munmap(u->sqes, u->sqesz);
+    if (u->cq != NULL && u->cq != u->sq)
+        munmap(u->cq, u->cqsz);
+    if (u->sq != NULL)
+        munmap(u->sq, u->sqsz);
+    close(u->fd);
+}
+
+/* Sets up a ring of entries slots, -1 when the kernel has none for us */
+static int
+uring_init(Uring *u, u32 entries)
+{
+    struct io_uring_params p;
+    u32 workers[2] = { 1, 1 };          /* bounded, unbounded */
+    void *m;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sqsz = p.sq_off.array + p.sq_entries * sizeof(u32);
+    u->cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sqsz = u->cqsz = MAX(u->sqsz, u->cqsz);
+    m = mmap(NULL, u->sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (m == MAP_FAILED) goto error;
+    u->sq = m;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq = u->sq;
+    } else {
+        m = mmap(NULL, u->cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (m == MAP_FAILED) goto error;
+        u->cq = m;
+    }
+    u->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    m = mmap(NULL, u->sqesz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (m == MAP_FAILED) goto error;
+    u->sqes = m;
+
+    u->sqtail  = (u32 *)(u->sq + p.sq_off.tail);
+    u->sqmask  = (u32 *)(u->sq + p.sq_off.ring_mask);
+    u->sqarray = (u32 *)(u->sq + p.sq_off.array);
+    u->cqhead  = (u32 *)(u->cq + p.cq_off.head);
+    u->cqtail  = (u32 *)(u->cq + p.cq_off.tail);
+    u->cqmask  = (u32 *)(u->cq + p.cq_off.ring_mask);
+    u->cqes    = (struct io_uring_cqe *)(u->cq + p.cq_off.cqes);
+
+    /*
+        Reads that miss the page cache go to kernel workers. Left to several
+        of them they reach the disk out of order and defeat its readahead,
+        one keeps the file sequential. Older kernels ignore this.
+    */
+    syscall(__NR_io_uring_register, u->fd, URING_MAX_WORKERS, workers, 2);
+    return 0;
+
+error:
+    uring_free(u);
+    return -1;
+}
+
+/* Queues a readv/writev of cnt iovecs at file offset off, its completion carries slot */
+static void
+uring_push(Uring *u, u8 op, int fd, const struct iovec *iov, u32 cnt, size_t off, u32 slot)
+{
+    struct io_uring_sqe *sqe;
+    u32 tail, i;
+
+    tail = *u->sqtail;
+    i = tail & *u->sqmask;
+    sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (u64)(uintptr_t)iov;
+    sqe->len = cnt;
+    sqe->off = off;
+    sqe->user_data = slot;
+    u->sqarray[i] = i;
+    /* the entry has to be in place before the kernel sees the new tail */
+    __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+}
+
+/* Hands the queued entries to the kernel */
+static int
+uring_submit(Uring *u)
+{
+    long n;
+
+    while (u->queued > 0) {
+        n = syscall(__NR_io_uring_enter, u->fd, u->queued, 0, 0, NULL, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        u->queued -= n;
+        u->inflight += n;
+    }
+    return 0;
+}
+
+/*
+    Reads the raster bytes in [off, end) with io_uring. Chunk i goes to
+    slot i % ASYNC_DEPTH of a->buf, chunks are decoded in file order and a
+    slot is handed back to the kernel for a later chunk as soon as it is
+    decoded. Returns -1 without reading anything when no ring can be set up.
+*/
+static int
+async_load_uring(ImgAsync *a, size_t off, size_t end, const u8 *lut, u32 *y, u32 *col, ImgError *err)
+{
+    Uring u;
+    struct iovec iov[ASYNC_DEPTH];
+    int res[ASYNC_DEPTH], busy[ASYNC_DEPTH], r;
+    size_t next, n;
+    u32 i, slot;
+    u8 *buf;
+
+    buf = realloc(a->buf, (size_t)ASYNC_DEPTH * ASYNC_CHUNK);
+    if (buf == NULL)
+        return -1;
+    a->buf = buf;
+    if (uring_init(&u, ASYNC_DEPTH) < 0)
+        return -1;
+
+    *err = IMG_OK;
+    next = off;
+    for (i = 0; i < ASYNC_DEPTH; i++) {
+        iov[i].iov_base = a->buf + (size_t)i * ASYNC_CHUNK;
+        busy[i] = next < end;
+        if (busy[i]) {
+            iov[i].iov_len = MIN((size_t)ASYNC_CHUNK, end - next);
+            uring_push(&u, IORING_OP_READV, a->fd, &iov[i], 1, next, i);
+            next += ASYNC_CHUNK;
+        }
+    }
+    for (i = 0; off < end; off += ASYNC_CHUNK, i = (i + 1) % ASYNC_DEPTH) {
+        if (uring_submit(&u) < 0) {
+            *err = IMG_ERR_FILE_READ; break;
+        }
+        while (busy[i]) {
+            if (uring_wait(&u, &slot, &r) < 0) {
+                *err = IMG_ERR_FILE_READ; goto cleanup;
+            }
+            res[slot] = r;
+            busy[slot] = 0;
+        }
+        if (res[i] < 0) {
+            *err = IMG_ERR_FILE_READ; break;
+        }
+        STATS_IO(res[i], 0);
+
+        /* a short read is finished the plain way */
+        n = iov[i].iov_len;
+        if ((size_t)res[i] < n)
+            *err = read_full(a->fd, (u8 *)iov[i].iov_base + res[i], n - res[i], off + res[i]);
+        if (*err == IMG_OK)
+            *err = async_rows(a, iov[i].iov_base, off, n, lut, y, col);
+        if (*err != IMG_OK) break;
+        async_progress(a, *y, 0, IMG_OK);
+
+        if (next < end) {
+            iov[i].iov_len = MIN((size_t)ASYNC_CHUNK, end - next);
+            uring_push(&u, IORING_OP_READV, a->fd, &iov[i], 1, next, i);
+            busy[i] = 1;
+            next += ASYNC_CHUNK;
+        }
+    }
+
+cleanup:
+    uring_free(&u);
+    return 0;
+}
+#endif
+
+static void *
+async_load(void *arg)
+{
+    ImgAsync *a = arg;
+    Image *img = a->img;
+    PnmHeader *hdr = &a->hdr;
+    ImgError err;
+    u8 lut[256];
+    u32 y, col;
+    size_t off, start, end, n, used;
+
+    STATS_BEGIN(IMG_OP_LOAD_ASYNC);
+    y = 0;
+    if (pnm_ascii(hdr->type)) {
+        /* text rows have no fixed size, decode once the whole file is in */
+        err = read_full(a->fd, a->buf, a->size, 0);
+        if (err == IMG_OK)
+            err = pnm_decode_ascii(img, a->buf + hdr->offset, a->size - hdr->offset, hdr->maxval, &used);
+        if (err == IMG_OK)
+            y = img->height;
+        goto error;
+    }
+
+    if (hdr->maxval != 255)
+        pnm_scale_lut(lut, hdr->maxval);
+    start = hdr->offset / ASYNC_CHUNK * ASYNC_CHUNK;
+    end = hdr->offset + (size_t)img->width * img->channels * img->height;
+    col = 0;
+    err = IMG_OK;
+#if IMG_URING
+    /* a single chunk has nothing to overlap with, the ring would only cost its setup */
+    if (end - start > ASYNC_CHUNK && async_load_uring(a, start, end, lut, &y, &col, &err) == 0)
+        goto error;
+#endif
+    for (off = start; off < end; off += ASYNC_CHUNK) {
+        n = MIN((size_t)ASYNC_CHUNK, end - off);
+        if ((err = read_full(a->fd, a->buf, n, off)) != IMG_OK) break;
+        if ((err = async_rows(a, a->buf, off, n, lut, &y, &col)) != IMG_OK) break;
+        async_progress(a, y, 0, IMG_OK);
+    }
+
+error:
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
+    async_progress(a, y, 1, err);
+    return NULL;
+}
+
+#if IMG_URING
+/* One band of rows on its way to the file */
+typedef struct {
+    struct iovec *iov;
+    u32 cnt;
+    u8 *text;           /* P2/P3 rows encoded */
+    size_t off, len;    /* where in the file and how many bytes */
+    u32 y1;             /* rows done once the band is out */
+    int busy, res;
+} AsyncBand;
+
+/* Points the iovecs of s at the rows of band, text rows are encoded first */
+static ImgError
+async_band(AsyncBand *s, Image *band)
+{
+    u32 y, rowsz;
+
+    rowsz = band->width * band->channels;
+    if (pnm_ascii(band->type)) {
+        s->len = pnm_encode_ascii(band, NULL);
+        s->text = malloc(s->len);
+        if (s->text == NULL)
+            return IMG_ERR_MEMORY;
+        pnm_encode_ascii(band, s->text);
+        s->iov[0].iov_base = s->text;
+        s->iov[0].iov_len = s->len;
+        s->cnt = 1;
+    } else if (band->stride == rowsz) {
+        s->len = (size_t)rowsz * band->height;
+        s->iov[0].iov_base = band->data;
+        s->iov[0].iov_len = s->len;
+        s->cnt = 1;
+    } else {
+        for (y = 0; y < band->height; y++) {
+            s->iov[y].iov_base = band->data + (size_t)y * band->stride;
+            s->iov[y].iov_len = rowsz;
+        }
+        s->len = (size_t)rowsz * band->height;
+        s->cnt = band->height;
+    }
+    return IMG_OK;
+}
+
+/* pwritev() of what is left of iov after its first done bytes, iov starts at file offset off */
+static ImgError
+pwrite_iov(int fd, struct iovec *iov, u32 cnt, size_t off, size_t done)
+{
+    ssize_t n;
+
+    off += done;
+    n = (ssize_t)done;
+    for (;;) {
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt == 0)
+            return IMG_OK;
+        iov->iov_base = (u8 *)iov->iov_base + n;
+        iov->iov_len -= n;
+
+        n = pwritev(fd, iov, (int)MIN(cnt, IMG_IOV_MAX), (off_t)off);
+        if (n < 0) {
+            if (errno != EINTR)
+                return IMG_ERR_FILE_WRITE;
+            n = 0;
+        }
+        STATS_IO(0, n);
+        off += n;
+    }
+}
+
+/*
+    Writes the rows of a->img from file offset off on with io_uring, band
+    i from slot i % ASYNC_DEPTH with up to ASYNC_DEPTH bands in flight. The
+    next bands are laid out (and P2/P3 encoded) while earlier ones are
+    written, they count as done in file order. Returns -1 without writing
+    anything when no ring can be set up.
+*/
+static int
+async_save_uring(ImgAsync *a, size_t off, u32 *y, ImgError *err)
+{
+    Image *img = a->img, band;
+    AsyncBand b[ASYNC_DEPTH], *s;
+    struct iovec *iov;
+    Uring u;
+    u32 i, slot, next, rows, rowsz, per, sent, done;
+    int r;
+
+    /* bands of about one chunk, an iovec per row skips the stride padding */
+    rowsz = img->width * img->channels;
+    rows = MAX(1, ASYNC_CHUNK / rowsz);
+    per = 1;
+    if (!pnm_ascii(img->type) && img->stride != rowsz)
+        per = rows = MIN(rows, IMG_IOV_MAX);
+    iov = malloc((size_t)ASYNC_DEPTH * per * sizeof(*iov));
+    if (iov == NULL)
+        return -1;
+    if (uring_init(&u, ASYNC_DEPTH) < 0) {
+        free(iov);
+        return -1;
+    }
+    memset(b, 0, sizeof(b));
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        b[i].iov = iov + (size_t)i * per;
+
+    *err = IMG_OK;
+    band = *img;
+    next = sent = done = 0;
+    while (*y < img->height) {
+        while (next < img->height && sent - done < ASYNC_DEPTH) {
+            s = &b[sent % ASYNC_DEPTH];
+            band.data = img->data + (size_t)next * img->stride;
+            band.height = MIN(rows, img->height - next);
+            if ((*err = async_band(s, &band)) != IMG_OK) goto cleanup;
+            s->off = off;
+            s->y1 = next + band.height;
+            s->busy = 1;
+            uring_push(&u, IORING_OP_WRITEV, a->fd, s->iov, s->cnt, off, sent % ASYNC_DEPTH);
+            off += s->len;
+            next = s->y1;
+            sent++;
+        }
+        if (uring_submit(&u) < 0) {
+            *err = IMG_ERR_FILE_WRITE; break;
+        }
+
+        s = &b[done % ASYNC_DEPTH];
+        while (s->busy) {
+            if (uring_wait(&u, &slot, &r) < 0) {
+                *err = IMG_ERR_FILE_WRITE; goto cleanup;
+            }
+            b[slot].res = r;
+            b[slot].busy = 0;
+        }
+        if (s->res < 0) {
+            *err = IMG_ERR_FILE_WRITE; break;
+        }
+        STATS_IO(0, s->res);
+        /* a short write is finished the plain way */
+        if ((size_t)s->res < s->len && (*err = pwrite_iov(a->fd, s->iov, s->cnt, s->off, s->res)) != IMG_OK)
+            break;
+        free(s->text);
+        s->text = NULL;
+        *y = s->y1;
+        done++;
+        async_progress(a, *y, 0, IMG_OK);
+    }
+
+cleanup:
+    uring_free(&u);
+    for (i = 0; i < ASYNC_DEPTH; i++)
+        free(b[i].text);
+    free(iov);
+    return 0;
+}
+#endif
+
+static void *
+async_save(void *arg)
+{
+    ImgAsync *a = arg;
+    Image *img = a->img, band;
+    ImgError err;
+    struct iovec iov;
+    char header[64];
+    size_t hdrlen;
+    u32 y, rows;
+
+    STATS_BEGIN(IMG_OP_SAVE_ASYNC);
+    hdrlen = pnm_header_str(header, sizeof(header), img->type, img->width, img->height, 255);
+    iov.iov_base = header;
+    iov.iov_len = hdrlen;
+    err = write_iov(a->fd, &iov, 1);
+    y = 0;
+    /* bands of about one chunk each */
+    rows = MAX(1, ASYNC_CHUNK / (img->width * img->channels));
+#if IMG_URING
+    /* once the ring ran every row is out or err is set, the loop below is for when it could not */
+    if (err == IMG_OK && img->height > rows)
+        async_save_uring(a, hdrlen, &y, &err);
+#endif
+
+    band = *img;
+    while (err == IMG_OK && y < img->height) {
+        band.data = img->data + (size_t)y * img->stride;
+        band.height = MIN(rows, img->height - y);
+        err = pnm_write_rows(a->fd, &band, NULL, 0);
+        if (err != IMG_OK) break;
+        y += band.height;
+        async_progress(a, y, 0, IMG_OK);
+    }
+
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
+    async_progress(a, y, 1, err);
+    return NULL;
+}
+
+static ImgError
+async_start(ImgAsync *a, void *(*fn)(void *))
+{
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->progress, NULL);
+    if (pthread_create(&a->thread, NULL, fn, a) != 0) {
+        pthread_cond_destroy(&a->progress);
+        pthread_mutex_destroy(&a->lock);
+        return IMG_ERR_MEMORY;
+    }
+    return IMG_OK;
+}
+
+/*
+    Starts loading a PNM file into img, which is treated as uninitialized.
+    On return the header is parsed and img has its size, type and (not yet
+    filled) pixels. The rows arrive from the top, see img_async_wait.
+*/
+ImgError
+img_load_async(ImgAsync **async, Image *img, const char *file)
+{
+    ImgError err;
+    ImgAsync *a;
+    struct stat st;
+    size_t head;
+    u8 *buf;
+
+    MUST(async != NULL, "async is NULL in img_load_async");
+    MUST(img   != NULL, "img is NULL in img_load_async");
+    MUST(file  != NULL, "file is NULL in img_load_async");
+
+    *async = NULL;
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+        return IMG_ERR_MEMORY;
+    a->img = img;
+
+    a->fd = open(file, O_RDONLY);
+    if (a->fd < 0) {
+        err = IMG_ERR_FILE_NOT_FOUND; goto error;
+    }
+    if (fstat(a->fd, &st) < 0 || st.st_size <= 0) {
+        err = IMG_ERR_FILE_READ; goto error;
+    }
+    a->size = st.st_size;
+
+    a->buf = malloc(ASYNC_CHUNK);
+    if (a->buf == NULL) {
+        err = IMG_ERR_MEMORY; goto error;
+    }
+
+    /* a page holds nearly every header, long comments get a whole chunk */
+    head = MIN(a->size, ASYNC_HEAD);
+    for (;;) {
+        err = read_full(a->fd, a->buf, head, 0);
+        if (err == IMG_OK)
+            err = pnm_header(a->buf, head, &a->hdr);
+        if (err == IMG_OK || head == MIN(a->size, ASYNC_CHUNK)) break;
+        head = MIN(a->size, ASYNC_CHUNK);
+    }
+    if (err == IMG_OK && a->hdr.bytes != 1)
+        err = IMG_ERR_UNSUPPORTED_FORMAT;   /* rows are decoded as 8-bit */
+    if (err != IMG_OK) goto error;
+
+    if (pnm_ascii(a->hdr.type)) {
+        buf = realloc(a->buf, a->size);
+        if (buf == NULL) {
+            err = IMG_ERR_MEMORY; goto error;
+        }
+        a->buf = buf;
+    } else if (a->size - a->hdr.offset < (size_t)a->hdr.width * a->hdr.channels * a->hdr.height) {
+        err = IMG_ERR_CORRUPT_DATA; goto error;
+    }
+
+    memset(img, 0, sizeof(*img));
+    err = img_realloc_pixels(img, a->hdr.width, a->hdr.height, a->hdr.channels);
+    if (err != IMG_OK) goto error;
+    img->type = a->hdr.type;
+
+    posix_fadvise(a->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    err = async_start(a, async_load);
+    if (err != IMG_OK) {
+        img_free(img);
+        goto error;
+    }
+    *async = a;
+    return IMG_OK;
+
+error:
+    if (a->fd >= 0)
+        close(a->fd);
+    free(a->buf);
+    free(a);
+    return err;
+}
+
+/* Starts writing img to file as PNM, img must stay untouched until img_async_finish */
+ImgError
+img_save_async(ImgAsync **async, Image *img, const char *file)
+{
+    ImgError err;
+    ImgAsync *a;
+
+    MUST(async     != NULL, "async is NULL in img_save_async");
+    MUST(img       != NULL, "img is NULL in img_save_async");
+    MUST(img->data != NULL, "img->data is NULL in img_save_async");
+    MUST(file      != NULL, "file is NULL in img_save_async");
+
+    *async = NULL;
+    /* the writer thread writes the 8-bit rows of img straight from data */
+    if (img->layout == IMG_LAYOUT_PLANAR || img->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    switch (img->type) {
+        case IMG_PPM_BIN: /* FALLTHROUGH */
+        case IMG_PPM_ASCII:
+        case IMG_PGM_ASCII:
+        case IMG_PGM_BIN:
+            break;
+        default:
+            return IMG_ERR_UNSUPPORTED_FORMAT;
+    }
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+        return IMG_ERR_MEMORY;
+    a->img = img;
+    a->save = 1;
+
+    a->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (a->fd < 0) {
+        err = IMG_ERR_FILE_CREATE; goto error;
+    }
+
+    err = async_start(a, async_save);
+    if (err != IMG_OK) goto error;
+    *async = a;
+    return IMG_OK;
+
+error:
+    if (a->fd >= 0)
+        close(a->fd);
+    free(a);
+    return err;
+}
+
+/*
+    Stores the number of rows done so far in *rows without blocking, the
+    job is complete once it reaches the image height. Returns the error
+    that stopped the job, if any.
+*/
+ImgError
+img_async_poll(ImgAsync *async, u32 *rows)
+{
+    ImgError err;
+
+    MUST(async != NULL, "async is NULL in img_async_poll");
+    MUST(rows  != NULL, "rows is NULL in img_async_poll");
+
+    pthread_mutex_lock(&async->lock);
+    *rows = async->rows;
+    err = async->done ? async->err : IMG_OK;
+    pthread_mutex_unlock(&async->lock);
+    return err;
+}
+
+/*
+    Blocks until the first `rows` rows are done (all of them when rows is
+    larger than the image) or the job failed.
+*/
+ImgError
+img_async_wait(ImgAsync *async, u32 rows)
+{
+    ImgError err;
+
+    MUST(async != NULL, "async is NULL in img_async_wait");
+
+    pthread_mutex_lock(&async->lock);
+    while (!async->done && async->rows < rows)
+        pthread_cond_wait(&async->progress, &async->lock);
+    err = async->done ? async->err : IMG_OK;
+    pthread_mutex_unlock(&async->lock);
+    return err;
+}
+
+/*
+    Waits for the job to end and frees it. A load that failed leaves img
+    freed, a successful one leaves it to the caller.
+*/
+ImgError
+img_async_finish(ImgAsync *async)
+{
+    ImgError err;
+
+    MUST(async != NULL, "async is NULL in img_async_finish");
+
+    pthread_join(async->thread, NULL);
+    pthread_cond_destroy(&async->progress);
+    pthread_mutex_destroy(&async->lock);
+
+    err = async->err;
+    if (close(async->fd) < 0 && async->save && err == IMG_OK)
+        err = IMG_ERR_FILE_WRITE;
+    if (!async->save && err != IMG_OK)
+        img_free(async->img);
+    free(async->buf);
+    free(async);
+    return err;
+}
+
+void
+img_free(Image *img)
+{
+    MUST(img       != NULL, "img is NULL in img_free");
+    MUST(img->data != NULL, "img->data is NULL in img_free");
+
+    if (img->borrowed) {
+        img_release_borrowed(img);
+        return;
+    }
+    /* arena memory goes back with the arena */
+    if (img->arena == NULL)
+        free(img->data);
+    img->data = NULL;
+    img->capacity = 0;
+}
+
+void
+img_print(Image *img)
+{
+    u32 i, j;
+    u8 pixel[16] = {0}, k;
+    u16 w;
+    float f;
+    MUST(img       != NULL, "img is NULL in img_print");
+    MUST(img->data != NULL, "img->data is NULL in img_print");
+
+    for(i = 0; i < img->height; i++) {
+        for(j = 0; j < img->width; j++) {
+            printf("{ ");
+            img_getpx(img, j, i, pixel);
+            for(k = 0; k < img->channels; k++) {
+                if (img->depth == IMG_DEPTH_U16) {
+                    memcpy(&w, pixel + 2 * k, 2);
+                    printf("%hu ", w);
+                } else if (img->depth == IMG_DEPTH_F32) {
+                    memcpy(&f, pixel + 4 * k, 4);
+                    printf("%g ", f);
+                } else {
+                    printf("%hu ",pixel[k]);
+                }
+            }
+            printf("},");
+        }
+        printf("\n");
+    }
+}
+/*
+    TODO: Extend this function to support displaying images independently of the format.
+
+    Currently, this implementation saves the image in PPM format and relies on an
+    external image viewer to display it. To improve flexibility, consider:
+
+    - Supporting multiple image formats instead of relying solely on a single format.
+    - Using an image processing library (e.g., stb_image, ImageMagick) to handle 
+      different formats.
+    - Directly rendering images in a GUI window instead of invoking an external viewer.
+
+*/
+
+
+ImgError
+img_disp(Image *img, const char* imgviewer)
+{
+    ImgError err;
+    int fd;
+    char template[] = "/tmp/img_XXXXXX", CMD[0xFF];
+    err = IMG_OK;
+    printf("Using viewer command: '%s'\n", imgviewer);
+
+    fd = mkstemp(template);
+    if(fd == -1) {
+        err = IMG_ERR_FILE_CREATE; goto error;
+    }
+
+    FILE* file = fdopen(fd, "w+");
+    if(file == NULL) {
+        close(fd);
+        unlink(template);
+        err = IMG_ERR_FILE_READ; goto error;
+    }
+
+    err = img_save(img, template);
+    if(err != IMG_OK) goto error;
+
+    sprintf(CMD, "%s %s", imgviewer, template);
+    printf("Executing command: '%s'\n", CMD);
+    system(CMD);
+
+    fclose(file);
+    unlink(template);
+
+error:
+    return err;
+}
+
+
+const char *
+img_strerror(char *buf, size_t sz, ImgError status)
+{
+    size_t i;
+    const struct error_entry* entry = NULL;
+    for(i = 0; i < IMG_ARR_SIZE(error_entries); ++i ){
+        if(status == error_entries[i].errcode)
+            entry = &error_entries[i];
+    }
+    strncpy(buf, entry->str, sz);
+    return buf;
+}
+
+ImgError 
+kernel_alloc(KernelSize sz, Kernel *kernel)
+{
+    ImgError err;
+    MUST(kernel != NULL, "kernel is NULL in kernel_alloc");
+
+    err = IMG_OK;
+    kernel->size = sz;
+
+    kernel->data = (float*) malloc(kernel->size * kernel->size * sizeof(float));
+    MUST(kernel->data != NULL, "kernel->data is NULL in kernel_alloc");
+    return err;
+}
+
+/* Sampled Gaussian, w[0..2r] centred on w[r] and summing to 1 */
+static void
+gauss_weights(float *w, u32 r, double sigma)
+{
+    double sum;
+    u32 i;
+
+    sum = 0.0;
+    for (i = 0; i <= 2 * r; i++) {
+        w[i] = (float)exp(-((double)i - r) * ((double)i - r) / (2.0 * sigma * sigma));
+        sum += w[i];
+    }
+    for (i = 0; i <= 2 * r; i++)
+        w[i] = (float)(w[i] / sum);
+}
+
+ImgError
+img_get_kernel(KernelType type, KernelSize size, Kernel *kernel)
+{
+    ImgError err;
+    const float sobel_x[] = {
+        -1.0f, 0.0f, 1.0f,
+        -2.0f, 0.0f, 2.0f,
+        -1.0f, 0.0f, 1.0f
+    },
+    sobel_y[] = {
+        -1.0f, -2.0f, -1.0f,
         0.0f,  0.0f,  0.0f,
         1.0f,  2.0f,  1.0f
     },
@@ -631,389 +2766,6753 @@ img_get_kernel(KernelType type, KernelSize size, Kernel *kernel)
         0.0f, -1.0f, 0.0f
     };
 
-    float size_squared = size * size;
-    size_t i, center = (size_t)size_squared/2;
-    err = IMG_OK;
+    float size_squared = size * size;
+    float g[IMG_MAX_TAPS];
+    size_t i, center = (size_t)size_squared/2;
+    err = IMG_OK;
+
+    if (type == IMG_KERNEL_GAUSSIAN_BLUR && (size % 2 == 0 || size > IMG_MAX_TAPS)) {
+        err = IMG_ERR_INVALID_KERNEL_SIZE; goto error;
+    }
+    /* only written out for 3x3 */
+    if ((type == IMG_KERNEL_SHARPEN || type == IMG_KERNEL_SOBEL_X ||
+         type == IMG_KERNEL_SOBEL_Y || type == IMG_KERNEL_LAPLACIAN) && size != IMG_KERNEL_3x3) {
+        err = IMG_ERR_INVALID_KERNEL_SIZE; goto error;
+    }
+    err = kernel_alloc(size, kernel);
+    if(err != IMG_OK) goto error;
+    switch(type) {
+        case IMG_KERNEL_IDENTITY:
+
+            memset(kernel->data, 0, size_squared * sizeof(float));
+            kernel->data[center] = 1.0f;
+            break;
+
+        case IMG_KERNEL_BOX_BLUR:
+
+            for (i = 0; i < (size_squared); i++)
+                kernel->data[i] = 1.0f / size_squared ;
+
+            break;
+
+
+        case IMG_KERNEL_SHARPEN:
+
+            /*TODO: implement a generalized funciton that creates a sharpen kernel of custom size n */
+
+            /*May be replaced by fill_kernel util ?, i don't know*/
+            memcpy(kernel->data, sharpen, size_squared * sizeof(float));
+            break;
+
+        case IMG_KERNEL_SOBEL_X:
+
+            memcpy(kernel->data, sobel_x, size_squared * sizeof(float));
+            break;
+
+        case IMG_KERNEL_SOBEL_Y:
+
+            memcpy(kernel->data, sobel_y, size_squared * sizeof(float));
+            break;
+
+        case IMG_KERNEL_LAPLACIAN:
+            /*TODO: implement a funciton that creates a laplacian kernel of custom size n */
+            assert(size == IMG_KERNEL_3x3);
+
+            float laplacian[] = {
+                0.0f,  1.0f, 0.0f,
+                1.0f, -4.0f, 1.0f,
+                0.0f,  1.0f, 0.0f
+            };
+            memcpy(kernel->data, laplacian, size_squared * sizeof(float));
+            break;
+
+        case IMG_KERNEL_GAUSSIAN_BLUR:
+            /* sigma follows from the size the way OpenCV's getGaussianKernel picks it */
+            gauss_weights(g, size / 2, 0.3 * ((size - 1) * 0.5 - 1) + 0.8);
+            for (i = 0; i < size_squared; i++)
+                kernel->data[i] = g[i / size] * g[i % size];
+            break;
+
+        default:
+            img_free_kernel(kernel);
+            err = IMG_ERR_UNSUPPORTED_KERNEL; goto error;
+    }
+
+error:
+    return err;
+}
+
+/*
+    Same as img_convolve with img_get_kernel(type, size), the kernel comes
+    from the cache unless it is too big for it
+*/
+ImgError
+img_filter2D(Image *dest, Image *img, KernelType type, KernelSize size, BorderMode border_mode)
+{
+    ImgError err;
+    const PreparedKernel *kernel;
+    Kernel k = {0};
+    MUST(img       != NULL, "img is NULL in img_filter2D");
+    MUST(img->data != NULL, "img->data is NULL in img_filter2D");
+    MUST(dest      != NULL, "dest is NULL in img_filter2D");
+
+    STATS_BEGIN(IMG_OP_FILTER2D);
+    if ((u32)size >= IMG_MAX_TAPS) {
+        err = img_get_kernel(type, size, &k);
+        if (err != IMG_OK) goto error;
+        err = img_convolve(dest, img, &k, border_mode);
+        img_free_kernel(&k);
+        goto error;
+    }
+    err = img_get_prepared_kernel(type, size, &kernel);
+    if (err != IMG_OK) goto error;
+
+    err = img_convolve_prepared(dest, img, kernel, border_mode);
+
+error:
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+ImgError
+img_print_kernel(Kernel *kernel)
+{
+    ImgError err;
+    MUST(kernel       != NULL, "kernel is NULL in img_print_kernel");
+    MUST(kernel->data != NULL, "kernel is NULL in img_print_kernel");
+
+    err = IMG_OK;
+    for (int i = 0; i < kernel->size; i++) {
+        for (int j = 0; j < kernel->size; j++) {
+            printf("%6.2f ", kernel->data[i * kernel->size + j]);
+        }
+        printf("\n");
+    }
+    return err;
+}
+
+
+
+void
+img_free_kernel(Kernel *kernel)
+{
+    MUST(kernel       != NULL, "kernel is NULL in img_free_kernel");
+    MUST(kernel->data != NULL, "kernel is NULL in img_free_kernel");
+
+    free(kernel->data);
+    kernel->data = NULL;
+    kernel->size = 0;
+}
+
+/*
+    Thread pool
+
+    Operations hand img_parallel_rows() a function that fills output rows
+    [y0, y1). The rows are cut into bands, each participant (the caller plus
+    pool workers) starts with a contiguous share of them and steals bands
+    from the back of the others' queues once its own share is done. Every
+    output row is computed by the same code whichever thread gets it, so
+    results do not depend on the thread count.
+*/
+
+/* fills output rows [y0, y1), id selects the calling thread's scratch */
+typedef void (*RowFn)(void *ctx, u32 id, u32 y0, u32 y1);
+
+typedef struct {
+    pthread_mutex_t lock;
+    u32 next, end;      /* bands [next, end) still queued */
+} BandQueue;
+
+static struct {
+    pthread_mutex_t job;        /* one parallel job at a time */
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    u32 spawned;
+    u32 generation;
+    u32 active;
+
+    RowFn fn;
+    void *ctx;
+    u32 rows, band, participants;
+    BandQueue queues[IMG_MAX_THREADS];
+    u32 born[IMG_MAX_THREADS];  /* generation at spawn time */
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+static u32 default_threads;    /* 0: one per online CPU */
+static pthread_key_t call_threads_key;
+static pthread_key_t worker_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void
+pool_init(void)
+{
+    u32 i;
+
+    pthread_key_create(&call_threads_key, NULL);
+    pthread_key_create(&worker_key, NULL);
+    for (i = 0; i < IMG_MAX_THREADS; i++)
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+}
+
+void
+img_set_threads(u32 n)
+{
+    default_threads = MIN(n, IMG_MAX_THREADS);
+}
+
+void
+img_set_call_threads(u32 n)
+{
+    pthread_once(&pool_once, pool_init);
+    pthread_setspecific(call_threads_key, (void *)(uintptr_t)MIN(n, IMG_MAX_THREADS));
+}
+
+u32
+img_get_threads(void)
+{
+    long ncpu;
+    u32 n;
+
+    pthread_once(&pool_once, pool_init);
+    n = (u32)(uintptr_t)pthread_getspecific(call_threads_key);
+    if (n == 0)
+        n = default_threads;
+    if (n == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        n = ncpu > 0 ? (u32)MIN(ncpu, IMG_MAX_THREADS) : 1;
+    }
+    return n;
+}
+
+static int
+band_pop(BandQueue *q, u32 *band)
+{
+    int ok;
+
+    pthread_mutex_lock(&q->lock);
+    ok = q->next < q->end;
+    if (ok) *band = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static int
+band_steal(BandQueue *q, u32 *band)
+{
+    int ok;
+
+    pthread_mutex_lock(&q->lock);
+    ok = q->next < q->end;
+    if (ok) *band = --q->end;
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static void
+pool_run(u32 id)
+{
+    u32 b = 0, i, y0;
+
+    for (;;) {
+        if (!band_pop(&pool.queues[id], &b)) {
+            for (i = 1; i < pool.participants; i++)
+                if (band_steal(&pool.queues[(id + i) % pool.participants], &b))
+                    break;
+            if (i == pool.participants)
+                return;
+        }
+        y0 = b * pool.band;
+        pool.fn(pool.ctx, id, y0, MIN(y0 + pool.band, pool.rows));
+    }
+}
+
+static void *
+pool_worker(void *arg)
+{
+    u32 id, seen;
+
+    id = (u32)(uintptr_t)arg;
+    pthread_setspecific(worker_key, (void *)1);
+
+    pthread_mutex_lock(&pool.lock);
+    seen = pool.born[id];     /* the job that spawned us may already be posted */
+    for (;;) {
+        while (pool.generation == seen)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        seen = pool.generation;
+        if (id >= pool.participants)
+            continue;
+
+        pthread_mutex_unlock(&pool.lock);
+        pool_run(id);
+        pthread_mutex_lock(&pool.lock);
+
+        if (--pool.active == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    return NULL;
+}
+
+/*
+    Calls fn over [0, rows) in bands of at least `grain` rows, spread over at
+    most n threads (ids 0 to n - 1). n normally comes from img_get_threads(),
+    read once by the caller so it can size per-thread scratch. Runs inline for small jobs and when called
+    from inside a pool worker.
+*/
+static void
+img_parallel_rows(u32 n, u32 rows, u32 grain, RowFn fn, void *ctx)
+{
+    pthread_t th;
+    u32 nbands, share, i;
+
+    pthread_once(&pool_once, pool_init);
+    if (grain < 1) grain = 1;
+    n = MIN(n, rows / grain);
+    if (n <= 1 || pthread_getspecific(worker_key) != NULL) {
+        if (rows > 0) fn(ctx, 0, 0, rows);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.job);
+    pthread_mutex_lock(&pool.lock);
+
+    while (pool.spawned < n - 1) {
+        pool.born[pool.spawned + 1] = pool.generation;
+        if (pthread_create(&th, NULL, pool_worker, (void *)(uintptr_t)(pool.spawned + 1)) != 0)
+            break;
+        pthread_detach(th);
+        pool.spawned++;
+    }
+    n = MIN(n, pool.spawned + 1);
+
+    /* a few bands per thread leaves room for stealing */
+    pool.band = MAX(grain, rows / (n * 4));
+    nbands = (rows + pool.band - 1) / pool.band;
+    share = (nbands + n - 1) / n;
+    for (i = 0; i < n; i++) {
+        pool.queues[i].next = MIN(i * share, nbands);
+        pool.queues[i].end = MIN((i + 1) * share, nbands);
+    }
+
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.rows = rows;
+    pool.participants = n;
+    pool.active = n - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_setspecific(worker_key, (void *)1);
+    pool_run(0);
+    pthread_setspecific(worker_key, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.job);
+}
+
+/*
+    Scratch memory
+
+    Temporary buffers (row rings, per-thread accumulators, copies of a
+    source that is also the destination) come from a stack of blocks kept
+    per calling thread. An operation takes a mark, allocates what it needs
+    and releases back to the mark on its way out. When a release leaves
+    nothing in use, the blocks are merged into one big enough for all of
+    them, so once a thread has seen its largest call it no longer touches
+    malloc. More than SCRATCH_KEEP bytes are not kept between calls.
+*/
+
+#define SCRATCH_ALIGN 64
+#define SCRATCH_MIN   ((size_t)1 << 16)
+#define SCRATCH_KEEP  ((size_t)64 << 20)
+
+typedef struct ScratchBlock ScratchBlock;
+struct ScratchBlock {
+    ScratchBlock *prev;
+    u8 *base;           /* SCRATCH_ALIGN aligned, right after the header */
+    size_t size, used;
+};
+
+typedef struct {
+    ScratchBlock *block;
+    size_t used;
+} ScratchMark;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void
+scratch_free_blocks(void *top)
+{
+    ScratchBlock *b, *prev;
+
+    for (b = top; b != NULL; b = prev) {
+        prev = b->prev;
+        free(b);
+    }
+}
+
+static void
+scratch_init(void)
+{
+    pthread_key_create(&scratch_key, scratch_free_blocks);
+}
+
+static ScratchBlock *
+scratch_block(ScratchBlock *prev, size_t size)
+{
+    ScratchBlock *b;
+
+    if (size > SIZE_MAX - sizeof(*b) - SCRATCH_ALIGN)
+        return NULL;
+    b = malloc(sizeof(*b) + SCRATCH_ALIGN - 1 + size);
+    if (b == NULL)
+        return NULL;
+    b->prev = prev;
+    b->base = (u8 *)(((uintptr_t)(b + 1) + SCRATCH_ALIGN - 1) & ~(uintptr_t)(SCRATCH_ALIGN - 1));
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+static ScratchMark
+scratch_mark(void)
+{
+    ScratchMark m;
+
+    pthread_once(&scratch_once, scratch_init);
+    m.block = pthread_getspecific(scratch_key);
+    m.used = m.block != NULL ? m.block->used : 0;
+    return m;
+}
+
+/* SCRATCH_ALIGN aligned, uninitialized, valid until the enclosing release */
+static void *
+scratch_alloc(size_t size)
+{
+    ScratchBlock *b;
+    void *p;
+
+    pthread_once(&scratch_once, scratch_init);
+    if (size > SIZE_MAX - SCRATCH_ALIGN)
+        return NULL;
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+
+    b = pthread_getspecific(scratch_key);
+    if (b == NULL || b->size - b->used < size) {
+        b = scratch_block(b, MAX(size, SCRATCH_MIN));
+        if (b == NULL)
+            return NULL;
+        pthread_setspecific(scratch_key, b);
+    }
+    p = b->base + b->used;
+    b->used += size;
+    return p;
+}
+
+static void
+scratch_release(ScratchMark m)
+{
+    ScratchBlock *b, *prev;
+    size_t total;
+
+    b = pthread_getspecific(scratch_key);
+    if (b == NULL)
+        return;
+
+    if (m.used == 0 && (m.block == NULL || m.block->prev == NULL)) {
+        /* nothing below the mark is in use: keep one block covering them all */
+        if (b->prev == NULL && b->size <= SCRATCH_KEEP) {
+            b->used = 0;
+            return;
+        }
+        for (total = 0; b != NULL; b = prev) {
+            prev = b->prev;
+            total += b->size;
+            free(b);
+        }
+        b = total <= SCRATCH_KEEP ? scratch_block(NULL, total) : NULL;
+        pthread_setspecific(scratch_key, b);
+        return;
+    }
+
+    while (b != m.block) {
+        prev = b->prev;
+        free(b);
+        b = prev;
+    }
+    pthread_setspecific(scratch_key, b);
+    b->used = m.used;
+}
+
+/*
+    Copy of img in scratch memory, for operations whose destination is their
+    source. Marked borrowed so img_free() leaves it alone.
+*/
+static ImgError
+scratch_copy(Image *snap, const Image *img)
+{
+    size_t size;
+
+    if (img->layout == IMG_LAYOUT_PLANAR)
+        size = img->plane_size * img->channels;
+    else
+        size = (size_t)img->height * img->stride;
+    memset(snap, 0, sizeof(*snap));
+    snap->data = scratch_alloc(size);
+    if (snap->data == NULL)
+        return IMG_ERR_MEMORY;
+    memcpy(snap->data, img->data, size);
+    snap->layout = img->layout;
+    snap->plane_size = img->plane_size;
+    snap->stride = img->stride;
+    snap->width = img->width;
+    snap->height = img->height;
+    snap->channels = img->channels;
+    snap->depth = img->depth;
+    snap->type = img->type;
+    snap->borrowed = 1;
+    return IMG_OK;
+}
+
+/*
+    Sample depths
+
+    U16 and F32 images carry more precision than the 8-bit pipeline, for
+    16-bit files and for chains of operations that should not round to a
+    byte after every step. img_convert_depth maps 0-255, 0-65535 and the
+    float range 0-1 onto each other: widening is exact (v * 257, v / 255),
+    narrowing rounds and clamps floats to [0, 1] first. The integer cases
+    run 16 samples per SSE2 step, the float ones 8.
+*/
+
+static void
+depth_row(u8 *d, ImgDepth dd, const u8 *s, ImgDepth sd, u32 n)
+{
+    float f, scale;
+    u32 i, v;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(128);
+    const __m128i recip = _mm_set1_epi16((short)65281), bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+    __m128i a, b, c;
+    __m128 fa, fb, k;
+#endif
+
+    if (sd == dd) {
+        memcpy(d, s, (size_t)n * depth_size(sd));
+        return;
+    }
+    scale = (sd == IMG_DEPTH_U16 || dd == IMG_DEPTH_U16) ? 65535.0f : 255.0f;
+    i = 0;
+#if defined(__SSE2__)
+    k = _mm_set1_ps(scale);
+    if (sd == IMG_DEPTH_U8 && dd == IMG_DEPTH_U16) {
+        /* v | v << 8 is v * 257 */
+        for (; i + 16 <= n; i += 16) {
+            a = _mm_loadu_si128((const __m128i *)(s + i));
+            _mm_storeu_si128((__m128i *)(d + 2 * i), _mm_unpacklo_epi8(a, a));
+            _mm_storeu_si128((__m128i *)(d + 2 * i + 16), _mm_unpackhi_epi8(a, a));
+        }
+    } else if (sd == IMG_DEPTH_U16 && dd == IMG_DEPTH_U8) {
+        /* (v + 128) / 257 as a high multiply, the saturation does not change the result */
+        for (; i + 16 <= n; i += 16) {
+            a = _mm_loadu_si128((const __m128i *)(s + 2 * i));
+            b = _mm_loadu_si128((const __m128i *)(s + 2 * i + 16));
+            a = _mm_srli_epi16(_mm_mulhi_epu16(_mm_adds_epu16(a, round), recip), 8);
+            b = _mm_srli_epi16(_mm_mulhi_epu16(_mm_adds_epu16(b, round), recip), 8);
+            _mm_storeu_si128((__m128i *)(d + i), _mm_packus_epi16(a, b));
+        }
+    } else if (sd == IMG_DEPTH_U8) {
+        for (; i + 8 <= n; i += 8) {
+            a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(s + i)), zero);
+            fa = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(a, zero)), k);
+            fb = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(a, zero)), k);
+            _mm_storeu_ps((float *)(d + 4 * i), fa);
+            _mm_storeu_ps((float *)(d + 4 * i + 16), fb);
+        }
+    } else if (sd == IMG_DEPTH_U16) {
+        for (; i + 8 <= n; i += 8) {
+            a = _mm_loadu_si128((const __m128i *)(s + 2 * i));
+            fa = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(a, zero)), k);
+            fb = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(a, zero)), k);
+            _mm_storeu_ps((float *)(d + 4 * i), fa);
+            _mm_storeu_ps((float *)(d + 4 * i + 16), fb);
+        }
+    } else {
+        /* max(f, 0) puts NaN at 0 like the scalar comparisons below */
+        for (; i + 8 <= n; i += 8) {
+            fa = _mm_min_ps(_mm_max_ps(_mm_loadu_ps((const float *)(s + 4 * i)), _mm_setzero_ps()), one);
+            fb = _mm_min_ps(_mm_max_ps(_mm_loadu_ps((const float *)(s + 4 * i + 16)), _mm_setzero_ps()), one);
+            a = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(fa, k), half));
+            b = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(fb, k), half));
+            if (dd == IMG_DEPTH_U8) {
+                c = _mm_packs_epi32(a, b);
+                _mm_storel_epi64((__m128i *)(d + i), _mm_packus_epi16(c, c));
+            } else {
+                /* packs is signed, go through [-32768, 32767] and flip the top bit back */
+                c = _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+                _mm_storeu_si128((__m128i *)(d + 2 * i), _mm_xor_si128(c, flip));
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (sd == IMG_DEPTH_F32) {
+            f = ((const float *)s)[i];
+            f = f > 0 ? (f < 1 ? f : 1) : 0;
+            v = (u32)(f * scale + 0.5f);
+            if (dd == IMG_DEPTH_U8)
+                d[i] = (u8)v;
+            else
+                ((u16 *)d)[i] = (u16)v;
+            continue;
+        }
+        v = sd == IMG_DEPTH_U8 ? s[i] : ((const u16 *)s)[i];
+        if (dd == IMG_DEPTH_F32)
+            ((float *)d)[i] = (float)v / scale;
+        else if (dd == IMG_DEPTH_U16)
+            ((u16 *)d)[i] = (u16)(v * 257);
+        else
+            d[i] = (u8)((v * 255 + 32767) / 65535);
+    }
+}
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+} DepthJob;
+
+static void
+depth_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    DepthJob *job = ctx;
+    u32 y;
+
+    (void)id;
+    for (y = y0; y < y1; y++)
+        depth_row(job->dest->data + (size_t)y * job->dest->stride, job->dest->depth,
+                  job->src->data + (size_t)y * job->src->stride, job->src->depth,
+                  job->src->width * job->src->channels);
+}
+
+/* dest = src with samples of the given depth, dest may be src */
+ImgError
+img_convert_depth(Image *dest, Image *src, ImgDepth depth)
+{
+    ImgError err;
+    DepthJob job;
+    Image snapshot;
+    ScratchMark mark;
+
+    MUST(dest      != NULL, "dest is NULL in img_convert_depth");
+    MUST(src       != NULL, "src is NULL in img_convert_depth");
+    MUST(src->data != NULL, "src->data is NULL in img_convert_depth");
+
+    if (depth != IMG_DEPTH_U8 && depth != IMG_DEPTH_U16 && depth != IMG_DEPTH_F32)
+        return IMG_ERR_INVALID_PARAMETERS;
+    /* planes are 8-bit */
+    if (src->layout == IMG_LAYOUT_PLANAR)
+        return depth == IMG_DEPTH_U8 ? img_cpy(dest, src) : IMG_ERR_UNSUPPORTED_FORMAT;
+
+    STATS_BEGIN(IMG_OP_CONVERT_DEPTH);
+    err = IMG_OK;
+    mark = scratch_mark();
+    if (dest == src) {
+        if (src->depth == depth) goto cleanup;
+        /* every depth has a different sample size, rows never line up */
+        err = scratch_copy(&snapshot, src);
+        if (err != IMG_OK) goto cleanup;
+        src = &snapshot;
+    }
+
+    err = img_realloc_depth(dest, src->width, src->height, src->channels, depth);
+    if (err != IMG_OK) goto cleanup;
+    dest->type = src->type;
+
+    job.src = src;
+    job.dest = dest;
+    img_parallel_rows(img_get_threads(), src->height, ROW_GRAIN(src->width), depth_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)src->width * src->height : 0);
+    return err;
+}
+
+/*
+    Planar images
+
+    A planar image keeps every channel in a plane of its own, so loops over
+    one channel walk contiguous bytes. Operations that treat the channels
+    alike (filters, resizing, warps, orthogonal transforms, arithmetic) run
+    once per plane on one-channel views and give a planar result, color
+    conversions read and write the planes directly. Files, pipelines and
+    the rest work on interleaved pixels. img_convert_layout goes between
+    the two with SSE2 byte packs and unpacks for 2 and 4 channels and
+    pshufb for RGB.
+*/
+
+#if IMG_X86_DISPATCH
+/* pshufb masks taking channel c of 16 interleaved RGB pixels out of block b, and back */
+static u8 cvt_split[3][3][16], cvt_merge[3][3][16];
+static pthread_once_t cvt_once = PTHREAD_ONCE_INIT;
+
+static void
+cvt_init_masks(void)
+{
+    u32 b, c, i, t;
+
+    for (b = 0; b < 3; b++) {
+        for (c = 0; c < 3; c++) {
+            for (i = 0; i < 16; i++) {
+                t = 3 * i + c;
+                cvt_split[b][c][i] = t / 16 == b ? t % 16 : 0x80;
+                t = 16 * b + i;
+                cvt_merge[b][c][i] = t % 3 == c ? t / 3 : 0x80;
+            }
+        }
+    }
+}
+
+__attribute__((target("ssse3"))) static u32
+split_rgb_ssse3(u8 *d, size_t plane, const u8 *s, u32 width)
+{
+    __m128i in[3];
+    u32 x, b, c;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        for (b = 0; b < 3; b++)
+            in[b] = _mm_loadu_si128((const __m128i *)(s + 3 * x + 16 * b));
+        for (c = 0; c < 3; c++)
+            _mm_storeu_si128((__m128i *)(d + c * plane + x), _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(in[0], _mm_loadu_si128((const __m128i *)cvt_split[0][c])),
+                        _mm_shuffle_epi8(in[1], _mm_loadu_si128((const __m128i *)cvt_split[1][c]))),
+                        _mm_shuffle_epi8(in[2], _mm_loadu_si128((const __m128i *)cvt_split[2][c]))));
+    }
+    return x;
+}
+
+__attribute__((target("ssse3"))) static u32
+merge_rgb_ssse3(u8 *d, const u8 *s, size_t plane, u32 width)
+{
+    __m128i pl[3];
+    u32 x, b, c;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        for (c = 0; c < 3; c++)
+            pl[c] = _mm_loadu_si128((const __m128i *)(s + c * plane + x));
+        for (b = 0; b < 3; b++)
+            _mm_storeu_si128((__m128i *)(d + 3 * x + 16 * b), _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(pl[0], _mm_loadu_si128((const __m128i *)cvt_merge[b][0])),
+                        _mm_shuffle_epi8(pl[1], _mm_loadu_si128((const __m128i *)cvt_merge[b][1]))),
+                        _mm_shuffle_epi8(pl[2], _mm_loadu_si128((const __m128i *)cvt_merge[b][2]))));
+    }
+    return x;
+}
+#endif
+
+/* Interleaved row s into the rows of ch planes, plane bytes apart, at d */
+static void
+split_row(u8 *d, size_t plane, const u8 *s, u32 width, u8 ch, int ssse3)
+{
+    u32 x;
+    u8 c;
+#if defined(__SSE2__)
+    const __m128i lo = _mm_set1_epi16(0x00ff);
+    __m128i a[4], e[2], o[2];
+    u32 b;
+#endif
+
+    if (ch == 1) {
+        memcpy(d, s, width);
+        return;
+    }
+    x = 0;
+#if IMG_X86_DISPATCH
+    if (ch == 3 && ssse3)
+        x = split_rgb_ssse3(d, plane, s, width);
+#else
+    (void)ssse3;
+#endif
+#if defined(__SSE2__)
+    /* even bytes are masked, odd ones shifted down, then both packed */
+    if (ch == 2) {
+        for (; x + 16 <= width; x += 16) {
+            a[0] = _mm_loadu_si128((const __m128i *)(s + 2 * x));
+            a[1] = _mm_loadu_si128((const __m128i *)(s + 2 * x + 16));
+            _mm_storeu_si128((__m128i *)(d + x),
+                             _mm_packus_epi16(_mm_and_si128(a[0], lo), _mm_and_si128(a[1], lo)));
+            _mm_storeu_si128((__m128i *)(d + plane + x),
+                             _mm_packus_epi16(_mm_srli_epi16(a[0], 8), _mm_srli_epi16(a[1], 8)));
+        }
+    } else if (ch == 4) {
+        /* twice: channels (0, 2) and (1, 3) first, then each on its own */
+        for (; x + 16 <= width; x += 16) {
+            for (b = 0; b < 4; b++)
+                a[b] = _mm_loadu_si128((const __m128i *)(s + 4 * x + 16 * b));
+            for (b = 0; b < 2; b++) {
+                e[b] = _mm_packus_epi16(_mm_and_si128(a[2 * b], lo), _mm_and_si128(a[2 * b + 1], lo));
+                o[b] = _mm_packus_epi16(_mm_srli_epi16(a[2 * b], 8), _mm_srli_epi16(a[2 * b + 1], 8));
+            }
+            _mm_storeu_si128((__m128i *)(d + x),
+                             _mm_packus_epi16(_mm_and_si128(e[0], lo), _mm_and_si128(e[1], lo)));
+            _mm_storeu_si128((__m128i *)(d + plane + x),
+                             _mm_packus_epi16(_mm_and_si128(o[0], lo), _mm_and_si128(o[1], lo)));
+            _mm_storeu_si128((__m128i *)(d + 2 * plane + x),
+                             _mm_packus_epi16(_mm_srli_epi16(e[0], 8), _mm_srli_epi16(e[1], 8)));
+            _mm_storeu_si128((__m128i *)(d + 3 * plane + x),
+                             _mm_packus_epi16(_mm_srli_epi16(o[0], 8), _mm_srli_epi16(o[1], 8)));
+        }
+    }
+#endif
+    for (; x < width; x++)
+        for (c = 0; c < ch; c++)
+            d[c * plane + x] = s[(size_t)x * ch + c];
+}
+
+/* Rows of ch planes, plane bytes apart, at s into the interleaved row d */
+static void
+merge_row(u8 *d, const u8 *s, size_t plane, u32 width, u8 ch, int ssse3)
+{
+    u32 x;
+    u8 c;
+#if defined(__SSE2__)
+    __m128i p[4], lo, hi;
+#endif
+
+    if (ch == 1) {
+        memcpy(d, s, width);
+        return;
+    }
+    x = 0;
+#if IMG_X86_DISPATCH
+    if (ch == 3 && ssse3)
+        x = merge_rgb_ssse3(d, s, plane, width);
+#else
+    (void)ssse3;
+#endif
+#if defined(__SSE2__)
+    if (ch == 2) {
+        for (; x + 16 <= width; x += 16) {
+            p[0] = _mm_loadu_si128((const __m128i *)(s + x));
+            p[1] = _mm_loadu_si128((const __m128i *)(s + plane + x));
+            _mm_storeu_si128((__m128i *)(d + 2 * x), _mm_unpacklo_epi8(p[0], p[1]));
+            _mm_storeu_si128((__m128i *)(d + 2 * x + 16), _mm_unpackhi_epi8(p[0], p[1]));
+        }
+    } else if (ch == 4) {
+        for (; x + 16 <= width; x += 16) {
+            for (c = 0; c < 4; c++)
+                p[c] = _mm_loadu_si128((const __m128i *)(s + c * plane + x));
+            lo = _mm_unpacklo_epi8(p[0], p[1]);
+            hi = _mm_unpacklo_epi8(p[2], p[3]);
+            _mm_storeu_si128((__m128i *)(d + 4 * x), _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i *)(d + 4 * x + 16), _mm_unpackhi_epi16(lo, hi));
+            lo = _mm_unpackhi_epi8(p[0], p[1]);
+            hi = _mm_unpackhi_epi8(p[2], p[3]);
+            _mm_storeu_si128((__m128i *)(d + 4 * x + 32), _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i *)(d + 4 * x + 48), _mm_unpackhi_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; x < width; x++)
+        for (c = 0; c < ch; c++)
+            d[(size_t)x * ch + c] = s[c * plane + x];
+}
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    int ssse3;
+} LayoutJob;
+
+static void
+layout_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    LayoutJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    const u8 *s;
+    u8 *d;
+    u32 y;
+    u8 c;
+
+    (void)id;
+    for (y = y0; y < y1; y++) {
+        s = src->data + (size_t)y * src->stride;
+        d = dest->data + (size_t)y * dest->stride;
+        if (src->layout == dest->layout && src->layout == IMG_LAYOUT_PLANAR) {
+            for (c = 0; c < src->channels; c++)
+                memcpy(d + c * dest->plane_size, s + c * src->plane_size, src->width);
+        } else if (src->layout == dest->layout) {
+            memcpy(d, s, (size_t)src->width * src->channels);
+        } else if (dest->layout == IMG_LAYOUT_PLANAR) {
+            split_row(d, dest->plane_size, s, src->width, src->channels, job->ssse3);
+        } else {
+            merge_row(d, s, src->plane_size, src->width, src->channels, job->ssse3);
+        }
+    }
+}
+
+/* dest = src in the given layout, dest may be src */
+ImgError
+img_convert_layout(Image *dest, Image *src, ImgLayout layout)
+{
+    ImgError err;
+    LayoutJob job;
+    Image snapshot;
+    ScratchMark mark;
+
+    MUST(dest      != NULL, "dest is NULL in img_convert_layout");
+    MUST(src       != NULL, "src is NULL in img_convert_layout");
+    MUST(src->data != NULL, "src->data is NULL in img_convert_layout");
+
+    if (layout != IMG_LAYOUT_INTERLEAVED && layout != IMG_LAYOUT_PLANAR)
+        return IMG_ERR_INVALID_PARAMETERS;
+    if (src->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+
+    STATS_BEGIN(IMG_OP_CONVERT_LAYOUT);
+    err = IMG_OK;
+    mark = scratch_mark();
+    if (dest == src) {
+        if (src->layout == layout) goto cleanup;
+        err = scratch_copy(&snapshot, src);
+        if (err != IMG_OK) goto cleanup;
+        src = &snapshot;
+    }
+
+    if (layout == IMG_LAYOUT_PLANAR)
+        err = img_realloc_planes(dest, src->width, src->height, src->channels);
+    else
+        err = img_realloc_pixels(dest, src->width, src->height, src->channels);
+    if (err != IMG_OK) goto cleanup;
+    dest->type = src->type;
+
+    job.src = src;
+    job.dest = dest;
+    job.ssse3 = 0;
+#if IMG_X86_DISPATCH
+    job.ssse3 = src->channels == 3 && __builtin_cpu_supports("ssse3");
+    if (job.ssse3)
+        pthread_once(&cvt_once, cvt_init_masks);
+#endif
+    img_parallel_rows(img_get_threads(), src->height, ROW_GRAIN(src->width), layout_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)src->width * src->height : 0);
+    return err;
+}
+
+/*
+    One-channel views of the planes of a planar source, a second operand
+    and the destination, for operations that run once per plane. Views of
+    the same image are the same pointers, so the operation still sees
+    dest == src.
+*/
+typedef struct {
+    Image view[3][4];
+    Image *src[4], *src2[4], *dest[4];
+    Image snapshot;
+    ScratchMark mark;
+} PlaneSet;
+
+static void
+plane_view(Image *view, const Image *img, u8 c)
+{
+    memset(view, 0, sizeof(*view));
+    view->data = img->data + c * img->plane_size;
+    view->stride = img->stride;
+    view->width = img->width;
+    view->height = img->height;
+    view->channels = 1;
+    /* the operation finds the plane big enough and keeps it */
+    view->capacity = img->plane_size;
+    view->type = img->type;
+}
+
+/*
+    Makes dest a planar width x height image with the channels of src, in
+    place of src when dest == src (through a copy if the size changes), and
+    fills ps. src2 may be NULL. Has to be paired with planes_end.
+*/
+static ImgError
+planes_begin(PlaneSet *ps, Image *dest, Image *src, Image *src2, u32 width, u32 height)
+{
+    ImgError err;
+    u8 c;
+
+    ps->mark = scratch_mark();
+    if (src->layout != IMG_LAYOUT_PLANAR || (src2 != NULL && src2->layout != IMG_LAYOUT_PLANAR))
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (src2 != NULL && src2->channels != src->channels)
+        return IMG_ERR_INVALID_DIMENSIONS;
+
+    if (dest == src && (width != src->width || height != src->height)) {
+        err = scratch_copy(&ps->snapshot, src);
+        if (err != IMG_OK) return err;
+        src = &ps->snapshot;
+    }
+    if (dest != src && dest != src2) {
+        err = img_realloc_planes(dest, width, height, src->channels);
+        if (err != IMG_OK) return err;
+        dest->type = src->type;
+    }
+
+    for (c = 0; c < src->channels; c++) {
+        plane_view(&ps->view[0][c], src, c);
+        ps->src[c] = &ps->view[0][c];
+        ps->src2[c] = NULL;
+        if (src2 == src) {
+            ps->src2[c] = ps->src[c];
+        } else if (src2 != NULL) {
+            plane_view(&ps->view[1][c], src2, c);
+            ps->src2[c] = &ps->view[1][c];
+        }
+        if (dest == src) {
+            ps->dest[c] = ps->src[c];
+        } else if (dest == src2) {
+            ps->dest[c] = ps->src2[c];
+        } else {
+            plane_view(&ps->view[2][c], dest, c);
+            ps->dest[c] = &ps->view[2][c];
+        }
+    }
+    return IMG_OK;
+}
+
+static ImgError
+planes_end(PlaneSet *ps, ImgError err)
+{
+    scratch_release(ps->mark);
+    return err;
+}
+
+/*
+    Convolution engine
+
+    Every source row is converted once to float into a row buffer padded
+    with kernel->size / 2 pixels on each side (zeros or replicated edge
+    pixels), so the inner loops never check borders. Interleaved channels
+    are handled by stepping taps by `channels` floats, which makes 1 to 4
+    channels the same code path.
+
+    Rank-1 kernels (box, Sobel, Gaussian, ...) are split into a column and a
+    row vector and run as a horizontal pass into a ring of rows followed by a
+    vertical pass: 2 * size instead of size^2 multiply-adds per sample.
+
+    The row kernels come in scalar, SSE2 and AVX2 flavours, picked at run
+    time. They all add the taps in the same order without FMA so the output
+    does not depend on the instruction set.
+*/
+
+typedef struct {
+    /* dst[i] += sum(taps[k] * src[i + k * step]) */
+    void (*hpass)(float *dst, const float *src, u32 n, const float *taps, u32 ntaps, u32 step);
+    /* dst[i] = sum(taps[k] * rows[k][i]) */
+    void (*vpass)(float *dst, const float *const *rows, u32 n, const float *taps, u32 ntaps);
+    /* dst[i] = clamp(src[i] + 0.5, 0, 255) truncated */
+    void (*store)(u8 *dst, const float *src, u32 n);
+} ConvOps;
+
+static void
+hpass_scalar(float *dst, const float *src, u32 n, const float *taps, u32 ntaps, u32 step)
+{
+    u32 i, k;
+    float acc;
+
+    for (i = 0; i < n; i++) {
+        acc = dst[i];
+        for (k = 0; k < ntaps; k++)
+            acc = acc + taps[k] * src[i + k * step];
+        dst[i] = acc;
+    }
+}
+
+/* vpass over columns i .. n - 1, so the SIMD versions finish their rows here */
+static void
+vpass_tail(float *dst, const float *const *rows, u32 i, u32 n, const float *taps, u32 ntaps)
+{
+    u32 k;
+    float acc;
+
+    for (; i < n; i++) {
+        acc = 0.0f;
+        for (k = 0; k < ntaps; k++)
+            acc = acc + taps[k] * rows[k][i];
+        dst[i] = acc;
+    }
+}
+
+#if !defined(__SSE2__)
+static void
+vpass_scalar(float *dst, const float *const *rows, u32 n, const float *taps, u32 ntaps)
+{
+    vpass_tail(dst, rows, 0, n, taps, ntaps);
+}
+#endif
+
+static void
+store_scalar(u8 *dst, const float *src, u32 n)
+{
+    u32 i;
+    float v;
+
+    for (i = 0; i < n; i++) {
+        v = MIN(MAX(src[i], 0.0f), 255.0f) + 0.5f;
+        dst[i] = (u8)v;
+    }
+}
+
+/* store for U16 rows: clamp(src[i] + 0.5, 0, 65535) truncated */
+static void
+store_u16(u8 *dst, const float *src, u32 n)
+{
+    u16 *d = (u16 *)dst;
+    u32 i;
+    float v;
+
+    i = 0;
+#if defined(__SSE2__)
+    {
+        const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(65535.0f), half = _mm_set1_ps(0.5f);
+        const __m128i bias = _mm_set1_epi32(32768), flip = _mm_set1_epi16((short)0x8000);
+        __m128i a, b;
+
+        /* packs is signed, so pack v - 32768 and flip the top bit back */
+#define CVT(off) _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + (off)), lo), hi), half)), bias)
+        for (; i + 8 <= n; i += 8) {
+            a = CVT(0); b = CVT(4);
+            _mm_storeu_si128((__m128i *)(d + i), _mm_xor_si128(_mm_packs_epi32(a, b), flip));
+        }
+#undef CVT
+    }
+#endif
+    for (; i < n; i++) {
+        v = MIN(MAX(src[i], 0.0f), 65535.0f) + 0.5f;
+        d[i] = (u16)v;
+    }
+}
+
+/* store for F32 rows, as they are */
+static void
+store_f32(u8 *dst, const float *src, u32 n)
+{
+    memcpy(dst, src, (size_t)n * sizeof(float));
+}
+
+#if defined(__SSE2__)
+static void
+hpass_sse2(float *dst, const float *src, u32 n, const float *taps, u32 ntaps, u32 step)
+{
+    u32 i, k;
+    __m128 acc;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        acc = _mm_loadu_ps(dst + i);
+        for (k = 0; k < ntaps; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(taps[k]), _mm_loadu_ps(src + i + k * step)));
+        _mm_storeu_ps(dst + i, acc);
+    }
+    hpass_scalar(dst + i, src + i, n - i, taps, ntaps, step);
+}
+
+/* columns i .. n - 1 */
+static void
+vpass_sse2_from(float *dst, const float *const *rows, u32 i, u32 n, const float *taps, u32 ntaps)
+{
+    u32 k;
+    __m128 acc;
+
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_setzero_ps();
+        for (k = 0; k < ntaps; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(taps[k]), _mm_loadu_ps(rows[k] + i)));
+        _mm_storeu_ps(dst + i, acc);
+    }
+    vpass_tail(dst, rows, i, n, taps, ntaps);
+}
+
+static void
+vpass_sse2(float *dst, const float *const *rows, u32 n, const float *taps, u32 ntaps)
+{
+    vpass_sse2_from(dst, rows, 0, n, taps, ntaps);
+}
+
+static void
+store_sse2(u8 *dst, const float *src, u32 n)
+{
+    const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+    __m128i a, b, c, d;
+    u32 i;
+
+#define CVT(off) _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + (off)), lo), hi), half))
+    for (i = 0; i + 16 <= n; i += 16) {
+        a = CVT(0); b = CVT(4); c = CVT(8); d = CVT(12);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+    }
+#undef CVT
+    store_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+#if IMG_X86_DISPATCH
+__attribute__((target("avx2"))) static void
+hpass_avx2(float *dst, const float *src, u32 n, const float *taps, u32 ntaps, u32 step)
+{
+    u32 i, k;
+    __m256 acc;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        acc = _mm256_loadu_ps(dst + i);
+        for (k = 0; k < ntaps; k++)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(taps[k]), _mm256_loadu_ps(src + i + k * step)));
+        _mm256_storeu_ps(dst + i, acc);
+    }
+    hpass_sse2(dst + i, src + i, n - i, taps, ntaps, step);
+}
+
+__attribute__((target("avx2"))) static void
+vpass_avx2(float *dst, const float *const *rows, u32 n, const float *taps, u32 ntaps)
+{
+    u32 i, k;
+    __m256 acc;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        acc = _mm256_setzero_ps();
+        for (k = 0; k < ntaps; k++)
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(taps[k]), _mm256_loadu_ps(rows[k] + i)));
+        _mm256_storeu_ps(dst + i, acc);
+    }
+    vpass_sse2_from(dst, rows, i, n, taps, ntaps);
+}
+#endif
+
+static const ConvOps *
+conv_ops(void)
+{
+#if defined(__SSE2__)
+    static const ConvOps sse2 = { hpass_sse2, vpass_sse2, store_sse2 };
+#else
+    static const ConvOps scalar = { hpass_scalar, vpass_scalar, store_scalar };
+#endif
+#if IMG_X86_DISPATCH
+    static const ConvOps avx2 = { hpass_avx2, vpass_avx2, store_sse2 };
+
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2;
+#endif
+#if defined(__SSE2__)
+    return &sse2;
+#else
+    return &scalar;
+#endif
+}
+
+/*
+    Splits a rank-1 kernel into col * row. Returns 0 when the kernel is not
+    separable (sharpen, laplacian, ...).
+*/
+static int
+kernel_separate(const Kernel *kernel, float *col, float *row)
+{
+    size_t i, j, n, pr, pc;
+    float pivot, maxabs, tol;
+
+    n = kernel->size;
+    pr = pc = 0;
+    maxabs = 0.0f;
+    for (i = 0; i < n * n; i++) {
+        if (ABS(kernel->data[i]) > maxabs) {
+            maxabs = ABS(kernel->data[i]);
+            pr = i / n;
+            pc = i % n;
+        }
+    }
+    if (maxabs == 0.0f)
+        return 0;
+
+    pivot = kernel->data[pr * n + pc];
+    for (i = 0; i < n; i++) {
+        col[i] = kernel->data[i * n + pc];
+        row[i] = kernel->data[pr * n + i] / pivot;
+    }
+
+    tol = maxabs * 1e-5f;
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++)
+            if (ABS(col[i] * row[j] - kernel->data[i * n + j]) > tol)
+                return 0;
+    return 1;
+}
+
+/*
+    One row of samples of the given depth as floats with r pixels of border
+    on each side, src NULL is a row of zeros. U16 samples keep their 0-65535
+    range.
+*/
+static void
+conv_pad_row(float *dst, const u8 *src, ImgDepth depth, u32 width, u8 ch, u32 r, BorderMode border_mode)
+{
+    float *row;
+    u32 x, c, n;
+
+    n = width * ch;
+    if (src == NULL) {
+        memset(dst, 0, (n + 2 * r * ch) * sizeof(float));
+        return;
+    }
+
+    row = dst + r * ch;
+    if (depth == IMG_DEPTH_F32)
+        memcpy(row, src, n * sizeof(float));
+    else if (depth == IMG_DEPTH_U16)
+        for (x = 0; x < n; x++)
+            row[x] = ((const u16 *)src)[x];
+    else
+        for (x = 0; x < n; x++)
+            row[x] = src[x];
+
+    for (x = 0; x < r; x++) {
+        for (c = 0; c < ch; c++) {
+            if (border_mode == IMG_BORDER_REPLICATE) {
+                dst[x * ch + c] = row[c];
+                dst[(r + width + x) * ch + c] = row[n - ch + c];
+            } else {
+                dst[x * ch + c] = 0.0f;
+                dst[(r + width + x) * ch + c] = 0.0f;
+            }
+        }
+    }
+}
+
+/* Source row y as floats, r pixels of border on each side */
+static void
+conv_load_row(float *dst, const Image *img, i64 y, u32 r, BorderMode border_mode)
+{
+    if (y < 0 || y >= img->height) {
+        if (border_mode == IMG_BORDER_ZERO_PADDING) {
+            conv_pad_row(dst, NULL, img->depth, img->width, img->channels, r, border_mode);
+            return;
+        }
+        y = MIN(MAX(y, 0), img->height - 1);
+    }
+    conv_pad_row(dst, img->data + (size_t)y * img->stride, img->depth, img->width, img->channels, r, border_mode);
+}
+
+/*
+    Prepared kernels
+
+    Everything img_convolve works out from the taps before touching a
+    pixel. Never changed once made, so any number of threads may convolve
+    with one. The built-in kernels are made on first use and kept in
+    kernel_cache until the process exits, img_prepare_kernel makes one the
+    caller owns.
+*/
+struct PreparedKernel {
+    Kernel kernel;
+    float *col, *row;       /* kernel.size factors each */
+    int separable;
+    int cached;             /* owned by kernel_cache, not freed */
+};
+
+#define KERNEL_TYPES (IMG_KERNEL_LAPLACIAN + 1)
+
+static PreparedKernel *kernel_cache[KERNEL_TYPES][IMG_MAX_TAPS];
+static pthread_mutex_t kernel_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* kernel->data stays where it is, the factors go to the 2 * size floats at factors */
+static void
+kernel_prepare(PreparedKernel *pk, const Kernel *kernel, float *factors)
+{
+    pk->kernel = *kernel;
+    pk->col = factors;
+    pk->row = factors + kernel->size;
+    pk->separable = kernel_separate(kernel, pk->col, pk->row);
+    pk->cached = 0;
+}
+
+/* *prepared = copy of kernel with its factors, free with img_free_prepared_kernel */
+ImgError
+img_prepare_kernel(const Kernel *kernel, PreparedKernel **prepared)
+{
+    PreparedKernel *pk;
+    Kernel copy;
+
+    MUST(kernel       != NULL, "kernel is NULL in img_prepare_kernel");
+    MUST(kernel->data != NULL, "kernel->data is NULL in img_prepare_kernel");
+    MUST(prepared     != NULL, "prepared is NULL in img_prepare_kernel");
+
+    if (kernel->size % 2 == 0)
+        return IMG_ERR_INVALID_KERNEL_SIZE;
+
+    /* the taps and then the factors live right after the struct */
+    pk = malloc(sizeof(*pk) + ((size_t)kernel->size + 2) * kernel->size * sizeof(float));
+    if (pk == NULL)
+        return IMG_ERR_MEMORY;
+    copy.size = kernel->size;
+    copy.data = (float *)(pk + 1);
+    memcpy(copy.data, kernel->data, kernel->size * kernel->size * sizeof(float));
+    kernel_prepare(pk, &copy, copy.data + (size_t)kernel->size * kernel->size);
+    *prepared = pk;
+    return IMG_OK;
+}
+
+/*
+    *kernel = the shared prepared img_get_kernel(type, size), made on the
+    first call. Don't free it. Sizes from IMG_MAX_TAPS on are not cached,
+    use img_prepare_kernel for those.
+*/
+ImgError
+img_get_prepared_kernel(KernelType type, KernelSize size, const PreparedKernel **kernel)
+{
+    ImgError err;
+    PreparedKernel *pk;
+    Kernel k = {0};
+
+    MUST(kernel != NULL, "kernel is NULL in img_get_prepared_kernel");
+
+    if ((u32)type >= KERNEL_TYPES)
+        return IMG_ERR_UNSUPPORTED_KERNEL;
+    if ((u32)size % 2 == 0 || (u32)size >= IMG_MAX_TAPS)
+        return IMG_ERR_INVALID_KERNEL_SIZE;
+
+    err = IMG_OK;
+    pthread_mutex_lock(&kernel_cache_lock);
+    pk = kernel_cache[type][size];
+    if (pk == NULL) {
+        err = img_get_kernel(type, size, &k);
+        if (err != IMG_OK) goto unlock;
+        err = img_prepare_kernel(&k, &pk);
+        img_free_kernel(&k);
+        if (err != IMG_OK) goto unlock;
+        pk->cached = 1;
+        kernel_cache[type][size] = pk;
+    }
+    *kernel = pk;
+unlock:
+    pthread_mutex_unlock(&kernel_cache_lock);
+    return err;
+}
+
+void
+img_free_prepared_kernel(PreparedKernel *prepared)
+{
+    if (prepared == NULL)
+        return;
+    MUST(!prepared->cached, "cached kernel passed to img_free_prepared_kernel");
+    free(prepared);
+}
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    const PreparedKernel *pk;
+    BorderMode border_mode;
+    const ConvOps *ops;
+    void (*store)(u8 *dst, const float *src, u32 n);    /* ops->store or one for the wider depths */
+    u32 r, n, padn;
+    float *scratch;
+    size_t scratch_len;     /* floats per thread */
+    const float **rows;     /* kernel size ring rows per thread */
+} ConvJob;
+
+static void
+conv_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ConvJob *job = ctx;
+    const PreparedKernel *pk = job->pk;
+    const float **rows = job->rows + (size_t)id * pk->kernel.size;
+    float *ring, *padded, *acc, *slot;
+    u32 size, r, n, padn, k;
+    i64 y, yy;
+
+    size = pk->kernel.size;
+    r = job->r;
+    n = job->n;
+    padn = job->padn;
+
+    /*
+        separable: ring of `size` horizontally filtered rows + one padded row
+        otherwise: ring of `size` padded rows
+    */
+    ring = job->scratch + id * job->scratch_len;
+    padded = ring + (size_t)size * (pk->separable ? n : padn);
+    acc = padded + padn;
+
+    for (y = (i64)y0 - r; y < (i64)y1 + r; y++) {
+        /* source row y goes into slot (y - y0 + r) % size */
+        if (pk->separable) {
+            slot = ring + (size_t)((y - y0 + r) % size) * n;
+            conv_load_row(padded, job->src, y, r, job->border_mode);
+            memset(slot, 0, n * sizeof(float));
+            job->ops->hpass(slot, padded, n, pk->row, size, job->src->channels);
+        } else {
+            conv_load_row(ring + (size_t)((y - y0 + r) % size) * padn, job->src, y, r, job->border_mode);
+        }
+
+        yy = y - r;     /* output row that just became complete */
+        if (yy < (i64)y0) continue;
+
+        if (pk->separable) {
+            for (k = 0; k < size; k++)
+                rows[k] = ring + (size_t)((yy - y0 + k) % size) * n;
+            job->ops->vpass(acc, rows, n, pk->col, size);
+        } else {
+            memset(acc, 0, n * sizeof(float));
+            for (k = 0; k < size; k++)
+                job->ops->hpass(acc, ring + (size_t)((yy - y0 + k) % size) * padn, n,
+                                pk->kernel.data + k * size, size, job->src->channels);
+        }
+        job->store(job->dest->data + (size_t)yy * job->dest->stride, acc, n);
+    }
+}
+
+/* img_convolve with the factors already worked out */
+ImgError
+img_convolve_prepared(Image *dest, Image *img, const PreparedKernel *kernel, BorderMode border_mode)
+{
+    ImgError err;
+    ConvJob job;
+    Image snapshot;
+    ScratchMark mark;
+    PlaneSet ps;
+    u32 size, ch, nthreads;
+    u8 c;
+
+    MUST(img             != NULL, "img is NULL in img_convolve");
+    MUST(img->data       != NULL, "img->data is NULL in img_convolve");
+    MUST(dest            != NULL, "dest is NULL in img_convolve");
+    MUST(kernel          != NULL, "kernel is NULL in img_convolve");
+
+    if (img->layout == IMG_LAYOUT_PLANAR) {
+        err = planes_begin(&ps, dest, img, NULL, img->width, img->height);
+        for (c = 0; err == IMG_OK && c < img->channels; c++)
+            err = img_convolve_prepared(ps.dest[c], ps.src[c], kernel, border_mode);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(IMG_OP_CONVOLVE);
+    err = IMG_OK;
+    mark = scratch_mark();
+    size = kernel->kernel.size;
+    ch = img->channels;
+    nthreads = img_get_threads();
+
+    job.src = img;
+    job.dest = dest;
+    job.pk = kernel;
+    job.border_mode = border_mode;
+    job.ops = conv_ops();
+    /* wider samples are stored from the same float sums, F32 without rounding */
+    job.store = img->depth == IMG_DEPTH_U16 ? store_u16 : img->depth == IMG_DEPTH_F32 ? store_f32 : job.ops->store;
+    job.r = size / 2;
+    job.n = img->width * ch;
+    job.padn = job.n + 2 * job.r * ch;
+    job.scratch_len = (size_t)size * (kernel->separable ? job.n : job.padn) + job.padn + job.n;
+    job.scratch = scratch_alloc(nthreads * job.scratch_len * sizeof(float));
+    job.rows = scratch_alloc((size_t)nthreads * size * sizeof(*job.rows));
+    if (job.scratch == NULL || job.rows == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+
+    if (dest == img) {
+        /*
+            a single band keeps every source row in its ring before writing
+            over it, several bands would read rows their neighbours already
+            replaced
+        */
+        if (nthreads > 1) {
+            err = scratch_copy(&snapshot, img);
+            if (err != IMG_OK) goto cleanup;
+            job.src = &snapshot;
+        }
+    } else if (dest->data == NULL || dest->width != img->width || dest->height != img->height ||
+               dest->channels != ch || dest->depth != img->depth || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_depth(dest, img->width, img->height, ch, img->depth);
+        if (err != IMG_OK) goto cleanup;
+    }
+    dest->type = img->type;
+
+    img_parallel_rows(nthreads, img->height, 16, conv_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+ImgError
+img_convolve(Image *dest, Image *img, Kernel *kernel, BorderMode border_mode)
+{
+    PreparedKernel pk;
+    ScratchMark mark;
+    ImgError err;
+    float *factors;
+
+    MUST(kernel           != NULL, "kernel is NULL in img_convolve");
+    MUST(kernel->data     != NULL, "kernel->data is NULL in img_convolve");
+    MUST(kernel->size % 2 != 0,    "kernel->size % 2 == 0 NULL in img_convolve");
+
+    mark = scratch_mark();
+    factors = scratch_alloc(2 * (size_t)kernel->size * sizeof(float));
+    if (factors == NULL) {
+        scratch_release(mark);
+        return IMG_ERR_MEMORY;
+    }
+    kernel_prepare(&pk, kernel, factors);
+    err = img_convolve_prepared(dest, img, &pk, border_mode);
+    scratch_release(mark);
+    return err;
+}
+
+/*
+    Box filter
+
+    Mean of the (2r+1)^2 window around every pixel from running sums. Each
+    band keeps the sum of the 2r+1 source rows around the current row per
+    column, adding the row that enters the window and dropping the one that
+    leaves it, and every output row then slides a 2r+1 wide window along
+    those column sums the same way. The cost per pixel does not depend on r
+    and the sums are exact integers. Zero padding counts the zeros in the
+    mean, like img_convolve.
+*/
+#define BOX_MAX_RADIUS 0x7fffff     /* (2r+1) * 255 fits the u32 column sums */
+
+/* round(v / area) = ((v + area / 2) * mul) >> shift, mul 0 when area is too big */
+typedef struct {
+    u64 area;
+    double inv_area;
+    u32 mul, shift;
+} BoxDiv;
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    u32 r;
+    BorderMode border_mode;
+    BoxDiv div;
+    u8 *scratch;
+    size_t scratch_len;     /* bytes per thread */
+} BoxJob;
+
+/*
+    Multiplier for an exact v / area with v < 256 * area: with
+    2^l >= area and shift = 8 + 2l the rounding error of mul stays below
+    1 / area. mul fits u32 up to area = 2^22, past that the mean goes
+    through a double.
+*/
+static void
+box_divisor(BoxDiv *div, u64 area)
+{
+    u32 l;
+
+    div->area = area;
+    div->inv_area = 1.0 / (double)area;
+    div->mul = 0;
+    for (l = 0; ((u64)1 << l) < area; l++)
+        ;
+    if (l > 22)
+        return;
+    div->shift = 8 + 2 * l;
+    div->mul = (u32)((((u64)1 << div->shift) + area - 1) / area);
+}
+
+static inline u8
+box_mean(const BoxDiv *div, u64 v)
+{
+    u64 q;
+
+    v += div->area / 2;
+    if (div->mul != 0)
+        return (u8)((v * div->mul) >> div->shift);
+    q = (u64)((double)v * div->inv_area);
+    if (q * div->area > v)
+        q--;
+    else if ((q + 1) * div->area <= v)
+        q++;
+    return (u8)q;
+}
+
+/* Column sum x of channel c, x may be outside the row */
+static inline u32
+box_at(const u32 *col, i64 x, u32 width, u8 ch, u8 c, BorderMode border_mode)
+{
+    if (x < 0 || x >= width) {
+        if (border_mode == IMG_BORDER_ZERO_PADDING)
+            return 0;
+        x = x < 0 ? 0 : (i64)width - 1;
+    }
+    return col[x * ch + c];
+}
+
+/*
+    Slides the 2r+1 wide window along the column sums of one output row.
+    Inlined once per channel count so the running sums stay in registers.
+*/
+static inline __attribute__((always_inline)) void
+box_hline_ch(u8 *dst, const u32 *col, const BoxJob *job, const u8 ch)
+{
+    const BorderMode bm = job->border_mode;
+    const u32 width = job->src->width, r = job->r;
+    const BoxDiv div = job->div;    /* a local copy, dst stores can't alias it */
+    const u32 *in, *out;
+    u64 s[4];
+    i64 x, end;
+    u8 c;
+
+    /* first window [-r, r], only the columns inside the row are visited */
+    for (c = 0; c < ch; c++) {
+        s[c] = 0;
+        for (x = 0; x <= MIN((i64)r, (i64)width - 1); x++)
+            s[c] += col[x * ch + c];
+        if (bm == IMG_BORDER_REPLICATE) {
+            s[c] += (u64)r * col[c];
+            if (r > width - 1)
+                s[c] += (u64)(r - (width - 1)) * col[(size_t)(width - 1) * ch + c];
+        }
+        dst[c] = box_mean(&div, s[c]);
+    }
+
+    for (x = 1; x < width; x++) {
+        if (x > r && x + r < width) {
+            /* nothing clamped until x + r reaches the end of the row */
+            end = (i64)width - r;
+            in = col + (x + r) * ch;
+            out = col + (x - r - 1) * ch;
+            for (; x < end; x++, in += ch, out += ch) {
+                for (c = 0; c < ch; c++) {
+                    s[c] += in[c] - (u64)out[c];
+                    dst[x * ch + c] = box_mean(&div, s[c]);
+                }
+            }
+            x--;
+            continue;
+        }
+        for (c = 0; c < ch; c++) {
+            s[c] += box_at(col, x + r, width, ch, c, bm);
+            s[c] -= box_at(col, x - r - 1, width, ch, c, bm);
+            dst[x * ch + c] = box_mean(&div, s[c]);
+        }
+    }
+}
+
+static void
+box_hline(u8 *dst, const u32 *col, const BoxJob *job)
+{
+    switch (job->src->channels) {
+        case 1:  box_hline_ch(dst, col, job, 1); break;
+        case 2:  box_hline_ch(dst, col, job, 2); break;
+        case 3:  box_hline_ch(dst, col, job, 3); break;
+        default: box_hline_ch(dst, col, job, 4); break;
+    }
+}
+
+/* Source row y, NULL for a row of zeros */
+static const u8 *
+box_row(const BoxJob *job, i64 y)
+{
+    if (y < 0 || y >= job->src->height) {
+        if (job->border_mode == IMG_BORDER_ZERO_PADDING)
+            return NULL;
+        y = y < 0 ? 0 : (i64)job->src->height - 1;
+    }
+    return job->src->data + (size_t)y * job->src->stride;
+}
+
+static void
+box_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    BoxJob *job = ctx;
+    const Image *src = job->src;
+    const u8 *in, *out;
+    u32 *col, r, h, lo, hi, times;
+    size_t n, x;
+    u32 y;
+
+    r = job->r;
+    h = src->height;
+    n = (size_t)src->width * src->channels;
+    col = (u32 *)(job->scratch + id * job->scratch_len);
+
+    /* window of row y0, rows past the edges counted once per repeat */
+    memset(col, 0, n * sizeof(u32));
+    lo = y0 > r ? y0 - r : 0;
+    hi = (u32)MIN((u64)y0 + r, (u64)h - 1);
+    for (y = lo; y <= hi; y++) {
+        in = box_row(job, y);
+        for (x = 0; x < n; x++)
+            col[x] += in[x];
+    }
+    if (job->border_mode == IMG_BORDER_REPLICATE) {
+        if (r > y0) {
+            in = box_row(job, 0);
+            times = r - y0;
+            for (x = 0; x < n; x++)
+                col[x] += times * in[x];
+        }
+        if ((u64)y0 + r > h - 1) {
+            in = box_row(job, h - 1);
+            times = (u32)((u64)y0 + r - (h - 1));
+            for (x = 0; x < n; x++)
+                col[x] += times * in[x];
+        }
+    }
+
+    for (y = y0; y < y1; y++) {
+        box_hline(job->dest->data + (size_t)y * job->dest->stride, col, job);
+        if (y + 1 == y1)
+            break;
+
+        /* slide down: row y + r + 1 comes in, row y - r goes out */
+        in = box_row(job, (i64)y + r + 1);
+        out = box_row(job, (i64)y - r);
+        if (in == out)
+            continue;
+        if (in != NULL && out != NULL) {
+            for (x = 0; x < n; x++)
+                col[x] += in[x] - (u32)out[x];
+        } else if (in != NULL) {
+            for (x = 0; x < n; x++)
+                col[x] += in[x];
+        } else {
+            for (x = 0; x < n; x++)
+                col[x] -= out[x];
+        }
+    }
+}
+
+/*
+    dest = mean of the (2 * radius + 1)^2 window around every pixel, the
+    cost per pixel is the same for every radius. radius 0 copies img.
+*/
+ImgError
+img_box_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode)
+{
+    ImgError err;
+    BoxJob job;
+    Image snapshot;
+    ScratchMark mark;
+    PlaneSet ps;
+    u32 nthreads, grain;
+    u8 c;
+
+    MUST(dest      != NULL, "dest is NULL in img_box_filter");
+    MUST(img       != NULL, "img is NULL in img_box_filter");
+    MUST(img->data != NULL, "img->data is NULL in img_box_filter");
+
+    if (img->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (img->layout == IMG_LAYOUT_PLANAR) {
+        err = planes_begin(&ps, dest, img, NULL, img->width, img->height);
+        for (c = 0; err == IMG_OK && c < img->channels; c++)
+            err = img_box_filter(ps.dest[c], ps.src[c], radius, border_mode);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(IMG_OP_BOX_FILTER);
+    err = IMG_OK;
+    memset(&job, 0, sizeof(job));
+    if (radius > BOX_MAX_RADIUS || (border_mode != IMG_BORDER_ZERO_PADDING &&
+        border_mode != IMG_BORDER_REPLICATE)) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+
+    mark = scratch_mark();
+    nthreads = img_get_threads();
+    job.scratch_len = (size_t)img->width * img->channels * sizeof(u32);
+    job.scratch = scratch_alloc(nthreads * job.scratch_len);
+    if (job.scratch == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+
+    /* every output row reads 2r+1 source rows, in place needs a copy */
+    if (dest == img) {
+        err = scratch_copy(&snapshot, img);
+        if (err != IMG_OK) goto cleanup;
+        img = &snapshot;
+    } else if (dest->data == NULL || dest->width != img->width ||
+               dest->height != img->height || dest->channels != img->channels ||
+               dest->depth != IMG_DEPTH_U8 || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_pixels(dest, img->width, img->height, img->channels);
+        if (err != IMG_OK) goto cleanup;
+    }
+    dest->type = img->type;
+
+    job.src = img;
+    job.dest = dest;
+    job.r = radius;
+    job.border_mode = border_mode;
+    box_divisor(&job.div, (2 * (u64)radius + 1) * (2 * (u64)radius + 1));
+
+    /* a band starts by summing 2r+1 rows, keep bands at least that tall */
+    grain = MAX(ROW_GRAIN(img->width), (u32)MIN(2 * (u64)radius + 1, img->height));
+    img_parallel_rows(nthreads, img->height, grain, box_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+error:
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+/*
+    Integral image
+
+    ii->sum[y][x] holds the sum of every sample above and to the left of
+    (x, y), so the sum over any rectangle is four lookups whatever its size.
+    ii must be zeroed or hold an earlier result, which is reused.
+*/
+ImgError
+img_integral(IntegralImage *ii, Image *img)
+{
+    ImgError err;
+    u64 *sum, *row, *prev, acc[4];
+    const u8 *src;
+    size_t stride;
+    u32 x, y;
+    u8 c, ch;
+
+    MUST(ii        != NULL, "ii is NULL in img_integral");
+    MUST(img       != NULL, "img is NULL in img_integral");
+    MUST(img->data != NULL, "img->data is NULL in img_integral");
+
+    STATS_BEGIN(IMG_OP_INTEGRAL);
+    err = IMG_OK;
+    if (img->layout != IMG_LAYOUT_INTERLEAVED || img->depth != IMG_DEPTH_U8) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
+    }
+    ch = img->channels;
+    stride = ((size_t)img->width + 1) * ch;
+    if (stride > SIZE_MAX / sizeof(u64) / ((size_t)img->height + 1)) {
+        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
+    }
+    /* same number of sums as last time: every one of them is written again */
+    sum = ii->sum;
+    if (sum == NULL || stride * ((size_t)img->height + 1) != ii->stride * ((size_t)ii->height + 1)) {
+        sum = realloc(ii->sum, stride * ((size_t)img->height + 1) * sizeof(u64));
+        if (sum == NULL) {
+            err = IMG_ERR_MEMORY; goto error;
+        }
+    }
+    ii->sum = sum;
+    ii->width = img->width;
+    ii->height = img->height;
+    ii->channels = ch;
+    ii->stride = stride;
+
+    memset(sum, 0, stride * sizeof(u64));
+    for (y = 0; y < img->height; y++) {
+        prev = sum + (size_t)y * stride;
+        row = prev + stride;
+        src = img->data + (size_t)y * img->stride;
+        for (c = 0; c < ch; c++)
+            acc[c] = row[c] = 0;
+        for (x = 0; x < img->width; x++, src += ch) {
+            for (c = 0; c < ch; c++) {
+                acc[c] += src[c];
+                row[(size_t)(x + 1) * ch + c] = prev[(size_t)(x + 1) * ch + c] + acc[c];
+            }
+        }
+    }
+
+error:
+    STATS_END(err == IMG_OK ? (u64)img->width * img->height : 0);
+    return err;
+}
+
+/* Per channel sums of the w x h rectangle at (x, y) */
+ImgError
+img_integral_sum(const IntegralImage *ii, u32 x, u32 y, u32 w, u32 h, u64 *sum)
+{
+    const u64 *top, *bottom;
+    size_t l, r;
+    u8 c;
+
+    MUST(ii      != NULL, "ii is NULL in img_integral_sum");
+    MUST(ii->sum != NULL, "ii->sum is NULL in img_integral_sum");
+    MUST(sum     != NULL, "sum is NULL in img_integral_sum");
+
+    if (w < 1 || h < 1 || (u64)x + w > ii->width || (u64)y + h > ii->height)
+        return IMG_ERR_INVALID_PARAMETERS;
+
+    top = ii->sum + (size_t)y * ii->stride;
+    bottom = ii->sum + ((size_t)y + h) * ii->stride;
+    l = (size_t)x * ii->channels;
+    r = ((size_t)x + w) * ii->channels;
+    for (c = 0; c < ii->channels; c++)
+        sum[c] = bottom[r + c] - bottom[l + c] - top[r + c] + top[l + c];
+    return IMG_OK;
+}
+
+/* Per channel rounded mean of the w x h rectangle at (x, y) */
+ImgError
+img_integral_mean(const IntegralImage *ii, u32 x, u32 y, u32 w, u32 h, u8 *mean)
+{
+    ImgError err;
+    u64 sum[4], area;
+    u8 c;
+
+    MUST(mean != NULL, "mean is NULL in img_integral_mean");
+
+    err = img_integral_sum(ii, x, y, w, h, sum);
+    if (err != IMG_OK)
+        return err;
+    area = (u64)w * h;
+    for (c = 0; c < ii->channels; c++)
+        mean[c] = (u8)((sum[c] + area / 2) / area);
+    return IMG_OK;
+}
+
+void
+img_integral_free(IntegralImage *ii)
+{
+    MUST(ii != NULL, "ii is NULL in img_integral_free");
+
+    free(ii->sum);
+    memset(ii, 0, sizeof(*ii));
+}
+
+/*
+    Gaussian blur
+
+    Small sigma goes through img_convolve with a kernel cut at 3 sigma,
+    which it runs as a horizontal and a vertical 1-D pass. From
+    GAUSS_IIR_SIGMA on, a 3rd order recursive filter (Young and van Vliet)
+    takes over: a causal and an anticausal pass along each axis, a few
+    multiply-adds per sample whatever sigma is. Its poles are those of van
+    Vliet, Young and Verbeek scaled until the variance is sigma^2, the
+    original 1995 formula for the scale overshoots sigma by ~10%. The recursion runs over
+    several lines side by side (a block of rows horizontally, a strip of
+    columns vertically) so the inner loops vectorise. The anticausal pass
+    starts from the response of both passes to the border extension
+    (Triggs and Sdika), so the edges follow the BorderMode.
+*/
+#define GAUSS_IIR_SIGMA 4.0f    /* the FIR needs 6 sigma taps per pass from here on */
+#define GAUSS_BLOCK 8           /* rows filtered side by side horizontally */
+#define GAUSS_STRIP 256         /* columns filtered side by side vertically */
+
+typedef struct {
+    double b, a1, a2, a3;   /* y[n] = b x[n] + a1 y[n-1] + a2 y[n-2] + a3 y[n-3] */
+    double m[3][3];         /* y[N+k] = u + sum(m[k][j] * (w[N-1-j] - u)), u past the edge */
+} IirCoef;
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    BorderMode border_mode;
+    IirCoef g;
+    const ConvOps *ops;
+    float *tmp;             /* height rows of n floats */
+    size_t n;
+    float *block;           /* n * GAUSS_BLOCK floats per thread */
+    double *state;          /* 5 * state_len doubles per thread */
+    size_t state_len;
+} GaussJob;
+
+/* Complex pair and real pole of the 3rd order filter for sigma = 2 */
+static const double vyv_pole[2][2] = {
+    { 1.41650, 1.00829 },
+    { 1.86543, 0.0     }
+};
+
+/* Variance of the causal + anticausal filter with the poles raised to 1/q */
+static double
+vyv_variance(double q)
+{
+    double v, rho, th, zx, zy, ux, uy;
+    u32 k;
+
+    v = 0.0;
+    for (k = 0; k < 2; k++) {
+        rho = pow(hypot(vyv_pole[k][0], vyv_pole[k][1]), 1.0 / q);
+        th = atan2(vyv_pole[k][1], vyv_pole[k][0]) / q;
+        zx = rho * cos(th);
+        zy = rho * sin(th);
+        ux = zx - 1.0;
+        uy = zy;
+        /* 2 Re(z / (z - 1)^2), counted twice for the pair */
+        v += (k == 0 ? 4.0 : 2.0) * (zx * (ux * ux - uy * uy) + zy * 2.0 * ux * uy)
+             / ((ux * ux + uy * uy) * (ux * ux + uy * uy));
+    }
+    return v;
+}
+
+static ImgError
+iir_coef(IirCoef *g, double sigma)
+{
+    double lo, hi, q, m, phi, r3, a[3], b, *w, y[3], v;
+    ScratchMark mark;
+    size_t len, i;
+    u32 j, k;
+
+    /* the variance grows with q */
+    lo = 1e-2;
+    hi = 1e6;
+    for (i = 0; i < 100; i++) {
+        q = sqrt(lo * hi);
+        if (vyv_variance(q) < sigma * sigma)
+            lo = q;
+        else
+            hi = q;
+    }
+    q = sqrt(lo * hi);
+
+    /* 1 - a1 z^-1 - a2 z^-2 - a3 z^-3 = (1 - m e^(i phi) z^-1)(1 - m e^(-i phi) z^-1)(1 - r3 z^-1) */
+    m = pow(hypot(vyv_pole[0][0], vyv_pole[0][1]), -1.0 / q);
+    phi = atan2(vyv_pole[0][1], vyv_pole[0][0]) / q;
+    r3 = pow(vyv_pole[1][0], -1.0 / q);
+    a[0] = 2.0 * m * cos(phi) + r3;
+    a[1] = -(m * m + 2.0 * m * cos(phi) * r3);
+    a[2] = m * m * r3;
+    b = 1.0 - (a[0] + a[1] + a[2]);
+
+    /*
+        Past the edge the input stays at u, so w - u and y - u decay from
+        the last three causal outputs alone. Run both passes on a unit
+        deviation of each of them until it has died out.
+    */
+    len = (size_t)(30.0 * sigma) + 64;
+    mark = scratch_mark();
+    w = scratch_alloc((len + 3) * sizeof(double));
+    if (w == NULL)
+        return IMG_ERR_MEMORY;
+    for (j = 0; j < 3; j++) {
+        w[0] = w[1] = w[2] = 0.0;
+        w[2 - j] = 1.0;
+        for (i = 3; i < len + 3; i++)
+            w[i] = a[0] * w[i - 1] + a[1] * w[i - 2] + a[2] * w[i - 3];
+        y[0] = y[1] = y[2] = 0.0;
+        for (i = len + 2; i >= 3; i--) {
+            v = b * w[i] + a[0] * y[0] + a[1] * y[1] + a[2] * y[2];
+            y[2] = y[1];
+            y[1] = y[0];
+            y[0] = v;
+        }
+        for (k = 0; k < 3; k++)
+            g->m[k][j] = y[k];
+    }
+    scratch_release(mark);
+
+    g->b = b;
+    g->a1 = a[0];
+    g->a2 = a[1];
+    g->a3 = a[2];
+    return IMG_OK;
+}
+
+/*
+    Both passes over count positions stride floats apart, each holding
+    lanes independent samples. The feedback amplifies whatever is rounded
+    in it by up to 1/b, so the last three outputs are kept in double in
+    scratch (5 * lanes doubles) and only the stored samples are floats.
+*/
+static void
+iir_line(float *data, size_t stride, u32 count, u32 lanes, const IirCoef *coef,
+         BorderMode border_mode, double *scratch)
+{
+    const IirCoef g = *coef;
+    double *first, *last, *p1, *p2, *p3, *t, u, v1, v2, v3;
+    float *row;
+    i64 pos;
+    u32 l;
+
+    first = scratch;
+    last = first + lanes;
+    p1 = last + lanes;
+    p2 = p1 + lanes;
+    p3 = p2 + lanes;
+    for (l = 0; l < lanes; l++) {
+        first[l] = border_mode == IMG_BORDER_REPLICATE ? data[l] : 0.0;
+        last[l] = border_mode == IMG_BORDER_REPLICATE ? data[(size_t)(count - 1) * stride + l] : 0.0;
+    }
+
+    /* causal, the constant extension before the edge is its own steady state */
+    for (l = 0; l < lanes; l++)
+        p1[l] = p2[l] = p3[l] = first[l];
+    for (pos = 0; pos < count; pos++) {
+        row = data + pos * stride;
+        for (l = 0; l < lanes; l++) {
+            p3[l] = g.b * row[l] + g.a1 * p1[l] + g.a2 * p2[l] + g.a3 * p3[l];
+            row[l] = (float)p3[l];
+        }
+        t = p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = t;
+    }
+
+    /* anticausal, from the response to the extension after the edge */
+    for (l = 0; l < lanes; l++) {
+        u = last[l];
+        v1 = p1[l] - u;
+        v2 = p2[l] - u;
+        v3 = p3[l] - u;
+        p1[l] = u + g.m[0][0] * v1 + g.m[0][1] * v2 + g.m[0][2] * v3;
+        p2[l] = u + g.m[1][0] * v1 + g.m[1][1] * v2 + g.m[1][2] * v3;
+        p3[l] = u + g.m[2][0] * v1 + g.m[2][1] * v2 + g.m[2][2] * v3;
+    }
+    for (pos = (i64)count - 1; pos >= 0; pos--) {
+        row = data + pos * stride;
+        for (l = 0; l < lanes; l++) {
+            p3[l] = g.b * row[l] + g.a1 * p1[l] + g.a2 * p2[l] + g.a3 * p3[l];
+            row[l] = (float)p3[l];
+        }
+        t = p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = t;
+    }
+}
+
+/* Horizontal pass over blocks [b0, b1) of GAUSS_BLOCK rows, src -> tmp */
+static void
+gauss_hrows(void *ctx, u32 id, u32 b0, u32 b1)
+{
+    GaussJob *job = ctx;
+    const Image *src = job->src;
+    float *buf, *trow;
+    const u8 *srow;
+    u32 b, y0, rows, k;
+    size_t i;
+
+    buf = job->block + id * job->n * GAUSS_BLOCK;
+    for (b = b0; b < b1; b++) {
+        y0 = b * GAUSS_BLOCK;
+        rows = MIN(GAUSS_BLOCK, src->height - y0);
+
+        /* sample i of row k goes to buf[i * rows + k] */
+        for (k = 0; k < rows; k++) {
+            srow = src->data + (size_t)(y0 + k) * src->stride;
+            for (i = 0; i < job->n; i++)
+                buf[i * rows + k] = srow[i];
+        }
+        iir_line(buf, (size_t)src->channels * rows, src->width, src->channels * rows,
+                 &job->g, job->border_mode, job->state + id * 5 * job->state_len);
+        for (k = 0; k < rows; k++) {
+            trow = job->tmp + (size_t)(y0 + k) * job->n;
+            for (i = 0; i < job->n; i++)
+                trow[i] = buf[i * rows + k];
+        }
+    }
+}
+
+/* Vertical pass over strips [s0, s1) of GAUSS_STRIP columns, tmp -> dest */
+static void
+gauss_vrows(void *ctx, u32 id, u32 s0, u32 s1)
+{
+    GaussJob *job = ctx;
+    size_t x0;
+    u32 s, y, lanes;
+
+    for (s = s0; s < s1; s++) {
+        x0 = (size_t)s * GAUSS_STRIP;
+        lanes = (u32)MIN(GAUSS_STRIP, job->n - x0);
+        iir_line(job->tmp + x0, job->n, job->src->height, lanes, &job->g, job->border_mode,
+                 job->state + id * 5 * job->state_len);
+        for (y = 0; y < job->src->height; y++)
+            job->ops->store(job->dest->data + (size_t)y * job->dest->stride + x0,
+                            job->tmp + (size_t)y * job->n + x0, lanes);
+    }
+}
+
+/* dest = img blurred by a Gaussian of standard deviation sigma (pixels) */
+ImgError
+img_gaussian_blur(Image *dest, Image *img, float sigma, BorderMode border_mode)
+{
+    ImgError err;
+    GaussJob job;
+    Kernel kernel;
+    ScratchMark mark;
+    PlaneSet ps;
+    float g[IMG_MAX_TAPS];
+    u32 r, nthreads, nblocks, nstrips;
+    size_t i;
+    u8 c;
+
+    MUST(dest      != NULL, "dest is NULL in img_gaussian_blur");
+    MUST(img       != NULL, "img is NULL in img_gaussian_blur");
+    MUST(img->data != NULL, "img->data is NULL in img_gaussian_blur");
+
+    if (img->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (img->layout == IMG_LAYOUT_PLANAR) {
+        err = planes_begin(&ps, dest, img, NULL, img->width, img->height);
+        for (c = 0; err == IMG_OK && c < img->channels; c++)
+            err = img_gaussian_blur(ps.dest[c], ps.src[c], sigma, border_mode);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(IMG_OP_GAUSSIAN_BLUR);
+    err = IMG_OK;
+    memset(&job, 0, sizeof(job));
+    if (!(sigma > 0.0f) || (border_mode != IMG_BORDER_ZERO_PADDING &&
+        border_mode != IMG_BORDER_REPLICATE)) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+
+    mark = scratch_mark();
+    if (sigma < GAUSS_IIR_SIGMA) {
+        r = (u32)ceilf(3.0f * sigma);
+        kernel.size = 2 * r + 1;
+        kernel.data = scratch_alloc(kernel.size * kernel.size * sizeof(float));
+        if (kernel.data == NULL) {
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+        gauss_weights(g, r, sigma);
+        for (i = 0; i < kernel.size * kernel.size; i++)
+            kernel.data[i] = g[i / kernel.size] * g[i % kernel.size];
+        err = img_convolve(dest, img, &kernel, border_mode);
+        goto cleanup;
+    }
+
+    err = iir_coef(&job.g, sigma);
+    if (err != IMG_OK) goto cleanup;
+
+    nthreads = img_get_threads();
+    job.n = (size_t)img->width * img->channels;
+    job.tmp = scratch_alloc(job.n * img->height * sizeof(float));
+    job.block = scratch_alloc(nthreads * job.n * GAUSS_BLOCK * sizeof(float));
+    job.state_len = MAX(img->channels * GAUSS_BLOCK, GAUSS_STRIP);
+    job.state = scratch_alloc(nthreads * 5 * job.state_len * sizeof(double));
+    if (job.tmp == NULL || job.block == NULL || job.state == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+    job.src = img;
+    job.dest = dest;
+    job.border_mode = border_mode;
+    job.ops = conv_ops();
+
+    /* img is only read by the first pass, so dest may be img */
+    nblocks = (img->height + GAUSS_BLOCK - 1) / GAUSS_BLOCK;
+    img_parallel_rows(nthreads, nblocks, MAX(1, ROW_GRAIN(img->width) / GAUSS_BLOCK), gauss_hrows, &job);
+
+    if (dest->data == NULL || dest->width != img->width ||
+        dest->height != img->height || dest->channels != img->channels ||
+        dest->depth != IMG_DEPTH_U8 || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_pixels(dest, img->width, img->height, img->channels);
+        if (err != IMG_OK) goto cleanup;
+    }
+    dest->type = img->type;
+
+    nstrips = (u32)((job.n + GAUSS_STRIP - 1) / GAUSS_STRIP);
+    img_parallel_rows(nthreads, nstrips, 1, gauss_vrows, &job);
+
+cleanup:
+    scratch_release(mark);
+error:
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+/*
+    Rank filters
+
+    Median, minimum and maximum of the (2r+1)^2 window around every pixel.
+    Minimum and maximum are separable and run as a column pass into a
+    temporary image and a row pass out of it, both with the van Herk/Gil-
+    Werman running extremum: three comparisons per sample whatever r is.
+    3x3 and 5x5 medians push RANK_LANES samples at a time through a sorting
+    network. Larger medians keep a 256 bin histogram per column and slide
+    the window histogram along the row (Perreault and Hebert), with a 16
+    bin coarse level so only one 16 bin segment of the fine counts is
+    brought up to date per pixel. Zero padding counts the zeros in the
+    window, like img_convolve.
+*/
+#define RANK_MAX_RADIUS 0x7ffe      /* 2r+1 fits the u16 column histograms */
+#define RANK_STRIP 256              /* columns filtered side by side in the column pass */
+#define RANK_LANES 64               /* samples pushed through a network at once */
+
+typedef enum {
+    RANK_MIN,
+    RANK_MAX,
+    RANK_MEDIAN
+} RankKind;
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    u8 *tmp;                /* min/max column pass, height rows of n bytes */
+    size_t n;
+    u32 r;
+    BorderMode border_mode;
+    RankKind kind;
+    u8 *scratch;
+    size_t scratch_len;     /* bytes per thread */
+} RankJob;
+
+/* Compare-exchange pairs leaving the median of 9 in 4 and of 25 in 12 (Devillard) */
+static const u8 median9_net[][2] = {
+    {1,2},{4,5},{7,8},{0,1},{3,4},{6,7},{1,2},{4,5},{7,8},{0,3},{5,8},{4,7},
+    {3,6},{1,4},{2,5},{4,7},{4,2},{6,4},{4,2}
+};
+
+static const u8 median25_net[][2] = {
+    {0,1},{3,4},{2,4},{2,3},{6,7},{5,7},{5,6},{9,10},{8,10},{8,9},{12,13},
+    {11,13},{11,12},{15,16},{14,16},{14,15},{18,19},{17,19},{17,18},{21,22},
+    {20,22},{20,21},{23,24},{2,5},{3,6},{0,6},{0,3},{4,7},{1,7},{1,4},{11,14},
+    {8,14},{8,11},{12,15},{9,15},{9,12},{13,16},{10,16},{10,13},{20,23},
+    {17,23},{17,20},{21,24},{18,24},{18,21},{19,22},{8,17},{9,18},{0,18},
+    {0,9},{10,19},{1,19},{1,10},{11,20},{2,20},{2,11},{12,21},{3,21},{3,12},
+    {13,22},{4,22},{4,13},{14,23},{5,23},{5,14},{15,24},{6,24},{6,15},{7,16},
+    {7,19},{13,21},{15,23},{7,13},{7,15},{1,9},{3,11},{5,17},{11,17},{9,17},
+    {4,10},{6,12},{7,14},{4,6},{4,7},{12,14},{10,14},{6,7},{10,12},{6,10},
+    {6,17},{12,17},{7,17},{7,10},{12,18},{7,12},{10,18},{12,20},{10,20},
+    {10,12}
+};
+
+/* Sample i of a line count samples step bytes apart, zero for zero padding */
+static inline const u8 *
+rank_at(const u8 *line, size_t step, i64 i, u32 count, BorderMode border_mode, const u8 *zero)
+{
+    if (i < 0 || i >= count) {
+        if (border_mode == IMG_BORDER_ZERO_PADDING)
+            return zero;
+        i = i < 0 ? 0 : (i64)count - 1;
+    }
+    return line + (size_t)i * step;
+}
+
+/*
+    Running min or max of 2r+1 positions along a line of count positions,
+    each lanes samples wide. With the line padded by r on both sides, the
+    window of output i is [i, i + 2r]: the suffix of the block of w = 2r+1
+    padded positions holding i (h, one block at a time) joined with the
+    prefix of the next block up to i + 2r (g, running).
+    h holds w * lanes bytes, g and zero lanes bytes.
+*/
+static inline __attribute__((always_inline)) void
+vhgw_line(u8 *dst, size_t dstep, const u8 *src, size_t sstep, u32 count, u32 lanes,
+          const RankJob *job, u8 *h, u8 *g, const u8 *zero, const int max)
+{
+    const BorderMode bm = job->border_mode;
+    const u64 w = 2 * (u64)job->r + 1, end = (u64)count + 2 * job->r;
+    const u8 *x;
+    u8 *hb, *out;
+    u64 s, t, i;
+    u32 l;
+
+    for (t = 0; t + 1 < w; t++) {
+        x = rank_at(src, sstep, (i64)t - job->r, count, bm, zero);
+        for (l = 0; l < lanes; l++)
+            g[l] = t == 0 ? x[l] : max ? MAX(g[l], x[l]) : MIN(g[l], x[l]);
+    }
+
+    for (s = 0; s < count; s += w) {
+        for (t = MIN(s + w, end); t-- > s;) {
+            x = rank_at(src, sstep, (i64)t - job->r, count, bm, zero);
+            hb = h + (t - s) * lanes;
+            if (t + 1 == MIN(s + w, end)) {
+                memcpy(hb, x, lanes);
+                continue;
+            }
+            for (l = 0; l < lanes; l++)
+                hb[l] = max ? MAX(x[l], hb[l + lanes]) : MIN(x[l], hb[l + lanes]);
+        }
+        for (i = s; i < MIN(s + w, count); i++) {
+            /* i + 2r starts the next block when i = s + 1 */
+            x = rank_at(src, sstep, (i64)i + job->r, count, bm, zero);
+            hb = h + (i - s) * lanes;
+            out = dst + i * dstep;
+            if (i == s + 1) {
+                for (l = 0; l < lanes; l++) {
+                    g[l] = x[l];
+                    out[l] = max ? MAX(hb[l], g[l]) : MIN(hb[l], g[l]);
+                }
+            } else {
+                for (l = 0; l < lanes; l++) {
+                    g[l] = max ? MAX(g[l], x[l]) : MIN(g[l], x[l]);
+                    out[l] = max ? MAX(hb[l], g[l]) : MIN(hb[l], g[l]);
+                }
+            }
+        }
+    }
+}
+
+/* Column pass over strips [s0, s1) of RANK_STRIP columns, src -> tmp */
+static void
+minmax_cols(void *ctx, u32 id, u32 s0, u32 s1)
+{
+    RankJob *job = ctx;
+    u8 *scratch, *g, *zero, *h;
+    size_t x0;
+    u32 s, lanes;
+
+    scratch = job->scratch + id * job->scratch_len;
+    g = scratch;
+    zero = g + RANK_STRIP;
+    h = zero + RANK_STRIP;
+    memset(zero, 0, RANK_STRIP);
+    for (s = s0; s < s1; s++) {
+        x0 = (size_t)s * RANK_STRIP;
+        lanes = (u32)MIN(RANK_STRIP, job->n - x0);
+        if (job->kind == RANK_MAX)
+            vhgw_line(job->tmp + x0, job->n, job->src->data + x0, job->src->stride,
+                      job->src->height, lanes, job, h, g, zero, 1);
+        else
+            vhgw_line(job->tmp + x0, job->n, job->src->data + x0, job->src->stride,
+                      job->src->height, lanes, job, h, g, zero, 0);
+    }
+}
+
+/* One row of the row pass, inlined per channel count so lanes is a constant */
+static inline __attribute__((always_inline)) void
+minmax_row_ch(u8 *dst, const u8 *src, const RankJob *job, u8 *h, u8 *g, const u8 *zero,
+              const u8 ch)
+{
+    if (job->kind == RANK_MAX)
+        vhgw_line(dst, ch, src, ch, job->src->width, ch, job, h, g, zero, 1);
+    else
+        vhgw_line(dst, ch, src, ch, job->src->width, ch, job, h, g, zero, 0);
+}
+
+/* Row pass over rows [y0, y1), tmp -> dest */
+static void
+minmax_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    RankJob *job = ctx;
+    u8 *scratch, *g, *zero, *h, *dst;
+    const u8 *src;
+    u32 y;
+
+    scratch = job->scratch + id * job->scratch_len;
+    g = scratch;
+    zero = g + RANK_STRIP;
+    h = zero + RANK_STRIP;
+    memset(zero, 0, RANK_STRIP);
+    for (y = y0; y < y1; y++) {
+        src = job->tmp + (size_t)y * job->n;
+        dst = job->dest->data + (size_t)y * job->dest->stride;
+        switch (job->src->channels) {
+            case 1:  minmax_row_ch(dst, src, job, h, g, zero, 1); break;
+            case 2:  minmax_row_ch(dst, src, job, h, g, zero, 2); break;
+            case 3:  minmax_row_ch(dst, src, job, h, g, zero, 3); break;
+            default: minmax_row_ch(dst, src, job, h, g, zero, 4); break;
+        }
+    }
+}
+
+/* Source row y padded with r pixels on both sides into row */
+static void
+rank_pad_row(const RankJob *job, i64 y, u8 *row)
+{
+    const Image *src = job->src;
+    const u8 ch = src->channels;
+    const size_t pad = (size_t)job->r * ch;
+    const u8 *in;
+    u32 x;
+
+    if (y < 0 || y >= src->height) {
+        if (job->border_mode == IMG_BORDER_ZERO_PADDING) {
+            memset(row, 0, job->n + 2 * pad);
+            return;
+        }
+        y = y < 0 ? 0 : (i64)src->height - 1;
+    }
+    in = src->data + (size_t)y * src->stride;
+    memcpy(row + pad, in, job->n);
+    for (x = 0; x < job->r; x++) {
+        if (job->border_mode == IMG_BORDER_ZERO_PADDING) {
+            memset(row + (size_t)x * ch, 0, ch);
+            memset(row + pad + job->n + (size_t)x * ch, 0, ch);
+        } else {
+            memcpy(row + (size_t)x * ch, in, ch);
+            memcpy(row + pad + job->n + (size_t)x * ch, in + job->n - ch, ch);
+        }
+    }
+}
+
+/* 3x3 and 5x5 median, RANK_LANES samples of a row at a time through the network */
+static void
+median_net_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    RankJob *job = ctx;
+    const u32 r = job->r, w = 2 * r + 1;
+    const u8 ch = job->src->channels;
+    const u8 (*net)[2] = r == 1 ? median9_net : median25_net;
+    const u32 nnet = r == 1 ? IMG_ARR_SIZE(median9_net) : IMG_ARR_SIZE(median25_net);
+    const size_t padn = job->n + 2 * (size_t)r * ch;
+    u8 *scratch, *rows, (*v)[RANK_LANES], *a, *b, lo, *dst;
+    size_t x0, len;
+    u32 y, dy, dx, k, l;
+
+    scratch = job->scratch + id * job->scratch_len;
+    v = (u8 (*)[RANK_LANES])scratch;
+    rows = scratch + 25 * RANK_LANES;
+    memset(v, 0, 25 * RANK_LANES);   /* lanes past the last partial block */
+    for (y = y0; y < y1; y++) {
+        for (dy = 0; dy < w; dy++)
+            rank_pad_row(job, (i64)y + dy - r, rows + dy * padn);
+        dst = job->dest->data + (size_t)y * job->dest->stride;
+        for (x0 = 0; x0 < job->n; x0 += RANK_LANES) {
+            len = MIN(RANK_LANES, job->n - x0);
+            for (dy = 0; dy < w; dy++)
+                for (dx = 0; dx < w; dx++)
+                    memcpy(v[dy * w + dx], rows + dy * padn + x0 + (size_t)dx * ch, len);
+            for (k = 0; k < nnet; k++) {
+                a = v[net[k][0]];
+                b = v[net[k][1]];
+                for (l = 0; l < RANK_LANES; l++) {
+                    lo = MIN(a[l], b[l]);
+                    b[l] = MAX(a[l], b[l]);
+                    a[l] = lo;
+                }
+            }
+            memcpy(dst + x0, v[w * w / 2], len);
+        }
+    }
+}
+
+/*
+    Histograms for one band: colh[x] counts the 256 values of sample x in
+    the 2r+1 rows around the current row, colc[x] the same by v >> 4. The
+    window keeps exact coarse counts, each 16 bin fine segment catches up
+    with the columns that moved only when the median falls in it.
+*/
+static inline const u16 *
+rank_col(const u16 *hist, const u16 *zero, i64 x, u32 width, u8 ch, u32 bins,
+         BorderMode border_mode)
+{
+    if (x < 0 || x >= width) {
+        if (border_mode == IMG_BORDER_ZERO_PADDING)
+            return zero;
+        x = x < 0 ? 0 : (i64)width - 1;
+    }
+    return hist + (size_t)x * ch * bins;
+}
+
+static void
+median_hist_line(u8 *dst, const u16 *colh, const u16 *colc, const u16 *zeroh,
+                 const u16 *zeroc, const RankJob *job)
+{
+    const BorderMode bm = job->border_mode;
+    const u32 width = job->src->width;
+    const u8 ch = job->src->channels;
+    const i64 r = job->r;
+    const u32 half = (2 * job->r + 1) * (2 * job->r + 1) / 2;
+    const u16 *in, *out;
+    u32 fine[256], coarse[16], acc, below, b, k, v;
+    i64 last[16], x, xx;
+
+    memset(coarse, 0, sizeof(coarse));
+    for (xx = -r; xx <= r; xx++) {
+        in = rank_col(colc, zeroc, xx, width, ch, 16, bm);
+        for (k = 0; k < 16; k++)
+            coarse[k] += in[k];
+    }
+    for (b = 0; b < 16; b++)
+        last[b] = -2 * r - 2;       /* stale, rebuilt on first use */
+
+    for (x = 0; x < width; x++) {
+        if (x > 0) {
+            in = rank_col(colc, zeroc, x + r, width, ch, 16, bm);
+            out = rank_col(colc, zeroc, x - r - 1, width, ch, 16, bm);
+            for (k = 0; k < 16; k++)
+                coarse[k] += in[k] - (u32)out[k];
+        }
+
+        /* coarse segment holding the median, counted rather than searched */
+        acc = 0;
+        b = 0;
+        for (k = 0; k < 16; k++) {
+            acc += coarse[k];
+            b += acc <= half;
+        }
+        below = 0;
+        for (k = 0; k < 16; k++)
+            below += k < b ? coarse[k] : 0;
+
+        /* bring its fine counts from column last[b] to x */
+        if (x - last[b] > 2 * r) {
+            memset(fine + b * 16, 0, 16 * sizeof(u32));
+            for (xx = x - r; xx <= x + r; xx++) {
+                in = rank_col(colh, zeroh, xx, width, ch, 256, bm) + b * 16;
+                for (k = 0; k < 16; k++)
+                    fine[b * 16 + k] += in[k];
+            }
+        } else {
+            for (xx = last[b] + 1; xx <= x; xx++) {
+                in = rank_col(colh, zeroh, xx + r, width, ch, 256, bm) + b * 16;
+                out = rank_col(colh, zeroh, xx - r - 1, width, ch, 256, bm) + b * 16;
+                for (k = 0; k < 16; k++)
+                    fine[b * 16 + k] += in[k] - (u32)out[k];
+            }
+        }
+        last[b] = x;
+
+        acc = below;
+        v = b * 16;
+        for (k = 0; k < 16; k++) {
+            acc += fine[b * 16 + k];
+            v += acc <= half;
+        }
+        dst[x * ch] = (u8)v;
+    }
+}
+
+/* Source row y, a row of zeros for zero padding */
+static const u8 *
+rank_row(const RankJob *job, i64 y, const u8 *zero)
+{
+    return rank_at(job->src->data, job->src->stride, y, job->src->height,
+                   job->border_mode, zero);
+}
+
+static void
+median_hist_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    RankJob *job = ctx;
+    const i64 r = job->r;
+    const size_t n = job->n;
+    const u8 *in, *out;
+    u16 *colh, *colc, *zeroh, *zeroc;
+    u8 *scratch, *zero, *dst, c;
+    size_t x;
+    i64 yy;
+    u32 y;
+
+    scratch = job->scratch + id * job->scratch_len;
+    colh = (u16 *)scratch;
+    colc = colh + n * 256;
+    zeroh = colc + n * 16;
+    zeroc = zeroh + 256;
+    zero = (u8 *)(zeroc + 16);
+
+    memset(zero, 0, n);
+    memset(zeroh, 0, 256 * sizeof(u16));
+    memset(zeroc, 0, 16 * sizeof(u16));
+    zeroh[0] = zeroc[0] = (u16)(2 * r + 1);
+
+    memset(colh, 0, n * 256 * sizeof(u16));
+    memset(colc, 0, n * 16 * sizeof(u16));
+    for (yy = (i64)y0 - r; yy <= (i64)y0 + r; yy++) {
+        in = rank_row(job, yy, zero);
+        for (x = 0; x < n; x++) {
+            colh[x * 256 + in[x]]++;
+            colc[x * 16 + (in[x] >> 4)]++;
+        }
+    }
+
+    for (y = y0; y < y1; y++) {
+        dst = job->dest->data + (size_t)y * job->dest->stride;
+        for (c = 0; c < job->src->channels; c++)
+            median_hist_line(dst + c, colh + c * 256, colc + c * 16, zeroh, zeroc, job);
+        if (y + 1 == y1)
+            break;
+
+        /* slide down: row y + r + 1 comes in, row y - r goes out */
+        in = rank_row(job, (i64)y + r + 1, zero);
+        out = rank_row(job, (i64)y - r, zero);
+        if (in == out)
+            continue;
+        for (x = 0; x < n; x++) {
+            colh[x * 256 + in[x]]++;
+            colh[x * 256 + out[x]]--;
+            colc[x * 16 + (in[x] >> 4)]++;
+            colc[x * 16 + (out[x] >> 4)]--;
+        }
+    }
+}
+
+static ImgError
+rank_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode, RankKind kind, ImgOp op)
+{
+    ImgError err;
+    RankJob job;
+    Image snapshot;
+    ScratchMark mark;
+    PlaneSet ps;
+    u32 nthreads, grain, w;
+    size_t cols, rows;
+    u8 c;
+
+    if (img->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (img->layout == IMG_LAYOUT_PLANAR) {
+        err = planes_begin(&ps, dest, img, NULL, img->width, img->height);
+        for (c = 0; err == IMG_OK && c < img->channels; c++)
+            err = rank_filter(ps.dest[c], ps.src[c], radius, border_mode, kind, op);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(op);
+    err = IMG_OK;
+    memset(&job, 0, sizeof(job));
+    if (radius > RANK_MAX_RADIUS || (border_mode != IMG_BORDER_ZERO_PADDING &&
+        border_mode != IMG_BORDER_REPLICATE)) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+    if (radius == 0) {
+        if (dest != img)
+            err = img_cpy(dest, img);
+        goto error;
+    }
+
+    mark = scratch_mark();
+    nthreads = img_get_threads();
+    w = 2 * radius + 1;
+    job.src = img;
+    job.n = (size_t)img->width * img->channels;
+    job.r = radius;
+    job.border_mode = border_mode;
+    job.kind = kind;
+
+    if (kind != RANK_MEDIAN) {
+        /* h holds at most one block of the padded column or row */
+        cols = (size_t)MIN(w, (u64)img->height + 2 * radius) * RANK_STRIP;
+        rows = (size_t)MIN(w, (u64)img->width + 2 * radius) * img->channels;
+        job.scratch_len = 2 * RANK_STRIP + MAX(cols, rows);
+        job.tmp = scratch_alloc(job.n * img->height);
+    } else if (radius <= 2) {
+        job.scratch_len = 25 * RANK_LANES + w * (job.n + 2 * (size_t)radius * img->channels);
+    } else {
+        job.scratch_len = (job.n * 272 + 272) * sizeof(u16) + job.n;
+    }
+    job.scratch_len = (job.scratch_len + 63) & ~(size_t)63;
+    job.scratch = scratch_alloc(nthreads * job.scratch_len);
+    if (job.scratch == NULL || (kind != RANK_MEDIAN && job.tmp == NULL)) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+
+    if (kind != RANK_MEDIAN) {
+        /* img is only read by the column pass, so dest may be img */
+        img_parallel_rows(nthreads, (u32)((job.n + RANK_STRIP - 1) / RANK_STRIP), 1,
+                          minmax_cols, &job);
+    } else if (dest == img) {
+        /* every output row reads 2r+1 source rows, in place needs a copy */
+        err = scratch_copy(&snapshot, img);
+        if (err != IMG_OK) goto cleanup;
+        job.src = img = &snapshot;
+    }
+    if (dest->data == NULL || dest->width != img->width ||
+        dest->height != img->height || dest->channels != img->channels ||
+        dest->depth != IMG_DEPTH_U8 || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_pixels(dest, img->width, img->height, img->channels);
+        if (err != IMG_OK) goto cleanup;
+    }
+    dest->type = img->type;
+    job.dest = dest;
+
+    /* a median band starts from 2r+1 rows, keep bands at least that tall */
+    grain = MAX(ROW_GRAIN(img->width), (u32)MIN(w, img->height));
+    if (kind != RANK_MEDIAN)
+        img_parallel_rows(nthreads, img->height, ROW_GRAIN(img->width), minmax_rows, &job);
+    else if (radius <= 2)
+        img_parallel_rows(nthreads, img->height, ROW_GRAIN(img->width), median_net_rows, &job);
+    else
+        img_parallel_rows(nthreads, img->height, grain, median_hist_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+error:
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+/* dest = median of the (2 * radius + 1)^2 window around every pixel */
+ImgError
+img_median_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode)
+{
+    MUST(dest      != NULL, "dest is NULL in img_median_filter");
+    MUST(img       != NULL, "img is NULL in img_median_filter");
+    MUST(img->data != NULL, "img->data is NULL in img_median_filter");
+
+    return rank_filter(dest, img, radius, border_mode, RANK_MEDIAN, IMG_OP_MEDIAN_FILTER);
+}
+
+/* dest = minimum of the (2 * radius + 1)^2 window around every pixel (erosion) */
+ImgError
+img_min_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode)
+{
+    MUST(dest      != NULL, "dest is NULL in img_min_filter");
+    MUST(img       != NULL, "img is NULL in img_min_filter");
+    MUST(img->data != NULL, "img->data is NULL in img_min_filter");
+
+    return rank_filter(dest, img, radius, border_mode, RANK_MIN, IMG_OP_MIN_FILTER);
+}
+
+/* dest = maximum of the (2 * radius + 1)^2 window around every pixel (dilation) */
+ImgError
+img_max_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode)
+{
+    MUST(dest      != NULL, "dest is NULL in img_max_filter");
+    MUST(img       != NULL, "img is NULL in img_max_filter");
+    MUST(img->data != NULL, "img->data is NULL in img_max_filter");
+
+    return rank_filter(dest, img, radius, border_mode, RANK_MAX, IMG_OP_MAX_FILTER);
+}
+
+/* Only evaluated while building the weight tables below */
+static float
+cubic_kernel(float x)
+{
+    x = ABS(x);
+    if (x <= 1.0f)
+        return (1.5f * x - 2.5f) * x * x + 1.0f;
+    else if (x < 2.0f)
+        return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+    return 0.0f;
+}
+
+static float
+linear_kernel(float x)
+{
+    x = ABS(x);
+    return x < 1.0f ? 1.0f - x : 0.0f;
+}
+
+static float
+lanczos3_kernel(float x)
+{
+    const double pi = 3.14159265358979323846;
+    double px;
+
+    x = ABS(x);
+    if (x < 1e-6f)
+        return 1.0f;
+    if (x >= 3.0f)
+        return 0.0f;
+    px = pi * x;
+    return (float)(3.0 * sin(px) * sin(px / 3.0) / (px * px));
+}
+
+/*
+    Fixed-point filter taps for one axis: output i reads source samples
+    start[i] .. start[i] + ntaps - 1 weighted by w[i * ntaps ..], Q14,
+    summing to exactly 1 << 14. fw holds the same weights unrounded for
+    U16 and F32 images, w sits in the same block right after them.
+*/
+typedef struct {
+    u32 *start;
+    i16 *w;
+    float *fw;
+    u32 ntaps;
+} ResizeTaps;
+
+/* Taps from the heap for resize_taps_free, or from scratch memory for a single call */
+static ImgError
+resize_taps(ResizeTaps *t, u32 in, u32 out, ResizeFilter filter, int scratch)
+{
+    float (*fn)(float);
+    double scale, fscale, support, center, sum;
+    float *fw;
+    i64 lo, hi, j, best;
+    u32 i, k;
+    i32 total;
+
+    switch (filter) {
+        case IMG_RESIZE_BILINEAR: fn = linear_kernel;   support = 1.0; break;
+        case IMG_RESIZE_BICUBIC:  fn = cubic_kernel;    support = 2.0; break;
+        case IMG_RESIZE_LANCZOS3: fn = lanczos3_kernel; support = 3.0; break;
+        default: return IMG_ERR_INVALID_PARAMETERS;
+    }
+
+    /* when shrinking, stretch the filter over the source pixels one output covers */
+    scale = (double)in / out;
+    fscale = MAX(scale, 1.0);
+    support *= fscale;
+
+    t->ntaps = MIN((u32)(2 * support + 2), in);
+
+    if (scratch) {
+        t->start = scratch_alloc(out * sizeof(u32));
+        t->fw = scratch_alloc((size_t)out * t->ntaps * (sizeof(float) + sizeof(i16)));
+        if (t->start == NULL || t->fw == NULL)
+            return IMG_ERR_MEMORY;
+        memset(t->fw, 0, (size_t)out * t->ntaps * (sizeof(float) + sizeof(i16)));
+    } else {
+        t->start = malloc(out * sizeof(u32));
+        t->fw = calloc((size_t)out * t->ntaps, sizeof(float) + sizeof(i16));
+        if (t->start == NULL || t->fw == NULL) {
+            free(t->start);
+            free(t->fw);
+            return IMG_ERR_MEMORY;
+        }
+    }
+    t->w = (i16 *)(t->fw + (size_t)out * t->ntaps);
+
+    for (i = 0; i < out; i++) {
+        center = (i + 0.5) * scale;
+        lo = MAX((i64)(center - support + 0.5), 0);
+        hi = MIN((i64)(center + support + 0.5), (i64)in);
+        if (hi - lo > t->ntaps) hi = lo + t->ntaps;
+        if (hi <= lo) hi = lo + 1;
+
+        /* keep the window inside the source, weights shift along with it */
+        t->start[i] = (u32)MIN(lo, (i64)(in - t->ntaps));
+
+        /* raw kernel values go where their normalized weights will be */
+        fw = t->fw + (size_t)i * t->ntaps;
+        sum = 0.0;
+        for (j = lo; j < hi; j++) {
+            k = (u32)(j - t->start[i]);
+            fw[k] = fn((float)((j - center + 0.5) / fscale));
+            sum += fw[k];
+        }
+
+        total = 0;
+        best = lo;
+        for (j = lo; j < hi; j++) {
+            k = (u32)(j - t->start[i]);
+            if (fw[k] > fw[best - t->start[i]]) best = j;
+            t->w[i * t->ntaps + k] = (i16)FLOOR(fw[k] / sum * (1 << FIX_BITS) + 0.5);
+            total += t->w[i * t->ntaps + k];
+        }
+        for (j = lo; j < hi; j++)
+            fw[j - t->start[i]] = (float)(fw[j - t->start[i]] / sum);
+        /* rounding leftovers go to the biggest tap so flat areas stay flat */
+        t->w[i * t->ntaps + (best - t->start[i])] += (1 << FIX_BITS) - total;
+    }
+    return IMG_OK;
+}
+
+static void
+resize_taps_free(ResizeTaps *t)
+{
+    free(t->start);
+    free(t->fw);
+}
+
+/* dst[x] = sum(w[k] * row[start[x] + k]) for every channel */
+static void
+resize_hpass(u8 *dst, const u8 *src, const ResizeTaps *t, u32 width, u8 ch)
+{
+    const i16 *w;
+    const u8 *p;
+    u32 x, k;
+    i32 a0, a1, a2, a3;
+    u8 c;
+
+    for (x = 0; x < width; x++) {
+        w = t->w + x * t->ntaps;
+        p = src + t->start[x] * ch;
+        switch (ch) {
+            case 1:
+                a0 = 1 << (FIX_BITS - 1);
+                for (k = 0; k < t->ntaps; k++)
+                    a0 += w[k] * p[k];
+                dst[x] = fix_clamp(a0);
+                break;
+            case 3:
+                a0 = a1 = a2 = 1 << (FIX_BITS - 1);
+                for (k = 0; k < t->ntaps; k++, p += 3) {
+                    a0 += w[k] * p[0];
+                    a1 += w[k] * p[1];
+                    a2 += w[k] * p[2];
+                }
+                dst[3 * x + 0] = fix_clamp(a0);
+                dst[3 * x + 1] = fix_clamp(a1);
+                dst[3 * x + 2] = fix_clamp(a2);
+                break;
+            case 4:
+                a0 = a1 = a2 = a3 = 1 << (FIX_BITS - 1);
+                for (k = 0; k < t->ntaps; k++, p += 4) {
+                    a0 += w[k] * p[0];
+                    a1 += w[k] * p[1];
+                    a2 += w[k] * p[2];
+                    a3 += w[k] * p[3];
+                }
+                dst[4 * x + 0] = fix_clamp(a0);
+                dst[4 * x + 1] = fix_clamp(a1);
+                dst[4 * x + 2] = fix_clamp(a2);
+                dst[4 * x + 3] = fix_clamp(a3);
+                break;
+            default:
+                for (c = 0; c < ch; c++) {
+                    a0 = 1 << (FIX_BITS - 1);
+                    for (k = 0; k < t->ntaps; k++)
+                        a0 += w[k] * p[k * ch + c];
+                    dst[x * ch + c] = fix_clamp(a0);
+                }
+        }
+    }
+}
+
+/* dst[i] = sum(w[k] * rows[k][i]), contiguous so it vectorizes plainly */
+static void
+resize_vpass(u8 *dst, const u8 *const *rows, const i16 *w, u32 ntaps, u32 n)
+{
+    u32 i, k;
+    i32 acc;
+
+    i = 0;
+#if defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc0, acc1, acc2, acc3, a, b, wp, lo, hi;
+
+        for (; i + 16 <= n; i += 16) {
+            acc0 = acc1 = acc2 = acc3 = _mm_set1_epi32(1 << (FIX_BITS - 1));
+            /* two rows per step: interleaved 16-bit samples against a (w0, w1) pair */
+            for (k = 0; k < ntaps; k += 2) {
+                a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+                if (k + 1 < ntaps) {
+                    b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + i));
+                    wp = _mm_set1_epi32((i32)(((u32)(u16)w[k + 1] << 16) | (u16)w[k]));
+                } else {
+                    b = zero;
+                    wp = _mm_set1_epi32((u16)w[k]);
+                }
+                lo = _mm_unpacklo_epi8(a, zero);
+                hi = _mm_unpacklo_epi8(b, zero);
+                acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, hi), wp));
+                acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, hi), wp));
+                lo = _mm_unpackhi_epi8(a, zero);
+                hi = _mm_unpackhi_epi8(b, zero);
+                acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(lo, hi), wp));
+                acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(lo, hi), wp));
+            }
+            acc0 = _mm_packs_epi32(_mm_srai_epi32(acc0, FIX_BITS), _mm_srai_epi32(acc1, FIX_BITS));
+            acc2 = _mm_packs_epi32(_mm_srai_epi32(acc2, FIX_BITS), _mm_srai_epi32(acc3, FIX_BITS));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(acc0, acc2));
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        acc = 1 << (FIX_BITS - 1);
+        for (k = 0; k < ntaps; k++)
+            acc += w[k] * rows[k][i];
+        dst[i] = fix_clamp(acc);
+    }
+}
+
+/* resize_hpass on float samples with the float weights */
+static void
+resize_hpass_f(float *dst, const float *src, const ResizeTaps *t, u32 width, u8 ch)
+{
+    const float *w, *p;
+    u32 x, k;
+    float a0, a1, a2;
+    u8 c;
+
+    for (x = 0; x < width; x++) {
+        w = t->fw + x * t->ntaps;
+        p = src + t->start[x] * ch;
+        switch (ch) {
+            case 1:
+                a0 = 0.0f;
+                for (k = 0; k < t->ntaps; k++)
+                    a0 += w[k] * p[k];
+                dst[x] = a0;
+                break;
+            case 3:
+                a0 = a1 = a2 = 0.0f;
+                for (k = 0; k < t->ntaps; k++, p += 3) {
+                    a0 += w[k] * p[0];
+                    a1 += w[k] * p[1];
+                    a2 += w[k] * p[2];
+                }
+                dst[3 * x + 0] = a0;
+                dst[3 * x + 1] = a1;
+                dst[3 * x + 2] = a2;
+                break;
+#if defined(__SSE2__)
+            case 4: {
+                __m128 acc = _mm_setzero_ps();
+                for (k = 0; k < t->ntaps; k++)
+                    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(p + 4 * k)));
+                _mm_storeu_ps(dst + 4 * x, acc);
+                break;
+            }
+#endif
+            default:
+                for (c = 0; c < ch; c++) {
+                    a0 = 0.0f;
+                    for (k = 0; k < t->ntaps; k++)
+                        a0 += w[k] * p[k * ch + c];
+                    dst[x * ch + c] = a0;
+                }
+        }
+    }
+}
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    ResizeTaps tx, ty;
+    u8 *tmp;            /* horizontally resized source rows */
+    u32 tmp_stride, y0; /* tmp row 0 is source row y0 */
+    u32 *xmap;          /* nearest: source byte offset per output pixel */
+    /* U16 and F32 run in float from start to end, rounded once when stored */
+    float *ftmp;        /* tmp in float */
+    float *rows;        /* a converted source row or an output row per thread */
+    size_t rows_len;
+    const ConvOps *ops;
+    void (*store)(u8 *dst, const float *src, u32 n);
+    void *taprows;      /* ty.ntaps row pointers per thread */
+} ResizeJob;
+
+static void
+resize_hrows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ResizeJob *job = ctx;
+    u32 y;
+
+    for (y = y0; y < y1; y++)
+        resize_hpass(job->tmp + (size_t)y * job->tmp_stride,
+                     job->src->data + (size_t)(job->y0 + y) * job->src->stride,
+                     &job->tx, job->dest->width, job->src->channels);
+}
+
+static void
+resize_vrows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ResizeJob *job = ctx;
+    const u8 **rows = (const u8 **)job->taprows + (size_t)id * job->ty.ntaps;
+    u32 y, k, first;
+
+    for (y = y0; y < y1; y++) {
+        first = job->ty.start[y] - job->y0;
+        for (k = 0; k < job->ty.ntaps; k++)
+            rows[k] = job->tmp + (size_t)(first + k) * job->tmp_stride;
+        resize_vpass(job->dest->data + (size_t)y * job->dest->stride, rows,
+                     job->ty.w + y * job->ty.ntaps, job->ty.ntaps, job->tmp_stride);
+    }
+}
+
+static void
+resize_hrows_f(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ResizeJob *job = ctx;
+    const Image *src = job->src;
+    const u8 *s;
+    float *row;
+    u32 y;
+
+    row = job->rows + id * job->rows_len;
+    for (y = y0; y < y1; y++) {
+        s = src->data + (size_t)(job->y0 + y) * src->stride;
+        if (src->depth != IMG_DEPTH_F32)
+            conv_pad_row(row, s, src->depth, src->width, src->channels, 0, IMG_BORDER_ZERO_PADDING);
+        resize_hpass_f(job->ftmp + (size_t)y * job->tmp_stride,
+                       src->depth == IMG_DEPTH_F32 ? (const float *)s : row,
+                       &job->tx, job->dest->width, src->channels);
+    }
+}
+
+static void
+resize_vrows_f(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ResizeJob *job = ctx;
+    const float **rows = (const float **)job->taprows + (size_t)id * job->ty.ntaps;
+    float *acc;
+    u8 *d;
+    u32 y, k, first;
+
+    for (y = y0; y < y1; y++) {
+        first = job->ty.start[y] - job->y0;
+        for (k = 0; k < job->ty.ntaps; k++)
+            rows[k] = job->ftmp + (size_t)(first + k) * job->tmp_stride;
+        d = job->dest->data + (size_t)y * job->dest->stride;
+        /* F32 rows take the sums as they are */
+        acc = job->dest->depth == IMG_DEPTH_F32 ? (float *)d : job->rows + id * job->rows_len;
+        job->ops->vpass(acc, rows, job->tmp_stride, job->ty.fw + y * job->ty.ntaps, job->ty.ntaps);
+        if (acc != (float *)d)
+            job->store(d, acc, job->tmp_stride);
+    }
+}
+
+/* source row/column of output i when mapping n onto m samples */
+#define RESIZE_NEAREST_SRC(i, n, m) ((u32)(((u64)(i) * 2 + 1) * (n) / (2 * (u64)(m))))
+
+/* xmap and px count bytes, so any depth works */
+static void
+resize_nearest_row(u8 *d, const u8 *s, const u32 *xmap, u32 width, u8 px)
+{
+    u32 x;
+    u8 c;
+
+    for (x = 0; x < width; x++, d += px)
+        for (c = 0; c < px; c++)
+            d[c] = s[xmap[x] + c];
+}
+
+static void
+resize_nearest_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ResizeJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    u32 y;
+
+    for (y = y0; y < y1; y++)
+        resize_nearest_row(dest->data + (size_t)y * dest->stride,
+                           src->data + (size_t)RESIZE_NEAREST_SRC(y, src->height, dest->height) * src->stride,
+                           job->xmap, dest->width, dest->channels * depth_size(dest->depth));
+}
+
+/*
+    Separable resize: every output column and row gets its taps computed
+    once, then a horizontal pass over the source rows that matter and a
+    vertical pass over the result, both in 14-bit fixed point. Shrinking
+    widens the filter by the scale factor so every source pixel contributes
+    (no aliasing when going from 1920 to 320), and the tap count grows
+    with it, so any ratio works. U16 and F32 images go
+    through both passes in float instead, with the convolution's vertical
+    pass, and are only rounded when stored.
+*/
+ImgError
+img_resize_filter(Image *dest, Image *src, u32 new_width, u32 new_height, ResizeFilter filter)
+{
+    ImgError err;
+    ResizeJob job;
+    Image snapshot;
+    ScratchMark mark;
+    PlaneSet ps;
+    u32 x, y1, nthreads;
+    u8 c;
+
+    MUST(dest      != NULL, "dest is NULL in img_resize_filter");
+    MUST(src       != NULL, "src is NULL in img_resize_filter");
+    MUST(src->data != NULL, "src->data is NULL in img_resize_filter");
+
+    if (src->layout == IMG_LAYOUT_PLANAR && new_width >= 1 && new_height >= 1) {
+        err = planes_begin(&ps, dest, src, NULL, new_width, new_height);
+        for (c = 0; err == IMG_OK && c < src->channels; c++)
+            err = img_resize_filter(ps.dest[c], ps.src[c], new_width, new_height, filter);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(IMG_OP_RESIZE);
+    err = IMG_OK;
+    memset(&job, 0, sizeof(job));
+    if(new_width < 1 || new_height < 1){
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+
+    mark = scratch_mark();
+    if (dest == src) {
+        err = scratch_copy(&snapshot, src);
+        if (err != IMG_OK) goto cleanup;
+        src = &snapshot;
+    }
+    job.src = src;
+    job.dest = dest;
+    nthreads = img_get_threads();
+
+    if (filter == IMG_RESIZE_NEAREST) {
+        job.xmap = scratch_alloc(new_width * sizeof(u32));
+        if (job.xmap == NULL) {
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+        for (x = 0; x < new_width; x++)
+            job.xmap[x] = RESIZE_NEAREST_SRC(x, src->width, new_width) * src->channels * depth_size(src->depth);
+
+        err = img_realloc_depth(dest, new_width, new_height, src->channels, src->depth);
+        if (err != IMG_OK) goto cleanup;
+        dest->type = src->type;
+
+        img_parallel_rows(nthreads, new_height, ROW_GRAIN(new_width), resize_nearest_rows, &job);
+        goto cleanup;
+    }
+
+    err = resize_taps(&job.tx, src->width, new_width, filter, 1);
+    if (err != IMG_OK) goto cleanup;
+    err = resize_taps(&job.ty, src->height, new_height, filter, 1);
+    if (err != IMG_OK) goto cleanup;
+
+    /* only the source rows some output row reads */
+    job.y0 = job.ty.start[0];
+    y1 = job.ty.start[new_height - 1] + job.ty.ntaps;
+    job.tmp_stride = new_width * src->channels;
+    job.taprows = scratch_alloc((size_t)nthreads * job.ty.ntaps * sizeof(void *));
+    if (job.taprows == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+
+    if (src->depth != IMG_DEPTH_U8) {
+        job.ftmp = scratch_alloc((size_t)(y1 - job.y0) * job.tmp_stride * sizeof(float));
+        job.rows_len = MAX(src->width, new_width) * (size_t)src->channels;
+        job.rows = scratch_alloc(nthreads * job.rows_len * sizeof(float));
+        if (job.ftmp == NULL || job.rows == NULL) {
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+        job.ops = conv_ops();
+        job.store = src->depth == IMG_DEPTH_U16 ? store_u16 : store_f32;
+
+        err = img_realloc_depth(dest, new_width, new_height, src->channels, src->depth);
+        if (err != IMG_OK) goto cleanup;
+        dest->type = src->type;
+
+        img_parallel_rows(nthreads, y1 - job.y0, ROW_GRAIN((u64)new_width * job.tx.ntaps), resize_hrows_f, &job);
+        img_parallel_rows(nthreads, new_height, ROW_GRAIN((u64)new_width * job.ty.ntaps), resize_vrows_f, &job);
+        goto cleanup;
+    }
+
+    job.tmp = scratch_alloc((size_t)(y1 - job.y0) * job.tmp_stride);
+    if (job.tmp == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+
+    err = img_realloc_pixels(dest, new_width, new_height, src->channels);
+    if (err != IMG_OK) goto cleanup;
+    dest->type = src->type;
+
+    img_parallel_rows(nthreads, y1 - job.y0, ROW_GRAIN((u64)new_width * job.tx.ntaps), resize_hrows, &job);
+    img_parallel_rows(nthreads, new_height, ROW_GRAIN((u64)new_width * job.ty.ntaps), resize_vrows, &job);
+
+cleanup:
+    scratch_release(mark);
+error:
+    STATS_END(err == IMG_OK ? (u64)new_width * new_height : 0);
+    return err;
+}
+
+ImgError
+img_resize(Image *dest, Image *src, u32 new_width, u32 new_height)
+{
+    return img_resize_filter(dest, src, new_width, new_height, IMG_RESIZE_BICUBIC);
+}
+
+/*
+    Affine warps
+
+    Every output pixel (x, y) reads the source around Minv (x, y), Minv
+    being the inverse of the caller's matrix. Minv is applied incrementally:
+    per-column tables hold its x terms and every row adds its y and constant
+    terms once, all in WARP_BITS fixed point, so locating a pixel costs two
+    integer adds. The fraction picks one of WARP_TAB x WARP_TAB subpixel
+    positions, whose n x n weights are built from the resize kernels once
+    per call and summed in FIX_BITS fixed point.
+*/
+
+#define WARP_BITS     10
+#define WARP_TAB_BITS 5
+#define WARP_TAB      (1 << WARP_TAB_BITS)
+#define WARP_FIX_MAX  ((double)((i64)1 << 52))
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    BorderMode border;
+    u32 n;              /* taps per axis: 1, 2, 4 or 6 */
+    double m[6];        /* destination to source */
+    i64 bias;           /* rounds to the nearest pixel or subpixel position */
+    const i64 *ax, *ay; /* source x / y offset of every output column */
+    const i16 *w;       /* n * n weights per subpixel position, row-major */
+    int simd;           /* warp_row_avx2 handles the rows */
+} WarpJob;
+
+static inline i64
+warp_fix(double v)
+{
+    v *= 1 << WARP_BITS;
+    v = v < -WARP_FIX_MAX ? -WARP_FIX_MAX : v > WARP_FIX_MAX ? WARP_FIX_MAX : v;
+    return (i64)floor(v + 0.5);
+}
+
+/*
+    Weights for every (fy, fx) subpixel pair: the product of the 1-D kernel
+    taps, rounded and corrected so each set sums to exactly 1 << FIX_BITS.
+*/
+static void
+warp_weights(i16 *w, u32 n, ResizeFilter filter)
+{
+    float (*fn)(float);
+    double t[WARP_TAB][6], sum, f;
+    u32 fx, fy, j, k, best;
+    i32 total;
+    i16 *p;
+
+    fn = filter == IMG_RESIZE_BILINEAR ? linear_kernel :
+         filter == IMG_RESIZE_BICUBIC  ? cubic_kernel  : lanczos3_kernel;
+    for (fx = 0; fx < WARP_TAB; fx++) {
+        f = (double)fx / WARP_TAB;
+        sum = 0.0;
+        for (k = 0; k < n; k++)
+            sum += t[fx][k] = fn((float)(f + n / 2 - 1 - k));
+        for (k = 0; k < n; k++)
+            t[fx][k] /= sum;
+    }
+
+    for (fy = 0; fy < WARP_TAB; fy++) {
+        for (fx = 0; fx < WARP_TAB; fx++) {
+            p = w + (fy * WARP_TAB + fx) * n * n;
+            total = 0;
+            best = 0;
+            for (j = 0; j < n; j++) {
+                for (k = 0; k < n; k++) {
+                    p[j * n + k] = (i16)floor(t[fy][j] * t[fx][k] * (1 << FIX_BITS) + 0.5);
+                    total += p[j * n + k];
+                    if (p[j * n + k] > p[best]) best = j * n + k;
+                }
+            }
+            p[best] += (1 << FIX_BITS) - total;
+        }
+    }
+}
+
+/* Taps partly or fully outside the source, clamped or read as zero */
+static void
+warp_sample_border(u8 *d, const Image *src, i64 ix, i64 iy, const i16 *w, u32 n, BorderMode border)
+{
+    i32 acc[4];
+    i64 sx, sy;
+    u32 j, k;
+    u8 c, ch;
+    const u8 *p;
+
+    ch = src->channels;
+    if (border == IMG_BORDER_ZERO_PADDING &&
+        (ix + n <= 0 || iy + n <= 0 || ix >= src->width || iy >= src->height)) {
+        memset(d, 0, ch);
+        return;
+    }
+
+    for (c = 0; c < ch; c++)
+        acc[c] = 1 << (FIX_BITS - 1);
+    for (j = 0; j < n; j++) {
+        sy = iy + j;
+        if (sy < 0 || sy >= src->height) {
+            if (border == IMG_BORDER_ZERO_PADDING) continue;
+            sy = sy < 0 ? 0 : src->height - 1;
+        }
+        for (k = 0; k < n; k++) {
+            sx = ix + k;
+            if (sx < 0 || sx >= src->width) {
+                if (border == IMG_BORDER_ZERO_PADDING) continue;
+                sx = sx < 0 ? 0 : src->width - 1;
+            }
+            p = src->data + (size_t)sy * src->stride + (size_t)sx * ch;
+            for (c = 0; c < ch; c++)
+                acc[c] += w[j * n + k] * p[c];
+        }
+    }
+    for (c = 0; c < ch; c++)
+        d[c] = fix_clamp(acc[c]);
+}
+
+/* One output pixel, n and ch are constants at every call site so the tap loops unroll */
+static inline void
+warp_px(u8 *d, const WarpJob *job, i64 sx, i64 sy, u32 n, u8 ch)
+{
+    const Image *src = job->src;
+    const u8 *row, *p;
+    const i16 *w;
+    i64 ix, iy;
+    i32 acc;
+    u32 j, k;
+    u8 c;
+
+    ix = (sx >> WARP_BITS) - (i64)(n / 2 - 1);
+    iy = (sy >> WARP_BITS) - (i64)(n / 2 - 1);
+    w = job->w + (((sy >> (WARP_BITS - WARP_TAB_BITS)) & (WARP_TAB - 1)) * WARP_TAB +
+                  ((sx >> (WARP_BITS - WARP_TAB_BITS)) & (WARP_TAB - 1))) * n * n;
+
+    if (ix < 0 || iy < 0 || ix + n > src->width || iy + n > src->height) {
+        warp_sample_border(d, src, ix, iy, w, n, job->border);
+        return;
+    }
+    row = src->data + (size_t)iy * src->stride + (size_t)ix * ch;
+    for (c = 0; c < ch; c++) {
+        acc = 1 << (FIX_BITS - 1);
+        for (j = 0, p = row + c; j < n; j++, p += src->stride)
+            for (k = 0; k < n; k++)
+                acc += w[j * n + k] * p[k * ch];
+        d[c] = fix_clamp(acc);
+    }
+}
+
+static inline void
+warp_nearest_px(u8 *d, const WarpJob *job, i64 sx, i64 sy, u8 ch)
+{
+    const Image *src = job->src;
+    const u8 *p;
+    i64 ix, iy;
+    u8 c;
+
+    ix = sx >> WARP_BITS;
+    iy = sy >> WARP_BITS;
+    if (ix < 0 || iy < 0 || ix >= src->width || iy >= src->height) {
+        if (job->border == IMG_BORDER_ZERO_PADDING) {
+            memset(d, 0, ch);
+            return;
+        }
+        ix = ix < 0 ? 0 : ix >= src->width ? src->width - 1 : ix;
+        iy = iy < 0 ? 0 : iy >= src->height ? src->height - 1 : iy;
+    }
+    p = src->data + (size_t)iy * src->stride + (size_t)ix * ch;
+    for (c = 0; c < ch; c++)
+        d[c] = p[c];
+}
+
+static inline void
+warp_row(u8 *d, const WarpJob *job, i64 bx, i64 by, u32 n, u8 ch)
+{
+    u32 x, width;
+
+    width = job->dest->width;
+    for (x = 0; x < width; x++, d += ch) {
+        if (n == 1)
+            warp_nearest_px(d, job, bx + job->ax[x], by + job->ay[x], ch);
+        else
+            warp_px(d, job, bx + job->ax[x], by + job->ay[x], n, ch);
+    }
+}
+
+#if IMG_X86_DISPATCH
+/* low halves of the 64-bit lanes of lo and hi, in order */
+__attribute__((target("avx2"))) static inline __m256i
+warp_narrow(__m256i lo, __m256i hi)
+{
+    const __m256i idx = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(
+               _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(lo, idx))),
+               _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(hi, idx)), 1);
+}
+
+/* every 64-bit lane of lo and hi in [0, lim) */
+__attribute__((target("avx2"))) static inline int
+warp_inside(__m256i lo, __m256i hi, __m256i lim)
+{
+    const __m256i neg = _mm256_set1_epi64x(-1);
+    __m256i ok;
+
+    ok = _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi64(lo, neg), _mm256_cmpgt_epi64(lim, lo)),
+                          _mm256_and_si256(_mm256_cmpgt_epi64(hi, neg), _mm256_cmpgt_epi64(lim, hi)));
+    return _mm256_movemask_epi8(ok) == -1;
+}
+
+/*
+    Nearest and bilinear on one channel, 8 pixels at a time. A 32-bit
+    gather at a tap brings its right-hand neighbour along, so two gathers
+    fetch all four bilinear taps. The weights (32 - fx) (32 - fy), ... are
+    the ones in the table divided by 16, so the result is the same as the
+    scalar path's. Blocks reaching within 4 bytes of a row end, where the
+    gathers would read past the pixels, go through the scalar path.
+*/
+__attribute__((target("avx2"))) static void
+warp_row_avx2(u8 *d, const WarpJob *job, i64 bx, i64 by)
+{
+    const Image *src = job->src;
+    const int *base = (const int *)src->data;
+    const __m256i idx = _mm256_setr_epi32(0, 4, 0, 4, 0, 4, 0, 4);
+    const __m256i lo8 = _mm256_set1_epi32(0xFF), hi8 = _mm256_set1_epi32(0xFF0000);
+    const __m256i frac = _mm256_set1_epi32(WARP_TAB - 1), one = _mm256_set1_epi32(WARP_TAB);
+    const __m256i half = _mm256_set1_epi32(1 << (2 * WARP_TAB_BITS - 1));
+    __m256i vbx, vby, limx, limy, stride, sxl, sxh, syl, syh, sx, sy, off, g0, g1, fx, fy, v;
+    u32 x, k, n, width;
+    i64 maxx;
+
+    n = job->n;
+    width = job->dest->width;
+    maxx = MIN((i64)src->width - (n - 1), (i64)src->stride - 3);
+    vbx = _mm256_set1_epi64x(bx);
+    vby = _mm256_set1_epi64x(by);
+    limx = _mm256_set1_epi64x(maxx << WARP_BITS);
+    limy = _mm256_set1_epi64x(((i64)src->height - (n - 1)) << WARP_BITS);
+    stride = _mm256_set1_epi32((i32)src->stride);
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        sxl = _mm256_add_epi64(vbx, _mm256_loadu_si256((const __m256i *)(job->ax + x)));
+        sxh = _mm256_add_epi64(vbx, _mm256_loadu_si256((const __m256i *)(job->ax + x + 4)));
+        syl = _mm256_add_epi64(vby, _mm256_loadu_si256((const __m256i *)(job->ay + x)));
+        syh = _mm256_add_epi64(vby, _mm256_loadu_si256((const __m256i *)(job->ay + x + 4)));
+        if (maxx <= 0 || !warp_inside(sxl, sxh, limx) || !warp_inside(syl, syh, limy)) {
+            for (k = x; k < x + 8; k++) {
+                if (n == 1) warp_nearest_px(d + k, job, bx + job->ax[k], by + job->ay[k], 1);
+                else        warp_px(d + k, job, bx + job->ax[k], by + job->ay[k], 2, 1);
+            }
+            continue;
+        }
+
+        sx = warp_narrow(sxl, sxh);
+        sy = warp_narrow(syl, syh);
+        off = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(sy, WARP_BITS), stride),
+                               _mm256_srai_epi32(sx, WARP_BITS));
+        g0 = _mm256_i32gather_epi32(base, off, 1);
+        if (n == 1) {
+            v = _mm256_and_si256(g0, lo8);
+        } else {
+            g1 = _mm256_i32gather_epi32(base, _mm256_add_epi32(off, stride), 1);
+            fx = _mm256_and_si256(_mm256_srai_epi32(sx, WARP_BITS - WARP_TAB_BITS), frac);
+            fy = _mm256_and_si256(_mm256_srai_epi32(sy, WARP_BITS - WARP_TAB_BITS), frac);
+            fx = _mm256_or_si256(_mm256_sub_epi32(one, fx), _mm256_slli_epi32(fx, 16));
+            fy = _mm256_or_si256(_mm256_sub_epi32(one, fy), _mm256_slli_epi32(fy, 16));
+
+            /* (left, right) word pairs per row, then (top, bottom) */
+            g0 = _mm256_madd_epi16(_mm256_or_si256(_mm256_and_si256(g0, lo8),
+                                                   _mm256_and_si256(_mm256_slli_epi32(g0, 8), hi8)), fx);
+            g1 = _mm256_madd_epi16(_mm256_or_si256(_mm256_and_si256(g1, lo8),
+                                                   _mm256_and_si256(_mm256_slli_epi32(g1, 8), hi8)), fx);
+            v = _mm256_madd_epi16(_mm256_or_si256(g0, _mm256_slli_epi32(g1, 16)), fy);
+            v = _mm256_srai_epi32(_mm256_add_epi32(v, half), 2 * WARP_TAB_BITS);
+        }
+        v = _mm256_packus_epi16(_mm256_packus_epi32(v, v), v);
+        _mm_storel_epi64((__m128i *)(d + x),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, idx)));
+    }
+    for (; x < width; x++) {
+        if (n == 1) warp_nearest_px(d + x, job, bx + job->ax[x], by + job->ay[x], 1);
+        else        warp_px(d + x, job, bx + job->ax[x], by + job->ay[x], 2, 1);
+    }
+}
+#endif
+
+static void
+warp_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    WarpJob *job = ctx;
+    u8 *d;
+    i64 bx, by;
+    u32 y;
+
+    (void)id;
+    for (y = y0; y < y1; y++) {
+        d = job->dest->data + (size_t)y * job->dest->stride;
+        bx = warp_fix(job->m[1] * y + job->m[2]) + job->bias;
+        by = warp_fix(job->m[4] * y + job->m[5]) + job->bias;
+#if IMG_X86_DISPATCH
+        if (job->simd) {
+            warp_row_avx2(d, job, bx, by);
+            continue;
+        }
+#endif
+        switch (job->n * 8 + job->src->channels) {
+#define WARP_CASE(n, ch) \
+            case (n) * 8 + (ch): warp_row(d, job, bx, by, n, ch); break;
+            WARP_CASE(1, 1) WARP_CASE(1, 2) WARP_CASE(1, 3) WARP_CASE(1, 4)
+            WARP_CASE(2, 1) WARP_CASE(2, 2) WARP_CASE(2, 3) WARP_CASE(2, 4)
+            WARP_CASE(4, 1) WARP_CASE(4, 2) WARP_CASE(4, 3) WARP_CASE(4, 4)
+            WARP_CASE(6, 1) WARP_CASE(6, 2) WARP_CASE(6, 3) WARP_CASE(6, 4)
+#undef WARP_CASE
+        }
+    }
+}
+
+/* inv maps destination pixels to source coordinates */
+static ImgError
+warp_affine(Image *dest, Image *src, const double inv[6], u32 width, u32 height,
+            ResizeFilter filter, BorderMode border_mode)
+{
+    ImgError err;
+    WarpJob job;
+    Image snapshot;
+    ScratchMark mark;
+    PlaneSet ps;
+    i64 *ax, *ay;
+    i16 *w;
+    u32 x;
+    u8 c;
+
+    if (src->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (src->layout == IMG_LAYOUT_PLANAR && width >= 1 && height >= 1) {
+        err = planes_begin(&ps, dest, src, NULL, width, height);
+        for (c = 0; err == IMG_OK && c < src->channels; c++)
+            err = warp_affine(ps.dest[c], ps.src[c], inv, width, height, filter, border_mode);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(IMG_OP_WARP_AFFINE);
+    err = IMG_OK;
+    memset(&job, 0, sizeof(job));
+    if (width < 1 || height < 1 ||
+        (border_mode != IMG_BORDER_ZERO_PADDING && border_mode != IMG_BORDER_REPLICATE)) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+    switch (filter) {
+        case IMG_RESIZE_NEAREST:  job.n = 1; break;
+        case IMG_RESIZE_BILINEAR: job.n = 2; break;
+        case IMG_RESIZE_BICUBIC:  job.n = 4; break;
+        case IMG_RESIZE_LANCZOS3: job.n = 6; break;
+        default:
+            err = IMG_ERR_INVALID_PARAMETERS; goto error;
+    }
+
+    mark = scratch_mark();
+    if (dest == src) {
+        err = scratch_copy(&snapshot, src);
+        if (err != IMG_OK) goto cleanup;
+        src = &snapshot;
+    }
+
+    ax = scratch_alloc((size_t)width * 2 * sizeof(i64));
+    w = job.n > 1 ? scratch_alloc((size_t)WARP_TAB * WARP_TAB * job.n * job.n * sizeof(i16)) : NULL;
+    if (ax == NULL || (job.n > 1 && w == NULL)) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+    ay = ax + width;
+    for (x = 0; x < width; x++) {
+        ax[x] = warp_fix(inv[0] * x);
+        ay[x] = warp_fix(inv[3] * x);
+    }
+    if (job.n > 1)
+        warp_weights(w, job.n, filter);
+
+    err = img_realloc_pixels(dest, width, height, src->channels);
+    if (err != IMG_OK) goto cleanup;
+    dest->type = src->type;
+
+    job.src = src;
+    job.dest = dest;
+    job.border = border_mode;
+    memcpy(job.m, inv, sizeof(job.m));
+    job.bias = job.n == 1 ? 1 << (WARP_BITS - 1) : 1 << (WARP_BITS - WARP_TAB_BITS - 1);
+    job.ax = ax;
+    job.ay = ay;
+    job.w = w;
+#if IMG_X86_DISPATCH
+    /* the gathers take 32-bit byte offsets, coordinates have to fit 32 bits too */
+    job.simd = src->channels == 1 && job.n <= 2 && (u64)src->stride * src->height < ((u64)1 << 31) &&
+               src->stride < (1u << (31 - WARP_BITS)) && src->height < (1u << (31 - WARP_BITS)) &&
+               __builtin_cpu_supports("avx2");
+#endif
+    img_parallel_rows(img_get_threads(), height, ROW_GRAIN((u64)width * job.n * job.n), warp_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+error:
+    STATS_END(err == IMG_OK ? (u64)width * height : 0);
+    return err;
+}
+
+/*
+    dest (width x height) = src moved by the affine matrix, which takes a
+    source pixel (x, y) to (m[0] x + m[1] y + m[2], m[3] x + m[4] y + m[5])
+    in dest. Pixel centers sit at integer coordinates. Output pixels that
+    come from outside src follow border_mode.
+*/
+ImgError
+img_warp_affine(Image *dest, Image *src, const float matrix[6], u32 width, u32 height,
+                ResizeFilter filter, BorderMode border_mode)
+{
+    double m[6], inv[6], det;
+    u32 i;
+
+    MUST(dest      != NULL, "dest is NULL in img_warp_affine");
+    MUST(src       != NULL, "src is NULL in img_warp_affine");
+    MUST(src->data != NULL, "src->data is NULL in img_warp_affine");
+    MUST(matrix    != NULL, "matrix is NULL in img_warp_affine");
+
+    for (i = 0; i < 6; i++)
+        m[i] = matrix[i];
+    det = m[0] * m[4] - m[1] * m[3];
+    if (!isfinite(det) || det == 0.0)
+        return IMG_ERR_INVALID_PARAMETERS;
+
+    inv[0] =  m[4] / det;
+    inv[1] = -m[1] / det;
+    inv[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+    inv[3] = -m[3] / det;
+    inv[4] =  m[0] / det;
+    inv[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+    return warp_affine(dest, src, inv, width, height, filter, border_mode);
+}
+
+/*
+    dest = src rotated counter-clockwise by angle degrees about its center,
+    same size as src. Corners that come from outside follow border_mode.
+*/
+ImgError
+img_rotate(Image *dest, Image *src, float angle, ResizeFilter filter, BorderMode border_mode)
+{
+    const double pi = 3.14159265358979323846;
+    double inv[6], c, s, cx, cy;
+
+    MUST(dest      != NULL, "dest is NULL in img_rotate");
+    MUST(src       != NULL, "src is NULL in img_rotate");
+    MUST(src->data != NULL, "src->data is NULL in img_rotate");
+
+    if (!isfinite(angle))
+        return IMG_ERR_INVALID_PARAMETERS;
+
+    /* exact for multiples of 90 degrees, y points down */
+    angle = fmodf(angle, 360.0f);
+    c = cos(angle * pi / 180.0);
+    s = sin(angle * pi / 180.0);
+    if (fmodf(angle, 90.0f) == 0.0f) {
+        c = (double)(i32)floor(c + 0.5);
+        s = (double)(i32)floor(s + 0.5);
+    }
+    cx = (src->width - 1) / 2.0;
+    cy = (src->height - 1) / 2.0;
+
+    /* inverse rotation: destination back to source */
+    inv[0] = c;  inv[1] = -s; inv[2] = cx - c * cx + s * cy;
+    inv[3] = s;  inv[4] = c;  inv[5] = cy - s * cx - c * cy;
+    return warp_affine(dest, src, inv, src->width, src->height, filter, border_mode);
+}
+
+/*
+    Orthogonal transforms
+
+    Flips move whole rows or reverse the pixels within a row, which works
+    in place with one spare row per thread. Transposing ones (transpose,
+    quarter turns) walk the destination in ORIENT_TILE square tiles so the
+    source lines a tile reads stay in cache, and move 8 x 8 blocks at a
+    time: bytes and 2-byte pixels with SSE2 unpacks, 4-byte pixels as four
+    4 x 4 dword transposes, 3-byte pixels the same way after SSSE3 shuffles
+    widen them to 4 bytes.
+*/
+
+#define ORIENT_TILE  64
+#define ORIENT_BLOCK 8
+
+/* dest row j pixel i = src row i pixel j, for i < bw, j < bh; steps may be negative */
+typedef void (*BlockFn)(u8 *d, ssize_t dstep, const u8 *s, ssize_t sstep);
+
+static void
+transpose_block(u8 *d, ssize_t dstep, const u8 *s, ssize_t sstep, u8 ch, u32 bw, u32 bh)
+{
+    u32 i, j;
+    u8 c;
+
+    for (j = 0; j < bh; j++, d += dstep)
+        for (i = 0; i < bw; i++)
+            for (c = 0; c < ch; c++)
+                d[i * ch + c] = s[i * sstep + j * ch + c];
+}
+
+#if defined(__SSE2__)
+static void
+block8_u8(u8 *d, ssize_t dstep, const u8 *s, ssize_t sstep)
+{
+    __m128i t0, t1, t2, t3, u0, u1, u2, u3, v[4];
+    u32 j;
+
+#define ROW(i) _mm_loadl_epi64((const __m128i *)(s + (i) * sstep))
+    t0 = _mm_unpacklo_epi8(ROW(0), ROW(1));
+    t1 = _mm_unpacklo_epi8(ROW(2), ROW(3));
+    t2 = _mm_unpacklo_epi8(ROW(4), ROW(5));
+    t3 = _mm_unpacklo_epi8(ROW(6), ROW(7));
+#undef ROW
+    u0 = _mm_unpacklo_epi16(t0, t1);
+    u1 = _mm_unpackhi_epi16(t0, t1);
+    u2 = _mm_unpacklo_epi16(t2, t3);
+    u3 = _mm_unpackhi_epi16(t2, t3);
+    v[0] = _mm_unpacklo_epi32(u0, u2);
+    v[1] = _mm_unpackhi_epi32(u0, u2);
+    v[2] = _mm_unpacklo_epi32(u1, u3);
+    v[3] = _mm_unpackhi_epi32(u1, u3);
+    for (j = 0; j < 4; j++, d += 2 * dstep) {
+        _mm_storel_epi64((__m128i *)d, v[j]);
+        _mm_storel_epi64((__m128i *)(d + dstep), _mm_unpackhi_epi64(v[j], v[j]));
+    }
+}
+
+static void
+block8_u16(u8 *d, ssize_t dstep, const u8 *s, ssize_t sstep)
+{
+    __m128i r[8], t[8], u[8];
+    u32 i;
+
+    for (i = 0; i < 8; i++)
+        r[i] = _mm_loadu_si128((const __m128i *)(s + i * sstep));
+    for (i = 0; i < 8; i += 2) {
+        t[i]     = _mm_unpacklo_epi16(r[i], r[i + 1]);
+        t[i + 1] = _mm_unpackhi_epi16(r[i], r[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+        u[i]     = _mm_unpacklo_epi32(t[i], t[i + 2]);
+        u[i + 1] = _mm_unpackhi_epi32(t[i], t[i + 2]);
+        u[i + 2] = _mm_unpacklo_epi32(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm_unpackhi_epi32(t[i + 1], t[i + 3]);
+    }
+    for (i = 0; i < 4; i++, d += 2 * dstep) {
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi64(u[i], u[i + 4]));
+        _mm_storeu_si128((__m128i *)(d + dstep), _mm_unpackhi_epi64(u[i], u[i + 4]));
+    }
+}
+
+/* 4 x 4 dwords, r[i] becomes column i */
+static inline void
+transpose4_u32(__m128i *r)
+{
+    __m128i t0, t1, t2, t3;
+
+    t0 = _mm_unpacklo_epi32(r[0], r[1]);
+    t1 = _mm_unpacklo_epi32(r[2], r[3]);
+    t2 = _mm_unpackhi_epi32(r[0], r[1]);
+    t3 = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(t0, t1);
+    r[1] = _mm_unpackhi_epi64(t0, t1);
+    r[2] = _mm_unpacklo_epi64(t2, t3);
+    r[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static void
+block8_u32(u8 *d, ssize_t dstep, const u8 *s, ssize_t sstep)
+{
+    __m128i r[4];
+    u32 bi, bj, i;
+
+    for (bi = 0; bi < 8; bi += 4) {
+        for (bj = 0; bj < 8; bj += 4) {
+            for (i = 0; i < 4; i++)
+                r[i] = _mm_loadu_si128((const __m128i *)(s + (bi + i) * sstep + bj * 4));
+            transpose4_u32(r);
+            for (i = 0; i < 4; i++)
+                _mm_storeu_si128((__m128i *)(d + (bj + i) * dstep + bi * 4), r[i]);
+        }
+    }
+}
+#endif
+
+#if IMG_X86_DISPATCH
+/* 4 x 4 pixels of 3 bytes, rows are read and written as 8 + 4 bytes so nothing past them is touched */
+__attribute__((target("ssse3"))) static void
+block8_rgb_ssse3(u8 *d, ssize_t dstep, const u8 *s, ssize_t sstep)
+{
+    const __m128i widen  = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i narrow = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    __m128i r[4];
+    const u8 *p;
+    u32 bi, bj, i, tail;
+    u8 *q;
+
+    for (bi = 0; bi < 8; bi += 4) {
+        for (bj = 0; bj < 8; bj += 4) {
+            for (i = 0; i < 4; i++) {
+                p = s + (bi + i) * sstep + bj * 3;
+                memcpy(&tail, p + 8, 4);
+                r[i] = _mm_shuffle_epi8(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p),
+                                                           _mm_cvtsi32_si128((int)tail)), widen);
+            }
+            transpose4_u32(r);
+            for (i = 0; i < 4; i++) {
+                q = d + (bj + i) * dstep + bi * 3;
+                r[i] = _mm_shuffle_epi8(r[i], narrow);
+                _mm_storel_epi64((__m128i *)q, r[i]);
+                tail = (u32)_mm_cvtsi128_si32(_mm_srli_si128(r[i], 8));
+                memcpy(q + 8, &tail, 4);
+            }
+        }
+    }
+}
+#endif
+
+static BlockFn
+block_fn(u8 ch)
+{
+#if defined(__SSE2__)
+    if (ch == 1) return block8_u8;
+    if (ch == 2) return block8_u16;
+    if (ch == 4) return block8_u32;
+#endif
+#if IMG_X86_DISPATCH
+    if (ch == 3 && __builtin_cpu_supports("ssse3")) return block8_rgb_ssse3;
+#endif
+    return NULL;
+}
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    int rev_x;          /* destination rows read source rows bottom up */
+    int rev_y;          /* destination rows come from source columns right to left */
+    BlockFn block;
+} TransposeJob;
+
+/* dest(x, y) = src(rev_y ? W - 1 - y : y, rev_x ? H - 1 - x : x) */
+static void
+transpose_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    TransposeJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    const u8 *s;
+    u8 *d;
+    ssize_t dstep, sstep;
+    u32 tx, ty, x, y, bw, bh, col, tw, th;
+    u8 ch;
+
+    (void)id;
+    ch = src->channels;
+    for (ty = y0; ty < y1; ty += ORIENT_TILE) {
+        th = MIN(ORIENT_TILE, y1 - ty);
+        for (tx = 0; tx < dest->width; tx += ORIENT_TILE) {
+            tw = MIN(ORIENT_TILE, dest->width - tx);
+            for (y = ty; y < ty + th; y += ORIENT_BLOCK) {
+                bh = MIN(ORIENT_BLOCK, ty + th - y);
+                if (job->rev_y) {
+                    d = dest->data + (size_t)(y + bh - 1) * dest->stride;
+                    dstep = -(ssize_t)dest->stride;
+                    col = src->width - y - bh;
+                } else {
+                    d = dest->data + (size_t)y * dest->stride;
+                    dstep = dest->stride;
+                    col = y;
+                }
+                for (x = tx; x < tx + tw; x += ORIENT_BLOCK) {
+                    bw = MIN(ORIENT_BLOCK, tx + tw - x);
+                    if (job->rev_x) {
+                        s = src->data + (size_t)(src->height - 1 - x) * src->stride + (size_t)col * ch;
+                        sstep = -(ssize_t)src->stride;
+                    } else {
+                        s = src->data + (size_t)x * src->stride + (size_t)col * ch;
+                        sstep = src->stride;
+                    }
+                    if (job->block != NULL && bw == ORIENT_BLOCK && bh == ORIENT_BLOCK)
+                        job->block(d + (size_t)x * ch, dstep, s, sstep);
+                    else
+                        transpose_block(d + (size_t)x * ch, dstep, s, sstep, ch, bw, bh);
+                }
+            }
+        }
+    }
+}
+
+static ImgError
+transpose_into(Image *dest, Image *src, int rev_x, int rev_y, ImgOp op)
+{
+    ImgError err;
+    TransposeJob job;
+    Image snapshot;
+    ScratchMark mark;
+    PlaneSet ps;
+    u8 c;
+
+    if (src->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (src->layout == IMG_LAYOUT_PLANAR) {
+        err = planes_begin(&ps, dest, src, NULL, src->height, src->width);
+        for (c = 0; err == IMG_OK && c < src->channels; c++)
+            err = transpose_into(ps.dest[c], ps.src[c], rev_x, rev_y, op);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(op);
+    mark = scratch_mark();
+    if (dest == src) {
+        err = scratch_copy(&snapshot, src);
+        if (err != IMG_OK) goto cleanup;
+        src = &snapshot;
+    }
+
+    err = img_realloc_pixels(dest, src->height, src->width, src->channels);
+    if (err != IMG_OK) goto cleanup;
+    dest->type = src->type;
+
+    job.src = src;
+    job.dest = dest;
+    job.rev_x = rev_x;
+    job.rev_y = rev_y;
+    job.block = block_fn(src->channels);
+    img_parallel_rows(img_get_threads(), dest->height, MAX(ORIENT_BLOCK, ROW_GRAIN(dest->width)),
+                      transpose_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+#if IMG_X86_DISPATCH
+/* flip_row for 3-byte pixels, 4 at a time, returns the pixels done */
+__attribute__((target("ssse3"))) static u32
+flip_rgb_ssse3(u8 *d, const u8 *s, u32 width)
+{
+    const __m128i rev = _mm_setr_epi8(9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2, -1, -1, -1, -1);
+    __m128i v;
+    const u8 *p;
+    u32 x, tail;
+
+    for (x = 0; x + 4 <= width; x += 4, d += 12) {
+        p = s + (size_t)(width - x - 4) * 3;
+        memcpy(&tail, p + 8, 4);
+        v = _mm_shuffle_epi8(_mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p),
+                                                _mm_cvtsi32_si128((int)tail)), rev);
+        _mm_storel_epi64((__m128i *)d, v);
+        tail = (u32)_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        memcpy(d + 8, &tail, 4);
+    }
+    return x;
+}
+#endif
+
+/* d = s with the order of its width pixels reversed, d and s must not overlap */
+static void
+flip_row(u8 *d, const u8 *s, u32 width, u8 ch, int ssse3)
+{
+    u32 x, n;
+    u8 c;
+#if defined(__SSE2__)
+    __m128i v;
+
+    n = 0;
+#if IMG_X86_DISPATCH
+    if (ch == 3 && ssse3)
+        n = flip_rgb_ssse3(d, s, width) * 3;
+#endif
+    if (ch != 3) {
+        for (; n + 16 <= width * ch; n += 16) {
+            v = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(s + width * ch - n - 16)), 0x1B);
+            if (ch <= 2)
+                v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+            if (ch == 1)
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *)(d + n), v);
+        }
+    }
+    x = n / ch;
+#else
+    (void)ssse3;
+    x = n = 0;
+#endif
+    for (d += n; x < width; x++, d += ch)
+        for (c = 0; c < ch; c++)
+            d[c] = s[(size_t)(width - 1 - x) * ch + c];
+}
+
+typedef struct {
+    const Image *src;
+    Image *dest;
+    FlipMode mode;
+    u8 *tmp;            /* a row per thread when flipping in place */
+    int ssse3;
+} FlipJob;
+
+static void
+flip_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    FlipJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    u8 *a, *b, *tmp;
+    size_t rowsz;
+    u32 y, h;
+
+    rowsz = (size_t)src->width * src->channels;
+    h = src->height;
+    if (src != dest) {
+        for (y = y0; y < y1; y++) {
+            a = dest->data + (size_t)y * dest->stride;
+            b = src->data + (size_t)(job->mode == IMG_FLIP_HORIZONTAL ? y : h - 1 - y) * src->stride;
+            if (job->mode == IMG_FLIP_VERTICAL)
+                memcpy(a, b, rowsz);
+            else
+                flip_row(a, b, src->width, src->channels, job->ssse3);
+        }
+        return;
+    }
+
+    /* in place: row y and its mirror h - 1 - y are done together */
+    tmp = job->tmp + id * rowsz;
+    for (y = y0; y < y1; y++) {
+        a = dest->data + (size_t)y * dest->stride;
+        b = dest->data + (size_t)(h - 1 - y) * dest->stride;
+        memcpy(tmp, a, rowsz);
+        switch (job->mode) {
+            case IMG_FLIP_HORIZONTAL:
+                flip_row(a, tmp, src->width, src->channels, job->ssse3);
+                if (a == b) break;
+                memcpy(tmp, b, rowsz);
+                flip_row(b, tmp, src->width, src->channels, job->ssse3);
+                break;
+            case IMG_FLIP_VERTICAL:
+                if (a == b) break;
+                memcpy(a, b, rowsz);
+                memcpy(b, tmp, rowsz);
+                break;
+            default:
+                if (a != b)
+                    flip_row(a, b, src->width, src->channels, job->ssse3);
+                flip_row(b, tmp, src->width, src->channels, job->ssse3);
+                break;
+        }
+    }
+}
+
+static ImgError
+flip_into(Image *dest, Image *src, FlipMode mode, ImgOp op)
+{
+    ImgError err;
+    FlipJob job;
+    ScratchMark mark;
+    PlaneSet ps;
+    u32 nthreads, rows;
+    u8 c;
+
+    if (src->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+    if (src->layout == IMG_LAYOUT_PLANAR) {
+        err = planes_begin(&ps, dest, src, NULL, src->width, src->height);
+        for (c = 0; err == IMG_OK && c < src->channels; c++)
+            err = flip_into(ps.dest[c], ps.src[c], mode, op);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(op);
+    err = IMG_OK;
+    mark = scratch_mark();
+    if (mode != IMG_FLIP_HORIZONTAL && mode != IMG_FLIP_VERTICAL && mode != IMG_FLIP_BOTH) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto cleanup;
+    }
+
+    job.src = src;
+    job.dest = dest;
+    job.mode = mode;
+    job.tmp = NULL;
+    job.ssse3 = 0;
+#if IMG_X86_DISPATCH
+    job.ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+    nthreads = img_get_threads();
+    rows = src->height;
+    if (dest == src) {
+        rows = (src->height + 1) / 2;
+        job.tmp = scratch_alloc((size_t)nthreads * src->width * src->channels);
+        if (job.tmp == NULL) {
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+    } else {
+        err = img_realloc_pixels(dest, src->width, src->height, src->channels);
+        if (err != IMG_OK) goto cleanup;
+        dest->type = src->type;
+    }
+    img_parallel_rows(nthreads, rows, ROW_GRAIN(src->width), flip_rows, &job);
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)src->width * src->height : 0);
+    return err;
+}
+
+/* dest(x, y) = src(y, x), dest is src->height wide and src->width high */
+ImgError
+img_transpose(Image *dest, Image *src)
+{
+    MUST(dest      != NULL, "dest is NULL in img_transpose");
+    MUST(src       != NULL, "src is NULL in img_transpose");
+    MUST(src->data != NULL, "src->data is NULL in img_transpose");
+
+    return transpose_into(dest, src, 0, 0, IMG_OP_TRANSPOSE);
+}
+
+/* Mirrors src left to right, top to bottom or both, in place when dest == src */
+ImgError
+img_flip(Image *dest, Image *src, FlipMode mode)
+{
+    MUST(dest      != NULL, "dest is NULL in img_flip");
+    MUST(src       != NULL, "src is NULL in img_flip");
+    MUST(src->data != NULL, "src->data is NULL in img_flip");
+
+    return flip_into(dest, src, mode, IMG_OP_FLIP);
+}
+
+/*
+    Turns src by turns * 90 degrees counter-clockwise (clockwise when
+    negative), the same direction as img_rotate but without resampling.
+    Half turns work in place when dest == src.
+*/
+ImgError
+img_rotate90(Image *dest, Image *src, i32 turns)
+{
+    MUST(dest      != NULL, "dest is NULL in img_rotate90");
+    MUST(src       != NULL, "src is NULL in img_rotate90");
+    MUST(src->data != NULL, "src->data is NULL in img_rotate90");
+
+    switch (((turns % 4) + 4) % 4) {
+        case 1:  return transpose_into(dest, src, 0, 1, IMG_OP_ROTATE90);
+        case 2:  return flip_into(dest, src, IMG_FLIP_BOTH, IMG_OP_ROTATE90);
+        case 3:  return transpose_into(dest, src, 1, 0, IMG_OP_ROTATE90);
+        default: return dest == src ? IMG_OK : img_cpy(dest, src);
+    }
+}
+
+/*
+    Pyramids
+
+    A Gaussian level is the level below it blurred with the binomial
+    [1 4 6 4 1] / 16 along both axes, keeping every other row and column.
+    The blur is only worked out where a sample is kept: the column pass sums
+    the five source rows of a kept row, the row pass combines five of those
+    sums at the even columns, and the result is rounded once. Edges are
+    replicated.
+
+    A Laplacian level is its Gaussian level minus the next level expanded
+    back to its size, plus 128, wrapped to a byte. Adding the expanded level
+    back modulo 256 gives the Gaussian level exactly, so reconstruction is
+    lossless whatever the residuals are.
+*/
+
+typedef struct {
+    const Image *src;   /* the finer level when reducing, the coarser one when expanding */
+    const Image *res;   /* residuals read by expand */
+    Image *dest;
+    u8 *scratch;        /* column sums and an expanded row per thread */
+    size_t scratch_len;
+    int subtract;       /* expand: dest = res - up + 128 instead of up + res - 128 */
+} PyrJob;
+
+/* 2:1 row pass over column sums t (two replicated pixels on either side) */
+static inline void
+pyr_reduce_row(u8 *d, const u16 *t, u32 width, u8 ch)
+{
+    u32 x, s;
+    u8 c;
+
+    for (x = 0; x < width; x++, d += ch, t += 2 * ch)
+        for (c = 0; c < ch; c++) {
+            s = (u32)t[c] + t[4 * ch + c] + 4 * ((u32)t[ch + c] + t[3 * ch + c]) + 6 * (u32)t[2 * ch + c];
+            d[c] = (u8)((s + 128) >> 8);
+        }
+}
+
+/* pyr_reduce_row for three channels: filtering every column and keeping
+   the even ones beats the strided loop. The sums stay below 2^16. */
+static void
+pyr_reduce_row3(u8 *d, u8 *h, const u16 *t, u32 width)
+{
+    size_t n, i;
+    u32 x;
+
+    n = ((size_t)width * 2 - 1) * 3;
+    for (i = 0; i < n; i++)
+        h[i] = (u8)((u16)(t[i] + t[i + 12] + 4 * (t[i + 3] + t[i + 9]) + 6 * t[i + 6] + 128) >> 8);
+    for (x = 0; x < width; x++)
+        memcpy(d + (size_t)x * 3, h + (size_t)x * 6, 3);
+}
+
+static void
+pyr_reduce_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    PyrJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    u16 *t = (u16 *)(job->scratch + id * job->scratch_len);
+    u16 *m;
+    const u8 *r[5];
+    size_t n, i;
+    u32 y;
+    i64 sy;
+    u8 ch, c, k;
+
+    ch = src->channels;
+    n = (size_t)src->width * ch;
+    m = t + 2 * ch;
+    for (y = y0; y < y1; y++) {
+        for (k = 0; k < 5; k++) {
+            sy = MIN(MAX(2 * (i64)y + k - 2, 0), (i64)src->height - 1);
+            r[k] = src->data + (size_t)sy * src->stride;
+        }
+        for (i = 0; i < n; i++)
+            m[i] = (u16)(r[0][i] + r[4][i] + 4 * (r[1][i] + r[3][i]) + 6 * r[2][i]);
+        for (c = 0; c < ch; c++) {
+            t[c] = t[ch + c] = m[c];
+            m[n + c] = m[n + ch + c] = m[n - ch + c];
+        }
+
+        /* constant channel counts let the compiler unroll the taps */
+        switch (ch) {
+        case 1:  pyr_reduce_row(dest->data + (size_t)y * dest->stride, t, dest->width, 1); break;
+        case 2:  pyr_reduce_row(dest->data + (size_t)y * dest->stride, t, dest->width, 2); break;
+        case 3:  pyr_reduce_row3(dest->data + (size_t)y * dest->stride, (u8 *)(m + n + 2 * ch), t, dest->width); break;
+        default: pyr_reduce_row(dest->data + (size_t)y * dest->stride, t, dest->width, 4); break;
+        }
+    }
+}
+
+/* 1:2 row pass over column sums t (one replicated pixel on either side).
+   Even and odd output pixels are worked out apart, ev and od hold them
+   until they are interleaved into u. */
+static inline void
+pyr_expand_row(u8 *u, u8 *ev, u8 *od, const u16 *t, u32 width, u8 ch)
+{
+    const u16 *l = t, *m = t + ch, *r = t + 2 * ch;
+    size_t n, i;
+    u32 x;
+#if defined(__SSE2__)
+    __m128i a, b;
+#endif
+
+    n = (size_t)(width + 1) / 2 * ch;
+    for (i = 0; i < n; i++) {
+        ev[i] = (u8)(((u32)l[i] + 6 * (u32)m[i] + r[i] + 32) >> 6);
+        od[i] = (u8)((4 * ((u32)m[i] + r[i]) + 32) >> 6);
+    }
+
+    n = (size_t)(width / 2) * ch;
+    i = 0;
+#if defined(__SSE2__)
+    if (ch != 3) {
+        for (; i + 16 <= n; i += 16) {
+            a = _mm_loadu_si128((const __m128i *)(ev + i));
+            b = _mm_loadu_si128((const __m128i *)(od + i));
+            if (ch == 1) {
+                _mm_storeu_si128((__m128i *)(u + 2 * i), _mm_unpacklo_epi8(a, b));
+                _mm_storeu_si128((__m128i *)(u + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+            } else if (ch == 2) {
+                _mm_storeu_si128((__m128i *)(u + 2 * i), _mm_unpacklo_epi16(a, b));
+                _mm_storeu_si128((__m128i *)(u + 2 * i + 16), _mm_unpackhi_epi16(a, b));
+            } else {
+                _mm_storeu_si128((__m128i *)(u + 2 * i), _mm_unpacklo_epi32(a, b));
+                _mm_storeu_si128((__m128i *)(u + 2 * i + 16), _mm_unpackhi_epi32(a, b));
+            }
+        }
+    }
+#endif
+    for (x = (u32)(i / ch) * 2; x + 1 < width; x += 2) {
+        memcpy(u + (size_t)x * ch, ev + (size_t)(x / 2) * ch, ch);
+        memcpy(u + (size_t)(x + 1) * ch, od + (size_t)(x / 2) * ch, ch);
+    }
+    if (x < width)
+        memcpy(u + (size_t)x * ch, ev + (size_t)(x / 2) * ch, ch);
+}
+
+static void
+pyr_expand_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    PyrJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    u16 *t = (u16 *)(job->scratch + id * job->scratch_len);
+    u16 *m;
+    u8 *u, *ev, *od, *d;
+    const u8 *a, *b, *e, *r;
+    size_t n, dn, i;
+    u32 y, k;
+    u8 ch, c;
+
+    ch = src->channels;
+    n = (size_t)src->width * ch;
+    m = t + ch;
+    dn = (size_t)dest->width * ch;
+    u = (u8 *)(m + n + ch);
+    ev = u + dn;
+    od = ev + n + ch;
+    for (y = y0; y < y1; y++) {
+        k = y >> 1;
+        b = src->data + (size_t)k * src->stride;
+        e = src->data + (size_t)MIN(k + 1, src->height - 1) * src->stride;
+        if (y & 1) {
+            for (i = 0; i < n; i++)
+                m[i] = (u16)(4 * (b[i] + e[i]));
+        } else {
+            a = src->data + (size_t)(k > 0 ? k - 1 : 0) * src->stride;
+            for (i = 0; i < n; i++)
+                m[i] = (u16)(a[i] + 6 * b[i] + e[i]);
+        }
+        for (c = 0; c < ch; c++) {
+            t[c] = m[c];
+            m[n + c] = m[n - ch + c];
+        }
+        switch (ch) {
+        case 1:  pyr_expand_row(u, ev, od, t, dest->width, 1); break;
+        case 2:  pyr_expand_row(u, ev, od, t, dest->width, 2); break;
+        case 3:  pyr_expand_row(u, ev, od, t, dest->width, 3); break;
+        default: pyr_expand_row(u, ev, od, t, dest->width, 4); break;
+        }
+
+        d = dest->data + (size_t)y * dest->stride;
+        r = job->res->data + (size_t)y * job->res->stride;
+        if (job->subtract) {
+            for (i = 0; i < dn; i++)
+                d[i] = (u8)(r[i] - u[i] + 128);
+        } else {
+            for (i = 0; i < dn; i++)
+                d[i] = (u8)(u[i] + r[i] - 128);
+        }
+    }
+}
+
+/* per-thread rows for either pass at up to width pixels: padded column
+   sums, an expanded row and its even and odd halves */
+static size_t
+pyr_scratch_len(u32 width, u8 ch)
+{
+    return ((((size_t)width + 4) * ch * sizeof(u16) + ((size_t)width * 2 + 4) * ch) + 63) & ~(size_t)63;
+}
+
+ImgError
+img_pyramid(Pyramid *pyr, Image *img, u32 levels, int flags, Arena *arena)
+{
+    ImgError err;
+    PyrJob job;
+    ScratchMark mark;
+    Image *lv;
+    size_t off[IMG_PYRAMID_MAX_LEVELS], size;
+    u64 pixels;
+    u32 n, i, y, w, h, nthreads;
+    u8 *data;
+
+    MUST(pyr       != NULL, "pyr is NULL in img_pyramid");
+    MUST(img       != NULL, "img is NULL in img_pyramid");
+    MUST(img->data != NULL, "img->data is NULL in img_pyramid");
+
+    STATS_BEGIN(IMG_OP_PYRAMID);
+    mark = scratch_mark();
+    pixels = 0;
+    if (levels > IMG_PYRAMID_MAX_LEVELS || (flags & ~IMG_PYRAMID_LAPLACIAN)) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto cleanup;
+    }
+    if (img->layout != IMG_LAYOUT_INTERLEAVED || img->depth != IMG_DEPTH_U8) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto cleanup;
+    }
+    if (levels == 0)
+        levels = IMG_PYRAMID_MAX_LEVELS;
+
+    /* lay the levels out one after the other, the last one is at most 1x1 */
+    size = 0;
+    w = img->width;
+    h = img->height;
+    for (n = 0; n < levels; n++) {
+        off[n] = size;
+        if ((u64)h * calc_stride(w, img->channels) > SIZE_MAX - size) {
+            err = IMG_ERR_INVALID_DIMENSIONS; goto cleanup;
+        }
+        size += (size_t)h * calc_stride(w, img->channels);
+        pixels += (u64)w * h;
+        if (w == 1 && h == 1) {
+            n++;
+            break;
+        }
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    data = pyr->data;
+    if (data == NULL || size > pyr->capacity || pyr->arena != arena) {
+        if (data != NULL && pyr->arena == NULL)
+            free(data);
+        data = img_malloc(size, arena);
+        pyr->data = data;
+        pyr->capacity = data != NULL ? size : 0;
+        pyr->arena = arena;
+        if (data == NULL) {
+            pyr->levels = 0;
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+    }
+    pyr->levels = n;
+    pyr->flags = flags;
+
+    w = img->width;
+    h = img->height;
+    for (i = 0; i < n; i++) {
+        lv = &pyr->level[i];
+        memset(lv, 0, sizeof(*lv));
+        lv->data = data + off[i];
+        lv->stride = calc_stride(w, img->channels);
+        lv->width = w;
+        lv->height = h;
+        lv->channels = img->channels;
+        lv->capacity = (size_t)h * lv->stride;
+        lv->borrowed = 1;
+        lv->type = img->type;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    lv = &pyr->level[0];
+    for (y = 0; y < img->height; y++)
+        memcpy(lv->data + (size_t)y * lv->stride, img->data + (size_t)y * img->stride,
+               (size_t)img->width * img->channels);
+
+    nthreads = img_get_threads();
+    job.scratch_len = pyr_scratch_len(img->width, img->channels);
+    job.scratch = scratch_alloc(nthreads * job.scratch_len);
+    if (job.scratch == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+    for (i = 1; i < n; i++) {
+        job.src = &pyr->level[i - 1];
+        job.dest = &pyr->level[i];
+        img_parallel_rows(nthreads, job.dest->height, ROW_GRAIN(job.src->width), pyr_reduce_rows, &job);
+    }
+    /* level i only needs level i + 1, which is still Gaussian */
+    if (flags & IMG_PYRAMID_LAPLACIAN) {
+        job.subtract = 1;
+        for (i = 0; i + 1 < n; i++) {
+            job.src = &pyr->level[i + 1];
+            job.res = job.dest = &pyr->level[i];
+            img_parallel_rows(nthreads, job.dest->height, ROW_GRAIN(job.dest->width), pyr_expand_rows, &job);
+        }
+    }
+    err = IMG_OK;
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? pixels : 0);
+    return err;
+}
+
+ImgError
+img_pyramid_reconstruct(Image *dest, const Pyramid *pyr)
+{
+    ImgError err;
+    PyrJob job;
+    ScratchMark mark;
+    Image tmp[2];
+    const Image *base;
+    u32 i, y, nthreads;
+
+    MUST(dest != NULL, "dest is NULL in img_pyramid_reconstruct");
+    MUST(pyr  != NULL, "pyr is NULL in img_pyramid_reconstruct");
+
+    STATS_BEGIN(IMG_OP_RECONSTRUCT);
+    mark = scratch_mark();
+    base = &pyr->level[0];
+    if (pyr->levels == 0 || pyr->data == NULL || !(pyr->flags & IMG_PYRAMID_LAPLACIAN) ||
+        (dest >= pyr->level && dest < pyr->level + IMG_PYRAMID_MAX_LEVELS)) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto cleanup;
+    }
+    if (dest->data == NULL || dest->width != base->width ||
+        dest->height != base->height || dest->channels != base->channels ||
+        dest->depth != IMG_DEPTH_U8 || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_pixels(dest, base->width, base->height, base->channels);
+        if (err != IMG_OK) goto cleanup;
+    }
+    dest->type = base->type;
+    err = IMG_OK;
+    if (pyr->levels == 1) {
+        for (y = 0; y < base->height; y++)
+            memcpy(dest->data + (size_t)y * dest->stride, base->data + (size_t)y * base->stride,
+                   (size_t)base->width * base->channels);
+        goto cleanup;
+    }
+
+    /* levels between the top and level 0 alternate between two buffers
+       the size of level 1 */
+    memset(tmp, 0, sizeof(tmp));
+    for (i = 0; i < 2 && pyr->levels > 2; i++) {
+        tmp[i].data = scratch_alloc(pyr->level[1].capacity);
+        if (tmp[i].data == NULL) {
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+    }
+    nthreads = img_get_threads();
+    job.scratch_len = pyr_scratch_len(base->width, base->channels);
+    job.scratch = scratch_alloc(nthreads * job.scratch_len);
+    if (job.scratch == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+    job.subtract = 0;
+    job.src = &pyr->level[pyr->levels - 1];
+    for (i = pyr->levels - 1; i-- > 0;) {
+        job.res = &pyr->level[i];
+        if (i == 0) {
+            job.dest = dest;
+        } else {
+            job.dest = &tmp[i & 1];
+            job.dest->width = job.res->width;
+            job.dest->height = job.res->height;
+            job.dest->stride = job.res->stride;
+            job.dest->channels = job.res->channels;
+        }
+        img_parallel_rows(nthreads, job.dest->height, ROW_GRAIN(job.dest->width), pyr_expand_rows, &job);
+        job.src = job.dest;
+    }
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+void
+img_pyramid_free(Pyramid *pyr)
+{
+    MUST(pyr != NULL, "pyr is NULL in img_pyramid_free");
+
+    /* arena memory goes back with the arena */
+    if (pyr->arena == NULL)
+        free(pyr->data);
+    memset(pyr, 0, sizeof(*pyr));
+}
+
+/*
+    Pointwise arithmetic
+
+    All of these run the same row loop: SSE2 saturating byte ops where the
+    operation maps onto one (add, subtract, absolute difference), 16-bit
+    fixed point for blend/multiply, a lookup table for scalar multiply.
+    Scalar tails use the same formulas so results don't depend on SIMD.
+    U16 images add and subtract with the 16-bit saturating ops, F32 ones
+    in plain float with nothing clamped, so a difference stays negative.
+*/
+
+typedef enum {
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_ABSDIFF,
+    ARITH_SUB_WRAP,
+    ARITH_BLEND,
+    ARITH_MUL,
+    ARITH_ADD_SCALAR,
+    ARITH_LUT
+} ArithOp;
+
+typedef struct {
+    Image *dest;
+    const Image *a, *b;
+    ArithOp op;
+    i32 k;          /* blend weight of b (Q8) or scalar addend */
+    u8 lut[256];
+} ArithJob;
+
+/* (x + 127) / 255 rounded, exact for x in [0, 255 * 255] */
+#define DIV255(x) ((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+
+static void
+arith_row(u8 *d, const u8 *a, const u8 *b, u32 n, const ArithJob *job)
+{
+    u32 i;
+    i32 v;
+
+    i = 0;
+#if defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128(), r128 = _mm_set1_epi16(128);
+        __m128i x, y, xl, xh, yl, yh, wa, wb, s;
+
+        wa = _mm_set1_epi16((i16)(256 - job->k));
+        wb = _mm_set1_epi16((i16)job->k);
+        s = _mm_set1_epi8((char)(u8)MIN(ABS(job->k), 255));
+
+        for (; job->op != ARITH_LUT && i + 16 <= n; i += 16) {
+            x = _mm_loadu_si128((const __m128i *)(a + i));
+            y = b != NULL ? _mm_loadu_si128((const __m128i *)(b + i)) : zero;
+            switch (job->op) {
+                case ARITH_ADD:      x = _mm_adds_epu8(x, y); break;
+                case ARITH_SUB:      x = _mm_subs_epu8(x, y); break;
+                case ARITH_ABSDIFF:  x = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x)); break;
+                case ARITH_SUB_WRAP: x = _mm_sub_epi8(x, y); break;
+                case ARITH_ADD_SCALAR:
+                    x = job->k >= 0 ? _mm_adds_epu8(x, s) : _mm_subs_epu8(x, s);
+                    break;
+                case ARITH_BLEND:
+                    xl = _mm_unpacklo_epi8(x, zero); xh = _mm_unpackhi_epi8(x, zero);
+                    yl = _mm_unpacklo_epi8(y, zero); yh = _mm_unpackhi_epi8(y, zero);
+                    xl = _mm_add_epi16(_mm_mullo_epi16(xl, wa), _mm_mullo_epi16(yl, wb));
+                    xh = _mm_add_epi16(_mm_mullo_epi16(xh, wa), _mm_mullo_epi16(yh, wb));
+                    /* a * 256 overflows i16 only as unsigned, srli keeps it right */
+                    xl = _mm_srli_epi16(_mm_add_epi16(xl, r128), 8);
+                    xh = _mm_srli_epi16(_mm_add_epi16(xh, r128), 8);
+                    x = _mm_packus_epi16(xl, xh);
+                    break;
+                case ARITH_MUL:
+                    xl = _mm_mullo_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+                    xh = _mm_mullo_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+                    xl = _mm_add_epi16(xl, r128);
+                    xh = _mm_add_epi16(xh, r128);
+                    xl = _mm_srli_epi16(_mm_add_epi16(xl, _mm_srli_epi16(xl, 8)), 8);
+                    xh = _mm_srli_epi16(_mm_add_epi16(xh, _mm_srli_epi16(xh, 8)), 8);
+                    x = _mm_packus_epi16(xl, xh);
+                    break;
+                default:
+                    break;
+            }
+            _mm_storeu_si128((__m128i *)(d + i), x);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        switch (job->op) {
+            case ARITH_ADD:        v = a[i] + b[i]; break;
+            case ARITH_SUB:        v = a[i] - b[i]; break;
+            case ARITH_ABSDIFF:    v = ABS(a[i] - b[i]); break;
+            case ARITH_SUB_WRAP:   v = (u8)(a[i] - b[i]); break;
+            case ARITH_ADD_SCALAR: v = a[i] + job->k; break;
+            case ARITH_BLEND:      v = (a[i] * (256 - job->k) + b[i] * job->k + 128) >> 8; break;
+            case ARITH_MUL:        v = DIV255(a[i] * b[i]); break;
+            default:               v = job->lut[a[i]]; break;
+        }
+        d[i] = (u8)MIN(MAX(v, 0), 255);
+    }
+}
+
+/* add and the subtractions on U16 samples */
+static void
+arith_row_u16(u16 *d, const u16 *a, const u16 *b, u32 n, ArithOp op)
+{
+    u32 i;
+    i32 v;
+
+    i = 0;
+#if defined(__SSE2__)
+    {
+        __m128i x, y;
+
+        for (; i + 8 <= n; i += 8) {
+            x = _mm_loadu_si128((const __m128i *)(a + i));
+            y = _mm_loadu_si128((const __m128i *)(b + i));
+            switch (op) {
+                case ARITH_ADD:     x = _mm_adds_epu16(x, y); break;
+                case ARITH_SUB:     x = _mm_subs_epu16(x, y); break;
+                case ARITH_ABSDIFF: x = _mm_or_si128(_mm_subs_epu16(x, y), _mm_subs_epu16(y, x)); break;
+                default:            x = _mm_sub_epi16(x, y); break;
+            }
+            _mm_storeu_si128((__m128i *)(d + i), x);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        switch (op) {
+            case ARITH_ADD:     v = MIN(a[i] + b[i], 65535); break;
+            case ARITH_SUB:     v = MAX(a[i] - b[i], 0); break;
+            case ARITH_ABSDIFF: v = ABS(a[i] - b[i]); break;
+            default:            v = (u16)(a[i] - b[i]); break;
+        }
+        d[i] = (u16)v;
+    }
+}
+
+/* the same on F32 samples: saturating and wrapped subtraction are both a - b */
+static void
+arith_row_f32(float *d, const float *a, const float *b, u32 n, ArithOp op)
+{
+    u32 i;
+
+    i = 0;
+#if defined(__SSE2__)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+        __m128 x, y;
+
+        for (; i + 4 <= n; i += 4) {
+            x = _mm_loadu_ps(a + i);
+            y = _mm_loadu_ps(b + i);
+            switch (op) {
+                case ARITH_ADD:     x = _mm_add_ps(x, y); break;
+                case ARITH_ABSDIFF: x = _mm_andnot_ps(sign, _mm_sub_ps(x, y)); break;
+                default:            x = _mm_sub_ps(x, y); break;
+            }
+            _mm_storeu_ps(d + i, x);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        switch (op) {
+            case ARITH_ADD:     d[i] = a[i] + b[i]; break;
+            case ARITH_ABSDIFF: d[i] = fabsf(a[i] - b[i]); break;
+            default:            d[i] = a[i] - b[i]; break;
+        }
+    }
+}
+
+static void
+arith_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    ArithJob *job = ctx;
+    const u8 *a, *b;
+    u8 *d;
+    u32 y, n;
+
+    n = job->dest->width * job->dest->channels;
+    if (job->dest->depth != IMG_DEPTH_U8) {
+        for (y = y0; y < y1; y++) {
+            d = job->dest->data + (size_t)y * job->dest->stride;
+            a = job->a->data + (size_t)y * job->a->stride;
+            b = job->b->data + (size_t)y * job->b->stride;
+            if (job->dest->depth == IMG_DEPTH_U16)
+                arith_row_u16((u16 *)d, (const u16 *)a, (const u16 *)b, n, job->op);
+            else
+                arith_row_f32((float *)d, (const float *)a, (const float *)b, n, job->op);
+        }
+        return;
+    }
+    for (y = y0; y < y1; y++)
+        arith_row(job->dest->data + (size_t)y * job->dest->stride,
+                  job->a->data + (size_t)y * job->a->stride,
+                  job->b != NULL ? job->b->data + (size_t)y * job->b->stride : NULL,
+                  n, job);
+}
+
+/* img2 may be NULL for the scalar ops */
+static ImgError
+arith(Image *dest, Image *img1, Image *img2, ArithJob *job, ImgOp op)
+{
+    ImgError err;
+    PlaneSet ps;
+    u8 c;
+
+    MUST(dest       != NULL, "dest is NULL in arith");
+    MUST(img1       != NULL, "img1 is NULL in arith");
+    MUST(img1->data != NULL, "img1->data is NULL in arith");
+
+    if (img1->layout == IMG_LAYOUT_PLANAR || (img2 != NULL && img2->layout == IMG_LAYOUT_PLANAR)) {
+        err = planes_begin(&ps, dest, img1, img2, img1->width, img1->height);
+        for (c = 0; err == IMG_OK && c < img1->channels; c++)
+            err = arith(ps.dest[c], ps.src[c], ps.src2[c], job, op);
+        return planes_end(&ps, err);
+    }
+
+    STATS_BEGIN(op);
+    err = IMG_OK;
+    if(img2 != NULL && (
+       img1->width != img2->width       ||
+       img1->height != img2->height     ||
+       img1->channels != img2->channels ||
+       img1->depth != img2->depth       ||
+       img1->type != img2->type)
+    ){
+        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
+    }
+    /* wider samples only add and subtract */
+    if (img1->depth != IMG_DEPTH_U8 && (img2 == NULL ||
+        (job->op != ARITH_ADD && job->op != ARITH_SUB && job->op != ARITH_ABSDIFF && job->op != ARITH_SUB_WRAP))) {
+        err = IMG_ERR_UNSUPPORTED_FORMAT; goto error;
+    }
+
+    /* dest may be one of the operands, only reshape it when it has to change */
+    if (dest->data == NULL || dest->width != img1->width ||
+        dest->height != img1->height || dest->channels != img1->channels ||
+        dest->depth != img1->depth || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_depth(dest, img1->width, img1->height, img1->channels, img1->depth);
+        if(err != IMG_OK) goto error;
+    }
+    dest->type = img1->type;
+
+    job->dest = dest;
+    job->a = img1;
+    job->b = img2;
+    img_parallel_rows(img_get_threads(), dest->height, ROW_GRAIN(dest->width), arith_rows, job);
+
+error:
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+/*
+    Checks the parameter of op and fills in the job, shared by the img_*
+    functions below and the pipeline steps.
+    IMG_SUBTRACT_SATURATE: max(img1 - img2, 0)
+    IMG_SUBTRACT_ABSDIFF:  |img1 - img2|
+    IMG_SUBTRACT_WRAP:     (img1 - img2) mod 256
+    ARITH_BLEND:           alpha in [0, 1]
+    ARITH_ADD_SCALAR:      value in [-255, 255]
+    ARITH_LUT:             factor >= 0
+*/
+static ImgError
+arith_prepare(ArithJob *job, ArithOp op, float param)
+{
+    float v;
+    u32 i;
+
+    job->op = op;
+    switch (op) {
+        case ARITH_SUB:
+            switch ((SubtractMode)param) {
+                case IMG_SUBTRACT_SATURATE: break;
+                case IMG_SUBTRACT_ABSDIFF:  job->op = ARITH_ABSDIFF;  break;
+                case IMG_SUBTRACT_WRAP:     job->op = ARITH_SUB_WRAP; break;
+                default: return IMG_ERR_INVALID_PARAMETERS;
+            }
+            break;
+        case ARITH_BLEND:
+            if (!(param >= 0.0f && param <= 1.0f))
+                return IMG_ERR_INVALID_PARAMETERS;
+            job->k = (i32)(param * 256.0f + 0.5f);
+            break;
+        case ARITH_ADD_SCALAR:
+            if (param < -255.0f || param > 255.0f)
+                return IMG_ERR_INVALID_PARAMETERS;
+            job->k = (i32)param;
+            break;
+        case ARITH_LUT:
+            if (!(param >= 0.0f))
+                return IMG_ERR_INVALID_PARAMETERS;
+            for (i = 0; i < 256; i++) {
+                v = i * param + 0.5f;
+                job->lut[i] = v >= 255.0f ? 255 : (u8)v;
+            }
+            break;
+        default:
+            break;
+    }
+    return IMG_OK;
+}
+
+/* dest = min(img1 + img2, 255) */
+ImgError
+img_add(Image *dest, Image *img1, Image *img2)
+{
+    ArithJob job = {0};
+
+    MUST(img2 != NULL, "img2 is NULL in img_add");
+    job.op = ARITH_ADD;
+    return arith(dest, img1, img2, &job, IMG_OP_ADD);
+}
+
+/* https://homepages.inf.ed.ac.uk/rbf/HIPR2/pixsub.htm */
+ImgError
+img_subtract_mode(Image *dest, Image *img1, Image *img2, SubtractMode mode)
+{
+    ArithJob job = {0};
+    ImgError err;
+
+    MUST(img2 != NULL, "img2 is NULL in img_subtract_mode");
+    err = arith_prepare(&job, ARITH_SUB, mode);
+    if (err != IMG_OK)
+        return err;
+    return arith(dest, img1, img2, &job, IMG_OP_SUBTRACT);
+}
+
+ImgError
+img_subtract(Image *dest, Image *img1, Image *img2)
+{
+    return img_subtract_mode(dest, img1, img2, IMG_SUBTRACT_SATURATE);
+}
+
+/* dest = img1 * (1 - alpha) + img2 * alpha, alpha in [0, 1] */
+ImgError
+img_blend(Image *dest, Image *img1, Image *img2, float alpha)
+{
+    ArithJob job = {0};
+    ImgError err;
+
+    MUST(img2 != NULL, "img2 is NULL in img_blend");
+    err = arith_prepare(&job, ARITH_BLEND, alpha);
+    if (err != IMG_OK)
+        return err;
+    return arith(dest, img1, img2, &job, IMG_OP_BLEND);
+}
+
+/* dest = img1 * img2 / 255 */
+ImgError
+img_multiply(Image *dest, Image *img1, Image *img2)
+{
+    ArithJob job = {0};
+
+    MUST(img2 != NULL, "img2 is NULL in img_multiply");
+    job.op = ARITH_MUL;
+    return arith(dest, img1, img2, &job, IMG_OP_MULTIPLY);
+}
+
+/* dest = clamp(img + value), value in [-255, 255] */
+ImgError
+img_add_scalar(Image *dest, Image *img, i16 value)
+{
+    ArithJob job = {0};
+    ImgError err;
+
+    err = arith_prepare(&job, ARITH_ADD_SCALAR, value);
+    if (err != IMG_OK)
+        return err;
+    return arith(dest, img, NULL, &job, IMG_OP_ADD_SCALAR);
+}
+
+/* dest = clamp(img * factor), factor >= 0 */
+ImgError
+img_multiply_scalar(Image *dest, Image *img, float factor)
+{
+    ArithJob job = {0};
+    ImgError err;
+
+    err = arith_prepare(&job, ARITH_LUT, factor);
+    if (err != IMG_OK)
+        return err;
+    return arith(dest, img, NULL, &job, IMG_OP_MULTIPLY_SCALAR);
+}
+
+/*
+    Color conversion
+
+    Linear conversions (gray, YCbCr) are a 3x3 matrix plus offset in
+    FIX_BITS fixed point. With SSSE3 16 RGB pixels are split into R, G, B
+    planes with pshufb, multiplied with pmaddwd on (R, G) and (B, 0) pairs
+    and, for 3 channel output, shuffled back. HSV is per pixel with
+    reciprocal tables instead of divisions. Rows are independent, so all
+    of them run on the thread pool.
+*/
+
+typedef enum {
+    CVT_MATRIX,
+    CVT_RGB2HSV,
+    CVT_HSV2RGB,
+    CVT_PREMULTIPLY
+} CvtKind;
+
+typedef struct {
+    i16 c[3][3];
+    i32 off[3];     /* FIX_BITS fixed point, rounding included */
+    u8 nout;
+} CvtMatrix;
+
+typedef struct {
+    Image *dest;
+    const Image *src;
+    CvtKind kind;
+    CvtMatrix m;
+    int simd;
+    int ssse3;          /* planar: split_row and merge_row may use pshufb */
+    u8 *scratch;        /* planar: scratch_len bytes of rows per thread */
+    size_t scratch_len;
+} CvtJob;
+
+#define FIX(x) ((i32)FLOOR((x) * (1 << FIX_BITS) + 0.5))
+
+static void
+cvt_matrix_scalar(u8 *dst, const u8 *src, u32 width, u8 sch, u8 dch, const CvtMatrix *m)
+{
+    u32 x;
+    u8 k, out[3];
+
+    for (x = 0; x < width; x++, src += sch, dst += dch) {
+        /* dst may be src, every output is worked out before any is stored */
+        for (k = 0; k < m->nout; k++)
+            out[k] = fix_clamp(m->c[k][0] * src[0] + m->c[k][1] * src[1] + m->c[k][2] * src[2] + m->off[k]);
+        for (k = 0; k < m->nout; k++)
+            dst[k] = out[k];
+        for (; k < dch; k++)
+            dst[k] = src[k];    /* alpha rides along */
+    }
+}
+
+#if IMG_X86_DISPATCH
+__attribute__((target("ssse3"))) static __m128i
+cvt_matrix_16(__m128i x0, __m128i x1, __m128i x2, const CvtMatrix *m, u8 k)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i w01, w2, off, lo01, hi01, lo2, hi2, acc[4];
+
+    w01 = _mm_set1_epi32((i32)(((u32)(u16)m->c[k][1] << 16) | (u16)m->c[k][0]));
+    w2 = _mm_set1_epi32((u16)m->c[k][2]);
+    off = _mm_set1_epi32(m->off[k]);
+
+    lo01 = _mm_unpacklo_epi8(x0, zero);
+    hi01 = _mm_unpacklo_epi8(x1, zero);
+    lo2 = _mm_unpacklo_epi8(x2, zero);
+    acc[0] = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo01, hi01), w01),
+                           _mm_madd_epi16(_mm_unpacklo_epi16(lo2, zero), w2));
+    acc[1] = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo01, hi01), w01),
+                           _mm_madd_epi16(_mm_unpackhi_epi16(lo2, zero), w2));
+
+    lo01 = _mm_unpackhi_epi8(x0, zero);
+    hi01 = _mm_unpackhi_epi8(x1, zero);
+    hi2 = _mm_unpackhi_epi8(x2, zero);
+    acc[2] = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo01, hi01), w01),
+                           _mm_madd_epi16(_mm_unpacklo_epi16(hi2, zero), w2));
+    acc[3] = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo01, hi01), w01),
+                           _mm_madd_epi16(_mm_unpackhi_epi16(hi2, zero), w2));
+
+    acc[0] = _mm_srai_epi32(_mm_add_epi32(acc[0], off), FIX_BITS);
+    acc[1] = _mm_srai_epi32(_mm_add_epi32(acc[1], off), FIX_BITS);
+    acc[2] = _mm_srai_epi32(_mm_add_epi32(acc[2], off), FIX_BITS);
+    acc[3] = _mm_srai_epi32(_mm_add_epi32(acc[3], off), FIX_BITS);
+    return _mm_packus_epi16(_mm_packs_epi32(acc[0], acc[1]), _mm_packs_epi32(acc[2], acc[3]));
+}
+
+__attribute__((target("ssse3"))) static void
+cvt_matrix_ssse3(u8 *dst, const u8 *src, u32 width, u8 dch, const CvtMatrix *m)
+{
+    __m128i in[3], pl[3], out[3];
+    u32 x, b, c;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        for (b = 0; b < 3; b++)
+            in[b] = _mm_loadu_si128((const __m128i *)(src + 3 * x + 16 * b));
+        for (c = 0; c < 3; c++)
+            pl[c] = _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(in[0], _mm_loadu_si128((const __m128i *)cvt_split[0][c])),
+                        _mm_shuffle_epi8(in[1], _mm_loadu_si128((const __m128i *)cvt_split[1][c]))),
+                        _mm_shuffle_epi8(in[2], _mm_loadu_si128((const __m128i *)cvt_split[2][c])));
+
+        if (dch == 1) {
+            _mm_storeu_si128((__m128i *)(dst + x), cvt_matrix_16(pl[0], pl[1], pl[2], m, 0));
+            continue;
+        }
+
+        for (c = 0; c < 3; c++)
+            out[c] = cvt_matrix_16(pl[0], pl[1], pl[2], m, c);
+        for (b = 0; b < 3; b++)
+            _mm_storeu_si128((__m128i *)(dst + 3 * x + 16 * b), _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(out[0], _mm_loadu_si128((const __m128i *)cvt_merge[b][0])),
+                        _mm_shuffle_epi8(out[1], _mm_loadu_si128((const __m128i *)cvt_merge[b][1]))),
+                        _mm_shuffle_epi8(out[2], _mm_loadu_si128((const __m128i *)cvt_merge[b][2]))));
+    }
+    cvt_matrix_scalar(dst + x * dch, src + 3 * x, width - x, 3, dch, m);
+}
+
+/* cvt_matrix_ssse3 on planes, returns the pixels done */
+__attribute__((target("ssse3"))) static u32
+cvt_matrix_planar_ssse3(u8 *d, size_t dplane, const u8 *s, size_t splane, u32 width, const CvtMatrix *m)
+{
+    __m128i pl[3], out[3];
+    u32 x;
+    u8 k;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        for (k = 0; k < 3; k++)
+            pl[k] = _mm_loadu_si128((const __m128i *)(s + k * splane + x));
+        for (k = 0; k < m->nout; k++)
+            out[k] = cvt_matrix_16(pl[0], pl[1], pl[2], m, k);
+        for (k = 0; k < m->nout; k++)
+            _mm_storeu_si128((__m128i *)(d + k * dplane + x), out[k]);
+    }
+    return x;
+}
+#endif
+
+/* cvt_matrix_scalar on the rows of planes splane and dplane bytes apart, d may be s */
+static void
+cvt_matrix_planar(u8 *d, size_t dplane, const u8 *s, size_t splane, u32 width, u8 dch,
+                  const CvtMatrix *m, int simd)
+{
+    u32 x;
+    u8 k, out[3];
+
+    x = 0;
+#if IMG_X86_DISPATCH
+    if (simd)
+        x = cvt_matrix_planar_ssse3(d, dplane, s, splane, width, m);
+#else
+    (void)simd;
+#endif
+    for (; x < width; x++) {
+        for (k = 0; k < m->nout; k++)
+            out[k] = fix_clamp(m->c[k][0] * s[x] + m->c[k][1] * s[splane + x] +
+                               m->c[k][2] * s[2 * splane + x] + m->off[k]);
+        for (k = 0; k < m->nout; k++)
+            d[k * dplane + x] = out[k];
+    }
+    for (k = m->nout; k < dch; k++)
+        if (d + k * dplane != s + k * splane)
+            memcpy(d + k * dplane, s + k * splane, width);
+}
+
+/* (256 / 6) / d and 255 / max in 12 bit fixed point for hue and saturation */
+static i32 hsv_hdiv[256], hsv_sdiv[256];
+static pthread_once_t hsv_once = PTHREAD_ONCE_INIT;
+
+static void
+hsv_init_tables(void)
+{
+    u32 i;
+
+    for (i = 1; i < 256; i++) {
+        hsv_hdiv[i] = (i32)FLOOR((256.0 / 6.0) * 4096.0 / i + 0.5);
+        hsv_sdiv[i] = (i32)FLOOR(255.0 * 4096.0 / i + 0.5);
+    }
+}
+
+/* H, S, V all in 0..255, hue wraps around at 256 */
+static void
+cvt_rgb2hsv(u8 *dst, const u8 *src, u32 width, u8 ch)
+{
+    i32 r, g, b, max, min, d, h;
+    u32 x;
+    u8 k;
+
+    for (x = 0; x < width; x++, src += ch, dst += ch) {
+        r = src[0]; g = src[1]; b = src[2];
+        max = MAX(MAX(r, g), b);
+        min = MIN(MIN(r, g), b);
+        d = max - min;
+
+        if (d == 0)
+            h = 0;
+        else if (max == r)
+            h = (g - b) * hsv_hdiv[d];
+        else if (max == g)
+            h = (85 << 12) + 1365 + (b - r) * hsv_hdiv[d];
+        else
+            h = (170 << 12) + 2731 + (r - g) * hsv_hdiv[d];
+
+        dst[0] = (u8)(((h + 2048) >> 12) & 255);
+        dst[1] = max == 0 ? 0 : (u8)((d * hsv_sdiv[max] + 2048) >> 12);
+        dst[2] = (u8)max;
+        for (k = 3; k < ch; k++)
+            dst[k] = src[k];
+    }
+}
+
+static void
+cvt_hsv2rgb(u8 *dst, const u8 *src, u32 width, u8 ch)
+{
+    i32 h6, region, rem, s, v, p, q, t, r, g, b;
+    u32 x;
+    u8 k;
+
+    for (x = 0; x < width; x++, src += ch, dst += ch) {
+        s = src[1];
+        v = src[2];
+        h6 = src[0] * 6;
+        region = h6 >> 8;
+        rem = h6 & 255;
+
+        p = DIV255(v * (255 - s));
+        q = DIV255(v * (255 - DIV255(s * rem)));
+        t = DIV255(v * (255 - DIV255(s * (255 - rem))));
+
+        switch (region) {
+            case 0:  r = v; g = t; b = p; break;
+            case 1:  r = q; g = v; b = p; break;
+            case 2:  r = p; g = v; b = t; break;
+            case 3:  r = p; g = q; b = v; break;
+            case 4:  r = t; g = p; b = v; break;
+            default: r = v; g = p; b = q; break;
+        }
+        dst[0] = (u8)r;
+        dst[1] = (u8)g;
+        dst[2] = (u8)b;
+        for (k = 3; k < ch; k++)
+            dst[k] = src[k];
+    }
+}
+
+/* RGBA -> RGB * A / 255, A kept */
+static void
+cvt_premultiply(u8 *dst, const u8 *src, u32 width)
+{
+    u32 x, i;
+    u8 c;
+
+    x = 0;
+#if defined(__SSE2__)
+    {
+        const __m128i zero = _mm_setzero_si128(), r128 = _mm_set1_epi16(128);
+        /* alpha lanes are multiplied by 255, which DIV255 undoes */
+        const __m128i keep = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i a255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+        __m128i v, lo, hi, alo, ahi;
+
+        for (; x + 4 <= width; x += 4) {
+            v = _mm_loadu_si128((const __m128i *)(src + 4 * x));
+            lo = _mm_unpacklo_epi8(v, zero);
+            hi = _mm_unpackhi_epi8(v, zero);
+            alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            alo = _mm_or_si128(_mm_and_si128(alo, keep), a255);
+            ahi = _mm_or_si128(_mm_and_si128(ahi, keep), a255);
+            lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), r128);
+            hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), r128);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            _mm_storeu_si128((__m128i *)(dst + 4 * x), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; x < width; x++) {
+        i = 4 * x;
+        for (c = 0; c < 3; c++)
+            dst[i + c] = (u8)DIV255(src[i + c] * src[i + 3]);
+        dst[i + 3] = src[i + 3];
+    }
+}
+
+static void
+cvt_row(const CvtJob *job, u8 *dst, const u8 *src, u32 w, u8 sch, u8 dch)
+{
+    switch (job->kind) {
+        case CVT_MATRIX:
+#if IMG_X86_DISPATCH
+            if (job->simd) {
+                cvt_matrix_ssse3(dst, src, w, dch, &job->m);
+                break;
+            }
+#endif
+            cvt_matrix_scalar(dst, src, w, sch, dch, &job->m);
+            break;
+        case CVT_RGB2HSV:     cvt_rgb2hsv(dst, src, w, sch); break;
+        case CVT_HSV2RGB:     cvt_hsv2rgb(dst, src, w, sch); break;
+        case CVT_PREMULTIPLY: cvt_premultiply(dst, src, w); break;
+    }
+}
+
+static void
+cvt_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    CvtJob *job = ctx;
+    u32 y;
+
+    for (y = y0; y < y1; y++)
+        cvt_row(job, job->dest->data + (size_t)y * job->dest->stride,
+                job->src->data + (size_t)y * job->src->stride,
+                job->src->width, job->src->channels, job->dest->channels);
+}
+
+/*
+    cvt_rows for planar images: matrices straight on the planes, the rest
+    on a row merged into scratch and split again
+*/
+static void
+cvt_planar_rows(void *ctx, u32 id, u32 y0, u32 y1)
+{
+    CvtJob *job = ctx;
+    const Image *src = job->src;
+    Image *dest = job->dest;
+    const u8 *s;
+    u8 *d, *in, *out;
+    u32 y, w;
+
+    w = src->width;
+    if (job->kind == CVT_MATRIX) {
+        for (y = y0; y < y1; y++)
+            cvt_matrix_planar(dest->data + (size_t)y * dest->stride, dest->plane_size,
+                              src->data + (size_t)y * src->stride, src->plane_size,
+                              w, dest->channels, &job->m, job->simd);
+        return;
+    }
+
+    in = job->scratch + id * job->scratch_len;
+    out = in + (size_t)w * src->channels;
+    for (y = y0; y < y1; y++) {
+        s = src->data + (size_t)y * src->stride;
+        d = dest->data + (size_t)y * dest->stride;
+        merge_row(in, s, src->plane_size, w, src->channels, job->ssse3);
+        cvt_row(job, out, in, w, src->channels, dest->channels);
+        split_row(d, dest->plane_size, out, w, dest->channels, job->ssse3);
+    }
+}
+
+/* Picks the SIMD path and builds the tables a job needs for sch source channels */
+static void
+cvt_prepare(CvtJob *job, u8 sch)
+{
+#if IMG_X86_DISPATCH
+    job->simd = job->kind == CVT_MATRIX && sch == 3 && __builtin_cpu_supports("ssse3");
+    if (job->simd)
+        pthread_once(&cvt_once, cvt_init_masks);
+#endif
+    if (job->kind == CVT_RGB2HSV)
+        pthread_once(&hsv_once, hsv_init_tables);
+}
+
+/*
+    Runs a conversion into dest, which may be img itself. Changing the
+    channel count in place goes through a copy of the source.
+*/
+static ImgError
+cvt_color(Image *dest, Image *img, u8 dch, ImgType type, CvtJob *job, ImgOp op)
+{
+    ImgError err;
+    Image snapshot;
+    ScratchMark mark;
+    u32 nthreads;
+
+    MUST(dest      != NULL, "dest is NULL in cvt_color");
+    MUST(img       != NULL, "img is NULL in cvt_color");
+    MUST(img->data != NULL, "img->data is NULL in cvt_color");
+
+    if (img->depth != IMG_DEPTH_U8)
+        return IMG_ERR_UNSUPPORTED_FORMAT;
+
+    STATS_BEGIN(op);
+    err = IMG_OK;
+    mark = scratch_mark();
+    if (dest == img && dch != img->channels) {
+        err = scratch_copy(&snapshot, img);
+        if (err != IMG_OK) goto cleanup;
+        img = &snapshot;
+    }
+
+    /* dest comes out in the layout of img */
+    if (dest != img && (dest->data == NULL || dest->width != img->width ||
+        dest->height != img->height || dest->channels != dch || dest->depth != IMG_DEPTH_U8 ||
+        dest->layout != img->layout)) {
+        if (img->layout == IMG_LAYOUT_PLANAR)
+            err = img_realloc_planes(dest, img->width, img->height, dch);
+        else
+            err = img_realloc_pixels(dest, img->width, img->height, dch);
+        if (err != IMG_OK) goto cleanup;
+    }
+    dest->type = type;
+
+    job->dest = dest;
+    job->src = img;
+    cvt_prepare(job, img->channels);
+    nthreads = img_get_threads();
+
+    if (img->layout != IMG_LAYOUT_PLANAR) {
+        img_parallel_rows(nthreads, img->height, ROW_GRAIN(img->width), cvt_rows, job);
+        goto cleanup;
+    }
+
+    job->ssse3 = 0;
+    job->scratch = NULL;
+    job->scratch_len = (size_t)img->width * (img->channels + dch);
+    if (job->kind != CVT_MATRIX) {
+        job->scratch = scratch_alloc(nthreads * job->scratch_len);
+        if (job->scratch == NULL) {
+            err = IMG_ERR_MEMORY; goto cleanup;
+        }
+    }
+#if IMG_X86_DISPATCH
+    job->ssse3 = __builtin_cpu_supports("ssse3");
+    job->simd = job->kind == CVT_MATRIX && job->ssse3;
+    if (job->ssse3)
+        pthread_once(&cvt_once, cvt_init_masks);
+#endif
+    img_parallel_rows(nthreads, img->height, ROW_GRAIN(img->width), cvt_planar_rows, job);
+
+cleanup:
+    scratch_release(mark);
+    STATS_END(err == IMG_OK ? (u64)dest->width * dest->height : 0);
+    return err;
+}
+
+static ImgError
+gray_job(CvtJob *job, GrayCoeffs coeffs)
+{
+    double w[3];
+    u8 c;
+
+    switch (coeffs) {
+        /* refernce for the formula: https://poynton.ca/PDFs/ColorFAQ.pdf */
+        case IMG_GRAY_BT709:   w[0] = 0.2125; w[1] = 0.7154; w[2] = 0.0721; break;
+        case IMG_GRAY_BT601:   w[0] = 0.299;  w[1] = 0.587;  w[2] = 0.114;  break;
+        case IMG_GRAY_AVERAGE: w[0] = w[1] = w[2] = 1.0 / 3.0; break;
+        default: return IMG_ERR_INVALID_PARAMETERS;
+    }
+
+    job->kind = CVT_MATRIX;
+    job->m.nout = 1;
+    for (c = 0; c < 3; c++)
+        job->m.c[0][c] = (i16)FIX(w[c]);
+    job->m.off[0] = 1 << (FIX_BITS - 1);
+    return IMG_OK;
+}
+
+ImgError
+img_rgb2gray_coeffs(Image *dest, Image *img, GrayCoeffs coeffs)
+{
+    CvtJob job = {0};
+    ImgError err;
+
+    MUST(img != NULL, "img is NULL in img_rgb2gray_coeffs");
+    if (img->channels < 3)
+        return IMG_ERR_COLOR_SPACE;
+
+    err = gray_job(&job, coeffs);
+    if (err != IMG_OK)
+        return err;
+    return cvt_color(dest, img, 1, IMG_PGM_BIN, &job, IMG_OP_RGB2GRAY);
+}
+
+ImgError
+img_rgb2gray(Image *dest, Image *img)
+{
+    return img_rgb2gray_coeffs(dest, img, IMG_GRAY_BT709);
+}
+
+/* Full range BT.601 (JFIF) YCbCr */
+ImgError
+img_rgb2ycbcr(Image *dest, Image *img)
+{
+    static const double m[3][3] = {
+        {  0.299,     0.587,     0.114    },
+        { -0.168736, -0.331264,  0.5      },
+        {  0.5,      -0.418688, -0.081312 }
+    };
+    CvtJob job = {0};
+    u8 k, c;
+
+    MUST(img != NULL, "img is NULL in img_rgb2ycbcr");
+    if (img->channels < 3)
+        return IMG_ERR_COLOR_SPACE;
+
+    job.kind = CVT_MATRIX;
+    job.m.nout = 3;
+    for (k = 0; k < 3; k++) {
+        for (c = 0; c < 3; c++)
+            job.m.c[k][c] = (i16)FIX(m[k][c]);
+        job.m.off[k] = (k == 0 ? 0 : 128 << FIX_BITS) + (1 << (FIX_BITS - 1));
+    }
+    return cvt_color(dest, img, img->channels, img->type, &job, IMG_OP_RGB2YCBCR);
+}
+
+ImgError
+img_ycbcr2rgb(Image *dest, Image *img)
+{
+    static const double m[3][3] = {
+        { 1.0,  0.0,       1.402    },
+        { 1.0, -0.344136, -0.714136 },
+        { 1.0,  1.772,     0.0      }
+    };
+    CvtJob job = {0};
+    u8 k, c;
+
+    MUST(img != NULL, "img is NULL in img_ycbcr2rgb");
+    if (img->channels < 3)
+        return IMG_ERR_COLOR_SPACE;
+
+    job.kind = CVT_MATRIX;
+    job.m.nout = 3;
+    for (k = 0; k < 3; k++) {
+        for (c = 0; c < 3; c++)
+            job.m.c[k][c] = (i16)FIX(m[k][c]);
+        /* Cb and Cr are stored around 128 */
+        job.m.off[k] = -(job.m.c[k][1] + job.m.c[k][2]) * 128 + (1 << (FIX_BITS - 1));
+    }
+    return cvt_color(dest, img, img->channels, img->type, &job, IMG_OP_YCBCR2RGB);
+}
+
+ImgError
+img_rgb2hsv(Image *dest, Image *img)
+{
+    CvtJob job = {0};
+
+    MUST(img != NULL, "img is NULL in img_rgb2hsv");
+    if (img->channels < 3)
+        return IMG_ERR_COLOR_SPACE;
+
+    job.kind = CVT_RGB2HSV;
+    return cvt_color(dest, img, img->channels, img->type, &job, IMG_OP_RGB2HSV);
+}
+
+ImgError
+img_hsv2rgb(Image *dest, Image *img)
+{
+    CvtJob job = {0};
+
+    MUST(img != NULL, "img is NULL in img_hsv2rgb");
+    if (img->channels < 3)
+        return IMG_ERR_COLOR_SPACE;
+
+    job.kind = CVT_HSV2RGB;
+    return cvt_color(dest, img, img->channels, img->type, &job, IMG_OP_HSV2RGB);
+}
+
+ImgError
+img_premultiply(Image *dest, Image *img)
+{
+    CvtJob job = {0};
+
+    MUST(img != NULL, "img is NULL in img_premultiply");
+    if (img->channels != 4)
+        return IMG_ERR_COLOR_SPACE;
+
+    job.kind = CVT_PREMULTIPLY;
+    return cvt_color(dest, img, 4, img->type, &job, IMG_OP_PREMULTIPLY);
+}
+
+/*
+    Pipeline
+
+    A chain of steps is run row by row instead of step by step. Output
+    rows are split into bands over the thread pool and every thread pulls
+    rows through the chain on its own: pointwise steps (color conversion,
+    arithmetic) compute one row from one input row, convolution and resize
+    keep a ring of the (horizontally filtered) input rows their window
+    covers. Nothing but the final image and those rings is allocated, so
+    memory is O(width * window height) per thread rather than one full
+    image per step.
+
+    Every step runs the same row kernels as the matching img_* function,
+    the result is identical to calling them one after another. Bands
+    overlapping a neighborhood step recompute the rows of its window that
+    fall into the previous band.
+*/
+
+#define PIPE_NO_ROW INT64_MIN
+
+typedef enum {
+    PIPE_COLOR,
+    PIPE_CONVOLVE,
+    PIPE_RESIZE,
+    PIPE_ARITH
+} PipeKind;
+
+struct PipeStage {
+    PipeKind kind;
+    u32 width, height;      /* output geometry */
+    u8 channels;
+    u32 in_width, in_height;
+    u8 in_channels;
+
+    CvtJob cvt;
+
+    float *kernel;          /* copy of the kernel data, size * size, then col and row */
+    float *col, *row;
+    u32 size, r;
+    int separable;
+    BorderMode border_mode;
+
+    ResizeFilter filter;
+    ResizeTaps tx, ty;
+    u32 *xmap;
+
+    ArithJob arith;
+    Image *operand;         /* NULL for the scalar ops */
+};
+
+/* What one thread keeps for one stage */
+typedef struct {
+    u8 *out;                /* output row `tag` */
+    i64 tag;
+    void *ring;             /* convolve: float rows, resize: u8 rows */
+    i64 *ring_tag;          /* input row held in each ring slot */
+    u32 ring_len;           /* elements per slot */
+    float *padded, *acc;
+    const u8 **rows;        /* resize: the ring slots one output row reads */
+    const float **frows;    /* convolve: the same */
+} PipeState;
+
+typedef struct {
+    Pipeline *pipe;
+    Image *dest;            /* holds output rows out_y0 .. */
+    u32 out_y0;
+    u32 y0;                 /* first output row of the rows being run */
+    const Image *src;       /* holds source rows src_y0 .. src_y1 - 1 */
+    u32 src_y0, src_y1;
+    const Image *snapshot;  /* stands in for dest wherever dest is read */
+    PipeState *state;       /* nthreads * nstages */
+    u8 *block;              /* what state points into */
+    const ConvOps *ops;
+    u32 nthreads, grain;
+    ScratchMark mark;       /* state, block and copy are scratch memory */
+    Image copy;             /* dest as it was, when a step reads it */
+    Image window;           /* source rows read from pipe->reader */
+    Image chunk;            /* output rows on their way to a writer */
+} PipeRun;
+
+ImgError
+img_pipe_init(Pipeline *pipe, Image *src)
+{
+    MUST(pipe      != NULL, "pipe is NULL in img_pipe_init");
+    MUST(src       != NULL, "src is NULL in img_pipe_init");
+    MUST(src->data != NULL, "src->data is NULL in img_pipe_init");
+
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->src = src;
+    pipe->width = src->width;
+    pipe->height = src->height;
+    pipe->channels = src->channels;
+    pipe->type = src->type;
+    /* steps read interleaved 8-bit rows, img_convert_layout/img_convert_depth first */
+    if (src->layout != IMG_LAYOUT_INTERLEAVED || src->depth != IMG_DEPTH_U8)
+        pipe->err = IMG_ERR_UNSUPPORTED_FORMAT;
+    return pipe->err;
+}
+
+/* Source rows are read from rd as they are needed, rd must not have been read from yet */
+ImgError
+img_pipe_init_stream(Pipeline *pipe, PnmReader *rd)
+{
+    MUST(pipe     != NULL, "pipe is NULL in img_pipe_init_stream");
+    MUST(rd       != NULL, "rd is NULL in img_pipe_init_stream");
+    MUST(rd->map  != NULL, "rd is not open in img_pipe_init_stream");
+    MUST(rd->row  == 0,    "rd was already read from in img_pipe_init_stream");
+
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->reader = rd;
+    pipe->width = rd->width;
+    pipe->height = rd->height;
+    pipe->channels = rd->channels;
+    pipe->type = rd->type;
+    return IMG_OK;
+}
+
+static void
+pipe_stage_free(PipeStage *st)
+{
+    free(st->kernel);
+    resize_taps_free(&st->tx);
+    resize_taps_free(&st->ty);
+    free(st->xmap);
+    free(st);
+}
+
+void
+img_pipe_free(Pipeline *pipe)
+{
+    u32 s;
+
+    MUST(pipe != NULL, "pipe is NULL in img_pipe_free");
+
+    for (s = 0; s < pipe->nstages; s++)
+        pipe_stage_free(pipe->stages[s]);
+    pipe->nstages = 0;
+}
+
+/*
+    Appends a stage reading the current output of the pipeline. Returns
+    NULL and leaves the error in pipe->err when the pipeline already
+    failed or is full, so steps can be chained without checking each one.
+*/
+static PipeStage *
+pipe_push(Pipeline *pipe, PipeKind kind)
+{
+    PipeStage *st;
+
+    MUST(pipe != NULL, "pipe is NULL in pipe_push");
+
+    if (pipe->err != IMG_OK)
+        return NULL;
+    if (pipe->nstages == IMG_PIPE_MAX_STAGES) {
+        pipe->err = IMG_ERR_INVALID_PARAMETERS;
+        return NULL;
+    }
+
+    st = calloc(1, sizeof(*st));
+    if (st == NULL) {
+        pipe->err = IMG_ERR_MEMORY;
+        return NULL;
+    }
+
+    st->kind = kind;
+    st->in_width = st->width = pipe->width;
+    st->in_height = st->height = pipe->height;
+    st->in_channels = st->channels = pipe->channels;
+    pipe->stages[pipe->nstages++] = st;
+    return st;
+}
+
+/* Drops the stage pipe_push just added and records why */
+static ImgError
+pipe_fail(Pipeline *pipe, ImgError err)
+{
+    pipe_stage_free(pipe->stages[--pipe->nstages]);
+    pipe->err = err;
+    return err;
+}
+
+ImgError
+img_pipe_rgb2gray(Pipeline *pipe, GrayCoeffs coeffs)
+{
+    PipeStage *st;
+    ImgError err;
+
+    st = pipe_push(pipe, PIPE_COLOR);
+    if (st == NULL)
+        return pipe->err;
+    if (st->in_channels < 3)
+        return pipe_fail(pipe, IMG_ERR_COLOR_SPACE);
+
+    err = gray_job(&st->cvt, coeffs);
+    if (err != IMG_OK)
+        return pipe_fail(pipe, err);
+    cvt_prepare(&st->cvt, st->in_channels);
+
+    st->channels = pipe->channels = 1;
+    pipe->type = IMG_PGM_BIN;
+    return IMG_OK;
+}
+
+ImgError
+img_pipe_convolve(Pipeline *pipe, Kernel *kernel, BorderMode border_mode)
+{
+    PipeStage *st;
+
+    MUST(kernel           != NULL, "kernel is NULL in img_pipe_convolve");
+    MUST(kernel->data     != NULL, "kernel->data is NULL in img_pipe_convolve");
+    MUST(kernel->size % 2 != 0,    "kernel->size % 2 == 0 in img_pipe_convolve");
+
+    st = pipe_push(pipe, PIPE_CONVOLVE);
+    if (st == NULL)
+        return pipe->err;
+
+    st->kernel = malloc(((size_t)kernel->size + 2) * kernel->size * sizeof(float));
+    if (st->kernel == NULL)
+        return pipe_fail(pipe, IMG_ERR_MEMORY);
+    memcpy(st->kernel, kernel->data, kernel->size * kernel->size * sizeof(float));
+
+    st->size = kernel->size;
+    st->r = kernel->size / 2;
+    st->col = st->kernel + (size_t)kernel->size * kernel->size;
+    st->row = st->col + kernel->size;
+    st->separable = kernel_separate(kernel, st->col, st->row);
+    st->border_mode = border_mode;
+    return IMG_OK;
+}
+
+ImgError
+img_pipe_filter2D(Pipeline *pipe, KernelType type, KernelSize size, BorderMode border_mode)
+{
+    ImgError err;
+    Kernel kernel = {0};
 
-    err = kernel_alloc(size, kernel);
-    if(err != IMG_OK) goto error;
-    switch(type) {
-        case IMG_KERNEL_IDENTITY:
+    MUST(pipe != NULL, "pipe is NULL in img_pipe_filter2D");
+    if (pipe->err != IMG_OK)
+        return pipe->err;
 
-            memset(kernel->data, 0, size_squared * sizeof(float));
-            kernel->data[center] = 1.0f;
-            break;
+    err = img_get_kernel(type, size, &kernel);
+    if (err != IMG_OK) {
+        pipe->err = err;
+        return err;
+    }
+    err = img_pipe_convolve(pipe, &kernel, border_mode);
+    img_free_kernel(&kernel);
+    return err;
+}
 
-        case IMG_KERNEL_BOX_BLUR:
+ImgError
+img_pipe_resize(Pipeline *pipe, u32 new_width, u32 new_height, ResizeFilter filter)
+{
+    PipeStage *st;
+    ImgError err;
+    u32 x;
+
+    st = pipe_push(pipe, PIPE_RESIZE);
+    if (st == NULL)
+        return pipe->err;
+    if (new_width < 1 || new_height < 1)
+        return pipe_fail(pipe, IMG_ERR_INVALID_PARAMETERS);
+
+    st->filter = filter;
+    if (filter == IMG_RESIZE_NEAREST) {
+        st->xmap = malloc(new_width * sizeof(u32));
+        if (st->xmap == NULL)
+            return pipe_fail(pipe, IMG_ERR_MEMORY);
+        for (x = 0; x < new_width; x++)
+            st->xmap[x] = RESIZE_NEAREST_SRC(x, st->in_width, new_width) * st->in_channels;
+    } else {
+        err = resize_taps(&st->tx, st->in_width, new_width, filter, 0);
+        if (err == IMG_OK)
+            err = resize_taps(&st->ty, st->in_height, new_height, filter, 0);
+        if (err != IMG_OK)
+            return pipe_fail(pipe, err);
+    }
 
-            for (i = 0; i < (size_squared); i++)
-                kernel->data[i] = 1.0f / size_squared ;
+    st->width = pipe->width = new_width;
+    st->height = pipe->height = new_height;
+    return IMG_OK;
+}
 
-            break;
+/* operand may be NULL for the scalar ops */
+static ImgError
+pipe_arith(Pipeline *pipe, Image *operand, ArithOp op, float param)
+{
+    PipeStage *st;
+    ImgError err;
 
+    st = pipe_push(pipe, PIPE_ARITH);
+    if (st == NULL)
+        return pipe->err;
+
+    if (operand != NULL) {
+        MUST(operand->data != NULL, "operand->data is NULL in pipe_arith");
+        if (operand->width != st->in_width || operand->height != st->in_height ||
+            operand->channels != st->in_channels || operand->type != pipe->type)
+            return pipe_fail(pipe, IMG_ERR_INVALID_DIMENSIONS);
+        if (operand->layout != IMG_LAYOUT_INTERLEAVED || operand->depth != IMG_DEPTH_U8)
+            return pipe_fail(pipe, IMG_ERR_UNSUPPORTED_FORMAT);
+    }
 
-        case IMG_KERNEL_SHARPEN:
+    err = arith_prepare(&st->arith, op, param);
+    if (err != IMG_OK)
+        return pipe_fail(pipe, err);
+    st->operand = operand;
+    return IMG_OK;
+}
 
-            /*TODO: implement a generalized funciton that creates a sharpen kernel of custom size n */
+ImgError
+img_pipe_add(Pipeline *pipe, Image *img)
+{
+    MUST(img != NULL, "img is NULL in img_pipe_add");
+    return pipe_arith(pipe, img, ARITH_ADD, 0.0f);
+}
 
-            /*May be replaced by fill_kernel util ?, i don't know*/
-            memcpy(kernel->data, sharpen, size_squared * sizeof(float));
-            break;
+ImgError
+img_pipe_subtract(Pipeline *pipe, Image *img, SubtractMode mode)
+{
+    MUST(img != NULL, "img is NULL in img_pipe_subtract");
+    return pipe_arith(pipe, img, ARITH_SUB, mode);
+}
 
-        case IMG_KERNEL_SOBEL_X:
+ImgError
+img_pipe_blend(Pipeline *pipe, Image *img, float alpha)
+{
+    MUST(img != NULL, "img is NULL in img_pipe_blend");
+    return pipe_arith(pipe, img, ARITH_BLEND, alpha);
+}
 
-            memcpy(kernel->data, sobel_x, size_squared * sizeof(float));
-            break;
+ImgError
+img_pipe_multiply(Pipeline *pipe, Image *img)
+{
+    MUST(img != NULL, "img is NULL in img_pipe_multiply");
+    return pipe_arith(pipe, img, ARITH_MUL, 0.0f);
+}
 
-        case IMG_KERNEL_SOBEL_Y:
+ImgError
+img_pipe_add_scalar(Pipeline *pipe, i16 value)
+{
+    return pipe_arith(pipe, NULL, ARITH_ADD_SCALAR, value);
+}
 
-            memcpy(kernel->data, sobel_y, size_squared * sizeof(float));
-            break;
+ImgError
+img_pipe_multiply_scalar(Pipeline *pipe, float factor)
+{
+    return pipe_arith(pipe, NULL, ARITH_LUT, factor);
+}
 
-        case IMG_KERNEL_LAPLACIAN:
-            /*TODO: implement a funciton that creates a laplacian kernel of custom size n */
-            assert(size == IMG_KERNEL_3x3);
+/*
+    Lays out the buffers one thread needs for stage st at base + offset,
+    returns the new offset. With base NULL it only measures.
+*/
+static size_t
+pipe_layout(const PipeStage *st, PipeState *ps, u8 *base, size_t off)
+{
+    size_t n, slots, slot_size, padn;
 
-            float laplacian[] = {
-                0.0f,  1.0f, 0.0f,
-                1.0f, -4.0f, 1.0f,
-                0.0f,  1.0f, 0.0f
-            };
-            memcpy(kernel->data, laplacian, size_squared * sizeof(float));
-            break;
+#define PIPE_CARVE(ptr, bytes) \
+    do { \
+        if (base != NULL) (ptr) = (void *)(base + off); \
+        off += ((bytes) + 31) & ~(size_t)31; \
+    } while (0)
 
-        case IMG_KERNEL_GAUSSIAN_BLUR:
-            /*TODO: implement the gaussian formula */
+    n = (size_t)st->in_width * st->in_channels;
+    padn = n + 2 * (size_t)st->r * st->in_channels;
+    slots = slot_size = 0;
+
+    PIPE_CARVE(ps->out, (size_t)st->width * st->channels);
+    switch (st->kind) {
+        case PIPE_CONVOLVE:
+            slots = st->size;
+            slot_size = st->separable ? n : padn;
+            PIPE_CARVE(ps->ring, slots * slot_size * sizeof(float));
+            PIPE_CARVE(ps->padded, padn * sizeof(float));
+            PIPE_CARVE(ps->acc, n * sizeof(float));
+            PIPE_CARVE(ps->frows, slots * sizeof(*ps->frows));
+            break;
+        case PIPE_RESIZE:
+            if (st->filter == IMG_RESIZE_NEAREST) break;
+            slots = st->ty.ntaps;
+            slot_size = (size_t)st->width * st->channels;
+            PIPE_CARVE(ps->ring, slots * slot_size);
+            PIPE_CARVE(ps->rows, slots * sizeof(*ps->rows));
+            break;
         default:
-            err = IMG_ERR_MEMORY; goto error;
             break;
     }
+    PIPE_CARVE(ps->ring_tag, slots * sizeof(i64));
 
-error:
-    return err;
+#undef PIPE_CARVE
+
+    if (base != NULL) {
+        ps->tag = PIPE_NO_ROW;
+        ps->ring_len = (u32)slot_size;
+        while (slots > 0)
+            ps->ring_tag[--slots] = PIPE_NO_ROW;
+    }
+    return off;
 }
 
-ImgError
-img_filter2D(Image *dest, Image *img, KernelType type, KernelSize size, BorderMode border_mode)
+static void pipe_compute(PipeRun *run, u32 id, u32 s, u32 y, u8 *out);
+
+/* Output row y of stage s, s == 0 reads the source */
+static const u8 *
+pipe_input(PipeRun *run, u32 id, u32 s, u32 y)
 {
-    ImgError err;
-    Kernel kernel = {0};
-    MUST(img       != NULL, "img is NULL in img_filter2D");
-    MUST(img->data != NULL, "img->data is NULL in img_filter2D");
-    MUST(dest      != NULL, "dest is NULL in img_filter2D");
+    PipeState *ps;
 
-    err = img_get_kernel(type, size, &kernel);
-    if (err != IMG_OK) goto error;
+    if (s == 0)
+        return run->src->data + (size_t)(y - run->src_y0) * run->src->stride;
 
-    err = img_convolve(dest, img, &kernel, border_mode);
-    if (err != IMG_OK) goto error;
+    ps = &run->state[id * run->pipe->nstages + s - 1];
+    if (ps->tag != y) {
+        pipe_compute(run, id, s - 1, y, ps->out);
+        ps->tag = y;
+    }
+    return ps->out;
+}
 
-    img_free_kernel(&kernel);
+static void
+pipe_convolve(PipeRun *run, u32 id, u32 s, u32 y, u8 *out)
+{
+    const PipeStage *st = run->pipe->stages[s];
+    PipeState *ps = &run->state[id * run->pipe->nstages + s];
+    const float **rows = ps->frows;
+    const u8 *src;
+    float *slot;
+    u32 j, k, n, size;
+    i64 iy;
+
+    size = st->size;
+    n = st->in_width * st->in_channels;
+
+    for (k = 0; k < size; k++) {
+        iy = (i64)y - st->r + k;
+        if (st->border_mode == IMG_BORDER_REPLICATE)
+            iy = MIN(MAX(iy, 0), (i64)st->in_height - 1);
+
+        /* the window covers at most `size` consecutive rows, no two share a slot */
+        j = (u32)((iy + size) % size);
+        slot = (float *)ps->ring + (size_t)j * ps->ring_len;
+        if (ps->ring_tag[j] != iy) {
+            src = iy < 0 || iy >= st->in_height ? NULL : pipe_input(run, id, s, (u32)iy);
+            if (st->separable) {
+                conv_pad_row(ps->padded, src, IMG_DEPTH_U8, st->in_width, st->in_channels, st->r, st->border_mode);
+                memset(slot, 0, n * sizeof(float));
+                run->ops->hpass(slot, ps->padded, n, st->row, size, st->in_channels);
+            } else {
+                conv_pad_row(slot, src, IMG_DEPTH_U8, st->in_width, st->in_channels, st->r, st->border_mode);
+            }
+            ps->ring_tag[j] = iy;
+        }
+        rows[k] = slot;
+    }
 
-error:
-    return err;
+    if (st->separable) {
+        run->ops->vpass(ps->acc, rows, n, st->col, size);
+    } else {
+        memset(ps->acc, 0, n * sizeof(float));
+        for (k = 0; k < size; k++)
+            run->ops->hpass(ps->acc, rows[k], n, st->kernel + k * size, size, st->in_channels);
+    }
+    run->ops->store(out, ps->acc, n);
 }
 
-ImgError
-img_print_kernel(Kernel *kernel)
+static void
+pipe_resize(PipeRun *run, u32 id, u32 s, u32 y, u8 *out)
 {
-    ImgError err;
-    MUST(kernel       != NULL, "kernel is NULL in img_print_kernel");
-    MUST(kernel->data != NULL, "kernel is NULL in img_print_kernel");
+    const PipeStage *st = run->pipe->stages[s];
+    PipeState *ps = &run->state[id * run->pipe->nstages + s];
+    u8 *slot;
+    u32 k, iy, ntaps;
+
+    if (st->filter == IMG_RESIZE_NEAREST) {
+        resize_nearest_row(out, pipe_input(run, id, s, RESIZE_NEAREST_SRC(y, st->in_height, st->height)),
+                           st->xmap, st->width, st->channels);
+        return;
+    }
 
-    err = IMG_OK;
-    for (int i = 0; i < kernel->size; i++) {
-        for (int j = 0; j < kernel->size; j++) {
-            printf("%6.2f ", kernel->data[i * kernel->size + j]);
+    ntaps = st->ty.ntaps;
+    for (k = 0; k < ntaps; k++) {
+        iy = st->ty.start[y] + k;
+        slot = (u8 *)ps->ring + (size_t)(iy % ntaps) * ps->ring_len;
+        if (ps->ring_tag[iy % ntaps] != iy) {
+            resize_hpass(slot, pipe_input(run, id, s, iy), &st->tx, st->width, st->channels);
+            ps->ring_tag[iy % ntaps] = iy;
         }
-        printf("\n");
+        ps->rows[k] = slot;
     }
-    return err;
+    resize_vpass(out, ps->rows, st->ty.w + (size_t)y * ntaps, ntaps, ps->ring_len);
 }
 
+/* Fills out with output row y of stage s */
+static void
+pipe_compute(PipeRun *run, u32 id, u32 s, u32 y, u8 *out)
+{
+    const PipeStage *st = run->pipe->stages[s];
+    const Image *b;
 
+    switch (st->kind) {
+        case PIPE_COLOR:
+            cvt_row(&st->cvt, out, pipe_input(run, id, s, y), st->width, st->in_channels, st->channels);
+            break;
+        case PIPE_CONVOLVE:
+            pipe_convolve(run, id, s, y, out);
+            break;
+        case PIPE_RESIZE:
+            pipe_resize(run, id, s, y, out);
+            break;
+        case PIPE_ARITH:
+            b = st->operand == run->dest ? run->snapshot : st->operand;
+            arith_row(out, pipe_input(run, id, s, y),
+                      b != NULL ? b->data + (size_t)y * b->stride : NULL,
+                      st->width * st->channels, &st->arith);
+            break;
+    }
+}
 
-void
-img_free_kernel(Kernel *kernel)
+static void
+pipe_rows(void *ctx, u32 id, u32 y0, u32 y1)
 {
-    MUST(kernel       != NULL, "kernel is NULL in img_free_kernel");
-    MUST(kernel->data != NULL, "kernel is NULL in img_free_kernel");
+    PipeRun *run = ctx;
+    Pipeline *pipe = run->pipe;
+    u8 *out;
+    u32 y;
+
+    for (y = run->y0 + y0; y < run->y0 + y1; y++) {
+        out = run->dest->data + (size_t)(y - run->out_y0) * run->dest->stride;
+        if (pipe->nstages == 0)
+            memcpy(out, pipe_input(run, id, 0, y), (size_t)pipe->width * pipe->channels);
+        else
+            pipe_compute(run, id, pipe->nstages - 1, y, out);
+    }
+}
 
-    free(kernel->data);
-    kernel->data = NULL;
-    kernel->size = 0;
+/* Narrows output rows [*lo, *hi) of the pipeline down to the source rows they read */
+static void
+pipe_span(const Pipeline *pipe, u32 *lo, u32 *hi)
+{
+    const PipeStage *st;
+    u32 s;
+
+    for (s = pipe->nstages; s-- > 0;) {
+        st = pipe->stages[s];
+        if (st->kind == PIPE_CONVOLVE) {
+            *lo = *lo > st->r ? *lo - st->r : 0;
+            *hi = MIN(*hi + st->r, st->in_height);
+        } else if (st->kind == PIPE_RESIZE && st->filter == IMG_RESIZE_NEAREST) {
+            *lo = RESIZE_NEAREST_SRC(*lo, st->in_height, st->height);
+            *hi = RESIZE_NEAREST_SRC(*hi - 1, st->in_height, st->height) + 1;
+        } else if (st->kind == PIPE_RESIZE) {
+            *lo = st->ty.start[*lo];
+            *hi = st->ty.start[*hi - 1] + st->ty.ntaps;
+        }
+    }
 }
 
-/* TODO: This is probably the worst implementation ever.
-   Many things can be handled more efficiently.
-*/
-ImgError 
-img_convolve(Image *dest, Image *img, Kernel *kernel, BorderMode border_mode)
+/* Slides the window of source rows to [lo, hi), both only ever grow */
+static ImgError
+pipe_fill_window(PipeRun *run, u32 lo, u32 hi)
 {
     ImgError err;
-    u8 channels, *p;
-    u16 x, y, half_kernel;
-    i16 kx, ky, px , py;
-    double sum_r, sum_g, sum_b;
-    float kernel_val;
-    u32 offset;
-
-    MUST(img             != NULL, "img is NULL in img_convolve");
-    MUST(img->data       != NULL, "img->data is NULL in img_convolve");
-    MUST(kernel->data     != NULL, "kernel->data is NULL in img_convolve");
-    MUST(kernel->size % 2 != 0,    "kernel->size % 2 == 0 NULL in img_convolve");
+    PnmReader *rd = run->pipe->reader;
+    Image *w = &run->window;
+    u32 keep, n;
+
+    keep = run->src_y1 > lo ? run->src_y1 - lo : 0;
+    if (keep > 0 && lo > run->src_y0)
+        memmove(w->data, w->data + (size_t)(lo - run->src_y0) * w->stride, (size_t)keep * w->stride);
+
+    /* rows nobody reads (nearest neighbour shrinking) */
+    while (rd->row < lo) {
+        n = MIN(lo - rd->row, w->height);
+        err = pnm_read_rows(rd, w->data, w->stride, n);
+        if (err != IMG_OK) return err;
+    }
 
-    err = IMG_OK;
-    half_kernel = kernel->size /2;
-    channels = img->channels;
+    run->src_y0 = lo;
+    run->src_y1 = hi;
+    if (rd->row < hi)
+        return pnm_read_rows(rd, w->data + (size_t)(rd->row - lo) * w->stride, w->stride, hi - rd->row);
+    return IMG_OK;
+}
 
-    err = img_cpy(dest, img);
-    if(err != IMG_OK) goto error;
+/* Output rows per round when streaming, enough for every thread to get a few bands */
+static u32
+pipe_chunk_rows(const PipeRun *run)
+{
+    return MIN(MAX(64, 4 * run->nthreads * run->grain), run->pipe->height);
+}
 
-    for (y = 0; y < dest->height; y++) {
-        for (x = 0; x < dest->width; x++) {
-            sum_r = 0.0, sum_g = 0.0, sum_b = 0.0;
-
-            for (ky = -half_kernel; ky <= half_kernel; ky++) {
-                for (kx = -half_kernel; kx <= half_kernel; kx++) {
-                    px = x + kx;
-                    py = y + ky;
-
-                    if (px < 0 || px >= dest->width || py < 0 || py >= dest->height) {
-                        switch(border_mode) {
-                            case IMG_BORDER_ZERO_PADDING:
-                                continue;
-                            case IMG_BORDER_REPLICATE:
-                                px = MIN(MAX(px, 0), dest->width - 1);
-                                py = MIN(MAX(py, 0), dest->height - 1);
-                        }
-                    }
+/*
+    Runs the output rows a chunk at a time, reading source rows from
+    pipe->reader and/or handing the finished rows to wr as it goes.
+*/
+static ImgError
+pipe_chunks(PipeRun *run, PnmWriter *wr)
+{
+    ImgError err;
+    Pipeline *pipe = run->pipe;
+    u32 y0, y1, lo, hi, rows, cap;
 
-                    // Get kernel value
-                    kernel_val = kernel->data[(ky + half_kernel) * kernel->size + (kx + half_kernel)];
+    err = IMG_OK;
+    rows = pipe_chunk_rows(run);
+    if (pipe->reader != NULL && pipe->reader->row != 0)
+        return IMG_ERR_INVALID_PARAMETERS;     /* already run once */
+
+    if (pipe->reader != NULL) {
+        for (cap = 0, y0 = 0; y0 < pipe->height; y0 += rows) {
+            lo = y0;
+            hi = MIN(y0 + rows, pipe->height);
+            pipe_span(pipe, &lo, &hi);
+            cap = MAX(cap, hi - lo);
+        }
+        err = img_init(&run->window, pipe->reader->width, cap, pipe->reader->channels, NULL);
+        if (err != IMG_OK) goto error;
+        run->src = &run->window;
+    }
+    if (wr != NULL) {
+        err = img_init(&run->chunk, pipe->width, rows, pipe->channels, NULL);
+        if (err != IMG_OK) goto error;
+        run->chunk.type = pipe->type;
+        run->dest = &run->chunk;
+    }
 
-                    // Get pixel from the img
-                    offset = py * dest->stride + px * channels;
-                    sum_r += img->data[offset] * kernel_val;
-                    if(channels == 3){
-                        sum_g += img->data[offset + 1] * kernel_val;
-                        sum_b += img->data[offset + 2] * kernel_val;
-                    }
-                }
-            }
+    for (y0 = 0; y0 < pipe->height; y0 = y1) {
+        y1 = MIN(y0 + rows, pipe->height);
+        if (pipe->reader != NULL) {
+            lo = y0;
+            hi = y1;
+            pipe_span(pipe, &lo, &hi);
+            err = pipe_fill_window(run, lo, hi);
+            if (err != IMG_OK) goto error;
+        }
 
-            sum_r = MIN(MAX(sum_r, 0.0), 255.0);
-            if(channels == 3){
-                sum_g = MIN(MAX(sum_g, 0.0), 255.0);
-                sum_b = MIN(MAX(sum_b, 0.0), 255.0);
-            }
+        run->y0 = y0;
+        if (wr != NULL)
+            run->out_y0 = y0;
+        img_parallel_rows(run->nthreads, y1 - y0, run->grain, pipe_rows, run);
 
-            // Write output directly to the image
-            p = IMG_PIXEL_PTR(dest, x, y);
-            p[0] = (u8)sum_r;
-            if(channels == 3){
-                p[1] = (u8)sum_g;
-                p[2] = (u8)sum_b;
-            }
+        if (wr != NULL) {
+            run->chunk.height = y1 - y0;
+            err = img_writer_write(wr, &run->chunk);
+            run->chunk.height = rows;
+            if (err != IMG_OK) goto error;
         }
     }
+
 error:
     return err;
 }
 
-ImgError
-img_rgb2gray(Image *dest, Image *img)
+static void
+pipe_end(PipeRun *run)
+{
+    scratch_release(run->mark);
+    if (run->window.data != NULL)
+        img_free(&run->window);
+    if (run->chunk.data != NULL)
+        img_free(&run->chunk);
+}
+
+/* Per-thread state and a copy of dest when one of the steps reads it */
+static ImgError
+pipe_begin(PipeRun *run, Pipeline *pipe, Image *dest)
 {
     ImgError err;
-    u16 x,y;
-    u8 pixel[4] = {0, 0, 0, 0}, newpixel[1] = {0};
+    size_t per_thread, off;
+    u32 s, t, widest;
+    int aliased;
+
+    memset(run, 0, sizeof(*run));
+    run->pipe = pipe;
+    run->dest = dest;
+    run->src = pipe->src;
+    run->src_y1 = pipe->src != NULL ? pipe->src->height : 0;
+    run->ops = conv_ops();
+    run->nthreads = img_get_threads();
+    run->mark = scratch_mark();
 
-    MUST(dest      != NULL, "dest is NULL in img_rgb2gray");
-    MUST(img       != NULL, "img is NULL in img_rgb2gray");
-    MUST(img->data != NULL, "img->data is NULL in img_rgb2gray");
+    err = IMG_OK;
+    aliased = dest != NULL && dest == pipe->src;
+    for (s = 0; s < pipe->nstages; s++)
+        aliased |= dest != NULL && pipe->stages[s]->operand == dest;
+    if (aliased) {
+        err = scratch_copy(&run->copy, dest);
+        if (err != IMG_OK) goto error;
+        run->snapshot = &run->copy;
+        if (run->src == dest)
+            run->src = &run->copy;
+    }
 
-    err = img_realloc_pixels(dest, img->width, img->height, 1);
-    if(err != IMG_OK) goto error;
+    per_thread = 0;
+    widest = pipe->width;
+    for (s = 0; s < pipe->nstages; s++) {
+        per_thread = pipe_layout(pipe->stages[s], NULL, NULL, per_thread);
+        widest = MAX(widest, pipe->stages[s]->in_width);
+    }
+    /* big enough bands that re-reading a window's worth of rows at each band edge is cheap */
+    run->grain = MAX(16, ROW_GRAIN(widest));
 
-    dest->type = IMG_PGM_BIN;
-    for(x = 0; x < dest->width; ++x) {
-        for(y = 0; y < dest->height; ++y) {
-            img_getpx(img, x, y, pixel);
-            /* refernce for the formula: https://poynton.ca/PDFs/ColorFAQ.pdf */
-            newpixel[0] = 0.2125 * pixel[0] + 0.7154 * pixel[1] + 0.0721 * pixel[2];
-            img_setpx(dest, x, y, newpixel);
-        }
+    run->state = scratch_alloc((size_t)run->nthreads * MAX(pipe->nstages, 1) * sizeof(PipeState));
+    run->block = scratch_alloc(MAX(run->nthreads * per_thread, 1));
+    if (run->state == NULL || run->block == NULL) {
+        err = IMG_ERR_MEMORY; goto error;
     }
+    memset(run->state, 0, (size_t)run->nthreads * MAX(pipe->nstages, 1) * sizeof(PipeState));
+    for (t = 0; t < run->nthreads; t++)
+        for (s = 0, off = 0; s < pipe->nstages; s++)
+            off = pipe_layout(pipe->stages[s], &run->state[t * pipe->nstages + s],
+                              run->block + t * per_thread, off);
 
 error:
     return err;
 }
 
-/* TODO: Find an efficient implementation for this cubic kernel */
-static float
-cubic_kernel(float x)
-{
-     // return (float)((P(x+2) * P(x+2) * P(x+2)) - 4 *(P(x+1) * P(x+1) * P(x+1)) + 6 * (P(x) * P(x) * P(x)) - 4 * (P(x - 1) * P(x - 1) * P(x - 1)))/6;
-    x = ABS(x);
-    if (x <= 1.0f)
-        return (1.5f * x - 2.5f) * x * x + 1.0f;
-    else if (x < 2.0f)
-        return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
-    return 0.0f;
-}
-
-
 /*
-    resize Using Bicubic Interpolation
-    Reference: https://iopscience.iop.org/article/10.1088/1742-6596/1114/1/012066
+    Runs the pipeline into dest, which may be the source or an operand of
+    one of the steps (it is then read from a copy). An empty pipeline
+    copies the source.
 */
-/* TODO: Optimize redundant calculations and memory access */
 ImgError
-img_resize(Image *dest, Image *src, u16 new_width, u16 new_height)
+img_pipe_run(Pipeline *pipe, Image *dest)
 {
     ImgError err;
-    float scale_x, scale_y, src_x, src_y, value;
-    int ix, iy, c, n, m;
-    u16  x, y;
-    u8 pixel[3] = {0}, spixel[3];
+    PipeRun run;
 
-    err = IMG_OK;
-    MUST(dest != NULL, "dest is NULL in img_resize");
-    MUST(src  != NULL, "src is NULL in img_resize");
+    MUST(pipe != NULL, "pipe is NULL in img_pipe_run");
+    MUST(dest != NULL, "dest is NULL in img_pipe_run");
 
-    if(new_width < 1 || new_height < 1){
-        err = IMG_ERR_INVALID_PARAMETERS; goto error;
-    }
+    if (pipe->err != IMG_OK)
+        return pipe->err;
+    if (pipe->nstages == 0 && pipe->src != NULL)
+        return dest == pipe->src ? IMG_OK : img_cpy(dest, pipe->src);
 
-    err = img_realloc_pixels(dest, new_width, new_height, src->channels);
-    dest->type = src->type;
+    STATS_BEGIN(IMG_OP_PIPE_RUN);
+    err = pipe_begin(&run, pipe, dest);
+    if (err != IMG_OK) goto cleanup;
 
-    scale_x = (float)src->width / new_width;
-    scale_y = (float)src->height / new_height;
-
-    for (y = 0; y < new_height; y++) {
-        for (x = 0; x < new_width; x++) {
-            src_x = (x + 0.5f) * scale_x - 0.5f;
-            src_y = (y + 0.5f) * scale_y - 0.5f;
-            ix = (int)FLOOR(src_x);
-            iy = (int)FLOOR(src_y);
-
-            for (c = 0; c < src->channels; c++) {
-                value = 0.0f;
-                for (m = -1; m <= 2; m++) {
-                    for (n = -1; n <= 2; n++) {
-                        int sx = ix + n;
-                        int sy = iy + m;
-                        if (sx < 0) sx = 0;
-                        if (sy < 0) sy = 0;
-                        sx = (sx >= src->width ? src->width - 1 : sx);
-                        sy = (sy >= src->height ? src->height - 1 : sy);
-
-                        img_getpx(src, sx, sy, spixel);
-                        value += spixel[c] * cubic_kernel(n - (src_x - ix)) * cubic_kernel(m - (src_y - iy));
-                    }
-                }
-                pixel[c] = MIN(MAX(value, 0), 255);
-            }
-            img_setpx(dest, x, y, pixel);
-        }
+    if (dest->data == NULL || dest->width != pipe->width ||
+        dest->height != pipe->height || dest->channels != pipe->channels ||
+        dest->depth != IMG_DEPTH_U8 || dest->layout != IMG_LAYOUT_INTERLEAVED) {
+        err = img_realloc_pixels(dest, pipe->width, pipe->height, pipe->channels);
+        if (err != IMG_OK) goto cleanup;
     }
-error:
+    dest->type = pipe->type;
+
+    if (pipe->reader != NULL)
+        err = pipe_chunks(&run, NULL);
+    else
+        img_parallel_rows(run.nthreads, pipe->height, run.grain, pipe_rows, &run);
+
+cleanup:
+    pipe_end(&run);
+    STATS_END(err == IMG_OK ? (u64)pipe->width * pipe->height : 0);
     return err;
 }
 
-
+/*
+    Runs the pipeline into a file opened with img_writer_open, whose size
+    has to match the output of the pipeline. Together with a pipeline made
+    by img_pipe_init_stream memory stays bounded by the rows each step
+    needs, not the image size.
+*/
 ImgError
-img_add(Image *dest, Image *img1, Image *img2)
+img_pipe_run_stream(Pipeline *pipe, PnmWriter *wr)
 {
     ImgError err;
-    u16 x, y, width, height, sum;
-    u8 ch, channels, pixel1[] = {0, 0, 0, 0}, pixel2[] = {0, 0, 0, 0};
+    PipeRun run;
+
+    MUST(pipe != NULL, "pipe is NULL in img_pipe_run_stream");
+    MUST(wr   != NULL, "wr is NULL in img_pipe_run_stream");
+
+    if (pipe->err != IMG_OK)
+        return pipe->err;
+    if (wr->width != pipe->width || wr->height - wr->row != pipe->height ||
+        wr->channels != pipe->channels)
+        return IMG_ERR_INVALID_DIMENSIONS;
+
+    STATS_BEGIN(IMG_OP_PIPE_RUN_STREAM);
+    err = pipe_begin(&run, pipe, NULL);
+    if (err == IMG_OK)
+        err = pipe_chunks(&run, wr);
+    pipe_end(&run);
+    STATS_END(err == IMG_OK ? (u64)pipe->width * pipe->height : 0);
+    return err;
+}
 
-    MUST(img1       != NULL, "img1 is NULL in img_add");
-    MUST(img2       != NULL, "img1 is NULL in img_add");
-    MUST(img1->data != NULL, "img1->data is NULL in img_add");
-    MUST(img2->data != NULL, "img1->data is NULL in img_add");
-    MUST(dest       != NULL, "dest is NULL in img_add");
+/*
+    Batches
+
+    img_batch_run spreads the items over the thread pool, each thread
+    taking the next unclaimed item from a shared counter until none are
+    left and running nested calls inline. Every item is decoded, pushed through a pipeline made of the
+    batch steps (one pass over the rows, no intermediate images) and saved
+    or handed back. A thread keeps its decode buffer, its output image and
+    the pipeline it built last, which is reused as long as the next item
+    has the same size and format. Before working on an item it claims the
+    next one, maps its file and asks the kernel to read it ahead, so the
+    disk works while the CPU does, however few items each thread gets.
+*/
 
-    err = IMG_OK;
-    if(img1->width != img2->width       ||
-       img1->height != img2->height     ||
-       img1->channels != img2->channels ||
-       img1->type != img2->type
-    ){
-        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
-    }
+typedef struct {
+    Image pool;             /* decoded pixels when they are not borrowed */
+    Image out;              /* result on its way to an out_path */
+    Pipeline pipe;          /* built for the input below */
+    int built;
+    u32 width, height;
+    u8 channels;
+    ImgType type;
+    u64 pixels;             /* produced by the items that succeeded */
+} BatchWorker;
 
-    width = img1->width;
-    height = img1->height;
-    channels = img1->channels;
+typedef struct {
+    u8 *buf;
+    size_t size;
+    int flags;              /* PNM_MAPPED when buf is a mapping of path */
+    ImgError err;
+} BatchInput;
+
+typedef struct {
+    BatchItem *items;
+    u32 nitems;
+    const BatchOp *ops;
+    u32 nops;
+    BatchWorker *workers;
+    pthread_mutex_t lock;
+    u32 next;               /* first unclaimed item */
+} BatchJob;
+
+static int
+batch_claim(BatchJob *job, u32 *item)
+{
+    int ok;
 
-    err = img_realloc_pixels(dest, width, height, channels);
-    dest->type = img1->type;
-    if(err != IMG_OK) goto error;
+    pthread_mutex_lock(&job->lock);
+    ok = job->next < job->nitems;
+    if (ok) *item = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    return ok;
+}
 
-    for(y = 0; y < height; ++y){
-        for(x = 0; x < width; ++x){
-            img_getpx(img1, x, y, pixel1);
-            img_getpx(img2, x, y, pixel2);
-            for(ch = 0; ch < channels; ++ch){
-                sum = (u16) pixel1[ch] + (u16) pixel2[ch];
-                pixel1[ch] = (u8)(MIN(255, sum));
-            }
-            img_setpx(dest, x, y, pixel1);
+static void
+batch_open(BatchInput *in, const BatchItem *item)
+{
+    in->flags = 0;
+    in->err = IMG_OK;
+    if (item->path == NULL) {
+        in->buf = (u8 *)item->buf;
+        in->size = item->size;
+        return;
+    }
+    in->err = pnm_map(item->path, &in->buf, &in->size);
+    if (in->err != IMG_OK)
+        return;
+    in->flags = PNM_MAPPED;
+    posix_madvise(in->buf, in->size, POSIX_MADV_WILLNEED);
+}
+
+static ImgError
+batch_build(Pipeline *pipe, Image *src, const BatchOp *ops, u32 nops)
+{
+    const BatchOp *op;
+    u32 i, w, h;
+
+    img_pipe_init(pipe, src);
+    for (i = 0; i < nops; i++) {
+        op = &ops[i];
+        switch (op->kind) {
+            case IMG_BATCH_RGB2GRAY:
+                img_pipe_rgb2gray(pipe, op->coeffs);
+                break;
+            case IMG_BATCH_FILTER2D:
+                img_pipe_filter2D(pipe, op->kernel, op->kernel_size, op->border_mode);
+                break;
+            case IMG_BATCH_RESIZE:
+                w = op->width;
+                h = op->height;
+                if (w == 0)
+                    w = (u32)MAX(1, ((u64)pipe->width * h + pipe->height / 2) / pipe->height);
+                if (h == 0)
+                    h = (u32)MAX(1, ((u64)pipe->height * w + pipe->width / 2) / pipe->width);
+                img_pipe_resize(pipe, w, h, op->filter);
+                break;
+            case IMG_BATCH_ADD_SCALAR:
+                img_pipe_add_scalar(pipe, (i16)op->value);
+                break;
+            case IMG_BATCH_MULTIPLY_SCALAR:
+                img_pipe_multiply_scalar(pipe, op->value);
+                break;
         }
     }
-error:
+    return pipe->err;
+}
+
+static ImgError
+batch_item(const BatchJob *job, BatchWorker *w, BatchItem *item, BatchInput *in)
+{
+    ImgError err;
+    Image src, *dest;
+
+    if (in->err != IMG_OK)
+        return in->err;
+
+    /* decode into the pooled buffer, which stays in w->pool when the rows are borrowed */
+    src = w->pool;
+    err = pnm_load_buf(&src, in->buf, in->size, IMG_UNKNOWN, NULL, in->flags | PNM_REUSE);
+    if (!src.borrowed)
+        w->pool = src;
+    if (err != IMG_OK)
+        return err;
+
+    if (!w->built || src.width != w->width || src.height != w->height ||
+        src.channels != w->channels || src.type != w->type) {
+        if (w->built)
+            img_pipe_free(&w->pipe);
+        w->built = 0;
+        err = batch_build(&w->pipe, &src, job->ops, job->nops);
+        if (err != IMG_OK) {
+            img_pipe_free(&w->pipe);
+            goto cleanup;
+        }
+        w->built = 1;
+        w->width = src.width;
+        w->height = src.height;
+        w->channels = src.channels;
+        w->type = src.type;
+    }
+    w->pipe.src = &src;
+
+    dest = item->out_path != NULL ? &w->out : &item->out;
+    err = img_pipe_run(&w->pipe, dest);
+    if (err == IMG_OK && item->out_path != NULL)
+        err = img_save(dest, item->out_path);
+    if (err == IMG_OK)
+        w->pixels += (u64)dest->width * dest->height;
+
+cleanup:
+    if (src.borrowed)
+        img_free(&src);
     return err;
 }
 
+/* Items as they are claimed, the file of the next one is read ahead, the band is ignored */
+static void
+batch_items(void *ctx, u32 id, u32 t0, u32 t1)
+{
+    BatchJob *job = ctx;
+    BatchInput cur, next;
+    u32 i, j;
+    int more;
+
+    if (!batch_claim(job, &j))
+        return;
+    batch_open(&next, &job->items[j]);
+    do {
+        i = j;
+        cur = next;
+        more = batch_claim(job, &j);
+        if (more)
+            batch_open(&next, &job->items[j]);
+        job->items[i].status = batch_item(job, &job->workers[id], &job->items[i], &cur);
+    } while (more);
+}
+
 /*
-    https://homepages.inf.ed.ac.uk/rbf/HIPR2/pixsub.htm
-    TODO: implement multiple subtraction methods (direct subtraction, absolute difference, and wrapped values)
-    and allow the user to select their preferred method
+    Runs the steps in ops on every item and sets its status. Items are
+    spread over the threads of the pool, each one processed by a single
+    thread. Returns IMG_OK when every item succeeded, otherwise the status
+    of the first one that failed.
 */
 ImgError
-img_subtract(Image *dest, Image *img1, Image *img2)
+img_batch_run(BatchItem *items, u32 nitems, const BatchOp *ops, u32 nops)
 {
     ImgError err;
-    u16 x, y, width, height;
-    u8 ch, diff, channels, pixel1[] = {0, 0, 0, 0}, pixel2[] = {0, 0, 0, 0};
+    BatchJob job;
+    ScratchMark mark;
+    u64 pixels;
+    u32 nthreads, i;
 
-    MUST(img1       != NULL, "img1 is NULL in img_add");
-    MUST(img2       != NULL, "img1 is NULL in img_add");
-    MUST(img1->data != NULL, "img1->data is NULL in img_add");
-    MUST(img2->data != NULL, "img1->data is NULL in img_add");
-    MUST(dest       != NULL, "dest is NULL in img_add");
+    MUST(items != NULL || nitems == 0, "items is NULL in img_batch_run");
+    MUST(ops   != NULL || nops == 0,   "ops is NULL in img_batch_run");
 
+    STATS_BEGIN(IMG_OP_BATCH_RUN);
     err = IMG_OK;
-    if(img1->width != img2->width       ||
-       img1->height != img2->height     ||
-       img1->channels != img2->channels ||
-       img1->type != img2->type
-    ){
-        err = IMG_ERR_INVALID_DIMENSIONS; goto error;
+    pixels = 0;
+    if (nops > IMG_PIPE_MAX_STAGES) {
+        err = IMG_ERR_INVALID_PARAMETERS; goto error;
     }
-
-    width = img1->width;
-    height = img1->height;
-    channels = img1->channels;
-
-    err = img_realloc_pixels(dest, width, height, channels);
-    dest->type = img1->type;
-    if(err != IMG_OK)  goto error;
-
-    for(y = 0; y < height; ++y){
-        for(x = 0; x < width; ++x){
-            img_getpx(img1, x, y, pixel1);
-            img_getpx(img2, x, y, pixel2);
-            for(ch = 0; ch < channels; ++ch){
-                diff = pixel1[ch] - pixel2[ch];
-                pixel2[ch] = MAX(0, diff);
-            }
-            img_setpx(dest, x, y, pixel2);
+    for (i = 0; i < nops; i++) {
+        if (ops[i].kind < IMG_BATCH_RGB2GRAY || ops[i].kind > IMG_BATCH_MULTIPLY_SCALAR ||
+            (ops[i].kind == IMG_BATCH_RESIZE && ops[i].width == 0 && ops[i].height == 0)) {
+            err = IMG_ERR_INVALID_PARAMETERS; goto error;
         }
     }
+    for (i = 0; i < nitems; i++)
+        MUST(items[i].path != NULL || items[i].buf != NULL, "item has neither path nor buf in img_batch_run");
+
+    mark = scratch_mark();
+    nthreads = img_get_threads();
+    job.items = items;
+    job.nitems = nitems;
+    job.ops = ops;
+    job.nops = nops;
+    job.next = 0;
+    job.workers = scratch_alloc(nthreads * sizeof(BatchWorker));
+    if (job.workers == NULL) {
+        err = IMG_ERR_MEMORY; goto cleanup;
+    }
+    memset(job.workers, 0, nthreads * sizeof(BatchWorker));
+
+    /* one band per thread, the items are claimed one by one */
+    pthread_mutex_init(&job.lock, NULL);
+    img_parallel_rows(nthreads, MIN(nthreads, nitems), 1, batch_items, &job);
+    pthread_mutex_destroy(&job.lock);
+
+    for (i = 0; i < nthreads; i++) {
+        pixels += job.workers[i].pixels;
+        if (job.workers[i].built)
+            img_pipe_free(&job.workers[i].pipe);
+        if (job.workers[i].pool.data != NULL)
+            img_free(&job.workers[i].pool);
+        if (job.workers[i].out.data != NULL)
+            img_free(&job.workers[i].out);
+    }
+    for (i = 0; i < nitems && err == IMG_OK; i++)
+        err = items[i].status;
+
+cleanup:
+    scratch_release(mark);
 error:
+    STATS_END(pixels);
     return err;
 }
@@ -34,6 +34,7 @@ typedef uint16_t u16;
 typedef uint8_t u8;
 
 typedef int64_t i64;
+typedef int32_t i32;
 typedef int16_t i16;
 typedef int8_t i8;
 
@@ -45,11 +46,22 @@ typedef enum {
     IMG_PGM_ASCII = 0x5032, // P2
 } ImgType;
 
+typedef enum {
+    IMG_DEPTH_U8 = 0,   /* 0-255, what every operation takes */
+    IMG_DEPTH_U16,      /* 0-65535, native byte order */
+    IMG_DEPTH_F32       /* float, 0-1 maps to the full range of the others, never clamped */
+} ImgDepth;
+
+typedef enum {
+    IMG_LAYOUT_INTERLEAVED = 0, /* RGBRGB..., what files and most callers use */
+    IMG_LAYOUT_PLANAR           /* RR..GG..BB.., one plane per channel */
+} ImgLayout;
+
 typedef enum {
     IMG_KERNEL_3x3 = 3,
     IMG_KERNEL_5x5 = 5,
     IMG_KERNEL_7x7 = 7,
-    IMG_KERNEL_11x11 = 7,
+    IMG_KERNEL_11x11 = 11,
 } KernelSize;
 
 typedef enum {
@@ -77,7 +89,9 @@ typedef enum {
     /* maybe used ? idk */
     IMG_ERR_COLOR_SPACE         = -11,   /* Unsupported or invalid color space            */
     IMG_ERR_CORRUPT_DATA        = -12,   /* The image data is corrupted                   */
-    IMG_ERR_UNKNOWN             = -13    /* Unknown error                                 */
+    IMG_ERR_UNKNOWN             = -13,   /* Unknown error                                 */
+    IMG_ERR_BUFFER_TOO_SMALL    = -14,   /* Caller-provided buffer cannot hold the result */
+    IMG_ERR_UNAVAILABLE         = -15    /* Feature not compiled into this build          */
 } ImgError;
 
 
@@ -88,12 +102,27 @@ typedef struct {
     - read about memory access patterns
     */
     u32 stride;
-    u16 width;
-    u16 height;
+    u32 width;
+    u32 height;
     u8 channels;
+    /* type of one sample, stride counts bytes whatever the depth */
+    ImgDepth depth;
 
+    /* IMG_LAYOUT_PLANAR: channel c is a one-channel plane starting at
+       data + c * plane_size, 64-byte aligned, and stride is the row size
+       within a plane */
+    ImgLayout layout;
+    size_t plane_size;
+
+    /* pixels come from this arena, or from malloc when NULL */
     Arena *arena;
-    u8 *owns_arena;
+    /* bytes allocated at data, reused while a new size fits */
+    size_t capacity;
+
+    /* pixels borrowed from a file mapping instead of allocated by us */
+    u8 borrowed;
+    void *map;
+    size_t map_size;
 
     ImgType type;
     ImgError status;
@@ -104,25 +133,257 @@ typedef struct {
     float *data;
 } Kernel;
 
+/* Kernel with its convolution setup done once, see img_prepare_kernel */
+typedef struct PreparedKernel PreparedKernel;
+
 typedef enum {
     IMG_BORDER_ZERO_PADDING,
     IMG_BORDER_REPLICATE
 } BorderMode;
 
+typedef enum {
+    IMG_SUBTRACT_SATURATE,
+    IMG_SUBTRACT_ABSDIFF,
+    IMG_SUBTRACT_WRAP
+} SubtractMode;
 
-ImgError img_init(Image *img, u16 width, u16 height, u8 channels, Arena* arena);
+typedef enum {
+    IMG_RESIZE_NEAREST,
+    IMG_RESIZE_BILINEAR,
+    IMG_RESIZE_BICUBIC,
+    IMG_RESIZE_LANCZOS3
+} ResizeFilter;
+
+typedef enum {
+    IMG_FLIP_HORIZONTAL,    /* left to right */
+    IMG_FLIP_VERTICAL,      /* top to bottom */
+    IMG_FLIP_BOTH           /* both, a half turn */
+} FlipMode;
+
+/* PNM file read a band of rows at a time */
+typedef struct {
+    u32 width;
+    u32 height;
+    u8 channels;
+    ImgType type;
+    u32 row;            /* first row the next img_reader_read returns */
+
+    u32 maxval;
+    u8 *map;
+    size_t map_size;
+    size_t pos;         /* next raster byte */
+    size_t released;    /* mapping before this was given back */
+} PnmReader;
+
+/* PNM file written a band of rows at a time */
+typedef struct {
+    u32 width;
+    u32 height;
+    u8 channels;
+    ImgType type;
+    u32 row;            /* rows written so far */
+    int fd;
+} PnmWriter;
+
+/* img_decode_pnm flag: use the rows of the input buffer as the pixels when they fit as they are */
+#define IMG_DECODE_BORROW 1
+
+/* Load or save running on a thread of its own, see img_load_async */
+typedef struct ImgAsync ImgAsync;
+
+#define IMG_PIPE_MAX_STAGES 16
+
+typedef struct PipeStage PipeStage;
+
+/*
+    Chain of operations run row by row by img_pipe_run, see image.c. The
+    first failing img_pipe_* step is remembered in err and returned again
+    by every later step and by img_pipe_run.
+*/
+typedef struct {
+    Image *src;
+    PnmReader *reader;      /* source rows come from here when src is NULL */
+    PipeStage *stages[IMG_PIPE_MAX_STAGES];
+    u32 nstages;
+    u32 width, height;      /* output geometry so far */
+    u8 channels;
+    ImgType type;
+    ImgError err;
+} Pipeline;
+
+/* Summed-area table filled by img_integral */
+typedef struct {
+    u32 width, height;
+    u8 channels;
+    size_t stride;      /* elements per row, (width + 1) * channels */
+    u64 *sum;           /* height + 1 rows, row and column 0 are zero */
+} IntegralImage;
+
+#define IMG_PYRAMID_MAX_LEVELS 32
+/* img_pyramid flags */
+#define IMG_PYRAMID_LAPLACIAN  1
+
+/* Levels filled by img_pyramid, each half the size of the one before */
+typedef struct {
+    u32 levels;
+    int flags;
+    /* level[0] is full size. With IMG_PYRAMID_LAPLACIAN all but the last
+       level hold residuals. The levels point into data and are borrowed. */
+    Image level[IMG_PYRAMID_MAX_LEVELS];
+    Arena *arena;       /* data comes from this arena, or from malloc when NULL */
+    u8 *data;
+    size_t capacity;
+} Pyramid;
+
+typedef enum {
+    IMG_GRAY_BT709,
+    IMG_GRAY_BT601,
+    IMG_GRAY_AVERAGE
+} GrayCoeffs;
+
+/* Step applied to every item of a batch, the fields it reads in brackets */
+typedef enum {
+    IMG_BATCH_RGB2GRAY,         /* coeffs */
+    IMG_BATCH_FILTER2D,         /* kernel, kernel_size, border_mode */
+    IMG_BATCH_RESIZE,           /* width, height (0: keep the aspect ratio), filter */
+    IMG_BATCH_ADD_SCALAR,       /* value, a whole number */
+    IMG_BATCH_MULTIPLY_SCALAR   /* value */
+} BatchOpKind;
+
+typedef struct {
+    BatchOpKind kind;
+    GrayCoeffs coeffs;
+    KernelType kernel;
+    KernelSize kernel_size;
+    BorderMode border_mode;
+    u32 width, height;
+    ResizeFilter filter;
+    float value;
+} BatchOp;
+
+/* One input of img_batch_run and what became of it */
+typedef struct {
+    const char *path;       /* PNM file, or NULL to decode buf */
+    const u8 *buf;          /* PNM file contents, size bytes */
+    size_t size;
+    const char *out_path;   /* where the result is saved, NULL keeps it in out */
+    Image out;              /* zeroed, or reused from an earlier run */
+    ImgError status;
+} BatchItem;
+
+/* Operations counted by the instrumentation (built with -DIMG_STATS).
+   Functions that only forward to another one (img_resize, img_rgb2gray,
+   img_subtract) are counted under the function they call. Operations that
+   run once per plane of a planar image count one call per plane. */
+typedef enum {
+    IMG_OP_INIT,
+    IMG_OP_CONVERT_LAYOUT,
+    IMG_OP_CONVERT_DEPTH,
+    IMG_OP_LOAD,
+    IMG_OP_LOADPNM,
+    IMG_OP_SAVE,
+    IMG_OP_SAVEPNM,
+    IMG_OP_SAVEPNM_MEM,
+    IMG_OP_DECODE_PNM,
+    IMG_OP_ENCODE_PNM,
+    IMG_OP_CPY,
+    IMG_OP_READER_READ,
+    IMG_OP_WRITER_WRITE,
+    IMG_OP_LOAD_ASYNC,
+    IMG_OP_SAVE_ASYNC,
+    IMG_OP_CONVOLVE,
+    IMG_OP_FILTER2D,
+    IMG_OP_BOX_FILTER,
+    IMG_OP_INTEGRAL,
+    IMG_OP_GAUSSIAN_BLUR,
+    IMG_OP_MEDIAN_FILTER,
+    IMG_OP_MIN_FILTER,
+    IMG_OP_MAX_FILTER,
+    IMG_OP_RESIZE,
+    IMG_OP_WARP_AFFINE,
+    IMG_OP_TRANSPOSE,
+    IMG_OP_FLIP,
+    IMG_OP_ROTATE90,
+    IMG_OP_PYRAMID,
+    IMG_OP_RECONSTRUCT,
+    IMG_OP_RGB2GRAY,
+    IMG_OP_RGB2HSV,
+    IMG_OP_HSV2RGB,
+    IMG_OP_RGB2YCBCR,
+    IMG_OP_YCBCR2RGB,
+    IMG_OP_PREMULTIPLY,
+    IMG_OP_ADD,
+    IMG_OP_SUBTRACT,
+    IMG_OP_BLEND,
+    IMG_OP_MULTIPLY,
+    IMG_OP_ADD_SCALAR,
+    IMG_OP_MULTIPLY_SCALAR,
+    IMG_OP_PIPE_RUN,
+    IMG_OP_PIPE_RUN_STREAM,
+    IMG_OP_BATCH_RUN,
+    IMG_OP_COUNT
+} ImgOp;
+
+typedef struct {
+    u64 calls;
+    u64 wall_ns;
+    u64 pixels;         /* pixels produced, or moved by the I/O calls */
+    u64 bytes_read;     /* from files */
+    u64 bytes_written;  /* to files or caller buffers */
+    u64 arena_bytes;    /* handed out by the image's arena */
+} ImgStats;
+
+/* Called after every counted call with that call alone (calls == 1) */
+typedef void (*ImgStatsHook)(ImgOp op, const ImgStats *call, void *userdata);
+
+
+ImgError img_init(Image *img, u32 width, u32 height, u8 channels, Arena* arena);
+ImgError img_init_layout(Image *img, u32 width, u32 height, u8 channels, ImgLayout layout, Arena *arena);
+ImgError img_convert_layout(Image *dest, Image *src, ImgLayout layout);
+ImgError img_init_depth(Image *img, u32 width, u32 height, u8 channels, ImgDepth depth, Arena *arena);
+ImgError img_convert_depth(Image *dest, Image *src, ImgDepth depth);
 ImgError img_load(Image *img, const char* file, Arena *arena);
 ImgError img_loadpnm(Image *img, const char* file, ImgType type, Arena *arena);
-ImgError img_getpx(Image *img, u16 x, u16 y, u8 *pixel);
-ImgError img_setpx(Image *img, u16 x, u16 y, u8 *pixel);
+ImgError img_getpx(Image *img, u32 x, u32 y, u8 *pixel);
+ImgError img_setpx(Image *img, u32 x, u32 y, u8 *pixel);
 ImgError img_savepnm(Image *img, const char *file);
+ImgError img_savepnm_mem(Image *img, u8 *buf, size_t size, size_t *written);
+ImgError img_decode_pnm(Image *img, const u8 *buf, size_t len, Arena *arena, int flags);
+ImgError img_encode_pnm(Image *img, u8 **out, size_t *len);
 ImgError img_save(Image *img, const char *file);
+ImgError img_reader_open(PnmReader *rd, const char *file);
+ImgError img_reader_read(PnmReader *rd, Image *band, u32 rows);
+void img_reader_close(PnmReader *rd);
+ImgError img_writer_open(PnmWriter *wr, const char *file, ImgType type, u32 width, u32 height);
+ImgError img_writer_write(PnmWriter *wr, Image *band);
+ImgError img_writer_close(PnmWriter *wr);
+ImgError img_load_async(ImgAsync **async, Image *img, const char *file);
+ImgError img_save_async(ImgAsync **async, Image *img, const char *file);
+ImgError img_async_poll(ImgAsync *async, u32 *rows);
+ImgError img_async_wait(ImgAsync *async, u32 rows);
+ImgError img_async_finish(ImgAsync *async);
 ImgError img_cpy(Image *dest, Image *src);
 void img_free(Image *img);
 void img_print(Image *img);
 ImgError img_disp(Image *img, const char* custom_viewer);
 const char *img_strerror(char *buf, size_t sz , ImgError err);
 
+/* Threads used by the operations below, 0 means one per online CPU.
+   img_set_call_threads() overrides the count for calls made from the
+   calling thread only (0 drops the override). */
+void img_set_threads(u32 n);
+void img_set_call_threads(u32 n);
+u32 img_get_threads(void);
+
+/* Instrumentation, IMG_ERR_UNAVAILABLE unless built with -DIMG_STATS.
+   Totals cover every thread, nested calls (img_filter2D running
+   img_convolve) are counted under both and the callee's bytes are also
+   added to the caller. */
+ImgError img_stats_get(ImgOp op, ImgStats *stats);
+ImgError img_stats_set_hook(ImgStatsHook hook, void *userdata);
+void img_stats_reset(void);
+const char *img_op_name(ImgOp op);
+
 /*Image Processing Functions*/
 
 /* ----------- Kernel stuff----------- */
@@ -130,11 +391,67 @@ ImgError img_get_kernel(KernelType type, KernelSize size, Kernel *kernel);
 ImgError img_filter2D(Image *dest, Image *img, KernelType type, KernelSize size, BorderMode border_mode);
 ImgError img_print_kernel(Kernel *kernel);
 void img_free_kernel(Kernel *kernel);
+/* Prepared kernels are immutable and can be shared between threads. The
+   ones from img_get_prepared_kernel belong to the library's cache. */
+ImgError img_get_prepared_kernel(KernelType type, KernelSize size, const PreparedKernel **kernel);
+ImgError img_prepare_kernel(const Kernel *kernel, PreparedKernel **prepared);
+void img_free_prepared_kernel(PreparedKernel *prepared);
 /* ------------------------------------*/
 ImgError img_convolve(Image *dest, Image *img, Kernel *kernel, BorderMode border_mode);
+ImgError img_convolve_prepared(Image *dest, Image *img, const PreparedKernel *kernel, BorderMode border_mode);
+ImgError img_box_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode);
+ImgError img_gaussian_blur(Image *dest, Image *img, float sigma, BorderMode border_mode);
+ImgError img_median_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode);
+ImgError img_min_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode);
+ImgError img_max_filter(Image *dest, Image *img, u32 radius, BorderMode border_mode);
+ImgError img_integral(IntegralImage *ii, Image *img);
+ImgError img_integral_sum(const IntegralImage *ii, u32 x, u32 y, u32 w, u32 h, u64 *sum);
+ImgError img_integral_mean(const IntegralImage *ii, u32 x, u32 y, u32 w, u32 h, u8 *mean);
+void img_integral_free(IntegralImage *ii);
+ImgError img_pyramid(Pyramid *pyr, Image *img, u32 levels, int flags, Arena *arena);
+ImgError img_pyramid_reconstruct(Image *dest, const Pyramid *pyr);
+void img_pyramid_free(Pyramid *pyr);
 ImgError img_rgb2gray(Image *dest, Image *img);
-ImgError img_resize(Image *dest, Image *src, u16 new_width, u16 new_height);
+ImgError img_rgb2gray_coeffs(Image *dest, Image *img, GrayCoeffs coeffs);
+ImgError img_rgb2hsv(Image *dest, Image *img);
+ImgError img_hsv2rgb(Image *dest, Image *img);
+ImgError img_rgb2ycbcr(Image *dest, Image *img);
+ImgError img_ycbcr2rgb(Image *dest, Image *img);
+ImgError img_premultiply(Image *dest, Image *img);
+
+/* Pipelines */
+ImgError img_pipe_init(Pipeline *pipe, Image *src);
+ImgError img_pipe_init_stream(Pipeline *pipe, PnmReader *rd);
+ImgError img_pipe_rgb2gray(Pipeline *pipe, GrayCoeffs coeffs);
+ImgError img_pipe_convolve(Pipeline *pipe, Kernel *kernel, BorderMode border_mode);
+ImgError img_pipe_filter2D(Pipeline *pipe, KernelType type, KernelSize size, BorderMode border_mode);
+ImgError img_pipe_resize(Pipeline *pipe, u32 new_width, u32 new_height, ResizeFilter filter);
+ImgError img_pipe_add(Pipeline *pipe, Image *img);
+ImgError img_pipe_subtract(Pipeline *pipe, Image *img, SubtractMode mode);
+ImgError img_pipe_blend(Pipeline *pipe, Image *img, float alpha);
+ImgError img_pipe_multiply(Pipeline *pipe, Image *img);
+ImgError img_pipe_add_scalar(Pipeline *pipe, i16 value);
+ImgError img_pipe_multiply_scalar(Pipeline *pipe, float factor);
+ImgError img_pipe_run(Pipeline *pipe, Image *dest);
+ImgError img_pipe_run_stream(Pipeline *pipe, PnmWriter *wr);
+void img_pipe_free(Pipeline *pipe);
+ImgError img_resize(Image *dest, Image *src, u32 new_width, u32 new_height);
+ImgError img_resize_filter(Image *dest, Image *src, u32 new_width, u32 new_height, ResizeFilter filter);
+ImgError img_warp_affine(Image *dest, Image *src, const float matrix[6], u32 width, u32 height,
+                         ResizeFilter filter, BorderMode border_mode);
+ImgError img_rotate(Image *dest, Image *src, float angle, ResizeFilter filter, BorderMode border_mode);
+ImgError img_transpose(Image *dest, Image *src);
+ImgError img_flip(Image *dest, Image *src, FlipMode mode);
+ImgError img_rotate90(Image *dest, Image *src, i32 turns);
 ImgError img_add(Image *dest, Image *img1, Image *img2);
 ImgError img_subtract(Image *dest, Image *img1, Image *img2);
+ImgError img_subtract_mode(Image *dest, Image *img1, Image *img2, SubtractMode mode);
+ImgError img_blend(Image *dest, Image *img1, Image *img2, float alpha);
+ImgError img_multiply(Image *dest, Image *img1, Image *img2);
+ImgError img_add_scalar(Image *dest, Image *img, i16 value);
+ImgError img_multiply_scalar(Image *dest, Image *img, float factor);
+
+/* Batches */
+ImgError img_batch_run(BatchItem *items, u32 nitems, const BatchOp *ops, u32 nops);
 
 #endif